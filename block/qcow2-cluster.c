@@ -314,16 +314,27 @@ void qcow2_encrypt_sectors(BDRVQcowState *s, int64_t sector_num,
     }
 }
 
-static int coroutine_fn copy_sectors(BlockDriverState *bs,
-                                     uint64_t start_sect,
-                                     uint64_t cluster_offset,
-                                     int n_start, int n_end)
+/*
+ * Reads the sectors [n_start, n_end) of the guest cluster starting at
+ * start_sect into a newly allocated buffer, encrypting them if necessary so
+ * that they can be written to the image file as they are.
+ *
+ * On success, *buf is the allocated buffer (or NULL if there was nothing to
+ * read because the area lies beyond the end of the image) and the number of
+ * sectors read is returned. Returns -errno on failure.
+ */
+static int coroutine_fn read_cow_sectors(BlockDriverState *bs,
+                                         uint64_t start_sect,
+                                         int n_start, int n_end,
+                                         uint8_t **buf)
 {
     BDRVQcowState *s = bs->opaque;
     QEMUIOVector qiov;
     struct iovec iov;
     int n, ret;
 
+    *buf = NULL;
+
     /*
      * If this is the last cluster and it is only partially used, we must only
      * copy until the end of the image, or bdrv_check_request will fail for the
@@ -351,7 +362,8 @@ static int coroutine_fn copy_sectors(BlockDriverState *bs,
      */
     ret = bs->drv->bdrv_co_readv(bs, start_sect + n_start, n, &qiov);
     if (ret < 0) {
-        goto out;
+        qemu_vfree(iov.iov_base);
+        return ret;
     }
 
     if (s->crypt_method) {
@@ -360,6 +372,29 @@ static int coroutine_fn copy_sectors(BlockDriverState *bs,
                         &s->aes_encrypt_key);
     }
 
+    *buf = iov.iov_base;
+    return n;
+}
+
+static int coroutine_fn copy_sectors(BlockDriverState *bs,
+                                     uint64_t start_sect,
+                                     uint64_t cluster_offset,
+                                     int n_start, int n_end)
+{
+    QEMUIOVector qiov;
+    struct iovec iov;
+    uint8_t *buf;
+    int n, ret;
+
+    n = read_cow_sectors(bs, start_sect, n_start, n_end, &buf);
+    if (n <= 0) {
+        return n;
+    }
+
+    iov.iov_base = buf;
+    iov.iov_len = n * BDRV_SECTOR_SIZE;
+    qemu_iovec_init_external(&qiov, &iov, 1);
+
     BLKDBG_EVENT(bs->file, BLKDBG_COW_WRITE);
     ret = bdrv_co_writev(bs->file, (cluster_offset >> 9) + n_start, n, &qiov);
     if (ret < 0) {
@@ -368,10 +403,68 @@ static int coroutine_fn copy_sectors(BlockDriverState *bs,
 
     ret = 0;
 out:
-    qemu_vfree(iov.iov_base);
+    qemu_vfree(buf);
     return ret;
 }
 
+/*
+ * Reads the COW areas of a newly allocated cluster range into the buffers in
+ * m, so that the caller can write them to the image file in a single request
+ * together with the guest data (which must cover exactly the sectors between
+ * the two areas). After a successful call m->cow_merged is set and
+ * qcow2_alloc_cluster_link_l2() won't copy the areas again.
+ *
+ * Must be called without s->lock held.
+ *
+ * Return 0 on success and -errno in error cases
+ */
+int coroutine_fn qcow2_read_cow_regions(BlockDriverState *bs, QCowL2Meta *m)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t start_sect;
+    int ret;
+
+    assert(m->nb_clusters > 0 && !m->cow_merged);
+
+    start_sect = (m->offset & ~(s->cluster_size - 1)) >> 9;
+
+    if (m->n_start) {
+        ret = read_cow_sectors(bs, start_sect, 0, m->n_start,
+                               &m->cow_start_buf);
+        if (ret < 0) {
+            goto fail;
+        }
+        m->cow_start_sectors = ret;
+    }
+
+    if (m->nb_available & (s->cluster_sectors - 1)) {
+        ret = read_cow_sectors(bs, start_sect, m->nb_available,
+                               align_offset(m->nb_available,
+                                            s->cluster_sectors),
+                               &m->cow_end_buf);
+        if (ret < 0) {
+            goto fail;
+        }
+        m->cow_end_sectors = ret;
+    }
+
+    m->cow_merged = true;
+    return 0;
+
+fail:
+    qcow2_free_cow_regions(m);
+    return ret;
+}
+
+void qcow2_free_cow_regions(QCowL2Meta *m)
+{
+    qemu_vfree(m->cow_start_buf);
+    qemu_vfree(m->cow_end_buf);
+    m->cow_start_buf = NULL;
+    m->cow_end_buf = NULL;
+    m->cow_start_sectors = 0;
+    m->cow_end_sectors = 0;
+}
 
 /*
  * get_cluster_offset
@@ -632,7 +725,10 @@ int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m)
 
     /* copy content of unmodified sectors */
     start_sect = (m->offset & ~(s->cluster_size - 1)) >> 9;
-    if (m->n_start) {
+    if (m->cow_merged) {
+        /* Already written along with the guest data */
+        cow = m->n_start || (m->nb_available & (s->cluster_sectors - 1));
+    } else if (m->n_start) {
         cow = true;
         qemu_co_mutex_unlock(&s->lock);
         ret = copy_sectors(bs, start_sect, cluster_offset, 0, m->n_start);
@@ -641,7 +737,7 @@ int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m)
             goto err;
     }
 
-    if (m->nb_available & (s->cluster_sectors - 1)) {
+    if (!m->cow_merged && (m->nb_available & (s->cluster_sectors - 1))) {
         cow = true;
         qemu_co_mutex_unlock(&s->lock);
         ret = copy_sectors(bs, start_sect, cluster_offset, m->nb_available,
@@ -782,7 +878,7 @@ static int do_alloc_cluster_offset(BlockDriverState *bs, uint64_t guest_offset,
         uint64_t old_start = old_alloc->offset >> s->cluster_bits;
         uint64_t old_end = old_start + old_alloc->nb_clusters;
 
-        if (end < old_start || start > old_end) {
+        if (end <= old_start || start >= old_end) {
             /* No intersection */
         } else {
             if (start < old_start) {
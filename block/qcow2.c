@@ -783,7 +783,8 @@ static coroutine_fn int qcow2_co_writev(BlockDriverState *bs,
 
     qemu_co_queue_init(&l2meta.dependent_requests);
 
-    qemu_iovec_init(&hd_qiov, qiov->niov);
+    /* Leave room for the COW areas before and after the guest data */
+    qemu_iovec_init(&hd_qiov, qiov->niov + 2);
 
     s->cluster_cache_offset = -1; /* disable compressed cache */
 
@@ -813,9 +814,25 @@ static coroutine_fn int qcow2_co_writev(BlockDriverState *bs,
         cluster_offset = l2meta.cluster_offset;
         assert((cluster_offset & 511) == 0);
 
+        qemu_co_mutex_unlock(&s->lock);
+
+        /*
+         * Read the COW areas now, so that they can be written together with
+         * the guest data in a single request instead of three.
+         */
+        if (l2meta.nb_clusters > 0) {
+            ret = qcow2_read_cow_regions(bs, &l2meta);
+            if (ret < 0) {
+                qemu_co_mutex_lock(&s->lock);
+                goto fail;
+            }
+        }
+
         qemu_iovec_reset(&hd_qiov);
-        qemu_iovec_concat(&hd_qiov, qiov, bytes_done,
-            cur_nr_sectors * 512);
+        if (l2meta.cow_start_sectors) {
+            qemu_iovec_add(&hd_qiov, l2meta.cow_start_buf,
+                           l2meta.cow_start_sectors * 512);
+        }
 
         if (s->crypt_method) {
             if (!cluster_data) {
@@ -823,25 +840,33 @@ static coroutine_fn int qcow2_co_writev(BlockDriverState *bs,
                                                  s->cluster_size);
             }
 
-            assert(hd_qiov.size <=
-                   QCOW_MAX_CRYPT_CLUSTERS * s->cluster_size);
-            qemu_iovec_to_buf(&hd_qiov, 0, cluster_data, hd_qiov.size);
+            assert(cur_nr_sectors <=
+                   QCOW_MAX_CRYPT_CLUSTERS * s->cluster_sectors);
+            qemu_iovec_to_buf(qiov, bytes_done, cluster_data,
+                              cur_nr_sectors * 512);
 
             qcow2_encrypt_sectors(s, sector_num, cluster_data,
                 cluster_data, cur_nr_sectors, 1, &s->aes_encrypt_key);
 
-            qemu_iovec_reset(&hd_qiov);
             qemu_iovec_add(&hd_qiov, cluster_data,
                 cur_nr_sectors * 512);
+        } else {
+            qemu_iovec_concat(&hd_qiov, qiov, bytes_done,
+                cur_nr_sectors * 512);
+        }
+
+        if (l2meta.cow_end_sectors) {
+            qemu_iovec_add(&hd_qiov, l2meta.cow_end_buf,
+                           l2meta.cow_end_sectors * 512);
         }
 
         BLKDBG_EVENT(bs->file, BLKDBG_WRITE_AIO);
-        qemu_co_mutex_unlock(&s->lock);
         trace_qcow2_writev_data(qemu_coroutine_self(),
                                 (cluster_offset >> 9) + index_in_cluster);
         ret = bdrv_co_writev(bs->file,
-                             (cluster_offset >> 9) + index_in_cluster,
-                             cur_nr_sectors, &hd_qiov);
+                             (cluster_offset >> 9) + index_in_cluster
+                                 - l2meta.cow_start_sectors,
+                             hd_qiov.size >> BDRV_SECTOR_BITS, &hd_qiov);
         qemu_co_mutex_lock(&s->lock);
         if (ret < 0) {
             goto fail;
@@ -852,6 +877,7 @@ static coroutine_fn int qcow2_co_writev(BlockDriverState *bs,
             goto fail;
         }
 
+        qcow2_free_cow_regions(&l2meta);
         run_dependent_requests(s, &l2meta);
 
         remaining_sectors -= cur_nr_sectors;
@@ -862,6 +888,7 @@ static coroutine_fn int qcow2_co_writev(BlockDriverState *bs,
     ret = 0;
 
 fail:
+    qcow2_free_cow_regions(&l2meta);
     run_dependent_requests(s, &l2meta);
 
     qemu_co_mutex_unlock(&s->lock);
@@ -207,6 +207,18 @@ typedef struct QCowL2Meta
     int nb_clusters;
     CoQueue dependent_requests;
 
+    /*
+     * If cow_merged is set, the COW areas before and after the guest data have
+     * been read by qcow2_read_cow_regions() and are written to the image file
+     * in the same request as the guest data, so qcow2_alloc_cluster_link_l2()
+     * doesn't need to copy them any more.
+     */
+    bool cow_merged;
+    uint8_t *cow_start_buf;
+    int cow_start_sectors;
+    uint8_t *cow_end_buf;
+    int cow_end_sectors;
+
     QLIST_ENTRY(QCowL2Meta) next_in_flight;
 } QCowL2Meta;
 
@@ -302,6 +314,8 @@ uint64_t qcow2_alloc_compressed_cluster_offset(BlockDriverState *bs,
                                          uint64_t offset,
                                          int compressed_size);
 
+int qcow2_read_cow_regions(BlockDriverState *bs, QCowL2Meta *m);
+void qcow2_free_cow_regions(QCowL2Meta *m);
 int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m);
 int qcow2_discard_clusters(BlockDriverState *bs, uint64_t offset,
     int nb_sectors);
@@ -64,6 +64,7 @@ typedef uint64_t target_ulong __attribute__((aligned(TARGET_LONG_ALIGNMENT)));
 #define EXCP_HLT        0x10001 /* hlt instruction reached */
 #define EXCP_DEBUG      0x10002 /* cpu stopped after a breakpoint or singlestep */
 #define EXCP_HALTED     0x10003 /* cpu is halted (waiting for external event) */
+#define EXCP_ATOMIC     0x10004 /* atomic insn must run with other cpus stopped */
 
 #define TB_JMP_CACHE_BITS 12
 #define TB_JMP_CACHE_SIZE (1 << TB_JMP_CACHE_BITS)
@@ -77,9 +78,25 @@ typedef uint64_t target_ulong __attribute__((aligned(TARGET_LONG_ALIGNMENT)));
 #define TB_JMP_PAGE_MASK (TB_JMP_CACHE_SIZE - TB_JMP_PAGE_SIZE)
 
 #if !defined(CONFIG_USER_ONLY)
+/* Default number of direct-mapped TLB entries per MMU mode.  */
 #define CPU_TLB_BITS 8
 #define CPU_TLB_SIZE (1 << CPU_TLB_BITS)
 
+/* The i386 TCG backend reads the TLB index mask from env->tlb_mask, so
+   there the number of entries in use can be changed at flush time.  Other
+   backends hardcode CPU_TLB_SIZE and keep the default.  */
+#if defined(__i386__) || defined(__x86_64__)
+#define CPU_TLB_DYN_MIN_BITS 6
+#define CPU_TLB_DYN_MAX_BITS 10
+#else
+#define CPU_TLB_DYN_MIN_BITS CPU_TLB_BITS
+#define CPU_TLB_DYN_MAX_BITS CPU_TLB_BITS
+#endif
+#define CPU_TLB_MAX_SIZE (1 << CPU_TLB_DYN_MAX_BITS)
+
+/* Fully associative victim TLB, searched before walking the page tables */
+#define CPU_VTLB_SIZE 8
+
 #if HOST_LONG_BITS == 32 && TARGET_LONG_BITS == 32
 #define CPU_TLB_ENTRY_BITS 4
 #else
@@ -108,12 +125,38 @@ typedef struct CPUTLBEntry {
 
 extern int CPUTLBEntry_wrong_size[sizeof(CPUTLBEntry) == (1 << CPU_TLB_ENTRY_BITS) ? 1 : -1];
 
+/* Per MMU mode bookkeeping used to resize the TLB at flush time */
+typedef struct CPUTLBDesc {
+    uint32_t n_used;         /* entries filled since the last flush */
+    uint32_t window_max;     /* largest n_used in the current window */
+    uint32_t window_flushes; /* flushes in the current window */
+} CPUTLBDesc;
+
+typedef struct CPUTLBStats {
+    uint64_t fill;       /* slow path misses resolved by tlb_fill() */
+    uint64_t victim_hit; /* slow path misses resolved by the victim TLB */
+    uint64_t flush;
+    uint64_t resize;
+} CPUTLBStats;
+
+/* Index of the direct-mapped TLB entry for addr in MMU mode mmu_idx */
+#define CPU_TLB_INDEX(env, mmu_idx, addr)                               \
+    (((addr) >> TARGET_PAGE_BITS) &                                     \
+     ((env)->tlb_mask[mmu_idx] >> CPU_TLB_ENTRY_BITS))
+
 #define CPU_COMMON_TLB \
+    /* (entries in use - 1) << CPU_TLB_ENTRY_BITS, for each MMU mode */ \
+    uintptr_t tlb_mask[NB_MMU_MODES];                                   \
     /* The meaning of the MMU modes is defined in the target code. */   \
-    CPUTLBEntry tlb_table[NB_MMU_MODES][CPU_TLB_SIZE];                  \
-    hwaddr iotlb[NB_MMU_MODES][CPU_TLB_SIZE];               \
+    CPUTLBEntry tlb_table[NB_MMU_MODES][CPU_TLB_MAX_SIZE];              \
+    CPUTLBEntry tlb_v_table[NB_MMU_MODES][CPU_VTLB_SIZE];               \
+    hwaddr iotlb[NB_MMU_MODES][CPU_TLB_MAX_SIZE];                       \
+    hwaddr iotlb_v[NB_MMU_MODES][CPU_VTLB_SIZE];                        \
     target_ulong tlb_flush_addr;                                        \
-    target_ulong tlb_flush_mask;
+    target_ulong tlb_flush_mask;                                        \
+    unsigned int vtlb_index;                                            \
+    CPUTLBDesc tlb_desc[NB_MMU_MODES];                                  \
+    CPUTLBStats tlb_stats;
 
 #else
 
@@ -164,6 +207,8 @@ typedef struct CPUWatchpoint {
                                      memory was accessed */             \
     uint32_t halted; /* Nonzero if the CPU is in suspend state */       \
     uint32_t interrupt_request;                                         \
+    /* interrupt_request as last seen by cpu_exec() */                  \
+    uint32_t interrupt_request_seen;                                    \
     volatile sig_atomic_t exit_request;                                 \
     CPU_COMMON_TLB                                                      \
     struct TranslationBlock *tb_jmp_cache[TB_JMP_CACHE_SIZE];           \
@@ -179,6 +224,10 @@ typedef struct CPUWatchpoint {
         icount_decr_u16 u16;                                            \
     } icount_decr;                                                      \
     uint32_t can_do_io; /* nonzero if memory mapped IO is safe.  */     \
+    /* multi-threaded TCG: execute the next instruction on its own, in  \
+       an exclusive section (see EXCP_ATOMIC) */                        \
+    uint32_t step_atomic;                                               \
+    struct TranslationBlock *step_tb;                                   \
                                                                         \
     /* from this point: preserved by CPU reset */                       \
     /* ice debug support */                                             \
@@ -22,6 +22,9 @@
 #include "tcg.h"
 #include "qemu-barrier.h"
 #include "qtest.h"
+#if !defined(CONFIG_USER_ONLY)
+#include "main-loop.h"
+#endif
 
 int tb_invalidated_flag;
 
@@ -80,6 +83,38 @@ static void cpu_exec_nocache(CPUArchState *env, int max_cycles,
     tb_free(tb);
 }
 
+/* Execute the next instruction of a vCPU that every other vCPU is
+   waiting on, so that atomic guest operations can be emulated with
+   plain loads and stores.  */
+static void cpu_exec_step_atomic(CPUArchState *env)
+{
+    TranslationBlock *tb;
+    target_ulong cs_base, pc;
+    int flags;
+    bool locked;
+
+    env->step_atomic = 0;
+    /* the TB must not bail out at its exit_request check; we return to
+       the vCPU thread loop right after it anyway */
+    env->exit_request = 0;
+
+    cpu_get_tb_cpu_state(env, &pc, &cs_base, &flags);
+    locked = tcg_iothread_lock();
+    tb = tb_gen_code(env, pc, cs_base, flags, 1 | CF_EXCLUSIVE);
+    tcg_iothread_unlock(locked);
+
+    env->step_tb = tb;
+    env->current_tb = tb;
+    tcg_qemu_tb_exec(env, tb->tc_ptr);
+    env->current_tb = NULL;
+
+    tb_phys_invalidate(tb, -1);
+    tb_free(tb);
+    env->step_tb = NULL;
+    /* leave cpu_exec() so that the exclusive section can end */
+    env->exit_request = 1;
+}
+
 static TranslationBlock *tb_find_slow(CPUArchState *env,
                                       target_ulong pc,
                                       target_ulong cs_base,
@@ -89,6 +124,12 @@ static TranslationBlock *tb_find_slow(CPUArchState *env,
     unsigned int h;
     tb_page_addr_t phys_pc, phys_page1;
     target_ulong virt_page2;
+    bool locked;
+
+    /* Translation may fault in code pages, which needs the iothread
+       lock; it must be taken before the translation cache lock.  */
+    locked = tcg_iothread_lock();
+    tb_lock_acquire();
 
     tb_invalidated_flag = 0;
 
@@ -104,7 +145,8 @@ static TranslationBlock *tb_find_slow(CPUArchState *env,
         if (tb->pc == pc &&
             tb->page_addr[0] == phys_page1 &&
             tb->cs_base == cs_base &&
-            tb->flags == flags) {
+            tb->flags == flags &&
+            !(tb->cflags & CF_EXCLUSIVE)) {
             /* check next page if needed */
             if (tb->page_addr[1] != -1) {
                 tb_page_addr_t phys_page2;
@@ -133,6 +175,8 @@ static TranslationBlock *tb_find_slow(CPUArchState *env,
     }
     /* we add the TB in the virtual pc hash table */
     env->tb_jmp_cache[tb_jmp_cache_hash_func(pc)] = tb;
+    tb_lock_release();
+    tcg_iothread_unlock(locked);
     return tb;
 }
 
@@ -154,6 +198,33 @@ static inline TranslationBlock *tb_find_fast(CPUArchState *env)
     return tb;
 }
 
+/* Called at the end of a TB that was left through an indirect branch:
+   return the host code of the next TB if it is in the jump cache, so
+   that goto_ptr can continue there without going through cpu_exec().
+   Interrupts raised since cpu_exec() last looked at interrupt_request,
+   exit requests and jump cache misses return the epilogue instead, which
+   exits to cpu_exec() as exit_tb(0) does.  Interrupts that were already
+   pending but masked do not stop the chain: whatever unmasks them ends
+   its TB with exit_tb(0).  */
+void *tb_lookup_ptr(CPUArchState *env)
+{
+    TranslationBlock *tb;
+    target_ulong cs_base, pc;
+    int flags;
+
+    if (unlikely(env->interrupt_request != env->interrupt_request_seen ||
+                 env->exit_request)) {
+        return tcg_ctx.code_gen_epilogue;
+    }
+    cpu_get_tb_cpu_state(env, &pc, &cs_base, &flags);
+    tb = env->tb_jmp_cache[tb_jmp_cache_hash_func(pc)];
+    if (unlikely(!tb || tb->pc != pc || tb->cs_base != cs_base ||
+                 tb->flags != flags)) {
+        return tcg_ctx.code_gen_epilogue;
+    }
+    return tb->tc_ptr;
+}
+
 static CPUDebugExcpHandler *debug_excp_handler;
 
 void cpu_set_debug_excp_handler(CPUDebugExcpHandler *handler)
@@ -254,16 +325,34 @@ int cpu_exec(CPUArchState *env)
                     ret = env->exception_index;
                     break;
 #else
+                    if (mttcg_enabled) {
+                        qemu_mutex_lock_iothread();
+                    }
                     do_interrupt(env);
                     env->exception_index = -1;
+                    if (mttcg_enabled) {
+                        qemu_mutex_unlock_iothread();
+                    }
 #endif
                 }
             }
 
+            if (unlikely(env->step_atomic)) {
+                cpu_exec_step_atomic(env);
+            }
+
             next_tb = 0; /* force lookup of first TB */
             for(;;) {
                 interrupt_request = env->interrupt_request;
                 if (unlikely(interrupt_request)) {
+#if !defined(CONFIG_USER_ONLY)
+                    /* interrupt controllers and interrupt_request itself
+                       are protected by the iothread lock */
+                    if (mttcg_enabled) {
+                        qemu_mutex_lock_iothread();
+                        interrupt_request = env->interrupt_request;
+                    }
+#endif
                     if (unlikely(env->singlestep_enabled & SSTEP_NOIRQ)) {
                         /* Mask out external interrupts for this step. */
                         interrupt_request &= ~CPU_INTERRUPT_SSTEP_MASK;
@@ -538,6 +627,11 @@ int cpu_exec(CPUArchState *env)
                            the program flow was changed */
                         next_tb = 0;
                     }
+#if !defined(CONFIG_USER_ONLY)
+                    if (mttcg_enabled) {
+                        qemu_mutex_unlock_iothread();
+                    }
+#endif
                 }
                 if (unlikely(env->exit_request)) {
                     env->exit_request = 0;
@@ -563,8 +657,10 @@ int cpu_exec(CPUArchState *env)
 #endif
                 }
 #endif /* DEBUG_DISAS || CONFIG_DEBUG_EXEC */
+                env->interrupt_request_seen = env->interrupt_request;
                 spin_lock(&tb_lock);
                 tb = tb_find_fast(env);
+                tb_lock_acquire();
                 /* Note: we do it here to avoid a gcc bug on Mac OS X when
                    doing it in tb_find_slow */
                 if (tb_invalidated_flag) {
@@ -585,6 +681,7 @@ int cpu_exec(CPUArchState *env)
                 if (next_tb != 0 && tb->page_addr[1] == -1) {
                     tb_add_jump((TranslationBlock *)(next_tb & ~3), next_tb & 3, tb);
                 }
+                tb_lock_release();
                 spin_unlock(&tb_lock);
 
                 /* cpu_interrupt might be called while translating the
@@ -597,7 +694,21 @@ int cpu_exec(CPUArchState *env)
                     tc_ptr = tb->tc_ptr;
                     /* execute the generated code */
                     next_tb = tcg_qemu_tb_exec(env, tc_ptr);
-                    if ((next_tb & 3) == 2) {
+                    if (unlikely(tb_profile_enabled) && (next_tb & 3) < 2
+                        && next_tb != 0) {
+                        /* left through a goto_tb that is not chained */
+                        tb = (TranslationBlock *)(next_tb & ~3);
+                        if (tb->cflags & CF_PROFILE) {
+                            tb->exit_count[next_tb & 3]++;
+                        }
+                    }
+                    if ((next_tb & 3) == 3) {
+                        /* exit_request seen at the start of a TB (only
+                           generated in multi-threaded mode).  */
+                        tb = (TranslationBlock *)(next_tb & ~3);
+                        cpu_pc_from_tb(env, tb);
+                        next_tb = 0;
+                    } else if ((next_tb & 3) == 2) {
                         /* Instruction counter expired.  */
                         int insns_left;
                         tb = (TranslationBlock *)(next_tb & ~3);
@@ -633,6 +744,22 @@ int cpu_exec(CPUArchState *env)
             /* Reload env after longjmp - the compiler may have smashed all
              * local variables as longjmp is marked 'noreturn'. */
             env = cpu_single_env;
+#if !defined(CONFIG_USER_ONLY)
+            if (mttcg_enabled) {
+                /* we may have left a helper that held either lock */
+                tb_lock_reset();
+                if (qemu_mutex_iothread_locked()) {
+                    qemu_mutex_unlock_iothread();
+                }
+                if (env->step_tb) {
+                    /* the atomic instruction raised an exception */
+                    tb_phys_invalidate(env->step_tb, -1);
+                    tb_free(env->step_tb);
+                    env->step_tb = NULL;
+                    env->exit_request = 1;
+                }
+            }
+#endif
         }
     } /* for(;;) */
 
@@ -37,6 +37,7 @@
 #include "qtest.h"
 #include "main-loop.h"
 #include "bitmap.h"
+#include "tcg.h"
 
 #ifndef _WIN32
 #include "compatfd.h"
@@ -385,6 +386,49 @@ void configure_icount(const char *option)
                    qemu_get_clock_ns(vm_clock) + get_ticks_per_sec() / 10);
 }
 
+void configure_tcg(QemuOpts *opts)
+{
+    const char *thread_mode = qemu_opt_get(opts, "thread");
+    const char *cache = qemu_opt_get(opts, "cache");
+
+    if (qemu_opt_get_bool(opts, "perfmap", false)) {
+        tb_perf_map_enable();
+    }
+    if (qemu_opt_get_bool(opts, "profile", false)) {
+        tb_profile_enabled = true;
+    }
+    if (cache) {
+        if (!tcg_enabled()) {
+            fprintf(stderr, "qemu: -tcg cache requires TCG\n");
+            exit(1);
+        }
+        tb_cache_init(cache, false);
+    }
+    if (!thread_mode || strcmp(thread_mode, "single") == 0) {
+        return;
+    }
+    if (strcmp(thread_mode, "multi") != 0) {
+        fprintf(stderr, "qemu: invalid TCG thread mode '%s'\n", thread_mode);
+        exit(1);
+    }
+#if !defined(TARGET_SUPPORTS_MTTCG) || !defined(TCG_TARGET_SUPPORTS_MTTCG)
+    fprintf(stderr, "qemu: multi-threaded TCG is not supported for this "
+            "guest on this host\n");
+    exit(1);
+#endif
+    if (!tcg_enabled()) {
+        fprintf(stderr, "qemu: -tcg thread=multi requires TCG\n");
+        exit(1);
+    }
+    if (use_icount) {
+        fprintf(stderr, "qemu: -tcg thread=multi is not compatible with "
+                "-icount\n");
+        exit(1);
+    }
+    mttcg_enabled = true;
+    parallel_cpus = smp_cpus > 1;
+}
+
 /***********************************************************/
 void hw_error(const char *fmt, ...)
 {
@@ -473,7 +517,9 @@ static void cpu_signal(int sig)
     if (cpu_single_env) {
         cpu_exit(cpu_single_env);
     }
-    exit_request = 1;
+    if (!mttcg_enabled) {
+        exit_request = 1;
+    }
 }
 
 #ifdef CONFIG_LINUX
@@ -622,6 +668,17 @@ static QemuThread io_thread;
 static QemuThread *tcg_cpu_thread;
 static QemuCond *tcg_halt_cond;
 
+/* Whether the calling thread holds qemu_global_mutex.  Only maintained
+   for the qemu_mutex_lock_iothread()/qemu_mutex_unlock_iothread() API,
+   which is what multi-threaded TCG vCPU threads use.  */
+static DEFINE_TLS(bool, iothread_locked);
+
+/* multi-threaded TCG: the vCPU that has stopped all others, see
+   tcg_exclusive_start() */
+static CPUState *tcg_exclusive_cpu;
+static QemuCond tcg_exclusive_cond;
+static QemuCond tcg_resume_cond;
+
 /* cpu creation */
 static QemuCond qemu_cpu_cond;
 /* system init */
@@ -635,11 +692,15 @@ void qemu_init_cpu_loop(void)
     qemu_cond_init(&qemu_pause_cond);
     qemu_cond_init(&qemu_work_cond);
     qemu_cond_init(&qemu_io_proceeded_cond);
+    qemu_cond_init(&tcg_exclusive_cond);
+    qemu_cond_init(&tcg_resume_cond);
     qemu_mutex_init(&qemu_global_mutex);
 
     qemu_thread_get_self(&io_thread);
 }
 
+static void flush_queued_work(CPUState *cpu);
+
 void run_on_cpu(CPUState *cpu, void (*func)(void *data), void *data)
 {
     struct qemu_work_item wi;
@@ -659,6 +720,7 @@ void run_on_cpu(CPUState *cpu, void (*func)(void *data), void *data)
     cpu->queued_work_last = &wi;
     wi.next = NULL;
     wi.done = false;
+    wi.free = false;
 
     qemu_cpu_kick(cpu);
     while (!wi.done) {
@@ -666,9 +728,38 @@ void run_on_cpu(CPUState *cpu, void (*func)(void *data), void *data)
 
         qemu_cond_wait(&qemu_work_cond, &qemu_global_mutex);
         cpu_single_env = self_env;
+        if (mttcg_enabled && self_env) {
+            /* cpu may in turn be waiting for work queued on us */
+            flush_queued_work(ENV_GET_CPU(self_env));
+        }
     }
 }
 
+void async_run_on_cpu(CPUState *cpu, void (*func)(void *data), void *data)
+{
+    struct qemu_work_item *wi;
+
+    if (qemu_cpu_is_self(cpu)) {
+        func(data);
+        return;
+    }
+
+    wi = g_malloc0(sizeof(struct qemu_work_item));
+    wi->func = func;
+    wi->data = data;
+    wi->free = true;
+    if (cpu->queued_work_first == NULL) {
+        cpu->queued_work_first = wi;
+    } else {
+        cpu->queued_work_last->next = wi;
+    }
+    cpu->queued_work_last = wi;
+    wi->next = NULL;
+    wi->done = false;
+
+    qemu_cpu_kick(cpu);
+}
+
 static void flush_queued_work(CPUState *cpu)
 {
     struct qemu_work_item *wi;
@@ -681,6 +772,9 @@ static void flush_queued_work(CPUState *cpu)
         cpu->queued_work_first = wi->next;
         wi->func(wi->data);
         wi->done = true;
+        if (wi->free) {
+            g_free(wi);
+        }
     }
     cpu->queued_work_last = NULL;
     qemu_cond_broadcast(&qemu_work_cond);
@@ -729,6 +823,17 @@ static void qemu_kvm_wait_io_event(CPUArchState *env)
     qemu_wait_io_event_common(cpu);
 }
 
+static void qemu_mttcg_wait_io_event(CPUArchState *env)
+{
+    CPUState *cpu = ENV_GET_CPU(env);
+
+    while (cpu_thread_is_idle(env)) {
+        qemu_cond_wait(cpu->halt_cond, &qemu_global_mutex);
+    }
+
+    qemu_wait_io_event_common(cpu);
+}
+
 static void *qemu_kvm_cpu_thread_fn(void *arg)
 {
     CPUArchState *env = arg;
@@ -809,6 +914,116 @@ static void *qemu_dummy_cpu_thread_fn(void *arg)
 }
 
 static void tcg_exec_all(void);
+static int tcg_cpu_exec(CPUArchState *env);
+
+/* Called with the iothread lock held.  Kick every other vCPU out of
+   cpu_exec() and keep it out until tcg_exclusive_end(), so that the
+   caller can modify the translation cache or emulate an atomic guest
+   operation without interference.  */
+static void tcg_exclusive_start(CPUState *cpu)
+{
+    CPUArchState *env;
+    bool busy;
+
+    while (tcg_exclusive_cpu) {
+        qemu_cond_wait(&tcg_resume_cond, &qemu_global_mutex);
+        flush_queued_work(cpu);
+    }
+    tcg_exclusive_cpu = cpu;
+
+    do {
+        busy = false;
+        for (env = first_cpu; env != NULL; env = env->next_cpu) {
+            CPUState *other = ENV_GET_CPU(env);
+
+            /* A vCPU that stopped itself from device code (e.g. in
+               pause_all_vcpus()) is waiting on us, not running guest
+               code.  */
+            if (other != cpu && other->running && !other->stopped) {
+                cpu_exit(env);
+                busy = true;
+            }
+        }
+        if (busy) {
+            qemu_cond_wait(&tcg_exclusive_cond, &qemu_global_mutex);
+            /* a running vCPU may be blocked in run_on_cpu() for us */
+            flush_queued_work(cpu);
+        }
+    } while (busy);
+}
+
+static void tcg_exclusive_end(void)
+{
+    tcg_exclusive_cpu = NULL;
+    qemu_cond_broadcast(&tcg_resume_cond);
+}
+
+/* Run guest code with the iothread lock released.  */
+static int qemu_mttcg_cpu_exec(CPUArchState *env)
+{
+    CPUState *cpu = ENV_GET_CPU(env);
+    int r;
+
+    while (tcg_exclusive_cpu && tcg_exclusive_cpu != cpu) {
+        qemu_cond_wait(&tcg_resume_cond, &qemu_global_mutex);
+        flush_queued_work(cpu);
+    }
+    cpu->running = true;
+    qemu_mutex_unlock_iothread();
+
+    r = tcg_cpu_exec(env);
+
+    qemu_mutex_lock_iothread();
+    cpu->running = false;
+    if (tcg_exclusive_cpu) {
+        qemu_cond_broadcast(&tcg_exclusive_cond);
+    }
+    return r;
+}
+
+static void *qemu_mttcg_cpu_thread_fn(void *arg)
+{
+    CPUArchState *env = arg;
+    CPUState *cpu = ENV_GET_CPU(env);
+    int r;
+
+    qemu_mutex_lock_iothread();
+    qemu_thread_get_self(cpu->thread);
+    cpu->thread_id = qemu_get_thread_id();
+
+    /* signal CPU creation */
+    cpu->created = true;
+    qemu_cond_signal(&qemu_cpu_cond);
+
+    while (1) {
+        if (cpu_can_run(cpu)) {
+            r = qemu_mttcg_cpu_exec(env);
+            if (r == EXCP_DEBUG) {
+                cpu_handle_guest_debug(env);
+            } else if (r == EXCP_ATOMIC) {
+                /* Execute the atomic instruction on its own while all
+                   other vCPUs are stopped.  */
+                tcg_exclusive_start(cpu);
+                env->step_atomic = 1;
+                qemu_mttcg_cpu_exec(env);
+                env->step_atomic = 0;
+                tcg_exclusive_end();
+            }
+        }
+        if (tb_flush_pending || tb_evict_pending) {
+            tcg_exclusive_start(cpu);
+            if (tb_flush_pending) {
+                tb_flush(env);
+            } else if (tb_evict_pending) {
+                tb_evict_region(env);
+            }
+            tcg_exclusive_end();
+        }
+        qemu_mttcg_wait_io_event(env);
+    }
+
+    return NULL;
+}
 
 static void *qemu_tcg_cpu_thread_fn(void *arg)
 {
@@ -870,6 +1085,15 @@ static void qemu_cpu_kick_thread(CPUState *cpu)
 void qemu_cpu_kick(CPUState *cpu)
 {
     qemu_cond_broadcast(cpu->halt_cond);
+    if (mttcg_enabled) {
+        /* translated code polls exit_request, no signal needed */
+        cpu_exit(cpu->env_ptr);
+        /* let vCPUs waiting around an exclusive section run queued work */
+        qemu_cond_broadcast(&tcg_exclusive_cond);
+        qemu_cond_broadcast(&tcg_resume_cond);
+        qemu_cond_broadcast(&qemu_work_cond);
+        return;
+    }
     if (!tcg_enabled() && !cpu->thread_kicked) {
         qemu_cpu_kick_thread(cpu);
         cpu->thread_kicked = true;
@@ -903,7 +1127,7 @@ static bool qemu_in_vcpu_thread(void)
 
 void qemu_mutex_lock_iothread(void)
 {
-    if (!tcg_enabled()) {
+    if (!tcg_enabled() || mttcg_enabled) {
         qemu_mutex_lock(&qemu_global_mutex);
     } else {
         iothread_requesting_mutex = true;
@@ -914,13 +1138,36 @@ void qemu_mutex_lock_iothread(void)
         iothread_requesting_mutex = false;
         qemu_cond_broadcast(&qemu_io_proceeded_cond);
     }
+    tls_var(iothread_locked) = true;
 }
 
 void qemu_mutex_unlock_iothread(void)
 {
+    tls_var(iothread_locked) = false;
     qemu_mutex_unlock(&qemu_global_mutex);
 }
 
+bool qemu_mutex_iothread_locked(void)
+{
+    return tls_var(iothread_locked);
+}
+
+bool tcg_iothread_lock(void)
+{
+    if (!mttcg_enabled || tls_var(iothread_locked)) {
+        return false;
+    }
+    qemu_mutex_lock_iothread();
+    return true;
+}
+
+void tcg_iothread_unlock(bool locked)
+{
+    if (locked) {
+        qemu_mutex_unlock_iothread();
+    }
+}
+
 static int all_vcpus_paused(void)
 {
     CPUArchState *penv = first_cpu;
@@ -950,7 +1197,7 @@ void pause_all_vcpus(void)
 
     if (qemu_in_vcpu_thread()) {
         cpu_stop_current();
-        if (!kvm_enabled()) {
+        if (!kvm_enabled() && !mttcg_enabled) {
             while (penv) {
                 CPUState *pcpu = ENV_GET_CPU(penv);
                 pcpu->stop = 0;
@@ -985,6 +1232,20 @@ void resume_all_vcpus(void)
     }
 }
 
+static void qemu_mttcg_start_vcpu(CPUArchState *env)
+{
+    CPUState *cpu = ENV_GET_CPU(env);
+
+    cpu->thread = g_malloc0(sizeof(QemuThread));
+    cpu->halt_cond = g_malloc0(sizeof(QemuCond));
+    qemu_cond_init(cpu->halt_cond);
+    qemu_thread_create(cpu->thread, qemu_mttcg_cpu_thread_fn, env,
+                       QEMU_THREAD_JOINABLE);
+    while (!cpu->created) {
+        qemu_cond_wait(&qemu_cpu_cond, &qemu_global_mutex);
+    }
+}
+
 static void qemu_tcg_init_vcpu(CPUState *cpu)
 {
     /* share a single thread for all cpus with TCG */
@@ -1043,9 +1304,12 @@ void qemu_init_vcpu(void *_env)
 
     env->nr_cores = smp_cores;
     env->nr_threads = smp_threads;
+    cpu->env_ptr = env;
     cpu->stopped = true;
     if (kvm_enabled()) {
         qemu_kvm_start_vcpu(env);
+    } else if (tcg_enabled() && mttcg_enabled) {
+        qemu_mttcg_start_vcpu(env);
     } else if (tcg_enabled()) {
         qemu_tcg_init_vcpu(cpu);
     } else {
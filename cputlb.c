@@ -40,6 +40,77 @@ static const CPUTLBEntry s_cputlb_empty_entry = {
     .addend     = -1,
 };
 
+/* Number of flushes over which the TLB occupancy must stay low before
+   the TLB is shrunk.  */
+#define TLB_RESIZE_WINDOW 16
+
+static inline unsigned int tlb_n_entries(CPUArchState *env, int mmu_idx)
+{
+    return (env->tlb_mask[mmu_idx] >> CPU_TLB_ENTRY_BITS) + 1;
+}
+
+static inline bool tlb_entry_is_empty(const CPUTLBEntry *tlb_entry)
+{
+    return tlb_entry->addr_read == (target_ulong)-1 &&
+           tlb_entry->addr_write == (target_ulong)-1 &&
+           tlb_entry->addr_code == (target_ulong)-1;
+}
+
+static inline bool tlb_hit_page_anyprot(const CPUTLBEntry *tlb_entry,
+                                        target_ulong page)
+{
+    return page == (tlb_entry->addr_read &
+                    (TARGET_PAGE_MASK | TLB_INVALID_MASK)) ||
+           page == (tlb_entry->addr_write &
+                    (TARGET_PAGE_MASK | TLB_INVALID_MASK)) ||
+           page == (tlb_entry->addr_code &
+                    (TARGET_PAGE_MASK | TLB_INVALID_MASK));
+}
+
+/* Choose the number of TLB entries for the next period from the number
+   of entries filled since the previous flush.  Grow as soon as more than
+   70% were used, but only shrink when the occupancy stayed below 30% for
+   a whole window of flushes: some guests flush on every context switch,
+   long before a large working set has been faulted back in.  */
+static void tlb_mmu_resize(CPUArchState *env, int mmu_idx)
+{
+    CPUTLBDesc *desc = &env->tlb_desc[mmu_idx];
+    unsigned int old_size = tlb_n_entries(env, mmu_idx);
+    unsigned int new_size = old_size;
+
+    if (env->tlb_mask[mmu_idx] == 0) {
+        /* First flush, or the TLB was cleared together with the rest of
+           the CPU state on reset.  */
+        memset(desc, 0, sizeof(*desc));
+        env->tlb_mask[mmu_idx] = (CPU_TLB_SIZE - 1) << CPU_TLB_ENTRY_BITS;
+        return;
+    }
+
+    if (desc->n_used > desc->window_max) {
+        desc->window_max = desc->n_used;
+    }
+    desc->window_flushes++;
+
+    if (desc->n_used * 10 > old_size * 7 && old_size < CPU_TLB_MAX_SIZE) {
+        new_size = old_size * 2;
+    } else if (desc->window_flushes >= TLB_RESIZE_WINDOW &&
+               desc->window_max * 10 < old_size * 3 &&
+               old_size > (1 << CPU_TLB_DYN_MIN_BITS)) {
+        new_size = old_size / 2;
+    }
+
+    if (new_size != old_size || desc->window_flushes >= TLB_RESIZE_WINDOW) {
+        desc->window_max = 0;
+        desc->window_flushes = 0;
+    }
+    desc->n_used = 0;
+
+    if (new_size != old_size) {
+        env->tlb_mask[mmu_idx] = (new_size - 1) << CPU_TLB_ENTRY_BITS;
+        env->tlb_stats.resize++;
+    }
+}
+
 /* NOTE:
  * If flush_global is true (the usual case), flush all tlb entries.
  * If flush_global is false, flush (at least) all tlb entries not
@@ -52,9 +123,44 @@ static const CPUTLBEntry s_cputlb_empty_entry = {
  * entries from the TLB at any time, so flushing more entries than
  * required is only an efficiency issue, not a correctness issue.
  */
+static void tlb_flush_async_work(void *opaque)
+{
+    tlb_flush(opaque, 1);
+}
+
+/* Flush all tlb entries of env and only return once its vCPU can no
+   longer use them, e.g. before a removed MMIO or RAM section is freed.
+   Called with the iothread lock held.  */
+void tlb_flush_sync(CPUArchState *env)
+{
+    CPUState *cpu = ENV_GET_CPU(env);
+
+    if (cpu->running && !cpu->stopped && env != cpu_single_env) {
+        /* returns once the vCPU has left cpu_exec() and run the flush */
+        run_on_cpu(cpu, tlb_flush_async_work, env);
+        return;
+    }
+    /* Not executing guest code, or stopped in device code: the queued
+       flush runs before it gets back to guest code.  */
+    tlb_flush(env, 1);
+}
+
 void tlb_flush(CPUArchState *env, int flush_global)
 {
-    int i;
+    CPUState *cpu = ENV_GET_CPU(env);
+    int i, mmu_idx;
+
+    if (cpu->running && env != cpu_single_env) {
+        /* The owning vCPU thread is executing guest code without the
+           iothread lock; let it flush its own TLB before it re-enters
+           cpu_exec().  Until then it may still use the stale entries,
+           which is fine for guest-initiated flushes (the guest cannot
+           tell a remote flush from a slightly later one) but not when
+           the entries point at memory that is going away: use
+           tlb_flush_sync() for that.  */
+        async_run_on_cpu(cpu, tlb_flush_async_work, env);
+        return;
+    }
 
 #if defined(DEBUG_TLB)
     printf("tlb_flush:\n");
@@ -63,33 +169,44 @@ void tlb_flush(CPUArchState *env, int flush_global)
        links while we are modifying them */
     env->current_tb = NULL;
 
-    for (i = 0; i < CPU_TLB_SIZE; i++) {
-        int mmu_idx;
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        unsigned int n;
 
-        for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        tlb_mmu_resize(env, mmu_idx);
+        n = tlb_n_entries(env, mmu_idx);
+        for (i = 0; i < n; i++) {
             env->tlb_table[mmu_idx][i] = s_cputlb_empty_entry;
         }
+        for (i = 0; i < CPU_VTLB_SIZE; i++) {
+            env->tlb_v_table[mmu_idx][i] = s_cputlb_empty_entry;
+        }
     }
 
     memset(env->tb_jmp_cache, 0, TB_JMP_CACHE_SIZE * sizeof (void *));
 
     env->tlb_flush_addr = -1;
     env->tlb_flush_mask = 0;
+    env->tlb_stats.flush++;
     tlb_flush_count++;
 }
 
 static inline void tlb_flush_entry(CPUTLBEntry *tlb_entry, target_ulong addr)
 {
-    if (addr == (tlb_entry->addr_read &
-                 (TARGET_PAGE_MASK | TLB_INVALID_MASK)) ||
-        addr == (tlb_entry->addr_write &
-                 (TARGET_PAGE_MASK | TLB_INVALID_MASK)) ||
-        addr == (tlb_entry->addr_code &
-                 (TARGET_PAGE_MASK | TLB_INVALID_MASK))) {
+    if (tlb_hit_page_anyprot(tlb_entry, addr)) {
         *tlb_entry = s_cputlb_empty_entry;
     }
 }
 
+static inline void tlb_flush_vtlb_page(CPUArchState *env, int mmu_idx,
+                                       target_ulong addr)
+{
+    int k;
+
+    for (k = 0; k < CPU_VTLB_SIZE; k++) {
+        tlb_flush_entry(&env->tlb_v_table[mmu_idx][k], addr);
+    }
+}
+
 void tlb_flush_page(CPUArchState *env, target_ulong addr)
 {
     int i;
@@ -113,9 +230,10 @@ void tlb_flush_page(CPUArchState *env, target_ulong addr)
     env->current_tb = NULL;
 
     addr &= TARGET_PAGE_MASK;
-    i = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        i = CPU_TLB_INDEX(env, mmu_idx, addr);
         tlb_flush_entry(&env->tlb_table[mmu_idx][i], addr);
+        tlb_flush_vtlb_page(env, mmu_idx, addr);
     }
 
     tb_flush_jmp_cache(env, addr);
@@ -179,12 +297,16 @@ void cpu_tlb_reset_dirty_all(ram_addr_t start1, ram_addr_t length)
         int mmu_idx;
 
         for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
-            unsigned int i;
+            unsigned int i, n = tlb_n_entries(env, mmu_idx);
 
-            for (i = 0; i < CPU_TLB_SIZE; i++) {
+            for (i = 0; i < n; i++) {
                 tlb_reset_dirty_range(&env->tlb_table[mmu_idx][i],
                                       start1, length);
             }
+            for (i = 0; i < CPU_VTLB_SIZE; i++) {
+                tlb_reset_dirty_range(&env->tlb_v_table[mmu_idx][i],
+                                      start1, length);
+            }
         }
     }
 }
@@ -200,13 +322,16 @@ static inline void tlb_set_dirty1(CPUTLBEntry *tlb_entry, target_ulong vaddr)
    so that it is no longer dirty */
 void tlb_set_dirty(CPUArchState *env, target_ulong vaddr)
 {
-    int i;
+    int i, k;
     int mmu_idx;
 
     vaddr &= TARGET_PAGE_MASK;
-    i = (vaddr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        i = CPU_TLB_INDEX(env, mmu_idx, vaddr);
         tlb_set_dirty1(&env->tlb_table[mmu_idx][i], vaddr);
+        for (k = 0; k < CPU_VTLB_SIZE; k++) {
+            tlb_set_dirty1(&env->tlb_v_table[mmu_idx][k], vaddr);
+        }
     }
 }
 
@@ -277,9 +402,22 @@ void tlb_set_page(CPUArchState *env, target_ulong vaddr,
     iotlb = memory_region_section_get_iotlb(env, section, vaddr, paddr, prot,
                                             &address);
 
-    index = (vaddr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
-    env->iotlb[mmu_idx][index] = iotlb - vaddr;
+    index = CPU_TLB_INDEX(env, mmu_idx, vaddr);
     te = &env->tlb_table[mmu_idx][index];
+
+    /* Make sure there is no stale copy of this page in the victim TLB,
+       then move the entry we are about to replace there.  */
+    tlb_flush_vtlb_page(env, mmu_idx, vaddr & TARGET_PAGE_MASK);
+    if (tlb_entry_is_empty(te)) {
+        env->tlb_desc[mmu_idx].n_used++;
+    } else if (!tlb_hit_page_anyprot(te, vaddr & TARGET_PAGE_MASK)) {
+        unsigned int vidx = env->vtlb_index++ % CPU_VTLB_SIZE;
+
+        env->tlb_v_table[mmu_idx][vidx] = *te;
+        env->iotlb_v[mmu_idx][vidx] = env->iotlb[mmu_idx][index];
+    }
+
+    env->iotlb[mmu_idx][index] = iotlb - vaddr;
     te->addend = addend - vaddr;
     if (prot & PAGE_READ) {
         te->addr_read = address;
@@ -321,11 +459,12 @@ tb_page_addr_t get_page_addr_code(CPUArchState *env1, target_ulong addr)
     void *p;
     MemoryRegion *mr;
 
-    page_index = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
     mmu_idx = cpu_mmu_index(env1);
+    page_index = CPU_TLB_INDEX(env1, mmu_idx, addr);
     if (unlikely(env1->tlb_table[mmu_idx][page_index].addr_code !=
                  (addr & TARGET_PAGE_MASK))) {
         cpu_ldub_code(env1, addr);
+        page_index = CPU_TLB_INDEX(env1, mmu_idx, addr);
     }
     pd = env1->iotlb[mmu_idx][page_index] & ~TARGET_PAGE_MASK;
     mr = iotlb_to_region(pd);
@@ -341,6 +480,91 @@ tb_page_addr_t get_page_addr_code(CPUArchState *env1, target_ulong addr)
     return qemu_ram_addr_from_host_nofail(p);
 }
 
+/* Look for addr in the victim TLB and, if found, swap it with the
+   direct-mapped entry so that the next access hits in the fast path.
+   access_type is 0 for loads, 1 for stores and 2 for code fetches.  */
+static bool tlb_victim_hit(CPUArchState *env, int mmu_idx, target_ulong addr,
+                           int access_type)
+{
+    target_ulong page = addr & TARGET_PAGE_MASK;
+    int index = CPU_TLB_INDEX(env, mmu_idx, addr);
+    int vidx;
+
+    for (vidx = 0; vidx < CPU_VTLB_SIZE; vidx++) {
+        CPUTLBEntry *vte = &env->tlb_v_table[mmu_idx][vidx];
+        target_ulong cmp;
+
+        switch (access_type) {
+        case 0:
+            cmp = vte->addr_read;
+            break;
+        case 1:
+            cmp = vte->addr_write;
+            break;
+        default:
+            cmp = vte->addr_code;
+            break;
+        }
+        if ((cmp & (TARGET_PAGE_MASK | TLB_INVALID_MASK)) == page) {
+            CPUTLBEntry tmptlb = env->tlb_table[mmu_idx][index];
+            hwaddr tmpiotlb = env->iotlb[mmu_idx][index];
+
+            env->tlb_table[mmu_idx][index] = *vte;
+            env->iotlb[mmu_idx][index] = env->iotlb_v[mmu_idx][vidx];
+            *vte = tmptlb;
+            env->iotlb_v[mmu_idx][vidx] = tmpiotlb;
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Called on a TLB miss from the softmmu helpers.  The victim TLB is
+   checked first; otherwise filling the TLB walks the memory map and may
+   raise a guest exception, so in multi-threaded TCG mode it runs under
+   the iothread lock.  */
+void tlb_fill_locked(CPUArchState *env1, target_ulong addr, int is_write,
+                     int mmu_idx, uintptr_t retaddr)
+{
+    bool locked;
+
+    if (tlb_victim_hit(env1, mmu_idx, addr, is_write)) {
+        env1->tlb_stats.victim_hit++;
+        return;
+    }
+    env1->tlb_stats.fill++;
+
+    locked = tcg_iothread_lock();
+    tlb_fill(env1, addr, is_write, mmu_idx, retaddr);
+    tcg_iothread_unlock(locked);
+}
+
+void dump_tlb_info(FILE *f, fprintf_function cpu_fprintf)
+{
+    CPUArchState *env;
+    uint64_t fill = 0, victim_hit = 0, resize = 0;
+
+    for (env = first_cpu; env != NULL; env = env->next_cpu) {
+        fill += env->tlb_stats.fill;
+        victim_hit += env->tlb_stats.victim_hit;
+        resize += env->tlb_stats.resize;
+    }
+    cpu_fprintf(f, "TLB fill count      %" PRIu64 "\n", fill);
+    cpu_fprintf(f, "TLB victim hits     %" PRIu64 " (%d%%)\n", victim_hit,
+                fill + victim_hit ? (int)(victim_hit * 100 /
+                                          (fill + victim_hit)) : 0);
+    cpu_fprintf(f, "TLB resize count    %" PRIu64 "\n", resize);
+    for (env = first_cpu; env != NULL; env = env->next_cpu) {
+        int mmu_idx;
+
+        cpu_fprintf(f, "CPU #%d TLB entries ", env->cpu_index);
+        for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+            cpu_fprintf(f, " %u", tlb_n_entries(env, mmu_idx));
+        }
+        cpu_fprintf(f, " (flushes %" PRIu64 ")\n", env->tlb_stats.flush);
+    }
+}
+
 #define MMUSUFFIX _cmmu
 #undef GETPC
 #define GETPC() ((uintptr_t)0)
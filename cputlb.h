@@ -30,6 +30,8 @@ MemoryRegionSection *phys_page_find(struct AddressSpaceDispatch *d,
                                     hwaddr index);
 void cpu_tlb_reset_dirty_all(ram_addr_t start1, ram_addr_t length);
 void tlb_set_dirty(CPUArchState *env, target_ulong vaddr);
+void tlb_flush_sync(CPUArchState *env);
+void dump_tlb_info(FILE *f, fprintf_function cpu_fprintf);
 extern int tlb_flush_count;
 
 /* exec.c */
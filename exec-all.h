@@ -143,9 +143,12 @@ struct TranslationBlock {
     uint64_t flags; /* flags defining in which context the code was generated */
     uint16_t size;      /* size of target code for this block (1 <=
                            size <= TARGET_PAGE_SIZE) */
-    uint16_t cflags;    /* compile flags */
+    uint32_t cflags;    /* compile flags */
 #define CF_COUNT_MASK  0x7fff
 #define CF_LAST_IO     0x8000 /* Last insn may be an IO access.  */
+#define CF_EXCLUSIVE   0x10000 /* Runs while all other vCPUs are stopped.  */
+#define CF_INVALID     0x20000 /* Invalidated, see tb_phys_invalidate().  */
+#define CF_PROFILE     0x40000 /* Counts its executions, see tb_profile_dump() */
 
     uint8_t *tc_ptr;    /* pointer to the translated code */
     /* next matching tb for physical address. */
@@ -170,6 +173,11 @@ struct TranslationBlock {
     struct TranslationBlock *jmp_next[2];
     struct TranslationBlock *jmp_first;
     uint32_t icount;
+    uint32_t tc_size;   /* size of the translated code */
+
+    /* hot block profiling (CF_PROFILE) */
+    uint64_t exec_count;
+    uint64_t exit_count[2]; /* returns to cpu_exec() through each goto_tb */
 };
 
 static inline unsigned int tb_jmp_cache_hash_page(target_ulong pc)
@@ -194,6 +202,7 @@ static inline unsigned int tb_phys_hash_func(tb_page_addr_t pc)
 
 void tb_free(TranslationBlock *tb);
 void tb_flush(CPUArchState *env);
+void tb_evict_region(CPUArchState *env);
 void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr);
 
 extern TranslationBlock *tb_phys_hash[CODE_GEN_PHYS_HASH_SIZE];
@@ -280,12 +289,46 @@ static inline void tb_add_jump(TranslationBlock *tb, int n,
 }
 
 TranslationBlock *tb_find_pc(uintptr_t pc_ptr);
+void *tb_lookup_ptr(CPUArchState *env);
 
 #include "qemu-lock.h"
 
 extern spinlock_t tb_lock;
 
 extern int tb_invalidated_flag;
+extern bool tb_flush_pending;
+extern bool tb_evict_pending;
+
+#if !defined(CONFIG_USER_ONLY)
+void tb_lock_acquire(void);
+void tb_lock_release(void);
+void tb_lock_reset(void);
+/* Take the iothread lock from a vCPU thread in multi-threaded TCG mode
+   unless it is already held; returns whether it was taken.  */
+bool tcg_iothread_lock(void);
+void tcg_iothread_unlock(bool locked);
+#else
+static inline void tb_lock_acquire(void)
+{
+}
+
+static inline void tb_lock_release(void)
+{
+}
+
+static inline void tb_lock_reset(void)
+{
+}
+
+static inline bool tcg_iothread_lock(void)
+{
+    return false;
+}
+
+static inline void tcg_iothread_unlock(bool locked)
+{
+}
+#endif
 
 /* The return address may point to the start of the next instruction.
    Subtracting one gets us the call instruction itself.  */
@@ -358,6 +401,8 @@ void io_mem_write(struct MemoryRegion *mr, hwaddr addr,
 
 void tlb_fill(CPUArchState *env1, target_ulong addr, int is_write, int mmu_idx,
               uintptr_t retaddr);
+void tlb_fill_locked(CPUArchState *env1, target_ulong addr, int is_write,
+                     int mmu_idx, uintptr_t retaddr);
 
 #include "softmmu_defs.h"
 
@@ -398,6 +443,19 @@ void cpu_set_debug_excp_handler(CPUDebugExcpHandler *handler);
 /* vl.c */
 extern int singlestep;
 
+/* exec.c */
+extern bool tb_profile_enabled;
+void tb_profile_set(bool enable);
+void tb_profile_dump(FILE *f, fprintf_function cpu_fprintf, int max);
+void tb_perf_map_enable(void);
+
+/* translate-cache.c */
+void tb_cache_init(const char *path, bool print_stats);
+bool tb_cache_lookup(CPUArchState *env, TranslationBlock *tb, int *code_size);
+void tb_cache_store(CPUArchState *env, TranslationBlock *tb, int code_size);
+void tb_cache_dump_info(FILE *f, fprintf_function cpu_fprintf);
+void tb_cache_exit(void);
+
 /* cpu-exec.c */
 extern volatile sig_atomic_t exit_request;
 
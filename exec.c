@@ -33,6 +33,7 @@
 #include "kvm.h"
 #include "hw/xen.h"
 #include "qemu-timer.h"
+#include "qemu-thread.h"
 #include "memory.h"
 #include "dma.h"
 #include "exec-memory.h"
@@ -79,12 +80,34 @@
 
 #define SMC_BITMAP_USE_THRESHOLD 10
 
+/* The translation buffer is split into regions which are filled in
+   turn.  When the last one is full, the oldest region is recycled and
+   only the TBs that were generated in it are invalidated.  */
+#define CODE_GEN_MAX_REGIONS 8
+
+typedef struct TBRegion {
+    uint8_t *code_start;
+    uint8_t *code_end;      /* end of the code generated so far */
+    uint8_t *code_max;      /* threshold to switch to the next region */
+    TranslationBlock *tbs;
+    int nb_tbs;
+} TBRegion;
+
 static TranslationBlock *tbs;
 static int code_gen_max_blocks;
 TranslationBlock *tb_phys_hash[CODE_GEN_PHYS_HASH_SIZE];
 static int nb_tbs;
+static TBRegion tb_regions[CODE_GEN_MAX_REGIONS];
+static int nb_tb_regions;
+static int tb_region_blocks;
+static int cur_tb_region;
 /* any access to the tbs or the page table must use this lock */
 spinlock_t tb_lock = SPIN_LOCK_UNLOCKED;
+/* set when the code buffer filled up in multi-threaded TCG mode; the
+   flush is then done by a vCPU thread once all others are quiescent */
+bool tb_flush_pending;
+/* likewise for recycling the oldest region of the translation buffer */
+bool tb_evict_pending;
 
 uint8_t *code_gen_prologue;
 static uint8_t *code_gen_buffer;
@@ -119,6 +142,43 @@ DEFINE_TLS(CPUArchState *,cpu_single_env);
    1 = Precise instruction counting.
    2 = Adaptive rate instruction counting.  */
 int use_icount = 0;
+/* Run each TCG vCPU in its own host thread (-tcg thread=multi).  */
+bool mttcg_enabled;
+/* Set when translated code may run concurrently on several vCPUs, so
+   that guest atomic operations must not be emulated non-atomically.  */
+bool parallel_cpus;
+
+#if !defined(CONFIG_USER_ONLY)
+/* In multi-threaded TCG mode the translation cache (tbs, tb_phys_hash,
+   the page descriptors and the code buffer) is protected by tb_mutex.
+   The lock is recursive per thread and is ordered after the iothread
+   lock: it is never held while acquiring the iothread lock.  */
+static QemuMutex tb_mutex;
+static DEFINE_TLS(int, tb_lock_depth);
+
+void tb_lock_acquire(void)
+{
+    if (mttcg_enabled && tls_var(tb_lock_depth)++ == 0) {
+        qemu_mutex_lock(&tb_mutex);
+    }
+}
+
+void tb_lock_release(void)
+{
+    if (mttcg_enabled && --tls_var(tb_lock_depth) == 0) {
+        qemu_mutex_unlock(&tb_mutex);
+    }
+}
+
+/* Drop the lock after a longjmp out of a locked section.  */
+void tb_lock_reset(void)
+{
+    if (tls_var(tb_lock_depth)) {
+        tls_var(tb_lock_depth) = 0;
+        qemu_mutex_unlock(&tb_mutex);
+    }
+}
+#endif
 
 typedef struct PageDesc {
     /* list of TBs intersecting this ram page */
@@ -190,7 +250,6 @@ static unsigned phys_map_nodes_nb, phys_map_nodes_nb_alloc;
 
 static void io_mem_init(void);
 static void memory_map_init(void);
-static void *qemu_safe_ram_ptr(ram_addr_t addr);
 
 static MemoryRegion io_mem_watch;
 #endif
@@ -200,6 +259,41 @@ static void tb_link_page(TranslationBlock *tb, tb_page_addr_t phys_pc,
 /* statistics */
 static int tb_flush_count;
 static int tb_phys_invalidate_count;
+static int tb_evict_count;
+static int tb_retranslate_count;
+static int tb_gen_count;
+static uint64_t tb_gen_bytes;
+/* start of the period for the code generation rate in "info jit" */
+static int64_t tb_gen_stats_time;
+
+/* hot block profiling and perf JIT map */
+bool tb_profile_enabled;
+static bool tb_perf_map_enabled;
+static FILE *tb_perf_map;
+static pid_t tb_perf_map_pid;
+
+/* Physical PCs of recently evicted or flushed TBs, used to count
+   retranslations.  0 is an empty slot, so the PC is stored plus one.  */
+#define TB_EVICTED_HASH_SIZE 4096
+static tb_page_addr_t tb_evicted_pc[TB_EVICTED_HASH_SIZE];
+
+static inline void tb_remember_evicted(TranslationBlock *tb)
+{
+    tb_page_addr_t phys_pc = tb->page_addr[0] + (tb->pc & ~TARGET_PAGE_MASK);
+
+    tb_evicted_pc[tb_phys_hash_func(phys_pc) & (TB_EVICTED_HASH_SIZE - 1)] =
+        phys_pc + 1;
+}
+
+static inline void tb_check_retranslated(tb_page_addr_t phys_pc)
+{
+    unsigned int h = tb_phys_hash_func(phys_pc) & (TB_EVICTED_HASH_SIZE - 1);
+
+    if (tb_evicted_pc[h] == phys_pc + 1) {
+        tb_evicted_pc[h] = 0;
+        tb_retranslate_count++;
+    }
+}
 
 #ifdef _WIN32
 static inline void map_exec(void *addr, long size)
@@ -468,6 +562,38 @@ not_found:
     return &phys_sections[s_index];
 }
 
+/* Small per-thread cache of phys_page_find() results for the accessors
+   in this file.  Entries are tagged with phys_map_generation, which is
+   bumped whenever the memory topology is rebuilt.  */
+#define PHYS_CACHE_BITS 4
+#define PHYS_CACHE_SIZE (1 << PHYS_CACHE_BITS)
+
+typedef struct PhysPageCacheEntry {
+    AddressSpaceDispatch *d;
+    hwaddr index;
+    unsigned int generation;
+    MemoryRegionSection *section;
+} PhysPageCacheEntry;
+
+static unsigned int phys_map_generation = 1;
+static DEFINE_TLS(PhysPageCacheEntry[PHYS_CACHE_SIZE], phys_page_cache);
+
+static MemoryRegionSection *phys_page_find_cached(AddressSpaceDispatch *d,
+                                                  hwaddr index)
+{
+    PhysPageCacheEntry *e;
+
+    e = &tls_var(phys_page_cache)[index & (PHYS_CACHE_SIZE - 1)];
+    if (e->generation != phys_map_generation || e->d != d
+        || e->index != index) {
+        e->section = phys_page_find(d, index);
+        e->d = d;
+        e->index = index;
+        e->generation = phys_map_generation;
+    }
+    return e->section;
+}
+
 bool memory_region_is_unassigned(MemoryRegion *mr)
 {
     return mr != &io_mem_ram && mr != &io_mem_rom
@@ -598,6 +724,39 @@ static inline void *alloc_code_gen_buffer(void)
 }
 #endif /* USE_STATIC_CODE_GEN_BUFFER, USE_MMAP */
 
+/* Each region must leave room for one worst-case TB past its threshold;
+   don't split small buffers so much that this headroom dominates.  */
+static void code_gen_alloc_regions(void)
+{
+    size_t headroom = TCG_MAX_OP_SIZE * OPC_BUF_SIZE;
+    size_t region_size;
+    int i;
+
+    nb_tb_regions = code_gen_buffer_size / (8 * headroom);
+    if (nb_tb_regions > CODE_GEN_MAX_REGIONS) {
+        nb_tb_regions = CODE_GEN_MAX_REGIONS;
+    } else if (nb_tb_regions < 1) {
+        nb_tb_regions = 1;
+    }
+    region_size = (code_gen_buffer_size / nb_tb_regions) &
+        ~(size_t)(CODE_GEN_ALIGN - 1);
+    tb_region_blocks = code_gen_max_blocks / nb_tb_regions;
+
+    for (i = 0; i < nb_tb_regions; i++) {
+        TBRegion *r = &tb_regions[i];
+
+        r->code_start = code_gen_buffer + i * region_size;
+        r->code_end = r->code_start;
+        r->code_max = r->code_start + region_size - headroom;
+        r->tbs = tbs + i * tb_region_blocks;
+        r->nb_tbs = 0;
+    }
+    /* the last region goes up to the prologue */
+    tb_regions[nb_tb_regions - 1].code_max =
+        code_gen_buffer + code_gen_buffer_max_size;
+    cur_tb_region = 0;
+}
+
 static inline void code_gen_alloc(size_t tb_size)
 {
     code_gen_buffer_size = size_code_gen_buffer(tb_size);
@@ -619,6 +778,7 @@ static inline void code_gen_alloc(size_t tb_size)
         (TCG_MAX_OP_SIZE * OPC_BUF_SIZE);
     code_gen_max_blocks = code_gen_buffer_size / CODE_GEN_AVG_BLOCK_SIZE;
     tbs = g_malloc(code_gen_max_blocks * sizeof(TranslationBlock));
+    code_gen_alloc_regions();
 }
 
 /* Must be called before using the QEMU cpus. 'tb_size' is the size
@@ -629,8 +789,12 @@ void tcg_exec_init(unsigned long tb_size)
     cpu_gen_init();
     code_gen_alloc(tb_size);
     code_gen_ptr = code_gen_buffer;
+    tb_gen_stats_time = get_clock();
     tcg_register_jit(code_gen_buffer, code_gen_buffer_size);
     page_init();
+#if !defined(CONFIG_USER_ONLY)
+    qemu_mutex_init(&tb_mutex);
+#endif
 #if !defined(CONFIG_USER_ONLY) || !defined(CONFIG_USE_GUEST_BASE)
     /* There's no guest base to take into account, so go ahead and
        initialize the prologue now.  */
@@ -732,12 +896,21 @@ void cpu_exec_init(CPUArchState *env)
    too many translation blocks or too much generated code. */
 static TranslationBlock *tb_alloc(target_ulong pc)
 {
+    TBRegion *r = &tb_regions[cur_tb_region];
     TranslationBlock *tb;
 
-    if (nb_tbs >= code_gen_max_blocks ||
-        (code_gen_ptr - code_gen_buffer) >= code_gen_buffer_max_size)
-        return NULL;
-    tb = &tbs[nb_tbs++];
+    if (r->nb_tbs >= tb_region_blocks || code_gen_ptr >= r->code_max) {
+        /* move on to the next region if it is still free */
+        if (cur_tb_region + 1 >= nb_tb_regions ||
+            tb_regions[cur_tb_region + 1].nb_tbs != 0) {
+            return NULL;
+        }
+        r->code_end = code_gen_ptr;
+        r = &tb_regions[++cur_tb_region];
+        code_gen_ptr = r->code_start;
+    }
+    tb = &r->tbs[r->nb_tbs++];
+    nb_tbs++;
     tb->pc = pc;
     tb->cflags = 0;
     return tb;
@@ -745,11 +918,14 @@ static TranslationBlock *tb_alloc(target_ulong pc)
 
 void tb_free(TranslationBlock *tb)
 {
+    TBRegion *r = &tb_regions[cur_tb_region];
+
     /* In practice this is mostly used for single use temporary TB
        Ignore the hard cases and just back up if this TB happens to
        be the last one generated.  */
-    if (nb_tbs > 0 && tb == &tbs[nb_tbs - 1]) {
+    if (r->nb_tbs > 0 && tb == &r->tbs[r->nb_tbs - 1]) {
         code_gen_ptr = tb->tc_ptr;
+        r->nb_tbs--;
         nb_tbs--;
     }
 }
@@ -794,11 +970,51 @@ static void page_flush_tb(void)
     }
 }
 
+#if !defined(CONFIG_USER_ONLY)
+/* With multi-threaded TCG, other vCPUs may be executing or translating
+   code.  If so, set *pending and kick them (or, from a vCPU, the caller)
+   out of cpu_exec(): the vCPU thread loop then does the work once all of
+   them have left it, see qemu_mttcg_cpu_thread_fn().  Callers outside
+   the vCPU threads hold the iothread lock, so a vCPU that isn't running
+   cannot start while they do the work themselves.  */
+static bool tb_defer_to_cpu_loop(bool *pending)
+{
+    CPUArchState *env;
+
+    if (!mttcg_enabled) {
+        return false;
+    }
+    if (cpu_single_env) {
+        *pending = true;
+        cpu_exit(cpu_single_env);
+        return true;
+    }
+    for (env = first_cpu; env != NULL; env = env->next_cpu) {
+        CPUState *cpu = ENV_GET_CPU(env);
+
+        /* as in tcg_exclusive_start(), a stopped vCPU is waiting in
+           device code, not running guest code */
+        if (cpu->running && !cpu->stopped) {
+            *pending = true;
+            cpu_exit(env);
+        }
+    }
+    return *pending;
+}
+#endif
+
 /* flush all the translation blocks */
-/* XXX: tb_flush is currently not thread safe */
 void tb_flush(CPUArchState *env1)
 {
     CPUArchState *env;
+    int i;
+
+#if !defined(CONFIG_USER_ONLY)
+    if (tb_defer_to_cpu_loop(&tb_flush_pending)) {
+        return;
+    }
+#endif
+    tb_lock_acquire();
 #if defined(DEBUG_FLUSH)
     printf("qemu: flush code_size=%ld nb_tbs=%d avg_tb_size=%ld\n",
            (unsigned long)(code_gen_ptr - code_gen_buffer),
@@ -808,6 +1024,19 @@ void tb_flush(CPUArchState *env1)
     if ((unsigned long)(code_gen_ptr - code_gen_buffer) > code_gen_buffer_size)
         cpu_abort(env1, "Internal error: code buffer overflow\n");
 
+    for (i = 0; i < nb_tb_regions; i++) {
+        TBRegion *r = &tb_regions[i];
+        int j;
+
+        for (j = 0; j < r->nb_tbs; j++) {
+            if (!(r->tbs[j].cflags & CF_INVALID)) {
+                tb_remember_evicted(&r->tbs[j]);
+            }
+        }
+        r->nb_tbs = 0;
+        r->code_end = r->code_start;
+    }
+    cur_tb_region = 0;
     nb_tbs = 0;
 
     for(env = first_cpu; env != NULL; env = env->next_cpu) {
@@ -821,6 +1050,50 @@ void tb_flush(CPUArchState *env1)
     /* XXX: flush processor icache at this point if cache flush is
        expensive */
     tb_flush_count++;
+    tb_flush_pending = false;
+    tb_evict_pending = false;
+    tb_lock_release();
+}
+
+/* Make room in the translation buffer by recycling its oldest region:
+   invalidate (and unlink) only the TBs that were generated there, and
+   continue generating code at its start.  */
+void tb_evict_region(CPUArchState *env1)
+{
+    TBRegion *r;
+    int i, next;
+
+    if (nb_tb_regions == 1) {
+        tb_flush(env1);
+        return;
+    }
+#if !defined(CONFIG_USER_ONLY)
+    /* Other vCPUs may be running code from that region */
+    if (tb_defer_to_cpu_loop(&tb_evict_pending)) {
+        return;
+    }
+#endif
+    tb_lock_acquire();
+    next = (cur_tb_region + 1) % nb_tb_regions;
+    r = &tb_regions[next];
+    for (i = 0; i < r->nb_tbs; i++) {
+        TranslationBlock *tb = &r->tbs[i];
+
+        if (!(tb->cflags & CF_INVALID)) {
+            tb_remember_evicted(tb);
+            tb_phys_invalidate(tb, -1);
+        }
+    }
+    nb_tbs -= r->nb_tbs;
+    r->nb_tbs = 0;
+    r->code_end = r->code_start;
+
+    tb_regions[cur_tb_region].code_end = code_gen_ptr;
+    cur_tb_region = next;
+    code_gen_ptr = r->code_start;
+    tb_evict_count++;
+    tb_evict_pending = false;
+    tb_lock_release();
 }
 
 #ifdef DEBUG_TB_CHECK
@@ -937,6 +1210,8 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
     tb_page_addr_t phys_pc;
     TranslationBlock *tb1, *tb2;
 
+    tb_lock_acquire();
+
     /* remove the TB from the hash list */
     phys_pc = tb->page_addr[0] + (tb->pc & ~TARGET_PAGE_MASK);
     h = tb_phys_hash_func(phys_pc);
@@ -981,8 +1256,10 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
         tb1 = tb2;
     }
     tb->jmp_first = (TranslationBlock *)((uintptr_t)tb | 2); /* fail safe */
+    tb->cflags |= CF_INVALID;
 
     tb_phys_invalidate_count++;
+    tb_lock_release();
 }
 
 static inline void set_bits(uint8_t *tab, int start, int len)
@@ -1040,6 +1317,34 @@ static void build_page_bitmap(PageDesc *p)
     }
 }
 
+/* Tell perf where the code of 'tb' lives, using the JIT map format of
+   Linux tools/perf: "start size symbol" lines in /tmp/perf-PID.map.  */
+static void tb_perf_map_add(TranslationBlock *tb)
+{
+    char name[64];
+
+    if (tb_perf_map_pid != getpid()) {
+        /* first TB of this process, which may be a forked child */
+        snprintf(name, sizeof(name), "/tmp/perf-%d.map", (int)getpid());
+        tb_perf_map = fopen(name, "w");
+        if (!tb_perf_map) {
+            tb_perf_map_enabled = false;
+            return;
+        }
+        setvbuf(tb_perf_map, NULL, _IOLBF, 0);
+        tb_perf_map_pid = getpid();
+        fprintf(tb_perf_map, "%" PRIxPTR " %x qemu-prologue\n",
+                (uintptr_t)code_gen_prologue, 1024);
+    }
+    fprintf(tb_perf_map, "%" PRIxPTR " %x guest:" TARGET_FMT_lx "\n",
+            (uintptr_t)tb->tc_ptr, tb->tc_size, tb->pc);
+}
+
+void tb_perf_map_enable(void)
+{
+    tb_perf_map_enabled = true;
+}
+
 TranslationBlock *tb_gen_code(CPUArchState *env,
                               target_ulong pc, target_ulong cs_base,
                               int flags, int cflags)
@@ -1050,24 +1355,46 @@ TranslationBlock *tb_gen_code(CPUArchState *env,
     target_ulong virt_page2;
     int code_gen_size;
 
+    tb_lock_acquire();
     phys_pc = get_page_addr_code(env, pc);
+    tb_check_retranslated(phys_pc);
     tb = tb_alloc(pc);
     if (!tb) {
-        /* flush must be done */
-        tb_flush(env);
+        /* recycle the oldest part of the translation buffer */
+        tb_evict_region(env);
+        if (tb_flush_pending || tb_evict_pending) {
+            /* deferred to the vCPU thread loop, see tb_flush() */
+            env->exception_index = EXCP_INTERRUPT;
+            cpu_loop_exit(env);
+        }
         /* cannot fail at this point */
         tb = tb_alloc(pc);
         /* Don't forget to invalidate previous TB info.  */
         tb_invalidated_flag = 1;
     }
+    if (tb_profile_enabled) {
+        cflags |= CF_PROFILE;
+    }
     tc_ptr = code_gen_ptr;
     tb->tc_ptr = tc_ptr;
     tb->cs_base = cs_base;
     tb->flags = flags;
     tb->cflags = cflags;
-    cpu_gen_code(env, tb, &code_gen_size);
+    tb->exec_count = 0;
+    tb->exit_count[0] = 0;
+    tb->exit_count[1] = 0;
+    if (!tb_cache_lookup(env, tb, &code_gen_size)) {
+        cpu_gen_code(env, tb, &code_gen_size);
+        tb_cache_store(env, tb, code_gen_size);
+    }
+    tb->tc_size = code_gen_size;
+    if (tb_perf_map_enabled) {
+        tb_perf_map_add(tb);
+    }
     code_gen_ptr = (void *)(((uintptr_t)code_gen_ptr + code_gen_size +
                              CODE_GEN_ALIGN - 1) & ~(CODE_GEN_ALIGN - 1));
+    tb_gen_count++;
+    tb_gen_bytes += code_gen_size;
 
     /* check next page if needed */
     virt_page2 = (pc + tb->size - 1) & TARGET_PAGE_MASK;
@@ -1076,6 +1403,7 @@ TranslationBlock *tb_gen_code(CPUArchState *env,
         phys_page2 = get_page_addr_code(env, virt_page2);
     }
     tb_link_page(tb, phys_pc, phys_page2);
+    tb_lock_release();
     return tb;
 }
 
@@ -1120,9 +1448,12 @@ void tb_invalidate_phys_page_range(tb_page_addr_t start, tb_page_addr_t end,
     int current_flags = 0;
 #endif /* TARGET_HAS_PRECISE_SMC */
 
+    tb_lock_acquire();
     p = page_find(start >> TARGET_PAGE_BITS);
-    if (!p)
+    if (!p) {
+        tb_lock_release();
         return;
+    }
     if (!p->code_bitmap &&
         ++p->code_write_count >= SMC_BITMAP_USE_THRESHOLD &&
         is_cpu_write_access) {
@@ -1206,6 +1537,7 @@ void tb_invalidate_phys_page_range(tb_page_addr_t start, tb_page_addr_t end,
         cpu_resume_from_signal(env, NULL);
     }
 #endif
+    tb_lock_release();
 }
 
 /* len must be <= 8 and start must be a multiple of len */
@@ -1410,32 +1742,47 @@ bool is_tcg_gen_code(uintptr_t tc_ptr)
    tb[1].tc_ptr. Return NULL if not found */
 TranslationBlock *tb_find_pc(uintptr_t tc_ptr)
 {
-    int m_min, m_max, m;
+    int m_min, m_max, m, i;
     uintptr_t v;
     TranslationBlock *tb;
+    TBRegion *r = NULL;
 
     if (nb_tbs <= 0)
         return NULL;
-    if (tc_ptr < (uintptr_t)code_gen_buffer ||
-        tc_ptr >= (uintptr_t)code_gen_ptr) {
+    tb_lock_acquire();
+    /* TBs are sorted by tc_ptr within each region */
+    for (i = 0; i < nb_tb_regions; i++) {
+        uint8_t *end = i == cur_tb_region ? code_gen_ptr
+                                          : tb_regions[i].code_end;
+
+        if (tc_ptr >= (uintptr_t)tb_regions[i].code_start &&
+            tc_ptr < (uintptr_t)end) {
+            r = &tb_regions[i];
+            break;
+        }
+    }
+    if (r == NULL || r->nb_tbs == 0) {
+        tb_lock_release();
         return NULL;
     }
     /* binary search (cf Knuth) */
     m_min = 0;
-    m_max = nb_tbs - 1;
+    m_max = r->nb_tbs - 1;
     while (m_min <= m_max) {
         m = (m_min + m_max) >> 1;
-        tb = &tbs[m];
+        tb = &r->tbs[m];
         v = (uintptr_t)tb->tc_ptr;
-        if (v == tc_ptr)
+        if (v == tc_ptr) {
+            tb_lock_release();
             return tb;
-        else if (tc_ptr < v) {
+        } else if (tc_ptr < v) {
             m_max = m - 1;
         } else {
             m_min = m + 1;
         }
     }
-    return &tbs[m_max];
+    tb_lock_release();
+    return &r->tbs[m_max];
 }
 
 static void tb_reset_jump_recursive(TranslationBlock *tb);
@@ -1733,6 +2080,9 @@ static void tcg_handle_interrupt(CPUArchState *env, int mask)
             && (mask & ~old_mask) != 0) {
             cpu_abort(env, "Raised interrupt while not in I/O function");
         }
+    } else if (mttcg_enabled) {
+        /* translated code checks exit_request at the start of each TB */
+        env->exit_request = 1;
     } else {
         cpu_unlink_tb(env);
     }
@@ -1757,7 +2107,11 @@ void cpu_reset_interrupt(CPUArchState *env, int mask)
 void cpu_exit(CPUArchState *env)
 {
     env->exit_request = 1;
-    cpu_unlink_tb(env);
+    /* Unlinking patches TBs other vCPUs may be executing; with one
+       thread per vCPU the exit_request check in each TB is used instead.  */
+    if (!mttcg_enabled) {
+        cpu_unlink_tb(env);
+    }
 }
 
 void cpu_abort(CPUArchState *env, const char *fmt, ...)
@@ -1849,10 +2203,10 @@ static void tlb_reset_dirty_range_all(ram_addr_t start, ram_addr_t end,
 
     /* we modify the TLB cache so that the dirty bit will be set again
        when accessing the range */
-    start1 = (uintptr_t)qemu_safe_ram_ptr(start);
+    start1 = (uintptr_t)qemu_get_ram_ptr(start);
     /* Check that we don't span multiple blocks - this breaks the
        address comparisons below.  */
-    if ((uintptr_t)qemu_safe_ram_ptr(end - 1) - start1
+    if ((uintptr_t)qemu_get_ram_ptr(end - 1) - start1
             != (end - 1) - start) {
         abort();
     }
@@ -2436,6 +2790,155 @@ static void *file_ram_alloc(RAMBlock *block,
 }
 #endif
 
+/* Read-mostly copy of ram_list.blocks sorted by offset, used to look up
+   the block for a ram_addr_t without walking (or reordering) the list.
+   It is rebuilt with the iothread lock held whenever a block is added or
+   removed, and published with a single pointer store.  Everybody but the
+   vCPU threads of multi-threaded TCG searches it under the iothread lock;
+   those run guest code without the lock, so the superseded map and the
+   removed block are only freed once each vCPU has gone through its
+   queued work, i.e. has left cpu_exec() at least once.  */
+typedef struct RAMBlockMap {
+    int nb_blocks;
+    RAMBlock *blocks[];
+} RAMBlockMap;
+
+static RAMBlockMap *volatile ram_block_map;
+
+typedef struct RAMBlockReclaim {
+    RAMBlockMap *map;
+    RAMBlock *block;
+    int pending;                /* vCPUs that may still see map */
+} RAMBlockReclaim;
+
+static int ram_block_cmp(const void *a, const void *b)
+{
+    const RAMBlock *ba = *(RAMBlock * const *)a;
+    const RAMBlock *bb = *(RAMBlock * const *)b;
+
+    return ba->offset < bb->offset ? -1 : ba->offset > bb->offset;
+}
+
+static void ram_block_free(RAMBlock *block)
+{
+    if (block->flags & RAM_PREALLOC_MASK) {
+        ;
+    } else if (mem_path) {
+#if defined (__linux__) && !defined(TARGET_S390X)
+        if (block->fd) {
+            munmap(block->host, block->length);
+            close(block->fd);
+        } else {
+            qemu_vfree(block->host);
+        }
+#else
+        abort();
+#endif
+    } else {
+#if defined(TARGET_S390X) && defined(CONFIG_KVM)
+        munmap(block->host, block->length);
+#else
+        if (xen_enabled()) {
+            xen_invalidate_map_cache_entry(block->host);
+        } else {
+            qemu_vfree(block->host);
+        }
+#endif
+    }
+    g_free(block);
+}
+
+static void ram_block_reclaim_done(RAMBlockReclaim *r)
+{
+    g_free(r->map);
+    if (r->block) {
+        ram_block_free(r->block);
+    }
+    g_free(r);
+}
+
+/* Run by each vCPU thread outside cpu_exec(), see ram_block_reclaim() */
+static void ram_block_reclaim_cpu(void *data)
+{
+    RAMBlockReclaim *r = data;
+
+    if (--r->pending == 0) {
+        ram_block_reclaim_done(r);
+    }
+}
+
+static void ram_block_reclaim(RAMBlockMap *map, RAMBlock *block)
+{
+    RAMBlockReclaim *r = g_malloc0(sizeof(*r));
+    CPUArchState *env;
+
+    r->map = map;
+    r->block = block;
+    if (mttcg_enabled) {
+        for (env = first_cpu; env != NULL; env = env->next_cpu) {
+            r->pending++;
+        }
+    }
+    if (r->pending == 0) {
+        ram_block_reclaim_done(r);
+        return;
+    }
+    for (env = first_cpu; env != NULL; env = env->next_cpu) {
+        async_run_on_cpu(ENV_GET_CPU(env), ram_block_reclaim_cpu, r);
+    }
+}
+
+/* Publish a new map after @removed (or NULL) was taken off the list, and
+   free the old map and @removed when no vCPU can be using them anymore.  */
+static void ram_block_map_update(RAMBlock *removed)
+{
+    RAMBlockMap *map, *old = ram_block_map;
+    RAMBlock *block;
+    int n = 0;
+
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        n++;
+    }
+    map = g_malloc(sizeof(*map) + n * sizeof(map->blocks[0]));
+    n = 0;
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        map->blocks[n++] = block;
+    }
+    qsort(map->blocks, n, sizeof(map->blocks[0]), ram_block_cmp);
+    map->nb_blocks = n;
+
+    /* Make the contents visible before the pointer.  */
+    smp_wmb();
+    ram_block_map = map;
+    ram_block_reclaim(old, removed);
+}
+
+static RAMBlock *qemu_get_ram_block(ram_addr_t addr)
+{
+    RAMBlockMap *map = ram_block_map;
+    RAMBlock *block;
+    int lo, hi, mid;
+
+    if (map) {
+        lo = 0;
+        hi = map->nb_blocks - 1;
+        while (lo <= hi) {
+            mid = (lo + hi) >> 1;
+            block = map->blocks[mid];
+            if (addr < block->offset) {
+                hi = mid - 1;
+            } else if (addr - block->offset >= block->length) {
+                lo = mid + 1;
+            } else {
+                return block;
+            }
+        }
+    }
+
+    fprintf(stderr, "Bad ram offset %" PRIx64 "\n", (uint64_t)addr);
+    abort();
+}
+
 static ram_addr_t find_ram_offset(ram_addr_t size)
 {
     RAMBlock *block, *next_block;
@@ -2583,6 +3086,7 @@ ram_addr_t qemu_ram_alloc_from_ptr(ram_addr_t size, void *host,
     new_block->length = size;
 
     QLIST_INSERT_HEAD(&ram_list.blocks, new_block, next);
+    ram_block_map_update(NULL);
 
     ram_list.phys_dirty = g_realloc(ram_list.phys_dirty,
                                        last_ram_offset() >> TARGET_PAGE_BITS);
@@ -2611,7 +3115,7 @@ void qemu_ram_free_from_ptr(ram_addr_t addr)
     QLIST_FOREACH(block, &ram_list.blocks, next) {
         if (addr == block->offset) {
             QLIST_REMOVE(block, next);
-            g_free(block);
+            ram_block_map_update(block);
             return;
         }
     }
@@ -2624,31 +3128,7 @@ void qemu_ram_free(ram_addr_t addr)
     QLIST_FOREACH(block, &ram_list.blocks, next) {
         if (addr == block->offset) {
             QLIST_REMOVE(block, next);
-            if (block->flags & RAM_PREALLOC_MASK) {
-                ;
-            } else if (mem_path) {
-#if defined (__linux__) && !defined(TARGET_S390X)
-                if (block->fd) {
-                    munmap(block->host, block->length);
-                    close(block->fd);
-                } else {
-                    qemu_vfree(block->host);
-                }
-#else
-                abort();
-#endif
-            } else {
-#if defined(TARGET_S390X) && defined(CONFIG_KVM)
-                munmap(block->host, block->length);
-#else
-                if (xen_enabled()) {
-                    xen_invalidate_map_cache_entry(block->host);
-                } else {
-                    qemu_vfree(block->host);
-                }
-#endif
-            }
-            g_free(block);
+            ram_block_map_update(block);
             return;
         }
     }
@@ -2727,66 +3207,44 @@ void qemu_ram_remap(ram_addr_t addr, ram_addr_t length)
  */
 void *qemu_get_ram_ptr(ram_addr_t addr)
 {
-    RAMBlock *block;
+    RAMBlock *block = qemu_get_ram_block(addr);
 
-    QLIST_FOREACH(block, &ram_list.blocks, next) {
-        if (addr - block->offset < block->length) {
-            /* Move this entry to to start of the list.  */
-            if (block != QLIST_FIRST(&ram_list.blocks)) {
-                QLIST_REMOVE(block, next);
-                QLIST_INSERT_HEAD(&ram_list.blocks, block, next);
-            }
-            if (xen_enabled()) {
-                /* We need to check if the requested address is in the RAM
-                 * because we don't want to map the entire memory in QEMU.
-                 * In that case just map until the end of the page.
-                 */
-                if (block->offset == 0) {
-                    return xen_map_cache(addr, 0, 0);
-                } else if (block->host == NULL) {
-                    block->host =
-                        xen_map_cache(block->offset, block->length, 1);
-                }
-            }
-            return block->host + (addr - block->offset);
+    if (xen_enabled()) {
+        /* We need to check if the requested address is in the RAM
+         * because we don't want to map the entire memory in QEMU.
+         * In that case just map until the end of the page.
+         */
+        if (block->offset == 0) {
+            return xen_map_cache(addr, 0, 0);
+        } else if (block->host == NULL) {
+            block->host =
+                xen_map_cache(block->offset, block->length, 1);
         }
     }
-
-    fprintf(stderr, "Bad ram offset %" PRIx64 "\n", (uint64_t)addr);
-    abort();
-
-    return NULL;
+    return block->host + (addr - block->offset);
 }
 
-/* Return a host pointer to ram allocated with qemu_ram_alloc.
- * Same as qemu_get_ram_ptr but avoid reordering ramblocks.
- */
-static void *qemu_safe_ram_ptr(ram_addr_t addr)
+/* Return a file descriptor through which another process can map the RAM
+ * block containing @addr and see the same contents as the guest, or -1.
+ * Only -mem-path memory mapped with -mem-prealloc is shared.  */
+int qemu_get_ram_fd(ram_addr_t addr)
 {
-    RAMBlock *block;
+#if defined(__linux__) && !defined(TARGET_S390X)
+    RAMBlock *block = qemu_get_ram_block(addr);
 
-    QLIST_FOREACH(block, &ram_list.blocks, next) {
-        if (addr - block->offset < block->length) {
-            if (xen_enabled()) {
-                /* We need to check if the requested address is in the RAM
-                 * because we don't want to map the entire memory in QEMU.
-                 * In that case just map until the end of the page.
-                 */
-                if (block->offset == 0) {
-                    return xen_map_cache(addr, 0, 0);
-                } else if (block->host == NULL) {
-                    block->host =
-                        xen_map_cache(block->offset, block->length, 1);
-                }
-            }
-            return block->host + (addr - block->offset);
-        }
+    if (block->fd && mem_prealloc && !(block->flags & RAM_PREALLOC_MASK)) {
+        return block->fd;
     }
+#endif
+    return -1;
+}
 
-    fprintf(stderr, "Bad ram offset %" PRIx64 "\n", (uint64_t)addr);
-    abort();
+/* Return the host address at which the RAM block containing @addr starts. */
+void *qemu_get_ram_block_host_ptr(ram_addr_t addr)
+{
+    RAMBlock *block = qemu_get_ram_block(addr);
 
-    return NULL;
+    return block->host;
 }
 
 /* Return a host pointer to guest's ram. Similar to qemu_get_ram_ptr
@@ -2799,18 +3257,11 @@ static void *qemu_ram_ptr_length(ram_addr_t addr, ram_addr_t *size)
     if (xen_enabled()) {
         return xen_map_cache(addr, *size, 1);
     } else {
-        RAMBlock *block;
-
-        QLIST_FOREACH(block, &ram_list.blocks, next) {
-            if (addr - block->offset < block->length) {
-                if (addr - block->offset + *size > block->length)
-                    *size = block->length - addr + block->offset;
-                return block->host + (addr - block->offset);
-            }
-        }
+        RAMBlock *block = qemu_get_ram_block(addr);
 
-        fprintf(stderr, "Bad ram offset %" PRIx64 "\n", (uint64_t)addr);
-        abort();
+        if (addr - block->offset + *size > block->length)
+            *size = block->length - addr + block->offset;
+        return block->host + (addr - block->offset);
     }
 }
 
@@ -3192,6 +3643,7 @@ static void mem_begin(MemoryListener *listener)
 
 static void core_begin(MemoryListener *listener)
 {
+    phys_map_generation++;
     phys_sections_clear();
     phys_section_unassigned = dummy_section(&io_mem_unassigned);
     phys_section_notdirty = dummy_section(&io_mem_notdirty);
@@ -3204,13 +3656,20 @@ static void tcg_commit(MemoryListener *listener)
     CPUArchState *env;
 
     /* since each CPU stores ram addresses in its TLB cache, we must
-       reset the modified entries */
+       reset the modified entries.  The old sections may be destroyed as
+       soon as we return, so vCPUs running without the iothread lock
+       must have dropped them by then.  */
     /* XXX: slow ! */
     for(env = first_cpu; env != NULL; env = env->next_cpu) {
-        tlb_flush(env, 1);
+        tlb_flush_sync(env);
     }
 }
 
+static void core_commit(MemoryListener *listener)
+{
+    phys_map_generation++;
+}
+
 static void core_log_global_start(MemoryListener *listener)
 {
     cpu_physical_memory_set_dirty_tracking(1);
@@ -3241,6 +3700,7 @@ static void io_region_del(MemoryListener *listener,
 
 static MemoryListener core_memory_listener = {
     .begin = core_begin,
+    .commit = core_commit,
     .log_global_start = core_log_global_start,
     .log_global_stop = core_log_global_stop,
     .priority = 1,
@@ -3279,6 +3739,7 @@ void address_space_destroy_dispatch(AddressSpace *as)
     destroy_l2_mapping(&d->phys_map, P_L2_LEVELS - 1);
     g_free(d);
     as->dispatch = NULL;
+    phys_map_generation++;
 }
 
 static void memory_map_init(void)
@@ -3383,7 +3844,7 @@ void address_space_rw(AddressSpace *as, hwaddr addr, uint8_t *buf,
         l = (page + TARGET_PAGE_SIZE) - addr;
         if (l > len)
             l = len;
-        section = phys_page_find(d, page >> TARGET_PAGE_BITS);
+        section = phys_page_find_cached(d, page >> TARGET_PAGE_BITS);
 
         if (is_write) {
             if (!memory_region_is_ram(section->mr)) {
@@ -3494,7 +3955,7 @@ void cpu_physical_memory_write_rom(hwaddr addr,
         l = (page + TARGET_PAGE_SIZE) - addr;
         if (l > len)
             l = len;
-        section = phys_page_find(d, page >> TARGET_PAGE_BITS);
+        section = phys_page_find_cached(d, page >> TARGET_PAGE_BITS);
 
         if (!(memory_region_is_ram(section->mr) ||
               memory_region_is_romd(section->mr))) {
@@ -3588,7 +4049,7 @@ void *address_space_map(AddressSpace *as,
         l = (page + TARGET_PAGE_SIZE) - addr;
         if (l > len)
             l = len;
-        section = phys_page_find(d, page >> TARGET_PAGE_BITS);
+        section = phys_page_find_cached(d, page >> TARGET_PAGE_BITS);
 
         if (!(memory_region_is_ram(section->mr) && !section->readonly)) {
             if (todo || bounce.buffer) {
@@ -3673,7 +4134,8 @@ static inline uint32_t ldl_phys_internal(hwaddr addr,
     uint32_t val;
     MemoryRegionSection *section;
 
-    section = phys_page_find(address_space_memory.dispatch, addr >> TARGET_PAGE_BITS);
+    section = phys_page_find_cached(address_space_memory.dispatch,
+                                    addr >> TARGET_PAGE_BITS);
 
     if (!(memory_region_is_ram(section->mr) ||
           memory_region_is_romd(section->mr))) {
@@ -3732,7 +4194,8 @@ static inline uint64_t ldq_phys_internal(hwaddr addr,
     uint64_t val;
     MemoryRegionSection *section;
 
-    section = phys_page_find(address_space_memory.dispatch, addr >> TARGET_PAGE_BITS);
+    section = phys_page_find_cached(address_space_memory.dispatch,
+                                    addr >> TARGET_PAGE_BITS);
 
     if (!(memory_region_is_ram(section->mr) ||
           memory_region_is_romd(section->mr))) {
@@ -3799,7 +4262,8 @@ static inline uint32_t lduw_phys_internal(hwaddr addr,
     uint64_t val;
     MemoryRegionSection *section;
 
-    section = phys_page_find(address_space_memory.dispatch, addr >> TARGET_PAGE_BITS);
+    section = phys_page_find_cached(address_space_memory.dispatch,
+                                    addr >> TARGET_PAGE_BITS);
 
     if (!(memory_region_is_ram(section->mr) ||
           memory_region_is_romd(section->mr))) {
@@ -3858,7 +4322,8 @@ void stl_phys_notdirty(hwaddr addr, uint32_t val)
     uint8_t *ptr;
     MemoryRegionSection *section;
 
-    section = phys_page_find(address_space_memory.dispatch, addr >> TARGET_PAGE_BITS);
+    section = phys_page_find_cached(address_space_memory.dispatch,
+                                    addr >> TARGET_PAGE_BITS);
 
     if (!memory_region_is_ram(section->mr) || section->readonly) {
         addr = memory_region_section_addr(section, addr);
@@ -3890,7 +4355,8 @@ void stq_phys_notdirty(hwaddr addr, uint64_t val)
     uint8_t *ptr;
     MemoryRegionSection *section;
 
-    section = phys_page_find(address_space_memory.dispatch, addr >> TARGET_PAGE_BITS);
+    section = phys_page_find_cached(address_space_memory.dispatch,
+                                    addr >> TARGET_PAGE_BITS);
 
     if (!memory_region_is_ram(section->mr) || section->readonly) {
         addr = memory_region_section_addr(section, addr);
@@ -3919,7 +4385,8 @@ static inline void stl_phys_internal(hwaddr addr, uint32_t val,
     uint8_t *ptr;
     MemoryRegionSection *section;
 
-    section = phys_page_find(address_space_memory.dispatch, addr >> TARGET_PAGE_BITS);
+    section = phys_page_find_cached(address_space_memory.dispatch,
+                                    addr >> TARGET_PAGE_BITS);
 
     if (!memory_region_is_ram(section->mr) || section->readonly) {
         addr = memory_region_section_addr(section, addr);
@@ -3986,7 +4453,8 @@ static inline void stw_phys_internal(hwaddr addr, uint32_t val,
     uint8_t *ptr;
     MemoryRegionSection *section;
 
-    section = phys_page_find(address_space_memory.dispatch, addr >> TARGET_PAGE_BITS);
+    section = phys_page_find_cached(address_space_memory.dispatch,
+                                    addr >> TARGET_PAGE_BITS);
 
     if (!memory_region_is_ram(section->mr) || section->readonly) {
         addr = memory_region_section_addr(section, addr);
@@ -4147,12 +4615,90 @@ void cpu_io_recompile(CPUArchState *env, uintptr_t retaddr)
     cpu_resume_from_signal(env, NULL);
 }
 
+/* Start or stop counting TB executions.  The translated code is flushed
+   so that all blocks are instrumented, or no longer are.  */
+void tb_profile_set(bool enable)
+{
+    tb_profile_enabled = enable;
+#if !defined(CONFIG_USER_ONLY)
+    if (mttcg_enabled) {
+        /* vCPUs may be running translated code, see tb_flush() */
+        tb_flush_pending = true;
+        cpu_exit(first_cpu);
+        return;
+    }
+#endif
+    tb_flush(first_cpu);
+}
+
+static int tb_profile_cmp(const void *a, const void *b)
+{
+    const TranslationBlock *ta = *(TranslationBlock * const *)a;
+    const TranslationBlock *tb = *(TranslationBlock * const *)b;
+
+    if (ta->exec_count == tb->exec_count) {
+        return 0;
+    }
+    return ta->exec_count < tb->exec_count ? 1 : -1;
+}
+
+/* '-' for no jump, 'c' if chained to the next TB, 'u' if it returns to
+   cpu_exec() */
+static char tb_profile_jump(TranslationBlock *tb, int n)
+{
+    if (tb->tb_next_offset[n] == 0xffff) {
+        return '-';
+    }
+    return tb->jmp_next[n] ? 'c' : 'u';
+}
+
+/* Print the 'max' most executed TBs.  Only the blocks translated while
+   profiling was enabled are counted.  */
+void tb_profile_dump(FILE *f, fprintf_function cpu_fprintf, int max)
+{
+    TranslationBlock **tbs, *tb;
+    uint64_t total = 0;
+    int i, j, n = 0;
+
+    tbs = g_malloc((nb_tbs + 1) * sizeof(*tbs));
+    for (i = 0; i < nb_tb_regions; i++) {
+        for (j = 0; j < tb_regions[i].nb_tbs; j++) {
+            tb = &tb_regions[i].tbs[j];
+            if ((tb->cflags & CF_PROFILE) && tb->exec_count) {
+                tbs[n++] = tb;
+                total += tb->exec_count;
+            }
+        }
+    }
+    qsort(tbs, n, sizeof(*tbs), tb_profile_cmp);
+
+    cpu_fprintf(f, "%d TBs executed %" PRIu64 " times%s\n", n, total,
+                tb_profile_enabled ? "" : " (profiling is off)");
+    cpu_fprintf(f, "%-18s %12s %6s %5s %5s %10s %10s jumps\n", "guest pc",
+                "count", "%", "size", "host", "exits0", "exits1");
+    for (i = 0; i < n && i < max; i++) {
+        tb = tbs[i];
+        cpu_fprintf(f, "%#-18" PRIx64 " %12" PRIu64 " %5.1f%% %5u %5u "
+                    "%10" PRIu64 " %10" PRIu64 " %c%c\n",
+                    (uint64_t)tb->pc, tb->exec_count,
+                    tb->exec_count * 100.0 / total, tb->size, tb->tc_size,
+                    tb->exit_count[0], tb->exit_count[1],
+                    tb_profile_jump(tb, 0), tb_profile_jump(tb, 1));
+    }
+    g_free(tbs);
+}
+
 #if !defined(CONFIG_USER_ONLY)
 
+/* tb_gen_bytes at tb_gen_stats_time */
+static uint64_t tb_gen_stats_bytes;
+
 void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
 {
-    int i, target_code_size, max_target_code_size;
+    int i, j, target_code_size, max_target_code_size;
     int direct_jmp_count, direct_jmp2_count, cross_page;
+    size_t code_size;
+    int64_t now, rate;
     TranslationBlock *tb;
 
     target_code_size = 0;
@@ -4160,32 +4706,44 @@ void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
     cross_page = 0;
     direct_jmp_count = 0;
     direct_jmp2_count = 0;
-    for(i = 0; i < nb_tbs; i++) {
-        tb = &tbs[i];
-        target_code_size += tb->size;
-        if (tb->size > max_target_code_size)
-            max_target_code_size = tb->size;
-        if (tb->page_addr[1] != -1)
-            cross_page++;
-        if (tb->tb_next_offset[0] != 0xffff) {
-            direct_jmp_count++;
-            if (tb->tb_next_offset[1] != 0xffff) {
-                direct_jmp2_count++;
+    code_size = 0;
+    for (i = 0; i < nb_tb_regions; i++) {
+        uint8_t *end = i == cur_tb_region ? code_gen_ptr
+                                          : tb_regions[i].code_end;
+
+        code_size += end - tb_regions[i].code_start;
+    }
+    for (i = 0; i < nb_tb_regions; i++) {
+        for (j = 0; j < tb_regions[i].nb_tbs; j++) {
+            tb = &tb_regions[i].tbs[j];
+            target_code_size += tb->size;
+            if (tb->size > max_target_code_size) {
+                max_target_code_size = tb->size;
+            }
+            if (tb->page_addr[1] != -1) {
+                cross_page++;
+            }
+            if (tb->tb_next_offset[0] != 0xffff) {
+                direct_jmp_count++;
+                if (tb->tb_next_offset[1] != 0xffff) {
+                    direct_jmp2_count++;
+                }
             }
         }
     }
     /* XXX: avoid using doubles ? */
     cpu_fprintf(f, "Translation buffer state:\n");
-    cpu_fprintf(f, "gen code size       %td/%zd\n",
-                code_gen_ptr - code_gen_buffer, code_gen_buffer_max_size);
+    cpu_fprintf(f, "gen code size       %zd/%zd (%d regions, current %d)\n",
+                code_size, code_gen_buffer_max_size, nb_tb_regions,
+                cur_tb_region);
     cpu_fprintf(f, "TB count            %d/%d\n", 
                 nb_tbs, code_gen_max_blocks);
     cpu_fprintf(f, "TB avg target size  %d max=%d bytes\n",
                 nb_tbs ? target_code_size / nb_tbs : 0,
                 max_target_code_size);
     cpu_fprintf(f, "TB avg host size    %td bytes (expansion ratio: %0.1f)\n",
-                nb_tbs ? (code_gen_ptr - code_gen_buffer) / nb_tbs : 0,
-                target_code_size ? (double) (code_gen_ptr - code_gen_buffer) / target_code_size : 0);
+                nb_tbs ? (ptrdiff_t)code_size / nb_tbs : 0,
+                target_code_size ? (double) code_size / target_code_size : 0);
     cpu_fprintf(f, "cross page TB count %d (%d%%)\n",
             cross_page,
             nb_tbs ? (cross_page * 100) / nb_tbs : 0);
@@ -4196,8 +4754,23 @@ void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
                 nb_tbs ? (direct_jmp2_count * 100) / nb_tbs : 0);
     cpu_fprintf(f, "\nStatistics:\n");
     cpu_fprintf(f, "TB flush count      %d\n", tb_flush_count);
+    cpu_fprintf(f, "TB evict count      %d\n", tb_evict_count);
     cpu_fprintf(f, "TB invalidate count %d\n", tb_phys_invalidate_count);
+    cpu_fprintf(f, "TB translate count  %d (%d retranslated after eviction)\n",
+                tb_gen_count, tb_retranslate_count);
+    now = get_clock();
+    rate = 0;
+    if (now > tb_gen_stats_time) {
+        rate = (tb_gen_bytes - tb_gen_stats_bytes) * get_ticks_per_sec() /
+               (now - tb_gen_stats_time);
+    }
+    cpu_fprintf(f, "code gen rate       %" PRId64 " bytes/s "
+                "(since last info jit)\n", rate);
+    tb_gen_stats_time = now;
+    tb_gen_stats_bytes = tb_gen_bytes;
     cpu_fprintf(f, "TLB flush count     %d\n", tlb_flush_count);
+    tb_cache_dump_info(f, cpu_fprintf);
+    dump_tlb_info(f, cpu_fprintf);
     tcg_dump_info(f, cpu_fprintf);
 }
 
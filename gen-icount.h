@@ -4,11 +4,23 @@
 
 static TCGArg *icount_arg;
 static int icount_label;
+static int exit_request_label;
 
 static inline void gen_icount_start(void)
 {
     TCGv_i32 count;
 
+    if (mttcg_enabled) {
+        /* Other threads cannot unchain the TBs we run, so poll for
+           cpu_exit() at the start of every TB instead.  */
+        TCGv_i32 flag = tcg_temp_new_i32();
+
+        exit_request_label = gen_new_label();
+        tcg_gen_ld_i32(flag, cpu_env, offsetof(CPUArchState, exit_request));
+        tcg_gen_brcondi_i32(TCG_COND_NE, flag, 0, exit_request_label);
+        tcg_temp_free_i32(flag);
+    }
+
     if (!use_icount)
         return;
 
@@ -26,6 +38,10 @@ static inline void gen_icount_start(void)
 
 static void gen_icount_end(TranslationBlock *tb, int num_insns)
 {
+    if (mttcg_enabled) {
+        gen_set_label(exit_request_label);
+        tcg_gen_exit_tb((tcg_target_long)tb + 3);
+    }
     if (use_icount) {
         *icount_arg = num_insns;
         gen_set_label(icount_label);
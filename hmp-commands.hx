@@ -364,6 +364,40 @@ STEXI
 @findex singlestep
 Run the emulation in single step mode.
 If called with option off, the emulation returns to normal mode.
+ETEXI
+
+    {
+        .name       = "tb_profile",
+        .args_type  = "option:s?",
+        .params     = "[on|off]",
+        .help       = "count how often each translated block is executed",
+        .mhandler.cmd = do_tb_profile,
+    },
+
+STEXI
+@item tb_profile [off]
+@findex tb_profile
+Count the executions of each translated block, for @code{hotblocks}.
+Translated code is flushed so that all blocks are counted from now on.
+If called with option off, counting stops.
+ETEXI
+
+    {
+        .name       = "hotblocks",
+        .args_type  = "count:i?",
+        .params     = "[count]",
+        .help       = "show the most executed translated blocks",
+        .mhandler.cmd = do_hotblocks,
+    },
+
+STEXI
+@item hotblocks [@var{count}]
+@findex hotblocks
+Show the @var{count} (default 20) most executed translated blocks since
+@code{tb_profile} was enabled: guest PC, execution count, guest and host
+code size, how often each of the two direct jumps returned to the main
+loop, and whether they are chained to the next block (c), unchained (u)
+or absent (-).
 ETEXI
 
     {
@@ -29,11 +29,14 @@
 #include "pci.h"
 #include "net.h"
 #include "net/checksum.h"
+#include "net/macset.h"
+#include "net/tap.h"
 #include "loader.h"
 #include "sysemu.h"
 #include "dma.h"
 
 #include "e1000_hw.h"
+#include "virtio-net.h"
 
 #define E1000_DEBUG
 
@@ -97,6 +100,7 @@ typedef struct E1000State_st {
 
     uint32_t rxbuf_size;
     uint32_t rxbuf_min_shift;
+    MACSet ra_set;             /* Valid RA entries, for receive_filter(). */
     struct e1000_tx {
         unsigned char header[256];
         unsigned char vlan_header[4];
@@ -131,6 +135,18 @@ typedef struct E1000State_st {
     } eecd_state;
 
     QEMUTimer *autoneg_timer;
+
+    QEMUTimer *mit_timer;      /* Mitigation timer. */
+    bool mit_timer_on;         /* Mitigation timer is running. */
+    bool mit_irq_level;        /* Tracks interrupt pin level. */
+    bool mit_ide;              /* Tracks E1000_TXD_CMD_IDE bit. */
+
+    bool has_vnet;             /* Peer takes and hands us virtio-net headers */
+
+/* Compatibility flags for migration to/from qemu 1.3.1 and older */
+#define E1000_FLAG_MIT_BIT 0
+#define E1000_FLAG_MIT (1 << E1000_FLAG_MIT_BIT)
+    uint32_t compat_flags;
 } E1000State;
 
 #define	defreg(x)	x = (E1000_##x>>2)
@@ -145,7 +161,8 @@ enum {
     defreg(TORH),	defreg(TORL),	defreg(TOTH),	defreg(TOTL),
     defreg(TPR),	defreg(TPT),	defreg(TXDCTL),	defreg(WUFC),
     defreg(RA),		defreg(MTA),	defreg(CRCERRS),defreg(VFTA),
-    defreg(VET),
+    defreg(VET),	defreg(RDTR),	defreg(RADV),	defreg(TADV),
+    defreg(TIDV),	defreg(ITR),
 };
 
 static void
@@ -224,16 +241,79 @@ static const uint32_t mac_reg_init[] = {
                 E1000_MANC_RMCP_EN,
 };
 
+/* Helper function, *curr == 0 means the value is not set */
+static inline void
+mit_update_delay(uint32_t *curr, uint32_t value)
+{
+    if (value && (*curr == 0 || value < *curr)) {
+        *curr = value;
+    }
+}
+
 static void
 set_interrupt_cause(E1000State *s, int index, uint32_t val)
 {
+    uint32_t pending_ints;
+    uint32_t mit_delay;
+
     if (val && (E1000_DEVID >= E1000_DEV_ID_82547EI_MOBILE)) {
         /* Only for 8257x */
         val |= E1000_ICR_INT_ASSERTED;
     }
     s->mac_reg[ICR] = val;
     s->mac_reg[ICS] = val;
-    qemu_set_irq(s->dev.irq[0], (s->mac_reg[IMS] & s->mac_reg[ICR]) != 0);
+
+    pending_ints = (s->mac_reg[IMS] & s->mac_reg[ICR]);
+    if (!s->mit_irq_level && pending_ints) {
+        /*
+         * Here we detect a potential rising edge.  We postpone raising the
+         * interrupt line while we are inside the mitigation delay window
+         * (s->mit_timer_on == 1).
+         * The delay is the smallest of ITR (256ns units) and the absolute
+         * timers RADV and TADV (1024ns units) that apply to the pending
+         * causes.  RDTR enables RADV, as on real hardware; the relative
+         * timers RDTR and TIDV are only used in place of an absolute timer
+         * that is zero, and are not restarted for every packet.
+         */
+        if (s->mit_timer_on) {
+            return;
+        }
+        if (s->compat_flags & E1000_FLAG_MIT) {
+            mit_delay = 0;
+            if (s->mit_ide &&
+                (pending_ints & (E1000_ICR_TXQE | E1000_ICR_TXDW))) {
+                mit_update_delay(&mit_delay, (s->mac_reg[TADV] ?
+                                              s->mac_reg[TADV] :
+                                              s->mac_reg[TIDV]) * 4);
+            }
+            if (s->mac_reg[RDTR] && (pending_ints & E1000_ICS_RXT0)) {
+                mit_update_delay(&mit_delay, (s->mac_reg[RADV] ?
+                                              s->mac_reg[RADV] :
+                                              s->mac_reg[RDTR]) * 4);
+            }
+            mit_update_delay(&mit_delay, s->mac_reg[ITR]);
+
+            if (mit_delay) {
+                s->mit_timer_on = 1;
+                qemu_mod_timer(s->mit_timer, qemu_get_clock_ns(vm_clock) +
+                               mit_delay * 256);
+            }
+            s->mit_ide = 0;
+        }
+    }
+
+    s->mit_irq_level = (pending_ints != 0);
+    qemu_set_irq(s->dev.irq[0], s->mit_irq_level);
+}
+
+static void
+e1000_mit_timer(void *opaque)
+{
+    E1000State *s = opaque;
+
+    s->mit_timer_on = 0;
+    /* Call set_interrupt_cause to update the irq level (if necessary). */
+    set_interrupt_cause(s, 0, s->mac_reg[ICR]);
 }
 
 static void
@@ -267,6 +347,21 @@ rxbufsize(uint32_t v)
     return 2048;
 }
 
+static void
+e1000_update_ra_set(E1000State *s)
+{
+    uint32_t ra[2], *rp;
+
+    mac_set_clear(&s->ra_set);
+    for (rp = s->mac_reg + RA; rp < s->mac_reg + RA + 32; rp += 2) {
+        if (!(rp[1] & E1000_RAH_AV))
+            continue;
+        ra[0] = cpu_to_le32(rp[0]);
+        ra[1] = cpu_to_le32(rp[1]);
+        mac_set_add(&s->ra_set, (uint8_t *)ra);
+    }
+}
+
 static void e1000_reset(void *opaque)
 {
     E1000State *d = opaque;
@@ -274,6 +369,10 @@ static void e1000_reset(void *opaque)
     int i;
 
     qemu_del_timer(d->autoneg_timer);
+    qemu_del_timer(d->mit_timer);
+    d->mit_timer_on = 0;
+    d->mit_irq_level = 0;
+    d->mit_ide = 0;
     memset(d->phy_reg, 0, sizeof d->phy_reg);
     memmove(d->phy_reg, phy_reg_init, sizeof phy_reg_init);
     memset(d->mac_reg, 0, sizeof d->mac_reg);
@@ -292,6 +391,7 @@ static void e1000_reset(void *opaque)
         d->mac_reg[RA] |= macaddr[i] << (8 * i);
         d->mac_reg[RA + 1] |= (i < 2) ? macaddr[i + 4] << (8 * i) : 0;
     }
+    e1000_update_ra_set(d);
 }
 
 static void
@@ -457,11 +557,51 @@ fcs_len(E1000State *s)
     return (s->mac_reg[RCTL] & E1000_RCTL_SECRC) ? 0 : 4;
 }
 
+static inline int
+loopback_enabled(E1000State *s)
+{
+    return ((s->phy_reg[PHY_CTRL] & MII_CR_LOOPBACK) != 0);
+}
+
+/* With a peer that takes virtio-net headers, TCP/UDP checksums and TCP
+ * segmentation are left to the host instead of being done in xmit_seg().
+ * The checksum can only be offloaded if it covers the rest of the frame.
+ */
+static bool
+csum_offload(E1000State *s)
+{
+    struct e1000_tx *tp = &s->tx;
+
+    return s->has_vnet && !loopback_enabled(s) &&
+           tp->tucso >= tp->tucss && tp->tucso + 2 <= tp->size &&
+           (!tp->tucse || tp->tucse + 1 >= tp->size);
+}
+
+static bool
+tso_offload(E1000State *s)
+{
+    struct e1000_tx *tp = &s->tx;
+
+    return s->has_vnet && !loopback_enabled(s) && tp->tcp && tp->mss &&
+           tp->hdr_len + tp->paylen <= sizeof(tp->data);
+}
+
+static ssize_t e1000_receive_frame(E1000State *s, const uint8_t *buf,
+                                   size_t size);
+
 static void
-e1000_send_packet(E1000State *s, const uint8_t *buf, int size)
+e1000_send_packet(E1000State *s, struct virtio_net_hdr *hdr,
+                  const uint8_t *buf, int size)
 {
-    if (s->phy_reg[PHY_CTRL] & MII_CR_LOOPBACK) {
-        s->nic->nc.info->receive(&s->nic->nc, buf, size);
+    if (loopback_enabled(s)) {
+        e1000_receive_frame(s, buf, size);
+    } else if (s->has_vnet) {
+        struct iovec iov[2] = {
+            { .iov_base = hdr, .iov_len = sizeof(*hdr) },
+            { .iov_base = (uint8_t *)buf, .iov_len = size },
+        };
+
+        qemu_sendv_packet(&s->nic->nc, iov, 2);
     } else {
         qemu_send_packet(&s->nic->nc, buf, size);
     }
@@ -471,8 +611,11 @@ static void
 xmit_seg(E1000State *s)
 {
     uint16_t len, *sp;
-    unsigned int frames = s->tx.tso_frames, css, sofar, n;
+    unsigned int frames = s->tx.tso_frames, css, sofar, n, segs = 1;
+    unsigned int octets = s->tx.size;
     struct e1000_tx *tp = &s->tx;
+    struct virtio_net_hdr hdr = { 0 };
+    bool gso = tp->tse && tp->cptse && tso_offload(s);
 
     if (tp->tse && tp->cptse) {
         css = tp->ipcss;
@@ -483,7 +626,10 @@ xmit_seg(E1000State *s)
                           tp->size - css);
             cpu_to_be16wu((uint16_t *)(tp->data+css+4),
                           be16_to_cpup((uint16_t *)(tp->data+css+4))+frames);
-        } else			// IPv6
+        } else if (gso)		// IPv6, checked by the host before segmenting
+            cpu_to_be16wu((uint16_t *)(tp->data+css+4),
+                          tp->size - css - 40);
+        else			// IPv6
             cpu_to_be16wu((uint16_t *)(tp->data+css+4),
                           tp->size - css);
         css = tp->tucss;
@@ -493,7 +639,7 @@ xmit_seg(E1000State *s)
             sofar = frames * tp->mss;
             cpu_to_be32wu((uint32_t *)(tp->data+css+4),	// seq
                 be32_to_cpupu((uint32_t *)(tp->data+css+4))+sofar);
-            if (tp->paylen - sofar > tp->mss)
+            if (!gso && tp->paylen - sofar > tp->mss)
                 tp->data[css + 13] &= ~9;		// PSH, FIN
         } else	// UDP
             cpu_to_be16wu((uint16_t *)(tp->data+css+4), len);
@@ -508,7 +654,21 @@ xmit_seg(E1000State *s)
         tp->tso_frames++;
     }
 
-    if (tp->sum_needed & E1000_TXD_POPTS_TXSM)
+    if (gso) {
+        hdr.gso_type = tp->ip ? VIRTIO_NET_HDR_GSO_TCPV4 :
+                                VIRTIO_NET_HDR_GSO_TCPV6;
+        if (tp->data[tp->tucss + 13] & 0x80)	// CWR
+            hdr.gso_type |= VIRTIO_NET_HDR_GSO_ECN;
+        hdr.hdr_len = tp->hdr_len;
+        hdr.gso_size = tp->mss;
+        segs = DIV_ROUND_UP(tp->size - tp->hdr_len, tp->mss);
+        octets += (segs - 1) * tp->hdr_len;
+    }
+    if (gso || (tp->sum_needed & E1000_TXD_POPTS_TXSM && csum_offload(s))) {
+        hdr.flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+        hdr.csum_start = tp->tucss;
+        hdr.csum_offset = tp->tucso - tp->tucss;
+    } else if (tp->sum_needed & E1000_TXD_POPTS_TXSM)
         putsum(tp->data, tp->size, tp->tucso, tp->tucss, tp->tucse);
     if (tp->sum_needed & E1000_TXD_POPTS_IXSM)
         putsum(tp->data, tp->size, tp->ipcso, tp->ipcss, tp->ipcse);
@@ -516,13 +676,17 @@ xmit_seg(E1000State *s)
         memmove(tp->vlan, tp->data, 4);
         memmove(tp->data, tp->data + 4, 8);
         memcpy(tp->data + 8, tp->vlan_header, 4);
-        e1000_send_packet(s, tp->vlan, tp->size + 4);
+        if (hdr.flags & VIRTIO_NET_HDR_F_NEEDS_CSUM)
+            hdr.csum_start += 4;
+        if (gso)
+            hdr.hdr_len += 4;
+        e1000_send_packet(s, &hdr, tp->vlan, tp->size + 4);
     } else
-        e1000_send_packet(s, tp->data, tp->size);
-    s->mac_reg[TPT]++;
-    s->mac_reg[GPTC]++;
+        e1000_send_packet(s, &hdr, tp->data, tp->size);
+    s->mac_reg[TPT] += segs;
+    s->mac_reg[GPTC] += segs;
     n = s->mac_reg[TOTL];
-    if ((s->mac_reg[TOTL] += s->tx.size) < n)
+    if ((s->mac_reg[TOTL] += octets) < n)
         s->mac_reg[TOTH]++;
 }
 
@@ -568,6 +732,10 @@ process_tx_desc(E1000State *s, struct e1000_tx_desc *dp)
         tp->cptse = 0;
     }
 
+    if (txd_lower & E1000_TXD_CMD_IDE) {
+        s->mit_ide = 1;
+    }
+
     if (vlan_enabled(s) && is_vlan_txd(txd_lower) &&
         (tp->cptse || txd_lower & E1000_TXD_CMD_EOP)) {
         tp->vlan_needed = 1;
@@ -578,7 +746,7 @@ process_tx_desc(E1000State *s, struct e1000_tx_desc *dp)
     }
         
     addr = le64_to_cpu(dp->buffer_addr);
-    if (tp->tse && tp->cptse) {
+    if (tp->tse && tp->cptse && !tso_offload(s)) {
         hdr = tp->hdr_len;
         msh = hdr + tp->mss;
         do {
@@ -602,6 +770,7 @@ process_tx_desc(E1000State *s, struct e1000_tx_desc *dp)
         // context descriptor TSE is not set, while data descriptor TSE is set
         DBGOUT(TXERR, "TCP segmentation error\n");
     } else {
+        // plain packet, or TSO packet to be segmented by the host
         split_size = MIN(sizeof(tp->data) - tp->size, split_size);
         pci_dma_read(&s->dev, addr, tp->data + tp->size, split_size);
         tp->size += split_size;
@@ -686,7 +855,7 @@ receive_filter(E1000State *s, const uint8_t *buf, int size)
 {
     static const uint8_t bcast[] = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
     static const int mta_shift[] = {4, 3, 2, 0};
-    uint32_t f, rctl = s->mac_reg[RCTL], ra[2], *rp;
+    uint32_t f, rctl = s->mac_reg[RCTL];
 
     if (is_vlan_packet(s, buf) && vlan_rx_filter_enabled(s)) {
         uint16_t vid = be16_to_cpup((uint16_t *)(buf + 14));
@@ -705,18 +874,10 @@ receive_filter(E1000State *s, const uint8_t *buf, int size)
     if ((rctl & E1000_RCTL_BAM) && !memcmp(buf, bcast, sizeof bcast))
         return 1;
 
-    for (rp = s->mac_reg + RA; rp < s->mac_reg + RA + 32; rp += 2) {
-        if (!(rp[1] & E1000_RAH_AV))
-            continue;
-        ra[0] = cpu_to_le32(rp[0]);
-        ra[1] = cpu_to_le32(rp[1]);
-        if (!memcmp(buf, (uint8_t *)ra, 6)) {
-            DBGOUT(RXFILTER,
-                   "unicast match[%d]: %02x:%02x:%02x:%02x:%02x:%02x\n",
-                   (int)(rp - s->mac_reg - RA)/2,
-                   buf[0], buf[1], buf[2], buf[3], buf[4], buf[5]);
-            return 1;
-        }
+    if (mac_set_contains(&s->ra_set, buf)) {
+        DBGOUT(RXFILTER, "unicast match: %02x:%02x:%02x:%02x:%02x:%02x\n",
+               buf[0], buf[1], buf[2], buf[3], buf[4], buf[5]);
+        return 1;
     }
     DBGOUT(RXFILTER, "unicast mismatch: %02x:%02x:%02x:%02x:%02x:%02x\n",
            buf[0], buf[1], buf[2], buf[3], buf[4], buf[5]);
@@ -785,9 +946,8 @@ static uint64_t rx_desc_base(E1000State *s)
 }
 
 static ssize_t
-e1000_receive(NetClientState *nc, const uint8_t *buf, size_t size)
+e1000_receive_frame(E1000State *s, const uint8_t *buf, size_t size)
 {
-    E1000State *s = DO_UPCAST(NICState, nc, nc)->opaque;
     struct e1000_rx_desc desc;
     dma_addr_t base;
     unsigned int n, rdt;
@@ -902,6 +1062,27 @@ e1000_receive(NetClientState *nc, const uint8_t *buf, size_t size)
     return size;
 }
 
+static ssize_t
+e1000_receive(NetClientState *nc, const uint8_t *buf, size_t size)
+{
+    E1000State *s = DO_UPCAST(NICState, nc, nc)->opaque;
+    size_t hdr_len = s->has_vnet ? sizeof(struct virtio_net_hdr) : 0;
+    ssize_t ret;
+
+    /* Receive offloads are never enabled on the peer, so the header only
+     * has to be skipped.
+     */
+    if (size < hdr_len) {
+        return size;
+    }
+
+    ret = e1000_receive_frame(s, buf + hdr_len, size - hdr_len);
+    if (ret > 0) {
+        ret += hdr_len;
+    }
+    return ret;
+}
+
 static uint32_t
 mac_readreg(E1000State *s, int index)
 {
@@ -943,6 +1124,13 @@ mac_writereg(E1000State *s, int index, uint32_t val)
     s->mac_reg[index] = val;
 }
 
+static void
+set_ra(E1000State *s, int index, uint32_t val)
+{
+    s->mac_reg[index] = val;
+    e1000_update_ra_set(s);
+}
+
 static void
 set_rdt(E1000State *s, int index, uint32_t val)
 {
@@ -1001,7 +1189,8 @@ static uint32_t (*macreg_readops[])(E1000State *, int) = {
     getreg(TORL),	getreg(TOTL),	getreg(IMS),	getreg(TCTL),
     getreg(RDH),	getreg(RDT),	getreg(VET),	getreg(ICS),
     getreg(TDBAL),	getreg(TDBAH),	getreg(RDBAH),	getreg(RDBAL),
-    getreg(TDLEN),	getreg(RDLEN),
+    getreg(TDLEN),	getreg(RDLEN),	getreg(RDTR),	getreg(RADV),
+    getreg(TADV),	getreg(TIDV),	getreg(ITR),
 
     [TOTH] = mac_read_clr8,	[TORH] = mac_read_clr8,	[GPRC] = mac_read_clr4,
     [GPTC] = mac_read_clr4,	[TPR] = mac_read_clr4,	[TPT] = mac_read_clr4,
@@ -1023,7 +1212,9 @@ static void (*macreg_writeops[])(E1000State *, int, uint32_t) = {
     [TDH] = set_16bit,	[RDH] = set_16bit,	[RDT] = set_rdt,
     [IMC] = set_imc,	[IMS] = set_ims,	[ICR] = set_icr,
     [EECD] = set_eecd,	[RCTL] = set_rx_control, [CTRL] = set_ctrl,
-    [RA ... RA+31] = &mac_writereg,
+    [RDTR] = set_16bit,	[RADV] = set_16bit,	[TADV] = set_16bit,
+    [TIDV] = set_16bit,	[ITR] = set_16bit,
+    [RA ... RA+31] = &set_ra,
     [MTA ... MTA+127] = &mac_writereg,
     [VFTA ... VFTA+127] = &mac_writereg,
 };
@@ -1106,10 +1297,41 @@ static int e1000_post_load(void *opaque, int version_id)
     /* nc.link_down can't be migrated, so infer link_down according
      * to link status bit in mac_reg[STATUS] */
     s->nic->nc.link_down = (s->mac_reg[STATUS] & E1000_STATUS_LU) == 0;
+    e1000_update_ra_set(s);
+
+    if (s->compat_flags & E1000_FLAG_MIT) {
+        /* Mitigation is on: let the timer bring the irq line up to date */
+        s->mit_ide = 0;
+        s->mit_timer_on = 1;
+        qemu_mod_timer(s->mit_timer, qemu_get_clock_ns(vm_clock) + 1);
+    }
 
     return 0;
 }
 
+static bool e1000_mit_state_needed(void *opaque)
+{
+    E1000State *s = opaque;
+
+    return s->compat_flags & E1000_FLAG_MIT;
+}
+
+static const VMStateDescription vmstate_e1000_mit_state = {
+    .name = "e1000/mit_state",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .minimum_version_id_old = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(mac_reg[RDTR], E1000State),
+        VMSTATE_UINT32(mac_reg[RADV], E1000State),
+        VMSTATE_UINT32(mac_reg[TADV], E1000State),
+        VMSTATE_UINT32(mac_reg[TIDV], E1000State),
+        VMSTATE_UINT32(mac_reg[ITR], E1000State),
+        VMSTATE_BOOL(mit_irq_level, E1000State),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static const VMStateDescription vmstate_e1000 = {
     .name = "e1000",
     .version_id = 2,
@@ -1186,6 +1408,14 @@ static const VMStateDescription vmstate_e1000 = {
         VMSTATE_UINT32_SUB_ARRAY(mac_reg, E1000State, MTA, 128),
         VMSTATE_UINT32_SUB_ARRAY(mac_reg, E1000State, VFTA, 128),
         VMSTATE_END_OF_LIST()
+    },
+    .subsections = (VMStateSubsection[]) {
+        {
+            .vmsd = &vmstate_e1000_mit_state,
+            .needed = e1000_mit_state_needed,
+        }, {
+            /* empty */
+        }
     }
 };
 
@@ -1235,6 +1465,8 @@ pci_e1000_uninit(PCIDevice *dev)
 
     qemu_del_timer(d->autoneg_timer);
     qemu_free_timer(d->autoneg_timer);
+    qemu_del_timer(d->mit_timer);
+    qemu_free_timer(d->mit_timer);
     memory_region_destroy(&d->mmio);
     memory_region_destroy(&d->io);
     qemu_del_net_client(&d->nic->nc);
@@ -1249,6 +1481,21 @@ static NetClientInfo net_e1000_info = {
     .link_status_changed = e1000_set_link_status,
 };
 
+static void
+e1000_init_vnet(E1000State *s)
+{
+    NetClientState *peer = s->nic->nc.peer;
+
+    if (!peer || peer->info->type != NET_CLIENT_OPTIONS_KIND_TAP ||
+        !tap_has_vnet_hdr(peer)) {
+        return;
+    }
+
+    tap_set_vnet_hdr_len(peer, sizeof(struct virtio_net_hdr));
+    tap_using_vnet_hdr(peer, 1);
+    s->has_vnet = true;
+}
+
 static int pci_e1000_init(PCIDevice *pci_dev)
 {
     E1000State *d = DO_UPCAST(E1000State, dev, pci_dev);
@@ -1285,10 +1532,12 @@ static int pci_e1000_init(PCIDevice *pci_dev)
                           object_get_typename(OBJECT(d)), d->dev.qdev.id, d);
 
     qemu_format_nic_info_str(&d->nic->nc, macaddr);
+    e1000_init_vnet(d);
 
     add_boot_device_path(d->conf.bootindex, &pci_dev->qdev, "/ethernet-phy@0");
 
     d->autoneg_timer = qemu_new_timer_ms(vm_clock, e1000_autoneg_timer, d);
+    d->mit_timer = qemu_new_timer_ns(vm_clock, e1000_mit_timer, d);
 
     return 0;
 }
@@ -1301,6 +1550,8 @@ static void qdev_e1000_reset(DeviceState *dev)
 
 static Property e1000_properties[] = {
     DEFINE_NIC_PROPERTIES(E1000State, conf),
+    DEFINE_PROP_BIT("mitigation", E1000State,
+                    compat_flags, E1000_FLAG_MIT_BIT, true),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -0,0 +1,41 @@
+/*
+ * vhost backends
+ *
+ * Copyright (c) 2013 QEMU contributors
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef VHOST_BACKEND_H
+#define VHOST_BACKEND_H
+
+typedef enum VhostBackendType {
+    VHOST_BACKEND_TYPE_NONE = 0,
+    VHOST_BACKEND_TYPE_KERNEL = 1,
+    VHOST_BACKEND_TYPE_USER = 2,
+    VHOST_BACKEND_TYPE_MAX = 3,
+} VhostBackendType;
+
+struct vhost_dev;
+
+/* A backend carries the VHOST_* requests of linux/vhost.h to whoever
+ * processes the virtqueues: the kernel through ioctls on /dev/vhost-net,
+ * or an external process through the vhost-user protocol.  vhost_call
+ * returns -1 and sets errno on failure, like ioctl().
+ */
+typedef struct VhostOps {
+    VhostBackendType backend_type;
+    int (*vhost_call)(struct vhost_dev *dev, unsigned long int request,
+                      void *arg);
+    void (*vhost_backend_cleanup)(struct vhost_dev *dev);
+} VhostOps;
+
+extern const VhostOps kernel_ops;
+extern const VhostOps user_ops;
+
+int vhost_set_backend_type(struct vhost_dev *dev,
+                           VhostBackendType backend_type);
+
+#endif /* VHOST_BACKEND_H */
@@ -0,0 +1,387 @@
+/*
+ * vhost-user
+ *
+ * Copyright (c) 2013 QEMU contributors
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "vhost.h"
+#include "vhost-backend.h"
+#include "qemu-error.h"
+
+#include <sys/socket.h>
+#include <linux/vhost.h>
+
+#define VHOST_MEMORY_MAX_NREGIONS    8
+
+/* See docs/specs/vhost-user.txt for the wire format. */
+typedef enum VhostUserRequest {
+    VHOST_USER_NONE = 0,
+    VHOST_USER_GET_FEATURES = 1,
+    VHOST_USER_SET_FEATURES = 2,
+    VHOST_USER_SET_OWNER = 3,
+    VHOST_USER_RESET_OWNER = 4,
+    VHOST_USER_SET_MEM_TABLE = 5,
+    VHOST_USER_SET_LOG_BASE = 6,
+    VHOST_USER_SET_LOG_FD = 7,
+    VHOST_USER_SET_VRING_NUM = 8,
+    VHOST_USER_SET_VRING_ADDR = 9,
+    VHOST_USER_SET_VRING_BASE = 10,
+    VHOST_USER_GET_VRING_BASE = 11,
+    VHOST_USER_SET_VRING_KICK = 12,
+    VHOST_USER_SET_VRING_CALL = 13,
+    VHOST_USER_SET_VRING_ERR = 14,
+    VHOST_USER_MAX
+} VhostUserRequest;
+
+typedef struct VhostUserMemoryRegion {
+    uint64_t guest_phys_addr;
+    uint64_t memory_size;
+    uint64_t userspace_addr;
+    uint64_t mmap_offset;
+} VhostUserMemoryRegion;
+
+typedef struct VhostUserMemory {
+    uint32_t nregions;
+    uint32_t padding;
+    VhostUserMemoryRegion regions[VHOST_MEMORY_MAX_NREGIONS];
+} VhostUserMemory;
+
+typedef struct VhostUserMsg {
+    uint32_t request;
+
+#define VHOST_USER_VERSION_MASK     (0x3)
+#define VHOST_USER_REPLY_MASK       (0x1 << 2)
+    uint32_t flags;
+    uint32_t size; /* the following payload size */
+    union {
+#define VHOST_USER_VRING_IDX_MASK   (0xff)
+#define VHOST_USER_VRING_NOFD_MASK  (0x1 << 8)
+        uint64_t u64;
+        struct vhost_vring_state state;
+        struct vhost_vring_addr addr;
+        VhostUserMemory memory;
+    } payload;
+} QEMU_PACKED VhostUserMsg;
+
+#define VHOST_USER_HDR_SIZE offsetof(VhostUserMsg, payload.u64)
+
+/* The version of the protocol we support */
+#define VHOST_USER_VERSION    (0x1)
+
+static const unsigned long int ioctl_to_vhost_user_request[VHOST_USER_MAX] = {
+    -1,                     /* VHOST_USER_NONE */
+    VHOST_GET_FEATURES,     /* VHOST_USER_GET_FEATURES */
+    VHOST_SET_FEATURES,     /* VHOST_USER_SET_FEATURES */
+    VHOST_SET_OWNER,        /* VHOST_USER_SET_OWNER */
+    VHOST_RESET_OWNER,      /* VHOST_USER_RESET_OWNER */
+    VHOST_SET_MEM_TABLE,    /* VHOST_USER_SET_MEM_TABLE */
+    VHOST_SET_LOG_BASE,     /* VHOST_USER_SET_LOG_BASE */
+    VHOST_SET_LOG_FD,       /* VHOST_USER_SET_LOG_FD */
+    VHOST_SET_VRING_NUM,    /* VHOST_USER_SET_VRING_NUM */
+    VHOST_SET_VRING_ADDR,   /* VHOST_USER_SET_VRING_ADDR */
+    VHOST_SET_VRING_BASE,   /* VHOST_USER_SET_VRING_BASE */
+    VHOST_GET_VRING_BASE,   /* VHOST_USER_GET_VRING_BASE */
+    VHOST_SET_VRING_KICK,   /* VHOST_USER_SET_VRING_KICK */
+    VHOST_SET_VRING_CALL,   /* VHOST_USER_SET_VRING_CALL */
+    VHOST_SET_VRING_ERR     /* VHOST_USER_SET_VRING_ERR */
+};
+
+static VhostUserRequest vhost_user_request_translate(unsigned long int request)
+{
+    VhostUserRequest idx;
+
+    for (idx = 0; idx < VHOST_USER_MAX; idx++) {
+        if (ioctl_to_vhost_user_request[idx] == request) {
+            break;
+        }
+    }
+
+    return (idx == VHOST_USER_MAX) ? VHOST_USER_NONE : idx;
+}
+
+static int vhost_user_read_all(int fd, void *buf, size_t size)
+{
+    uint8_t *p = buf;
+    ssize_t r;
+
+    while (size) {
+        r = read(fd, p, size);
+        if (r < 0 && errno == EINTR) {
+            continue;
+        }
+        if (r <= 0) {
+            if (r == 0) {
+                errno = ECONNRESET;
+            }
+            return -1;
+        }
+        p += r;
+        size -= r;
+    }
+    return 0;
+}
+
+static int vhost_user_read(struct vhost_dev *dev, VhostUserMsg *msg)
+{
+    if (vhost_user_read_all(dev->control, msg, VHOST_USER_HDR_SIZE) < 0) {
+        error_report("Failed to read vhost-user header: %s", strerror(errno));
+        return -1;
+    }
+
+    if (msg->flags != (VHOST_USER_REPLY_MASK | VHOST_USER_VERSION)) {
+        error_report("Failed to read vhost-user message: bad flags 0x%x",
+                     msg->flags);
+        errno = EPROTO;
+        return -1;
+    }
+
+    if (msg->size > sizeof(msg->payload)) {
+        error_report("Failed to read vhost-user message: size %u exceeds %zu",
+                     msg->size, sizeof(msg->payload));
+        errno = EPROTO;
+        return -1;
+    }
+
+    if (msg->size &&
+        vhost_user_read_all(dev->control, &msg->payload, msg->size) < 0) {
+        error_report("Failed to read vhost-user payload: %s", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+static int vhost_user_write(struct vhost_dev *dev, VhostUserMsg *msg,
+                            int *fds, int fd_num)
+{
+    char control[CMSG_SPACE(VHOST_MEMORY_MAX_NREGIONS * sizeof(int))];
+    size_t size = VHOST_USER_HDR_SIZE + msg->size;
+    struct msghdr msgh;
+    struct cmsghdr *cmsg;
+    struct iovec iov;
+    ssize_t r;
+
+    memset(&msgh, 0, sizeof(msgh));
+    iov.iov_base = msg;
+    iov.iov_len = size;
+    msgh.msg_iov = &iov;
+    msgh.msg_iovlen = 1;
+
+    if (fd_num) {
+        msgh.msg_control = control;
+        msgh.msg_controllen = CMSG_SPACE(fd_num * sizeof(int));
+
+        cmsg = CMSG_FIRSTHDR(&msgh);
+        cmsg->cmsg_len = CMSG_LEN(fd_num * sizeof(int));
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        memcpy(CMSG_DATA(cmsg), fds, fd_num * sizeof(int));
+    }
+
+    do {
+        r = sendmsg(dev->control, &msgh, 0);
+    } while (r < 0 && errno == EINTR);
+
+    if (r < 0) {
+        error_report("Failed to write vhost-user message: %s",
+                     strerror(errno));
+        return -1;
+    }
+    if (r != size) {
+        error_report("Short write of vhost-user message");
+        errno = EIO;
+        return -1;
+    }
+    return 0;
+}
+
+/* Only memory that another process can map shares the guest's view of RAM,
+ * i.e. -mem-path with -mem-prealloc.  Regions without a file descriptor
+ * (small ROMs that did not fit a huge page, for example) are left out; the
+ * backend only ever needs the rings and packet buffers.
+ */
+static int vhost_user_fill_mem_table(VhostUserMsg *msg,
+                                     struct vhost_memory *mem,
+                                     int *fds, int *fd_num)
+{
+    VhostUserMemoryRegion region;
+    ram_addr_t ram_addr;
+    int i, fd;
+
+    for (i = 0; i < mem->nregions; ++i) {
+        struct vhost_memory_region *reg = mem->regions + i;
+
+        if (qemu_ram_addr_from_host((void *)(uintptr_t)reg->userspace_addr,
+                                    &ram_addr) < 0) {
+            continue;
+        }
+        fd = qemu_get_ram_fd(ram_addr);
+        if (fd < 0) {
+            continue;
+        }
+        if (*fd_num == VHOST_MEMORY_MAX_NREGIONS) {
+            error_report("vhost-user supports at most %d memory regions",
+                         VHOST_MEMORY_MAX_NREGIONS);
+            errno = E2BIG;
+            return -1;
+        }
+        region.guest_phys_addr = reg->guest_phys_addr;
+        region.memory_size = reg->memory_size;
+        region.userspace_addr = reg->userspace_addr;
+        region.mmap_offset = reg->userspace_addr -
+            (uintptr_t)qemu_get_ram_block_host_ptr(ram_addr);
+        msg->payload.memory.regions[*fd_num] = region;
+        fds[(*fd_num)++] = fd;
+    }
+
+    if (!*fd_num) {
+        error_report("vhost-user needs guest RAM that can be shared, "
+                     "use -mem-path and -mem-prealloc");
+        errno = EINVAL;
+        return -1;
+    }
+
+    msg->payload.memory.nregions = *fd_num;
+    msg->payload.memory.padding = 0;
+    msg->size = offsetof(VhostUserMemory, regions) +
+        *fd_num * sizeof(VhostUserMemoryRegion);
+    return 0;
+}
+
+static int vhost_user_call(struct vhost_dev *dev, unsigned long int request,
+                           void *arg)
+{
+    VhostUserMsg msg;
+    VhostUserRequest msg_request;
+    struct vhost_vring_file *file;
+    int fds[VHOST_MEMORY_MAX_NREGIONS];
+    int fd_num = 0;
+    bool need_reply = false;
+
+    assert(dev->vhost_ops->backend_type == VHOST_BACKEND_TYPE_USER);
+
+    msg_request = vhost_user_request_translate(request);
+    msg.request = msg_request;
+    msg.flags = VHOST_USER_VERSION;
+    msg.size = 0;
+
+    switch (msg_request) {
+    case VHOST_USER_GET_FEATURES:
+        need_reply = true;
+        break;
+
+    case VHOST_USER_SET_FEATURES:
+    case VHOST_USER_SET_LOG_BASE:
+        msg.payload.u64 = *((uint64_t *) arg);
+        msg.size = sizeof(msg.payload.u64);
+        break;
+
+    case VHOST_USER_SET_OWNER:
+    case VHOST_USER_RESET_OWNER:
+        break;
+
+    case VHOST_USER_SET_MEM_TABLE:
+        if (vhost_user_fill_mem_table(&msg, arg, fds, &fd_num) < 0) {
+            return -1;
+        }
+        break;
+
+    case VHOST_USER_SET_LOG_FD:
+        fds[fd_num++] = *((int *) arg);
+        break;
+
+    case VHOST_USER_SET_VRING_NUM:
+    case VHOST_USER_SET_VRING_BASE:
+        memcpy(&msg.payload.state, arg, sizeof(struct vhost_vring_state));
+        msg.size = sizeof(msg.payload.state);
+        break;
+
+    case VHOST_USER_GET_VRING_BASE:
+        memcpy(&msg.payload.state, arg, sizeof(struct vhost_vring_state));
+        msg.size = sizeof(msg.payload.state);
+        need_reply = true;
+        break;
+
+    case VHOST_USER_SET_VRING_ADDR:
+        memcpy(&msg.payload.addr, arg, sizeof(struct vhost_vring_addr));
+        msg.size = sizeof(msg.payload.addr);
+        break;
+
+    case VHOST_USER_SET_VRING_KICK:
+    case VHOST_USER_SET_VRING_CALL:
+    case VHOST_USER_SET_VRING_ERR:
+        file = arg;
+        msg.payload.u64 = file->index & VHOST_USER_VRING_IDX_MASK;
+        msg.size = sizeof(msg.payload.u64);
+        if (file->fd >= 0) {
+            fds[fd_num++] = file->fd;
+        } else {
+            msg.payload.u64 |= VHOST_USER_VRING_NOFD_MASK;
+        }
+        break;
+
+    default:
+        error_report("vhost-user trying to send unhandled request 0x%lx",
+                     request);
+        errno = ENOSYS;
+        return -1;
+    }
+
+    if (vhost_user_write(dev, &msg, fds, fd_num) < 0) {
+        return -1;
+    }
+
+    if (!need_reply) {
+        return 0;
+    }
+
+    if (vhost_user_read(dev, &msg) < 0) {
+        return -1;
+    }
+
+    if (msg.request != msg_request) {
+        error_report("Received unexpected vhost-user reply: expected %d, "
+                     "got %d", msg_request, msg.request);
+        errno = EPROTO;
+        return -1;
+    }
+
+    switch (msg_request) {
+    case VHOST_USER_GET_FEATURES:
+        if (msg.size != sizeof(msg.payload.u64)) {
+            error_report("Received bad vhost-user reply size");
+            errno = EPROTO;
+            return -1;
+        }
+        *((uint64_t *) arg) = msg.payload.u64;
+        break;
+    case VHOST_USER_GET_VRING_BASE:
+        if (msg.size != sizeof(msg.payload.state)) {
+            error_report("Received bad vhost-user reply size");
+            errno = EPROTO;
+            return -1;
+        }
+        memcpy(arg, &msg.payload.state, sizeof(struct vhost_vring_state));
+        break;
+    default:
+        break;
+    }
+
+    return 0;
+}
+
+/* The socket belongs to the vhost-user net client, which closes it. */
+static void vhost_user_cleanup(struct vhost_dev *dev)
+{
+    assert(dev->vhost_ops->backend_type == VHOST_BACKEND_TYPE_USER);
+}
+
+const VhostOps user_ops = {
+    .backend_type = VHOST_BACKEND_TYPE_USER,
+    .vhost_call = vhost_user_call,
+    .vhost_backend_cleanup = vhost_user_cleanup,
+};
@@ -2,19 +2,30 @@
 #define VHOST_NET_H
 
 #include "net.h"
+#include "vhost-backend.h"
 
 struct vhost_net;
 typedef struct vhost_net VHostNetState;
 
-VHostNetState *vhost_net_init(NetClientState *backend, int devfd, bool force);
+typedef struct VhostNetOptions {
+    VhostBackendType backend_type;
+    NetClientState *net_backend;
+    /* /dev/vhost-net descriptor (-1 to open it) or vhost-user socket */
+    int devfd;
+    bool force;
+} VhostNetOptions;
+
+VHostNetState *vhost_net_init(VhostNetOptions *options);
 
 bool vhost_net_query(VHostNetState *net, VirtIODevice *dev);
-int vhost_net_start(VHostNetState *net, VirtIODevice *dev);
-void vhost_net_stop(VHostNetState *net, VirtIODevice *dev);
+int vhost_net_start(VirtIODevice *dev, NetClientState **ncs, int total_queues);
+void vhost_net_stop(VirtIODevice *dev, NetClientState **ncs, int total_queues);
 
 void vhost_net_cleanup(VHostNetState *net);
 
 unsigned vhost_net_get_features(VHostNetState *net, unsigned features);
 void vhost_net_ack_features(VHostNetState *net, unsigned features);
 
+VHostNetState *get_vhost_net(NetClientState *nc);
+
 #endif
@@ -57,6 +57,9 @@ typedef struct CPUClass {
  * @created: Indicates whether the CPU thread has been successfully created.
  * @stop: Indicates a pending stop request.
  * @stopped: Indicates the CPU has been artificially stopped.
+ * @env_ptr: Pointer to the target-specific CPU state.
+ * @running: Indicates the vCPU thread is inside cpu_exec() without the
+ * iothread lock (multi-threaded TCG only).
  *
  * State of one CPU core or thread.
  */
@@ -71,11 +74,13 @@ struct CPUState {
 #endif
     int thread_id;
     struct QemuCond *halt_cond;
+    void *env_ptr;
     struct qemu_work_item *queued_work_first, *queued_work_last;
     bool thread_kicked;
     bool created;
     bool stop;
     bool stopped;
+    bool running;
 
     /* TODO Move common fields from CPUArchState here. */
 };
@@ -136,5 +141,16 @@ bool cpu_is_stopped(CPUState *cpu);
  */
 void run_on_cpu(CPUState *cpu, void (*func)(void *data), void *data);
 
+/**
+ * async_run_on_cpu:
+ * @cpu: The vCPU to run on.
+ * @func: The function to be executed.
+ * @data: Data to pass to the function.
+ *
+ * Schedules the function @func for execution on the vCPU @cpu
+ * without waiting for it to complete.
+ */
+void async_run_on_cpu(CPUState *cpu, void (*func)(void *data), void *data);
+
 
 #endif
@@ -66,6 +66,9 @@ unsigned long reserved_va;
 static void usage(void);
 
 static const char *interp_prefix = CONFIG_QEMU_INTERP_PREFIX;
+static const char *tcache_path;
+static bool tcache_stats;
+static int hotblocks;
 const char *qemu_uname_release = CONFIG_UNAME_RELEASE;
 
 /* XXX: on x86 MAP_GROWSDOWN only works if ESP <= address + 32, so
@@ -3197,6 +3200,39 @@ static void handle_arg_singlestep(const char *arg)
     singlestep = 1;
 }
 
+/* Called when the guest process exits.  */
+void user_exit_report(void)
+{
+    tb_cache_exit();
+    if (hotblocks) {
+        tb_profile_dump(stderr, fprintf, hotblocks);
+    }
+}
+
+static void handle_arg_tcache(const char *arg)
+{
+    tcache_path = strdup(arg);
+}
+
+static void handle_arg_tcache_stats(const char *arg)
+{
+    tcache_stats = true;
+}
+
+static void handle_arg_perfmap(const char *arg)
+{
+    tb_perf_map_enable();
+}
+
+static void handle_arg_hotblocks(const char *arg)
+{
+    hotblocks = atoi(arg);
+    if (hotblocks <= 0) {
+        usage();
+    }
+    tb_profile_enabled = true;
+}
+
 static void handle_arg_strace(const char *arg)
 {
     do_strace = 1;
@@ -3253,6 +3289,14 @@ static const struct qemu_argument arg_table[] = {
      "",           "run in singlestep mode"},
     {"strace",     "QEMU_STRACE",      false, handle_arg_strace,
      "",           "log system calls"},
+    {"tcache",     "QEMU_TCACHE",      true,  handle_arg_tcache,
+     "file",       "reuse translated code saved in 'file' across runs"},
+    {"tcache-stats", "QEMU_TCACHE_STATS", false, handle_arg_tcache_stats,
+     "",           "print translation cache statistics at exit"},
+    {"perfmap",    "QEMU_PERFMAP",     false, handle_arg_perfmap,
+     "",           "write /tmp/perf-PID.map for the perf profiler"},
+    {"hotblocks",  "QEMU_HOTBLOCKS",   true,  handle_arg_hotblocks,
+     "count",      "print the 'count' most executed blocks at exit"},
     {"version",    "QEMU_VERSION",     false, handle_arg_version,
      "",           "display version information and exit"},
     {NULL, NULL, false, NULL, NULL, NULL}
@@ -3433,6 +3477,9 @@ int main(int argc, char **argv, char **envp)
     /* init debug */
     cpu_set_log_filename(log_file);
     optind = parse_args(argc, argv);
+    if (tcache_path) {
+        tb_cache_init(tcache_path, tcache_stats);
+    }
 
     /* Zero out regs */
     memset(regs, 0, sizeof(struct target_pt_regs));
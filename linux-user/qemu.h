@@ -275,6 +275,7 @@ void mmap_fork_end(int child);
 
 /* main.c */
 extern unsigned long guest_stack_size;
+void user_exit_report(void);
 
 /* user access */
 
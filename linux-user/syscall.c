@@ -5197,6 +5197,7 @@ abi_long do_syscall(void *cpu_env, int num, abi_long arg1,
         _mcleanup();
 #endif
         gdb_exit(cpu_env, arg1);
+        user_exit_report();
         _exit(arg1);
         ret = 0; /* avoid warning */
         break;
@@ -6957,6 +6958,7 @@ abi_long do_syscall(void *cpu_env, int num, abi_long arg1,
         _mcleanup();
 #endif
         gdb_exit(cpu_env, arg1);
+        user_exit_report();
         ret = get_errno(exit_group(arg1));
         break;
 #endif
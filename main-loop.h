@@ -294,6 +294,14 @@ void qemu_mutex_lock_iothread(void);
  */
 void qemu_mutex_unlock_iothread(void);
 
+/**
+ * qemu_mutex_iothread_locked: Return whether the main loop mutex is held.
+ *
+ * Returns true if the calling thread took the main loop mutex with
+ * qemu_mutex_lock_iothread and has not released it yet.
+ */
+bool qemu_mutex_iothread_locked(void);
+
 /* internal interfaces */
 
 void qemu_fd_register(int fd);
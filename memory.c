@@ -844,6 +844,19 @@ static bool memory_region_access_valid(MemoryRegion *mr,
     return true;
 }
 
+/* True if an access of @size can be passed straight to the region's
+ * read/write callback, without splitting it in access_with_adjusted_size().
+ */
+static inline bool memory_region_access_direct(MemoryRegion *mr,
+                                               unsigned size)
+{
+    unsigned min = mr->ops->impl.min_access_size;
+    unsigned max = mr->ops->impl.max_access_size;
+
+    return !mr->flush_coalesced_mmio
+        && size >= (min ? min : 1) && size <= (max ? max : 4);
+}
+
 static uint64_t memory_region_dispatch_read1(MemoryRegion *mr,
                                              hwaddr addr,
                                              unsigned size)
@@ -858,6 +871,11 @@ static uint64_t memory_region_dispatch_read1(MemoryRegion *mr,
         return mr->ops->old_mmio.read[bitops_ffsl(size)](mr->opaque, addr);
     }
 
+    if (memory_region_access_direct(mr, size)) {
+        return mr->ops->read(mr->opaque, addr, size)
+            & (-1ULL >> (64 - size * 8));
+    }
+
     /* FIXME: support unaligned access */
     access_with_adjusted_size(addr, &data, size,
                               mr->ops->impl.min_access_size,
@@ -912,6 +930,12 @@ static void memory_region_dispatch_write(MemoryRegion *mr,
         return;
     }
 
+    if (memory_region_access_direct(mr, size)) {
+        mr->ops->write(mr->opaque, addr, data & (-1ULL >> (64 - size * 8)),
+                       size);
+        return;
+    }
+
     /* FIXME: support unaligned access */
     access_with_adjusted_size(addr, &data, size,
                               mr->ops->impl.min_access_size,
@@ -1011,6 +1011,25 @@ static void do_singlestep(Monitor *mon, const QDict *qdict)
     }
 }
 
+static void do_tb_profile(Monitor *mon, const QDict *qdict)
+{
+    const char *option = qdict_get_try_str(qdict, "option");
+
+    if (!option || !strcmp(option, "on")) {
+        tb_profile_set(true);
+    } else if (!strcmp(option, "off")) {
+        tb_profile_set(false);
+    } else {
+        monitor_printf(mon, "unexpected option %s\n", option);
+    }
+}
+
+static void do_hotblocks(Monitor *mon, const QDict *qdict)
+{
+    tb_profile_dump((FILE *)mon, monitor_fprintf,
+                    qdict_get_try_int(qdict, "count", 20));
+}
+
 static void do_gdbserver(Monitor *mon, const QDict *qdict)
 {
     const char *device = qdict_get_try_str(qdict, "device");
@@ -38,6 +38,7 @@
 
 #include "qemu_socket.h"
 #include "qemu-queue.h"
+#include "qemu-timer.h"
 
 //#define DEBUG_NBD
 
@@ -86,6 +87,22 @@ struct NBDRequest {
     QSIMPLEQ_ENTRY(NBDRequest) entry;
     NBDClient *client;
     uint8_t *data;
+    int data_order;
+};
+
+/* Data buffers are shared by all clients of an export and come in power of
+ * two sizes between 4k and NBD_BUFFER_SIZE.  While a buffer sits in the pool,
+ * its first bytes are used to link it in the free list of its size class.
+ */
+#define NBD_POOL_MIN_ORDER      12
+#define NBD_POOL_MAX_ORDER      20
+#define NBD_POOL_CLASSES        (NBD_POOL_MAX_ORDER - NBD_POOL_MIN_ORDER + 1)
+#define NBD_POOL_MAX_CACHED     (16 * NBD_BUFFER_SIZE)
+
+typedef struct NBDPoolBuffer NBDPoolBuffer;
+
+struct NBDPoolBuffer {
+    QSLIST_ENTRY(NBDPoolBuffer) next;
 };
 
 struct NBDExport {
@@ -100,6 +117,13 @@ struct NBDExport {
     QTAILQ_HEAD(, NBDClient) clients;
     QSIMPLEQ_HEAD(, NBDRequest) requests;
     QTAILQ_ENTRY(NBDExport) next;
+
+    int queue_depth;
+    QSLIST_HEAD(, NBDPoolBuffer) pool[NBD_POOL_CLASSES];
+    size_t pool_cached;
+
+    int nb_in_flight;
+    NBDExportStats stats;
 };
 
 static QTAILQ_HEAD(, NBDExport) exports = QTAILQ_HEAD_INITIALIZER(exports);
@@ -776,11 +800,8 @@ ssize_t nbd_receive_reply(int csock, struct nbd_reply *reply)
     return 0;
 }
 
-static ssize_t nbd_send_reply(int csock, struct nbd_reply *reply)
+static void nbd_encode_reply(uint8_t *buf, struct nbd_reply *reply)
 {
-    uint8_t buf[NBD_REPLY_SIZE];
-    ssize_t ret;
-
     /* Reply
        [ 0 ..  3]    magic   (NBD_REPLY_MAGIC)
        [ 4 ..  7]    error   (0 == no error)
@@ -789,6 +810,14 @@ static ssize_t nbd_send_reply(int csock, struct nbd_reply *reply)
     cpu_to_be32w((uint32_t*)buf, NBD_REPLY_MAGIC);
     cpu_to_be32w((uint32_t*)(buf + 4), reply->error);
     cpu_to_be64w((uint64_t*)(buf + 8), reply->handle);
+}
+
+static ssize_t nbd_send_reply(int csock, struct nbd_reply *reply)
+{
+    uint8_t buf[NBD_REPLY_SIZE];
+    ssize_t ret;
+
+    nbd_encode_reply(buf, reply);
 
     TRACE("Sending response to client");
 
@@ -804,8 +833,6 @@ static ssize_t nbd_send_reply(int csock, struct nbd_reply *reply)
     return 0;
 }
 
-#define MAX_NBD_REQUESTS 16
-
 void nbd_client_get(NBDClient *client)
 {
     client->refcount++;
@@ -849,31 +876,100 @@ void nbd_client_close(NBDClient *client)
     }
 }
 
+static int nbd_buffer_order(uint32_t len)
+{
+    int order = NBD_POOL_MIN_ORDER;
+
+    while ((1U << order) < len) {
+        order++;
+    }
+    assert(order <= NBD_POOL_MAX_ORDER);
+    return order;
+}
+
+static uint8_t *nbd_buffer_get(NBDExport *exp, int order)
+{
+    NBDPoolBuffer *buf;
+    int i = order - NBD_POOL_MIN_ORDER;
+
+    if (QSLIST_EMPTY(&exp->pool[i])) {
+        return qemu_blockalign(exp->bs, 1 << order);
+    }
+
+    buf = QSLIST_FIRST(&exp->pool[i]);
+    QSLIST_REMOVE_HEAD(&exp->pool[i], next);
+    exp->pool_cached -= 1 << order;
+    return (uint8_t *)buf;
+}
+
+static void nbd_buffer_put(NBDExport *exp, uint8_t *data, int order)
+{
+    NBDPoolBuffer *buf = (NBDPoolBuffer *)data;
+    int i = order - NBD_POOL_MIN_ORDER;
+
+    /* Do not keep more memory around than the old fixed-size buffers of
+     * a single client used to take.
+     */
+    if (exp->pool_cached + (1 << order) > NBD_POOL_MAX_CACHED) {
+        qemu_vfree(data);
+        return;
+    }
+
+    QSLIST_INSERT_HEAD(&exp->pool[i], buf, next);
+    exp->pool_cached += 1 << order;
+}
+
+static void nbd_buffer_pool_free(NBDExport *exp)
+{
+    NBDPoolBuffer *buf;
+    int i;
+
+    for (i = 0; i < NBD_POOL_CLASSES; i++) {
+        while (!QSLIST_EMPTY(&exp->pool[i])) {
+            buf = QSLIST_FIRST(&exp->pool[i]);
+            QSLIST_REMOVE_HEAD(&exp->pool[i], next);
+            qemu_vfree(buf);
+        }
+    }
+    exp->pool_cached = 0;
+}
+
 static NBDRequest *nbd_request_get(NBDClient *client)
 {
     NBDRequest *req;
     NBDExport *exp = client->exp;
 
-    assert(client->nb_requests <= MAX_NBD_REQUESTS - 1);
+    assert(client->nb_requests <= exp->queue_depth - 1);
     client->nb_requests++;
 
     if (QSIMPLEQ_EMPTY(&exp->requests)) {
         req = g_malloc0(sizeof(NBDRequest));
-        req->data = qemu_blockalign(exp->bs, NBD_BUFFER_SIZE);
     } else {
         req = QSIMPLEQ_FIRST(&exp->requests);
         QSIMPLEQ_REMOVE_HEAD(&exp->requests, entry);
     }
     nbd_client_get(client);
     req->client = client;
+
+    if (++exp->nb_in_flight > exp->stats.max_in_flight) {
+        exp->stats.max_in_flight = exp->nb_in_flight;
+    }
     return req;
 }
 
 static void nbd_request_put(NBDRequest *req)
 {
     NBDClient *client = req->client;
-    QSIMPLEQ_INSERT_HEAD(&client->exp->requests, req, entry);
-    if (client->nb_requests-- == MAX_NBD_REQUESTS) {
+    NBDExport *exp = client->exp;
+
+    if (req->data) {
+        nbd_buffer_put(exp, req->data, req->data_order);
+        req->data = NULL;
+    }
+    exp->nb_in_flight--;
+
+    QSIMPLEQ_INSERT_HEAD(&exp->requests, req, entry);
+    if (client->nb_requests-- == exp->queue_depth) {
         qemu_notify_event();
     }
     nbd_client_put(client);
@@ -888,6 +984,7 @@ NBDExport *nbd_export_new(BlockDriverState *bs, off_t dev_offset,
     exp->refcount = 1;
     QTAILQ_INIT(&exp->clients);
     exp->bs = bs;
+    exp->queue_depth = NBD_DEFAULT_QUEUE_DEPTH;
     exp->dev_offset = dev_offset;
     exp->nbdflags = nbdflags;
     exp->size = size == -1 ? bdrv_getlength(bs) : size;
@@ -940,6 +1037,17 @@ void nbd_export_close(NBDExport *exp)
     nbd_export_put(exp);
 }
 
+void nbd_export_set_queue_depth(NBDExport *exp, int queue_depth)
+{
+    assert(queue_depth > 0 && queue_depth <= NBD_MAX_QUEUE_DEPTH);
+    exp->queue_depth = queue_depth;
+}
+
+void nbd_export_get_stats(NBDExport *exp, NBDExportStats *stats)
+{
+    *stats = exp->stats;
+}
+
 void nbd_export_get(NBDExport *exp)
 {
     assert(exp->refcount > 0);
@@ -963,9 +1071,9 @@ void nbd_export_put(NBDExport *exp)
         while (!QSIMPLEQ_EMPTY(&exp->requests)) {
             NBDRequest *first = QSIMPLEQ_FIRST(&exp->requests);
             QSIMPLEQ_REMOVE_HEAD(&exp->requests, entry);
-            qemu_vfree(first->data);
             g_free(first);
         }
+        nbd_buffer_pool_free(exp);
 
         g_free(exp);
     }
@@ -994,6 +1102,8 @@ static ssize_t nbd_co_send_reply(NBDRequest *req, struct nbd_reply *reply,
 {
     NBDClient *client = req->client;
     int csock = client->sock;
+    uint8_t buf[NBD_REPLY_SIZE];
+    struct iovec iov[2];
     ssize_t rc, ret;
 
     qemu_co_mutex_lock(&client->send_lock);
@@ -1004,15 +1114,16 @@ static ssize_t nbd_co_send_reply(NBDRequest *req, struct nbd_reply *reply,
     if (!len) {
         rc = nbd_send_reply(csock, reply);
     } else {
-        socket_set_cork(csock, 1);
-        rc = nbd_send_reply(csock, reply);
-        if (rc >= 0) {
-            ret = qemu_co_send(csock, req->data, len);
-            if (ret != len) {
-                rc = -EIO;
-            }
-        }
-        socket_set_cork(csock, 0);
+        /* Send the header and the data with a single writev */
+        nbd_encode_reply(buf, reply);
+        iov[0].iov_base = buf;
+        iov[0].iov_len = sizeof(buf);
+        iov[1].iov_base = req->data;
+        iov[1].iov_len = len;
+
+        TRACE("Sending response to client, %d byte(s) of data", len);
+        ret = qemu_co_sendv(csock, iov, 2, 0, sizeof(buf) + len);
+        rc = (ret == sizeof(buf) + len) ? 0 : -EIO;
     }
 
     client->send_coroutine = NULL;
@@ -1025,6 +1136,7 @@ static ssize_t nbd_co_receive_request(NBDRequest *req, struct nbd_request *reque
 {
     NBDClient *client = req->client;
     int csock = client->sock;
+    uint32_t command;
     ssize_t rc;
 
     client->recv_coroutine = qemu_coroutine_self();
@@ -1052,7 +1164,14 @@ static ssize_t nbd_co_receive_request(NBDRequest *req, struct nbd_request *reque
 
     TRACE("Decoding type");
 
-    if ((request->type & NBD_CMD_MASK_COMMAND) == NBD_CMD_WRITE) {
+    command = request->type & NBD_CMD_MASK_COMMAND;
+    if (request->len &&
+        (command == NBD_CMD_READ || command == NBD_CMD_WRITE)) {
+        req->data_order = nbd_buffer_order(request->len);
+        req->data = nbd_buffer_get(client->exp, req->data_order);
+    }
+
+    if (command == NBD_CMD_WRITE) {
         TRACE("Reading %u byte(s)", request->len);
 
         if (qemu_co_recv(csock, req->data, request->len) != request->len) {
@@ -1068,6 +1187,23 @@ out:
     return rc;
 }
 
+static void nbd_account(NBDExport *exp, uint32_t command, uint32_t len,
+                        int64_t start, uint32_t error)
+{
+    NBDExportStats *stats = &exp->stats;
+
+    if (error) {
+        stats->nr_errors++;
+    }
+    if (command >= NBD_CMD_MAX || command == NBD_CMD_DISC) {
+        return;
+    }
+
+    stats->nr_ops[command]++;
+    stats->nr_bytes[command] += len;
+    stats->total_time_ns[command] += get_clock() - start;
+}
+
 static void nbd_trip(void *opaque)
 {
     NBDClient *client = opaque;
@@ -1075,6 +1211,9 @@ static void nbd_trip(void *opaque)
     NBDRequest *req;
     struct nbd_request request;
     struct nbd_reply reply;
+    QEMUIOVector qiov;
+    struct iovec iov;
+    int64_t start;
     ssize_t ret;
 
     TRACE("Reading request.");
@@ -1091,6 +1230,7 @@ static void nbd_trip(void *opaque)
         goto out;
     }
 
+    start = get_clock();
     reply.handle = request.handle;
     reply.error = 0;
 
@@ -1121,8 +1261,12 @@ static void nbd_trip(void *opaque)
             }
         }
 
-        ret = bdrv_read(exp->bs, (request.from + exp->dev_offset) / 512,
-                        req->data, request.len / 512);
+        iov.iov_base = req->data;
+        iov.iov_len = request.len;
+        qemu_iovec_init_external(&qiov, &iov, 1);
+
+        ret = bdrv_co_readv(exp->bs, (request.from + exp->dev_offset) / 512,
+                            request.len / 512, &qiov);
         if (ret < 0) {
             LOG("reading from file failed");
             reply.error = -ret;
@@ -1144,8 +1288,12 @@ static void nbd_trip(void *opaque)
 
         TRACE("Writing to device");
 
-        ret = bdrv_write(exp->bs, (request.from + exp->dev_offset) / 512,
-                         req->data, request.len / 512);
+        iov.iov_base = req->data;
+        iov.iov_len = request.len;
+        qemu_iovec_init_external(&qiov, &iov, 1);
+
+        ret = bdrv_co_writev(exp->bs, (request.from + exp->dev_offset) / 512,
+                             request.len / 512, &qiov);
         if (ret < 0) {
             LOG("writing to file failed");
             reply.error = -ret;
@@ -1204,6 +1352,8 @@ static void nbd_trip(void *opaque)
         break;
     }
 
+    nbd_account(exp, request.type & NBD_CMD_MASK_COMMAND, request.len,
+                start, reply.error);
     TRACE("Request/Reply complete");
 
 done:
@@ -1219,7 +1369,8 @@ static int nbd_can_read(void *opaque)
 {
     NBDClient *client = opaque;
 
-    return client->recv_coroutine || client->nb_requests < MAX_NBD_REQUESTS;
+    return client->recv_coroutine ||
+           client->nb_requests < client->exp->queue_depth;
 }
 
 static void nbd_read(void *opaque)
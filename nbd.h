@@ -59,6 +59,21 @@ enum {
 
 #define NBD_BUFFER_SIZE (1024*1024)
 
+/* Number of requests that a single client can have in flight */
+#define NBD_DEFAULT_QUEUE_DEPTH 16
+#define NBD_MAX_QUEUE_DEPTH     1024
+
+/* Per-export request statistics, indexed by NBD_CMD_* */
+#define NBD_CMD_MAX             (NBD_CMD_TRIM + 1)
+
+typedef struct NBDExportStats {
+    uint64_t nr_ops[NBD_CMD_MAX];
+    uint64_t nr_bytes[NBD_CMD_MAX];
+    uint64_t total_time_ns[NBD_CMD_MAX];
+    uint64_t nr_errors;
+    int max_in_flight;
+} NBDExportStats;
+
 ssize_t nbd_wr_sync(int fd, void *buffer, size_t size, bool do_read);
 int tcp_socket_outgoing(const char *address, uint16_t port);
 int tcp_socket_incoming(const char *address, uint16_t port);
@@ -84,6 +99,8 @@ NBDExport *nbd_export_new(BlockDriverState *bs, off_t dev_offset,
 void nbd_export_close(NBDExport *exp);
 void nbd_export_get(NBDExport *exp);
 void nbd_export_put(NBDExport *exp);
+void nbd_export_set_queue_depth(NBDExport *exp, int queue_depth);
+void nbd_export_get_stats(NBDExport *exp, NBDExportStats *stats);
 
 BlockDriverState *nbd_export_get_blockdev(NBDExport *exp);
 
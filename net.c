@@ -131,11 +131,22 @@ int parse_host_port(struct sockaddr_in *saddr, const char *str)
 
 void qemu_format_nic_info_str(NetClientState *nc, uint8_t macaddr[6])
 {
+    int i;
+
     snprintf(nc->info_str, sizeof(nc->info_str),
              "model=%s,macaddr=%02x:%02x:%02x:%02x:%02x:%02x",
              nc->model,
              macaddr[0], macaddr[1], macaddr[2],
              macaddr[3], macaddr[4], macaddr[5]);
+
+    if (nc->info->type == NET_CLIENT_OPTIONS_KIND_NIC) {
+        NICState *nic = DO_UPCAST(NICState, nc, nc);
+
+        for (i = 1; i < nic->queues; i++) {
+            pstrcpy(nic->ncs[i]->info_str, sizeof(nc->info_str),
+                    nc->info_str);
+        }
+    }
 }
 
 void qemu_macaddr_default_if_unset(MACAddr *macaddr)
@@ -218,21 +229,63 @@ NICState *qemu_new_nic(NetClientInfo *info,
                        const char *name,
                        void *opaque)
 {
+    NetClientState *peers[MAX_QUEUE_NUM];
     NetClientState *nc;
     NICState *nic;
+    int i, queues = 1;
 
     assert(info->type == NET_CLIENT_OPTIONS_KIND_NIC);
     assert(info->size >= sizeof(NICState));
 
+    /* A netdev can provide several queues under a single name; the NIC gets
+     * one queue for each of them.  Hub ports are always single queue.
+     */
+    if (conf->peer &&
+        conf->peer->info->type != NET_CLIENT_OPTIONS_KIND_HUBPORT) {
+        queues = qemu_find_net_clients_except(conf->peer->name, peers,
+                                              NET_CLIENT_OPTIONS_KIND_NIC,
+                                              MAX_QUEUE_NUM);
+        assert(queues > 0 && peers[0] == conf->peer);
+        for (i = 1; i < queues; i++) {
+            if (peers[i]->peer || peers[i]->info != conf->peer->info) {
+                break;
+            }
+        }
+        queues = i;
+    }
+
     nc = qemu_new_net_client(info, conf->peer, model, name);
 
     nic = DO_UPCAST(NICState, nc, nc);
     nic->conf = conf;
     nic->opaque = opaque;
+    nic->queues = queues;
+    nic->ncs = g_malloc0(sizeof(NetClientState *) * queues);
+    nic->ncs[0] = nc;
+
+    for (i = 1; i < queues; i++) {
+        NICState *subqueue;
+
+        nc = qemu_new_net_client(info, peers[i], model, nic->nc.name);
+        nc->queue_index = i;
+
+        subqueue = DO_UPCAST(NICState, nc, nc);
+        subqueue->conf = conf;
+        subqueue->opaque = opaque;
+        subqueue->queues = queues;
+        subqueue->ncs = nic->ncs;
+        nic->ncs[i] = nc;
+    }
 
     return nic;
 }
 
+NetClientState *qemu_get_subqueue(NICState *nic, int queue_index)
+{
+    assert(queue_index < nic->queues);
+    return nic->ncs[queue_index];
+}
+
 static void qemu_cleanup_net_client(NetClientState *nc)
 {
     QTAILQ_REMOVE(&net_clients, nc, next);
@@ -255,34 +308,66 @@ static void qemu_free_net_client(NetClientState *nc)
     g_free(nc);
 }
 
-void qemu_del_net_client(NetClientState *nc)
+static void qemu_del_nic(NICState *nic)
 {
-    /* If there is a peer NIC, delete and cleanup client, but do not free. */
-    if (nc->peer && nc->peer->info->type == NET_CLIENT_OPTIONS_KIND_NIC) {
-        NICState *nic = DO_UPCAST(NICState, nc, nc->peer);
-        if (nic->peer_deleted) {
-            return;
-        }
-        nic->peer_deleted = true;
-        /* Let NIC know peer is gone. */
-        nc->peer->link_down = true;
-        if (nc->peer->info->link_status_changed) {
-            nc->peer->info->link_status_changed(nc->peer);
+    NetClientState **ncs = nic->ncs;
+    int i;
+
+    for (i = nic->queues - 1; i >= 0; i--) {
+        NetClientState *nc = ncs[i];
+
+        /* If the peer has already been deleted, free it now. */
+        if (nc->peer && DO_UPCAST(NICState, nc, nc)->peer_deleted) {
+            qemu_free_net_client(nc->peer);
         }
+
         qemu_cleanup_net_client(nc);
+        qemu_free_net_client(nc);
+    }
+    g_free(ncs);
+}
+
+void qemu_del_net_client(NetClientState *nc)
+{
+    NetClientState *ncs[MAX_QUEUE_NUM];
+    int queues, i;
+
+    /* All queues of a NIC go away together. */
+    if (nc->info->type == NET_CLIENT_OPTIONS_KIND_NIC) {
+        qemu_del_nic(DO_UPCAST(NICState, nc, nc));
         return;
     }
 
-    /* If this is a peer NIC and peer has already been deleted, free it now. */
-    if (nc->peer && nc->info->type == NET_CLIENT_OPTIONS_KIND_NIC) {
-        NICState *nic = DO_UPCAST(NICState, nc, nc);
-        if (nic->peer_deleted) {
-            qemu_free_net_client(nc->peer);
+    /* Likewise for the queues of a multiqueue netdev, which share a name. */
+    queues = qemu_find_net_clients_except(nc->name, ncs,
+                                          NET_CLIENT_OPTIONS_KIND_NIC,
+                                          MAX_QUEUE_NUM);
+    for (i = 0; i < queues; i++) {
+        NetClientState *queue = ncs[i];
+
+        if (queue->info != nc->info) {
+            continue;
         }
-    }
 
-    qemu_cleanup_net_client(nc);
-    qemu_free_net_client(nc);
+        /* If there is a peer NIC, delete and cleanup client, but do not
+         * free. */
+        if (queue->peer &&
+            queue->peer->info->type == NET_CLIENT_OPTIONS_KIND_NIC) {
+            NICState *nic = DO_UPCAST(NICState, nc, queue->peer);
+
+            nic->peer_deleted = true;
+            /* Let NIC know peer is gone. */
+            queue->peer->link_down = true;
+            if (queue->peer->info->link_status_changed) {
+                queue->peer->info->link_status_changed(queue->peer);
+            }
+            qemu_cleanup_net_client(queue);
+            continue;
+        }
+
+        qemu_cleanup_net_client(queue);
+        qemu_free_net_client(queue);
+    }
 }
 
 void qemu_foreach_nic(qemu_nic_foreach func, void *opaque)
@@ -290,7 +375,8 @@ void qemu_foreach_nic(qemu_nic_foreach func, void *opaque)
     NetClientState *nc;
 
     QTAILQ_FOREACH(nc, &net_clients, next) {
-        if (nc->info->type == NET_CLIENT_OPTIONS_KIND_NIC) {
+        if (nc->info->type == NET_CLIENT_OPTIONS_KIND_NIC &&
+            nc->queue_index == 0) {
             func(DO_UPCAST(NICState, nc, nc), opaque);
         }
     }
@@ -336,7 +422,10 @@ ssize_t qemu_deliver_packet(NetClientState *sender,
 
     if (ret == 0) {
         nc->receive_disabled = 1;
-    };
+    } else if (ret > 0) {
+        nc->rx_packets++;
+        nc->rx_bytes += ret;
+    }
 
     return ret;
 }
@@ -350,11 +439,39 @@ void qemu_purge_queued_packets(NetClientState *nc)
     qemu_net_queue_purge(nc->peer->send_queue, nc);
 }
 
+/* While receiving_batch is set, nc may put off work that only needs to be
+ * done once per batch, such as interrupting the guest or flushing packets to
+ * the host, until its receive_batch_end callback runs.  Batches nest; pass
+ * the value returned by qemu_net_batch_begin() to qemu_net_batch_end().
+ */
+unsigned qemu_net_batch_begin(NetClientState *nc)
+{
+    unsigned batching = nc->receiving_batch;
+
+    nc->receiving_batch = 1;
+    return batching;
+}
+
+void qemu_net_batch_end(NetClientState *nc, unsigned batching)
+{
+    nc->receiving_batch = batching;
+    if (!batching && nc->info->receive_batch_end) {
+        nc->info->receive_batch_end(nc);
+    }
+}
+
 void qemu_flush_queued_packets(NetClientState *nc)
 {
+    unsigned batching;
+    bool flushed;
+
     nc->receive_disabled = 0;
 
-    if (qemu_net_queue_flush(nc->send_queue)) {
+    batching = qemu_net_batch_begin(nc);
+    flushed = qemu_net_queue_flush(nc->send_queue);
+    qemu_net_batch_end(nc, batching);
+
+    if (flushed) {
         /* We emptied the queue successfully, signal to the IO thread to repoll
          * the file descriptor (for tap, for example).
          */
@@ -378,6 +495,9 @@ static ssize_t qemu_send_packet_async_with_flags(NetClientState *sender,
         return size;
     }
 
+    sender->tx_packets++;
+    sender->tx_bytes += size;
+
     queue = sender->peer->send_queue;
 
     return qemu_net_queue_send(queue, sender, flags, buf, size, sent_cb);
@@ -391,6 +511,37 @@ ssize_t qemu_send_packet_async(NetClientState *sender,
                                              buf, size, sent_cb);
 }
 
+/* Send count packets, each held in one element of pkts.  Returns the number
+ * of packets that were consumed right away.  If that is less than count, the
+ * rest have been queued and sent_cb is invoked once the last of them has been
+ * delivered; the caller must not send more packets until then.
+ */
+int qemu_send_packets_async(NetClientState *sender,
+                            const struct iovec *pkts, int count,
+                            NetPacketSent *sent_cb)
+{
+    NetClientState *peer = sender->peer;
+    unsigned batching;
+    int i, ret;
+
+    if (sender->link_down || !peer) {
+        return count;
+    }
+
+    for (i = 0; i < count; i++) {
+        sender->tx_packets++;
+        sender->tx_bytes += pkts[i].iov_len;
+    }
+
+    batching = qemu_net_batch_begin(peer);
+    ret = qemu_net_queue_send_batch(peer->send_queue, sender,
+                                    QEMU_NET_PACKET_FLAG_NONE,
+                                    pkts, count, sent_cb);
+    qemu_net_batch_end(peer, batching);
+
+    return ret;
+}
+
 void qemu_send_packet(NetClientState *nc, const uint8_t *buf, int size)
 {
     qemu_send_packet_async(nc, buf, size, NULL);
@@ -406,11 +557,25 @@ static ssize_t nc_sendv_compat(NetClientState *nc, const struct iovec *iov,
                                int iovcnt)
 {
     uint8_t buffer[4096];
-    size_t offset;
+    uint8_t *buf = buffer;
+    size_t offset, size;
+    ssize_t ret;
 
-    offset = iov_to_buf(iov, iovcnt, 0, buffer, sizeof(buffer));
+    if (iovcnt == 1) {
+        return nc->info->receive(nc, iov[0].iov_base, iov[0].iov_len);
+    }
 
-    return nc->info->receive(nc, buffer, offset);
+    /* don't truncate jumbo or GSO frames */
+    size = iov_size(iov, iovcnt);
+    if (size > sizeof(buffer)) {
+        buf = g_malloc(size);
+    }
+    offset = iov_to_buf(iov, iovcnt, 0, buf, size);
+    ret = nc->info->receive(nc, buf, offset);
+    if (buf != buffer) {
+        g_free(buf);
+    }
+    return ret;
 }
 
 ssize_t qemu_deliver_packet_iov(NetClientState *sender,
@@ -438,6 +603,9 @@ ssize_t qemu_deliver_packet_iov(NetClientState *sender,
 
     if (ret == 0) {
         nc->receive_disabled = 1;
+    } else if (ret > 0) {
+        nc->rx_packets++;
+        nc->rx_bytes += ret;
     }
 
     return ret;
@@ -453,6 +621,9 @@ ssize_t qemu_sendv_packet_async(NetClientState *sender,
         return iov_size(iov, iovcnt);
     }
 
+    sender->tx_packets++;
+    sender->tx_bytes += iov_size(iov, iovcnt);
+
     queue = sender->peer->send_queue;
 
     return qemu_net_queue_send_iov(queue, sender,
@@ -466,6 +637,29 @@ qemu_sendv_packet(NetClientState *nc, const struct iovec *iov, int iovcnt)
     return qemu_sendv_packet_async(nc, iov, iovcnt, NULL);
 }
 
+/* Send the same packet from several clients without copying it for each
+ * peer that has to queue it; see qemu_net_queue_send_shared().  *buffer
+ * must start out NULL and be released by the caller once all clients have
+ * been sent to.
+ */
+ssize_t qemu_sendv_packet_shared(NetClientState *sender,
+                                 const struct iovec *iov, int iovcnt,
+                                 NetBuffer **buffer)
+{
+    size_t size = iov_size(iov, iovcnt);
+
+    if (sender->link_down || !sender->peer) {
+        return size;
+    }
+
+    sender->tx_packets++;
+    sender->tx_bytes += size;
+
+    return qemu_net_queue_send_shared(sender->peer->send_queue, sender,
+                                      QEMU_NET_PACKET_FLAG_NONE,
+                                      iov, iovcnt, buffer, NULL);
+}
+
 NetClientState *qemu_find_netdev(const char *id)
 {
     NetClientState *nc;
@@ -481,6 +675,27 @@ NetClientState *qemu_find_netdev(const char *id)
     return NULL;
 }
 
+/* Collect up to max clients named id whose type is not type, in creation
+ * order.  This finds all queues of a multiqueue netdev or NIC.
+ */
+int qemu_find_net_clients_except(const char *id, NetClientState **ncs,
+                                 NetClientOptionsKind type, int max)
+{
+    NetClientState *nc;
+    int ret = 0;
+
+    QTAILQ_FOREACH(nc, &net_clients, next) {
+        if (nc->info->type == type) {
+            continue;
+        }
+        if (!strcmp(nc->name, id) && ret < max) {
+            ncs[ret++] = nc;
+        }
+    }
+
+    return ret;
+}
+
 static int nic_get_free_idx(void)
 {
     int index;
@@ -617,6 +832,9 @@ static int (* const net_client_init_fun[NET_CLIENT_OPTIONS_KIND_MAX])(
         [NET_CLIENT_OPTIONS_KIND_BRIDGE]    = net_init_bridge,
 #endif
         [NET_CLIENT_OPTIONS_KIND_HUBPORT]   = net_init_hubport,
+#ifdef CONFIG_LINUX
+        [NET_CLIENT_OPTIONS_KIND_VHOST_USER] = net_init_vhost_user,
+#endif
 };
 
 
@@ -647,6 +865,9 @@ static int net_client_init1(const void *object, int is_netdev, Error **errp)
         case NET_CLIENT_OPTIONS_KIND_BRIDGE:
 #endif
         case NET_CLIENT_OPTIONS_KIND_HUBPORT:
+#ifdef CONFIG_LINUX
+        case NET_CLIENT_OPTIONS_KIND_VHOST_USER:
+#endif
             break;
 
         default:
@@ -669,7 +890,18 @@ static int net_client_init1(const void *object, int is_netdev, Error **errp)
         if (!is_netdev &&
             (opts->kind != NET_CLIENT_OPTIONS_KIND_NIC ||
              !opts->nic->has_netdev)) {
-            peer = net_hub_add_port(u.net->has_vlan ? u.net->vlan : 0, NULL);
+            int vlan = u.net->has_vlan ? u.net->vlan : 0;
+
+            if (u.net->has_learning &&
+                net_hub_set_learning(vlan, u.net->learning) < 0) {
+                error_set(errp, QERR_INVALID_PARAMETER_VALUE, "learning",
+                          "a setting matching the rest of the vlan");
+                return -1;
+            }
+            peer = net_hub_add_port(vlan, NULL);
+        } else if (!is_netdev && u.net->has_learning) {
+            error_set(errp, QERR_INVALID_PARAMETER, "learning");
+            return -1;
         }
 
         if (net_client_init_fun[opts->kind](opts, name, peer) < 0) {
@@ -847,8 +1079,13 @@ void qmp_netdev_del(const char *id, Error **errp)
 
 void print_net_client(Monitor *mon, NetClientState *nc)
 {
-    monitor_printf(mon, "%s: type=%s,%s\n", nc->name,
+    monitor_printf(mon, "%s: index=%u,type=%s,%s\n", nc->name,
+                   nc->queue_index,
                    NetClientOptionsKind_lookup[nc->info->type], nc->info_str);
+    monitor_printf(mon, "    rx: packets=%" PRIu64 " bytes=%" PRIu64
+                   " tx: packets=%" PRIu64 " bytes=%" PRIu64 "\n",
+                   nc->rx_packets, nc->rx_bytes,
+                   nc->tx_packets, nc->tx_bytes);
 }
 
 void do_info_network(Monitor *mon)
@@ -879,20 +1116,25 @@ void do_info_network(Monitor *mon)
 
 void qmp_set_link(const char *name, bool up, Error **errp)
 {
-    NetClientState *nc = NULL;
+    NetClientState *ncs[MAX_QUEUE_NUM];
+    NetClientState *nc;
+    int queues, i;
 
-    QTAILQ_FOREACH(nc, &net_clients, next) {
-        if (!strcmp(nc->name, name)) {
-            goto done;
-        }
-    }
-done:
-    if (!nc) {
+    queues = qemu_find_net_clients_except(name, ncs,
+                                          NET_CLIENT_OPTIONS_KIND_MAX,
+                                          MAX_QUEUE_NUM);
+    if (queues == 0) {
         error_set(errp, QERR_DEVICE_NOT_FOUND, name);
         return;
     }
+    nc = ncs[0];
 
-    nc->link_down = !up;
+    /* All queues of a multiqueue client share its link state. */
+    for (i = 0; i < queues; i++) {
+        if (ncs[i]->info == nc->info) {
+            ncs[i]->link_down = !up;
+        }
+    }
 
     if (nc->info->link_status_changed) {
         nc->info->link_status_changed(nc);
@@ -912,10 +1154,11 @@ done:
 
 void net_cleanup(void)
 {
-    NetClientState *nc, *next_vc;
-
-    QTAILQ_FOREACH_SAFE(nc, &net_clients, next, next_vc) {
-        qemu_del_net_client(nc);
+    /* qemu_del_net_client() may remove several queues at once, so not even
+     * QTAILQ_FOREACH_SAFE is safe here.
+     */
+    while (!QTAILQ_EMPTY(&net_clients)) {
+        qemu_del_net_client(QTAILQ_FIRST(&net_clients));
     }
 }
 
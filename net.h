@@ -13,6 +13,8 @@ struct MACAddr {
     uint8_t a[6];
 };
 
+#define MAX_QUEUE_NUM 16
+
 /* qdev nic properties */
 
 typedef struct NICConf {
@@ -35,6 +37,7 @@ typedef ssize_t (NetReceive)(NetClientState *, const uint8_t *, size_t);
 typedef ssize_t (NetReceiveIOV)(NetClientState *, const struct iovec *, int);
 typedef void (NetCleanup) (NetClientState *);
 typedef void (LinkStatusChanged)(NetClientState *);
+typedef void (NetReceiveBatchEnd)(NetClientState *);
 
 typedef struct NetClientInfo {
     NetClientOptionsKind type;
@@ -46,6 +49,7 @@ typedef struct NetClientInfo {
     NetCleanup *cleanup;
     LinkStatusChanged *link_status_changed;
     NetPoll *poll;
+    NetReceiveBatchEnd *receive_batch_end;
 } NetClientInfo;
 
 struct NetClientState {
@@ -58,16 +62,31 @@ struct NetClientState {
     char *name;
     char info_str[256];
     unsigned receive_disabled : 1;
+    unsigned receiving_batch : 1;
+    unsigned queue_index;
+    uint64_t rx_packets;
+    uint64_t rx_bytes;
+    uint64_t tx_packets;
+    uint64_t tx_bytes;
 };
 
+/* A NIC has one NICState per queue.  All queues share the same info, conf,
+ * opaque and name; queue i is connected to the i-th netdev client carrying
+ * the name of conf->peer (see qemu_find_net_clients_except).  ncs points to
+ * an array of all queues and is shared by them; ncs[0] is the NIC itself.
+ */
 typedef struct NICState {
     NetClientState nc;
     NICConf *conf;
     void *opaque;
     bool peer_deleted;
+    NetClientState **ncs;
+    int queues;
 } NICState;
 
 NetClientState *qemu_find_netdev(const char *id);
+int qemu_find_net_clients_except(const char *id, NetClientState **ncs,
+                                 NetClientOptionsKind type, int max);
 NetClientState *qemu_new_net_client(NetClientInfo *info,
                                     NetClientState *peer,
                                     const char *model,
@@ -77,6 +96,7 @@ NICState *qemu_new_nic(NetClientInfo *info,
                        const char *model,
                        const char *name,
                        void *opaque);
+NetClientState *qemu_get_subqueue(NICState *nic, int queue_index);
 void qemu_del_net_client(NetClientState *nc);
 NetClientState *qemu_find_vlan_client_by_name(Monitor *mon, int vlan_id,
                                               const char *client_str);
@@ -87,10 +107,16 @@ ssize_t qemu_sendv_packet(NetClientState *nc, const struct iovec *iov,
                           int iovcnt);
 ssize_t qemu_sendv_packet_async(NetClientState *nc, const struct iovec *iov,
                                 int iovcnt, NetPacketSent *sent_cb);
+ssize_t qemu_sendv_packet_shared(NetClientState *nc, const struct iovec *iov,
+                                 int iovcnt, NetBuffer **buffer);
 void qemu_send_packet(NetClientState *nc, const uint8_t *buf, int size);
 ssize_t qemu_send_packet_raw(NetClientState *nc, const uint8_t *buf, int size);
 ssize_t qemu_send_packet_async(NetClientState *nc, const uint8_t *buf,
                                int size, NetPacketSent *sent_cb);
+int qemu_send_packets_async(NetClientState *nc, const struct iovec *pkts,
+                            int count, NetPacketSent *sent_cb);
+unsigned qemu_net_batch_begin(NetClientState *nc);
+void qemu_net_batch_end(NetClientState *nc, unsigned batching);
 void qemu_purge_queued_packets(NetClientState *nc);
 void qemu_flush_queued_packets(NetClientState *nc);
 void qemu_format_nic_info_str(NetClientState *nc, uint8_t macaddr[6]);
@@ -27,13 +27,37 @@
 #include "qemu-error.h"
 #include "qemu-log.h"
 #include "qemu-timer.h"
+#include "qemu-thread.h"
+#include "qemu-barrier.h"
 #include "hub.h"
 
+/* Packets are formatted into pcap records in a ring buffer from the main
+ * loop and written out by a separate thread, so a slow disk never stalls
+ * device emulation.  If the writer falls behind and the ring fills up,
+ * packets are dropped and counted instead.
+ */
+#define DUMP_RING_SIZE (4 * 1024 * 1024)
+
 typedef struct DumpState {
     NetClientState nc;
     int64_t start_ts;
     int fd;
     int pcap_caplen;
+    char *filename;
+    uint64_t rotate_size;
+    uint64_t file_size;
+    uint64_t dropped;
+    bool stopped;
+
+    /* Single producer (dump_receive), single consumer (dump_writer) */
+    uint8_t *ring;
+    uint32_t ring_head;
+    uint32_t ring_tail;
+    bool writer_idle;
+    bool writer_exit;
+    bool write_error;
+    QemuSemaphore writer_sem;
+    QemuThread writer;
 } DumpState;
 
 #define PCAP_MAGIC 0xa1b2c3d4
@@ -57,15 +81,77 @@ struct pcap_sf_pkthdr {
     uint32_t len;
 };
 
+static int dump_write_file_hdr(int fd, int snaplen)
+{
+    struct pcap_file_hdr hdr;
+
+    hdr.magic = PCAP_MAGIC;
+    hdr.version_major = 2;
+    hdr.version_minor = 4;
+    hdr.thiszone = 0;
+    hdr.sigfigs = 0;
+    hdr.snaplen = snaplen;
+    hdr.linktype = 1;
+
+    if (qemu_write_full(fd, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+        return -1;
+    }
+    return 0;
+}
+
+static void dump_ring_write(DumpState *s, uint32_t pos,
+                            const void *buf, size_t len)
+{
+    size_t offset = pos & (DUMP_RING_SIZE - 1);
+    size_t chunk = MIN(len, DUMP_RING_SIZE - offset);
+
+    memcpy(s->ring + offset, buf, chunk);
+    memcpy(s->ring, (const uint8_t *)buf + chunk, len - chunk);
+}
+
+static void dump_ring_read(DumpState *s, uint32_t pos, void *buf, size_t len)
+{
+    size_t offset = pos & (DUMP_RING_SIZE - 1);
+    size_t chunk = MIN(len, DUMP_RING_SIZE - offset);
+
+    memcpy(buf, s->ring + offset, chunk);
+    memcpy((uint8_t *)buf + chunk, s->ring, len - chunk);
+}
+
+static void dump_update_info_str(DumpState *s)
+{
+    int n;
+
+    n = snprintf(s->nc.info_str, sizeof(s->nc.info_str),
+                 "dump to %s (len=%d", s->filename, s->pcap_caplen);
+    if (s->rotate_size && n < sizeof(s->nc.info_str)) {
+        n += snprintf(s->nc.info_str + n, sizeof(s->nc.info_str) - n,
+                      ",rotate=%" PRIu64, s->rotate_size);
+    }
+    if (s->dropped && n < sizeof(s->nc.info_str)) {
+        n += snprintf(s->nc.info_str + n, sizeof(s->nc.info_str) - n,
+                      ",dropped=%" PRIu64, s->dropped);
+    }
+    if (n < sizeof(s->nc.info_str)) {
+        snprintf(s->nc.info_str + n, sizeof(s->nc.info_str) - n, ")");
+    }
+}
+
 static ssize_t dump_receive(NetClientState *nc, const uint8_t *buf, size_t size)
 {
     DumpState *s = DO_UPCAST(DumpState, nc, nc);
     struct pcap_sf_pkthdr hdr;
+    uint32_t head, tail;
     int64_t ts;
     int caplen;
 
     /* Early return in case of previous error. */
-    if (s->fd < 0) {
+    if (s->stopped) {
+        return size;
+    }
+    if (s->write_error) {
+        qemu_log("-net dump write error - stop dump\n");
+        s->stopped = true;
         return size;
     }
 
@@ -76,21 +162,151 @@ static ssize_t dump_receive(NetClientState *nc, const uint8_t *buf, size_t size)
     hdr.ts.tv_usec = ts % 1000000;
     hdr.caplen = caplen;
     hdr.len = size;
-    if (write(s->fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
-        write(s->fd, buf, caplen) != caplen) {
-        qemu_log("-net dump write error - stop dump\n");
-        close(s->fd);
-        s->fd = -1;
+
+    /* Order the read of ring_head before overwriting the space it frees */
+    head = s->ring_head;
+    smp_mb();
+    tail = s->ring_tail;
+    if (DUMP_RING_SIZE - (tail - head) < sizeof(hdr) + caplen) {
+        s->dropped++;
+        dump_update_info_str(s);
+        return size;
+    }
+
+    dump_ring_write(s, tail, &hdr, sizeof(hdr));
+    dump_ring_write(s, tail + sizeof(hdr), buf, caplen);
+    smp_wmb();
+    s->ring_tail = tail + sizeof(hdr) + caplen;
+
+    /* Pairs with the barrier in dump_writer() before it goes to sleep */
+    smp_mb();
+    if (s->writer_idle) {
+        s->writer_idle = false;
+        qemu_sem_post(&s->writer_sem);
     }
 
     return size;
 }
 
+/* Move the current file to <file>.1 and start a new one */
+static int dump_rotate(DumpState *s)
+{
+    char *old;
+    int ret = 0;
+
+    close(s->fd);
+    s->fd = -1;
+
+    old = g_strdup_printf("%s.1", s->filename);
+    unlink(old);
+    if (rename(s->filename, old) < 0) {
+        ret = -1;
+    }
+    g_free(old);
+    if (ret < 0) {
+        return ret;
+    }
+
+    s->fd = open(s->filename, O_CREAT | O_TRUNC | O_WRONLY | O_BINARY, 0644);
+    if (s->fd < 0 || dump_write_file_hdr(s->fd, s->pcap_caplen) < 0) {
+        return -1;
+    }
+    s->file_size = sizeof(struct pcap_file_hdr);
+    return 0;
+}
+
+/* Write out the records between head and tail, splitting them across files
+ * if the capture is rotated.  Returns the new head.
+ */
+static uint32_t dump_write_records(DumpState *s, uint32_t head, uint32_t tail)
+{
+    struct pcap_sf_pkthdr hdr;
+    uint32_t end = head, offset, len;
+
+    while (end != tail) {
+        dump_ring_read(s, end, &hdr, sizeof(hdr));
+        len = sizeof(hdr) + hdr.caplen;
+        if (s->rotate_size &&
+            s->file_size + (end - head) + len > s->rotate_size &&
+            s->file_size + (end - head) > sizeof(struct pcap_file_hdr)) {
+            break;
+        }
+        end += len;
+    }
+
+    offset = head & (DUMP_RING_SIZE - 1);
+    len = MIN(end - head, DUMP_RING_SIZE - offset);
+    if (qemu_write_full(s->fd, s->ring + offset, len) != len ||
+        qemu_write_full(s->fd, s->ring, end - head - len) != end - head - len) {
+        s->write_error = true;
+        return tail;
+    }
+    s->file_size += end - head;
+
+    if (end != tail && dump_rotate(s) < 0) {
+        s->write_error = true;
+        return tail;
+    }
+    return end;
+}
+
+static void *dump_writer(void *opaque)
+{
+    DumpState *s = opaque;
+    uint32_t head, tail;
+
+    for (;;) {
+        head = s->ring_head;
+        tail = s->ring_tail;
+        smp_rmb();
+
+        if (head == tail) {
+            if (s->writer_exit) {
+                break;
+            }
+            s->writer_idle = true;
+            smp_mb();
+            if (s->ring_tail == head && !s->writer_exit) {
+                qemu_sem_wait(&s->writer_sem);
+            }
+            s->writer_idle = false;
+            continue;
+        }
+
+        if (!s->write_error) {
+            head = dump_write_records(s, head, tail);
+        } else {
+            head = tail;
+        }
+
+        /* Finish reading the records before handing the space back */
+        smp_mb();
+        s->ring_head = head;
+    }
+
+    return NULL;
+}
+
 static void dump_cleanup(NetClientState *nc)
 {
     DumpState *s = DO_UPCAST(DumpState, nc, nc);
 
-    close(s->fd);
+    s->writer_exit = true;
+    smp_mb();
+    qemu_sem_post(&s->writer_sem);
+    qemu_thread_join(&s->writer);
+    qemu_sem_destroy(&s->writer_sem);
+
+    if (s->dropped) {
+        error_report("-net dump: %" PRIu64 " packets dropped from %s",
+                     s->dropped, s->filename);
+    }
+
+    if (s->fd >= 0) {
+        close(s->fd);
+    }
+    g_free(s->ring);
+    g_free(s->filename);
 }
 
 static NetClientInfo net_dump_info = {
@@ -101,9 +317,9 @@ static NetClientInfo net_dump_info = {
 };
 
 static int net_dump_init(NetClientState *peer, const char *device,
-                         const char *name, const char *filename, int len)
+                         const char *name, const char *filename, int len,
+                         uint64_t rotate_size)
 {
-    struct pcap_file_hdr hdr;
     NetClientState *nc;
     DumpState *s;
     struct tm tm;
@@ -115,15 +331,7 @@ static int net_dump_init(NetClientState *peer, const char *device,
         return -1;
     }
 
-    hdr.magic = PCAP_MAGIC;
-    hdr.version_major = 2;
-    hdr.version_minor = 4;
-    hdr.thiszone = 0;
-    hdr.sigfigs = 0;
-    hdr.snaplen = len;
-    hdr.linktype = 1;
-
-    if (write(fd, &hdr, sizeof(hdr)) < sizeof(hdr)) {
+    if (dump_write_file_hdr(fd, len) < 0) {
         error_report("-net dump write error: %s", strerror(errno));
         close(fd);
         return -1;
@@ -131,17 +339,23 @@ static int net_dump_init(NetClientState *peer, const char *device,
 
     nc = qemu_new_net_client(&net_dump_info, peer, device, name);
 
-    snprintf(nc->info_str, sizeof(nc->info_str),
-             "dump to %s (len=%d)", filename, len);
-
     s = DO_UPCAST(DumpState, nc, nc);
 
     s->fd = fd;
     s->pcap_caplen = len;
+    s->filename = g_strdup(filename);
+    s->rotate_size = rotate_size;
+    s->file_size = sizeof(struct pcap_file_hdr);
+
+    dump_update_info_str(s);
 
     qemu_get_timedate(&tm, 0);
     s->start_ts = mktime(&tm);
 
+    s->ring = g_malloc(DUMP_RING_SIZE);
+    qemu_sem_init(&s->writer_sem, 0);
+    qemu_thread_create(&s->writer, dump_writer, s, QEMU_THREAD_JOINABLE);
+
     return 0;
 }
 
@@ -181,5 +395,6 @@ int net_init_dump(const NetClientOptions *opts, const char *name,
         len = 65536;
     }
 
-    return net_dump_init(peer, "dump", name, file, len);
+    return net_dump_init(peer, "dump", name, file, len,
+                         dump->has_rotate ? dump->rotate : 0);
 }
@@ -13,15 +13,24 @@
  */
 
 #include "monitor.h"
+#include "qemu-error.h"
 #include "net.h"
 #include "clients.h"
 #include "hub.h"
+#include "mactable.h"
 #include "iov.h"
+#include "qemu-timer.h"
 
 /*
  * A hub broadcasts incoming packets to all its ports except the source port.
  * Hubs can be used to provide independent network segments, also confusingly
  * named the QEMU 'vlan' feature.
+ *
+ * In learning mode the hub remembers which port each source MAC address was
+ * seen on and forwards unicast frames for a known address to that port only,
+ * like a switch.  Ports peered with a dump client still see every frame.
+ * Learning is a property of the whole hub; any client on the hub may set it,
+ * but all clients that do have to agree.
  */
 
 typedef struct NetHub NetHub;
@@ -31,6 +40,8 @@ typedef struct NetHubPort {
     QLIST_ENTRY(NetHubPort) next;
     NetHub *hub;
     int id;
+    bool batching;              /* peer is in a batch started by the hub */
+    unsigned batch_saved;
 } NetHubPort;
 
 struct NetHub {
@@ -38,41 +49,84 @@ struct NetHub {
     QLIST_ENTRY(NetHub) next;
     int num_ports;
     QLIST_HEAD(, NetHubPort) ports;
+    bool learning;
+    bool learning_set;          /* learning was given explicitly */
+    MACTable *mac_table;
 };
 
 static QLIST_HEAD(, NetHub) hubs = QLIST_HEAD_INITIALIZER(&hubs);
 
-static ssize_t net_hub_receive(NetHub *hub, NetHubPort *source_port,
-                               const uint8_t *buf, size_t len)
+/* Record the source address of a frame and return the port its destination
+ * was learned on, or NULL if it has to be flooded.
+ */
+static NetHubPort *net_hub_learn(NetHub *hub, NetHubPort *source_port,
+                                 const struct iovec *iov, int iovcnt)
 {
-    NetHubPort *port;
+    uint8_t hdr[12];
+    int64_t now;
 
-    QLIST_FOREACH(port, &hub->ports, next) {
-        if (port == source_port) {
-            continue;
-        }
-
-        qemu_send_packet(&port->nc, buf, len);
+    if (iov_to_buf(iov, iovcnt, 0, hdr, sizeof(hdr)) < sizeof(hdr)) {
+        return NULL;
     }
-    return len;
+
+    now = qemu_get_clock_ms(rt_clock);
+    mac_table_learn(hub->mac_table, hdr + 6, source_port, now);
+    return mac_table_lookup(hub->mac_table, hdr, now);
+}
+
+static bool net_hub_port_is_mirror(NetHubPort *port)
+{
+    return port->nc.peer &&
+           port->nc.peer->info->type == NET_CLIENT_OPTIONS_KIND_DUMP;
 }
 
+/* Packets that end up queued by several peers share one NetBuffer instead of
+ * being copied into each queue.
+ */
 static ssize_t net_hub_receive_iov(NetHub *hub, NetHubPort *source_port,
                                    const struct iovec *iov, int iovcnt)
 {
-    NetHubPort *port;
+    NetHubPort *port, *dest = NULL;
+    NetBuffer *buffer = NULL;
     ssize_t len = iov_size(iov, iovcnt);
 
+    if (hub->learning) {
+        dest = net_hub_learn(hub, source_port, iov, iovcnt);
+    }
+
     QLIST_FOREACH(port, &hub->ports, next) {
         if (port == source_port) {
             continue;
         }
+        if (dest && port != dest && !net_hub_port_is_mirror(port)) {
+            continue;
+        }
 
-        qemu_sendv_packet(&port->nc, iov, iovcnt);
+        /* Extend a batch arriving at the source port to the other peers */
+        if (source_port->nc.receiving_batch && port->nc.peer &&
+            !port->batching) {
+            port->batch_saved = qemu_net_batch_begin(port->nc.peer);
+            port->batching = true;
+        }
+
+        qemu_sendv_packet_shared(&port->nc, iov, iovcnt, &buffer);
     }
+
+    qemu_net_buffer_unref(buffer);
     return len;
 }
 
+static ssize_t net_hub_receive(NetHub *hub, NetHubPort *source_port,
+                               const uint8_t *buf, size_t len)
+{
+    struct iovec iov = {
+        .iov_base = (void *)buf,
+        .iov_len = len,
+    };
+
+    return net_hub_receive_iov(hub, source_port, &iov, 1);
+}
+
 static NetHub *net_hub_new(int id)
 {
     NetHub *hub;
@@ -81,12 +135,27 @@ static NetHub *net_hub_new(int id)
     hub->id = id;
     hub->num_ports = 0;
     QLIST_INIT(&hub->ports);
+    hub->learning = false;
+    hub->learning_set = false;
+    hub->mac_table = NULL;
 
     QLIST_INSERT_HEAD(&hubs, hub, next);
 
     return hub;
 }
 
+static NetHub *net_hub_find(int id)
+{
+    NetHub *hub;
+
+    QLIST_FOREACH(hub, &hubs, next) {
+        if (hub->id == id) {
+            return hub;
+        }
+    }
+    return net_hub_new(id);
+}
+
 static int net_hub_port_can_receive(NetClientState *nc)
 {
     NetHubPort *port;
@@ -122,11 +191,29 @@ static ssize_t net_hub_port_receive_iov(NetClientState *nc,
     return net_hub_receive_iov(port->hub, port, iov, iovcnt);
 }
 
+static void net_hub_port_receive_batch_end(NetClientState *nc)
+{
+    NetHubPort *source_port = DO_UPCAST(NetHubPort, nc, nc);
+    NetHubPort *port;
+
+    QLIST_FOREACH(port, &source_port->hub->ports, next) {
+        if (port->batching) {
+            port->batching = false;
+            qemu_net_batch_end(port->nc.peer, port->batch_saved);
+        }
+    }
+}
+
 static void net_hub_port_cleanup(NetClientState *nc)
 {
     NetHubPort *port = DO_UPCAST(NetHubPort, nc, nc);
+    NetHub *hub = port->hub;
 
     QLIST_REMOVE(port, next);
+
+    if (hub->mac_table) {
+        mac_table_forget(hub->mac_table, port);
+    }
 }
 
 static NetClientInfo net_hub_port_info = {
@@ -135,6 +222,7 @@ static NetClientInfo net_hub_port_info = {
     .can_receive = net_hub_port_can_receive,
     .receive = net_hub_port_receive,
     .receive_iov = net_hub_port_receive_iov,
+    .receive_batch_end = net_hub_port_receive_batch_end,
     .cleanup = net_hub_port_cleanup,
 };
 
@@ -169,21 +257,36 @@ static NetHubPort *net_hub_port_new(NetHub *hub, const char *name)
  */
 NetClientState *net_hub_add_port(int hub_id, const char *name)
 {
-    NetHub *hub;
     NetHubPort *port;
 
-    QLIST_FOREACH(hub, &hubs, next) {
-        if (hub->id == hub_id) {
-            break;
-        }
-    }
+    port = net_hub_port_new(net_hub_find(hub_id), name);
+    return &port->nc;
+}
 
-    if (!hub) {
-        hub = net_hub_new(hub_id);
+/**
+ * Switch MAC address learning on or off for a hub
+ *
+ * If there is no existing hub with the given id then a new hub is created.
+ * Returns -EINVAL if @learning conflicts with what another client on the
+ * hub asked for.
+ */
+int net_hub_set_learning(int hub_id, bool learning)
+{
+    NetHub *hub = net_hub_find(hub_id);
+
+    if (hub->learning_set && hub->learning != learning) {
+        error_report("hub %d: learning=%s conflicts with learning=%s given "
+                     "for another client on the hub", hub_id,
+                     learning ? "on" : "off", hub->learning ? "on" : "off");
+        return -EINVAL;
     }
 
-    port = net_hub_port_new(hub, name);
-    return &port->nc;
+    if (learning && !hub->mac_table) {
+        hub->mac_table = g_new0(MACTable, 1);
+    }
+    hub->learning = learning;
+    hub->learning_set = true;
+    return 0;
 }
 
 /**
@@ -243,7 +346,8 @@ void net_hub_info(Monitor *mon)
     NetHubPort *port;
 
     QLIST_FOREACH(hub, &hubs, next) {
-        monitor_printf(mon, "hub %d\n", hub->id);
+        monitor_printf(mon, "hub %d%s\n", hub->id,
+                       hub->learning ? " (learning)" : "");
         QLIST_FOREACH(port, &hub->ports, next) {
             if (port->nc.peer) {
                 monitor_printf(mon, " \\ ");
@@ -290,6 +394,11 @@ int net_init_hubport(const NetClientOptions *opts, const char *name,
         return -EINVAL;
     }
 
+    if (hubport->has_learning &&
+        net_hub_set_learning(hubport->hubid, hubport->learning) < 0) {
+        return -EINVAL;
+    }
+
     net_hub_add_port(hubport->hubid, name);
     return 0;
 }
@@ -18,6 +18,7 @@
 #include "qemu-common.h"
 
 NetClientState *net_hub_add_port(int hub_id, const char *name);
+int net_hub_set_learning(int hub_id, bool learning);
 NetClientState *net_hub_find_client_by_name(int hub_id, const char *name);
 void net_hub_info(Monitor *mon);
 int net_hub_id_for_client(NetClientState *nc, int *id);
@@ -0,0 +1,35 @@
+/*
+ * Hash sets of MAC addresses for NIC receive filters
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "net/macset.h"
+
+void mac_set_clear(MACSet *set)
+{
+    memset(set, 0, sizeof(*set));
+}
+
+/* Returns 0 on success (including when @mac is already present), or
+ * -ENOSPC if the set already holds MAC_SET_MAX addresses.
+ */
+int mac_set_add(MACSet *set, const uint8_t *mac)
+{
+    uint64_t key = mac_set_key(mac);
+    unsigned i;
+
+    for (i = mac_set_hash(key); set->slot[i]; i = (i + 1) % MAC_SET_SIZE) {
+        if (set->slot[i] == key) {
+            return 0;
+        }
+    }
+    if (set->count >= MAC_SET_MAX) {
+        return -ENOSPC;
+    }
+    set->slot[i] = key;
+    set->count++;
+    return 0;
+}
@@ -0,0 +1,67 @@
+/*
+ * Hash sets of MAC addresses for NIC receive filters
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef QEMU_NET_MACSET_H
+#define QEMU_NET_MACSET_H
+
+#include "qemu-common.h"
+
+/*
+ * Device models rebuild a MACSet whenever the guest rewrites its address
+ * filter, so that the receive path can look up a destination address in
+ * constant time instead of walking the filter table for every frame.
+ *
+ * The set is open addressed with linear probing.  Each slot holds the
+ * 48-bit address with MAC_SET_USED or'ed in, or zero when empty.  A set
+ * never fills beyond half of its slots, so a lookup always ends at an
+ * empty slot.
+ */
+#define MAC_SET_BITS    7
+#define MAC_SET_SIZE    (1 << MAC_SET_BITS)
+#define MAC_SET_MAX     (MAC_SET_SIZE / 2)
+#define MAC_SET_USED    (1ULL << 63)
+
+typedef struct MACSet {
+    int count;
+    uint64_t slot[MAC_SET_SIZE];
+} MACSet;
+
+static inline uint64_t mac_set_key(const uint8_t *mac)
+{
+    return MAC_SET_USED |
+           (uint64_t)mac[0] << 40 | (uint64_t)mac[1] << 32 |
+           (uint64_t)mac[2] << 24 | (uint64_t)mac[3] << 16 |
+           (uint64_t)mac[4] << 8 | mac[5];
+}
+
+static inline unsigned mac_set_hash(uint64_t key)
+{
+    return (key * 0x9e3779b97f4a7c15ULL) >> (64 - MAC_SET_BITS);
+}
+
+static inline bool mac_set_contains(const MACSet *set, const uint8_t *mac)
+{
+    uint64_t key;
+    unsigned i;
+
+    if (!set->count) {
+        return false;
+    }
+    key = mac_set_key(mac);
+    for (i = mac_set_hash(key); set->slot[i]; i = (i + 1) % MAC_SET_SIZE) {
+        if (set->slot[i] == key) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void mac_set_clear(MACSet *set);
+int mac_set_add(MACSet *set, const uint8_t *mac);
+
+#endif /* QEMU_NET_MACSET_H */
@@ -0,0 +1,65 @@
+/*
+ * MAC address learning table for hubs
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "net/mactable.h"
+
+static MACTableEntry *mac_table_entry(MACTable *table, const uint8_t *mac)
+{
+    unsigned h = mac[0] ^ mac[1] ^ mac[2] ^ mac[3] ^ mac[4] ^ mac[5];
+
+    return &table->entry[h % MAC_TABLE_SIZE];
+}
+
+/* Record that @mac was seen on @port.  Group addresses are never sources of
+ * valid frames and are not learned.
+ */
+void mac_table_learn(MACTable *table, const uint8_t *mac, void *port,
+                     int64_t now)
+{
+    MACTableEntry *entry;
+
+    if (mac[0] & 1) {
+        return;
+    }
+
+    entry = mac_table_entry(table, mac);
+    memcpy(entry->mac, mac, 6);
+    entry->port = port;
+    entry->seen = now;
+}
+
+/* Returns the port @mac was last seen on, or NULL if it is a group address,
+ * unknown or aged out and frames for it have to be flooded.
+ */
+void *mac_table_lookup(MACTable *table, const uint8_t *mac, int64_t now)
+{
+    MACTableEntry *entry;
+
+    if (mac[0] & 1) {
+        return NULL;
+    }
+
+    entry = mac_table_entry(table, mac);
+    if (!entry->port || memcmp(entry->mac, mac, 6) != 0 ||
+        now - entry->seen > MAC_TABLE_AGEING_MS) {
+        return NULL;
+    }
+    return entry->port;
+}
+
+/* Drop all addresses learned on @port, which is going away */
+void mac_table_forget(MACTable *table, void *port)
+{
+    int i;
+
+    for (i = 0; i < MAC_TABLE_SIZE; i++) {
+        if (table->entry[i].port == port) {
+            table->entry[i].port = NULL;
+        }
+    }
+}
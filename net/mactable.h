@@ -0,0 +1,42 @@
+/*
+ * MAC address learning table for hubs
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef QEMU_NET_MACTABLE_H
+#define QEMU_NET_MACTABLE_H
+
+#include "qemu-common.h"
+
+/*
+ * A learning hub records the port each unicast source address was last seen
+ * on.  The table is direct mapped: an address that collides with another
+ * one simply replaces it, and the displaced address is flooded again until
+ * it is relearned.  Entries older than MAC_TABLE_AGEING_MS are ignored so
+ * that a guest which moves to another port is not cut off for long.
+ *
+ * Ports are opaque to the table; callers pass in the current time in
+ * milliseconds.
+ */
+#define MAC_TABLE_SIZE          256
+#define MAC_TABLE_AGEING_MS     (300 * 1000)
+
+typedef struct MACTableEntry {
+    uint8_t mac[6];
+    void *port;
+    int64_t seen;
+} MACTableEntry;
+
+typedef struct MACTable {
+    MACTableEntry entry[MAC_TABLE_SIZE];
+} MACTable;
+
+void mac_table_learn(MACTable *table, const uint8_t *mac, void *port,
+                     int64_t now);
+void *mac_table_lookup(MACTable *table, const uint8_t *mac, int64_t now);
+void mac_table_forget(MACTable *table, void *port);
+
+#endif /* QEMU_NET_MACTABLE_H */
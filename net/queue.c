@@ -24,6 +24,7 @@
 #include "net/queue.h"
 #include "qemu-queue.h"
 #include "net.h"
+#include "iov.h"
 
 /* The delivery handler may only return zero if it will call
  * qemu_net_queue_flush() when it determines that it is once again able
@@ -45,9 +46,51 @@ struct NetPacket {
     unsigned flags;
     int size;
     NetPacketSent *sent_cb;
+    NetBuffer *buffer;
+    uint8_t *data;
+    uint8_t payload[0];
+};
+
+/* A packet body that can be queued on several NetQueues at once, e.g. by a
+ * hub fanning out a broadcast, instead of being copied for every queue.
+ */
+struct NetBuffer {
+    int refcnt;
+    size_t size;
     uint8_t data[0];
 };
 
+NetBuffer *qemu_net_buffer_new(const struct iovec *iov, int iovcnt)
+{
+    NetBuffer *buffer;
+    size_t size = iov_size(iov, iovcnt);
+
+    buffer = g_malloc(sizeof(NetBuffer) + size);
+    buffer->refcnt = 1;
+    buffer->size = iov_to_buf(iov, iovcnt, 0, buffer->data, size);
+
+    return buffer;
+}
+
+NetBuffer *qemu_net_buffer_ref(NetBuffer *buffer)
+{
+    buffer->refcnt++;
+    return buffer;
+}
+
+void qemu_net_buffer_unref(NetBuffer *buffer)
+{
+    if (buffer && --buffer->refcnt == 0) {
+        g_free(buffer);
+    }
+}
+
+static void qemu_net_packet_free(NetPacket *packet)
+{
+    qemu_net_buffer_unref(packet->buffer);
+    g_free(packet);
+}
+
 struct NetQueue {
     void *opaque;
 
@@ -77,7 +120,7 @@ void qemu_del_net_queue(NetQueue *queue)
 
     QTAILQ_FOREACH_SAFE(packet, &queue->packets, entry, next) {
         QTAILQ_REMOVE(&queue->packets, packet, entry);
-        g_free(packet);
+        qemu_net_packet_free(packet);
     }
 
     g_free(queue);
@@ -97,6 +140,8 @@ static void qemu_net_queue_append(NetQueue *queue,
     packet->flags = flags;
     packet->size = size;
     packet->sent_cb = sent_cb;
+    packet->buffer = NULL;
+    packet->data = packet->payload;
     memcpy(packet->data, buf, size);
 
     QTAILQ_INSERT_TAIL(&queue->packets, packet, entry);
@@ -122,6 +167,8 @@ static void qemu_net_queue_append_iov(NetQueue *queue,
     packet->sent_cb = sent_cb;
     packet->flags = flags;
     packet->size = 0;
+    packet->buffer = NULL;
+    packet->data = packet->payload;
 
     for (i = 0; i < iovcnt; i++) {
         size_t len = iov[i].iov_len;
@@ -133,6 +180,25 @@ static void qemu_net_queue_append_iov(NetQueue *queue,
     QTAILQ_INSERT_TAIL(&queue->packets, packet, entry);
 }
 
+static void qemu_net_queue_append_buffer(NetQueue *queue,
+                                         NetClientState *sender,
+                                         unsigned flags,
+                                         NetBuffer *buffer,
+                                         NetPacketSent *sent_cb)
+{
+    NetPacket *packet;
+
+    packet = g_malloc(sizeof(NetPacket));
+    packet->sender = sender;
+    packet->flags = flags;
+    packet->size = buffer->size;
+    packet->sent_cb = sent_cb;
+    packet->buffer = qemu_net_buffer_ref(buffer);
+    packet->data = buffer->data;
+
+    QTAILQ_INSERT_TAIL(&queue->packets, packet, entry);
+}
+
 static ssize_t qemu_net_queue_deliver(NetQueue *queue,
                                       NetClientState *sender,
                                       unsigned flags,
@@ -213,6 +279,81 @@ ssize_t qemu_net_queue_send_iov(NetQueue *queue,
     return ret;
 }
 
+/* Like qemu_net_queue_send_iov(), but if the packet has to be queued its
+ * body is kept in *buffer, which is created on first use.  Passing the same
+ * buffer for several queues lets them share a single copy of the packet;
+ * the caller drops its own reference with qemu_net_buffer_unref().
+ */
+ssize_t qemu_net_queue_send_shared(NetQueue *queue,
+                                   NetClientState *sender,
+                                   unsigned flags,
+                                   const struct iovec *iov,
+                                   int iovcnt,
+                                   NetBuffer **buffer,
+                                   NetPacketSent *sent_cb)
+{
+    ssize_t ret;
+
+    if (!queue->delivering && qemu_can_send_packet(sender)) {
+        if (iovcnt == 1) {
+            ret = qemu_net_queue_deliver(queue, sender, flags,
+                                         iov[0].iov_base, iov[0].iov_len);
+        } else {
+            ret = qemu_net_queue_deliver_iov(queue, sender, flags,
+                                             iov, iovcnt);
+        }
+        if (ret != 0) {
+            qemu_net_queue_flush(queue);
+            return ret;
+        }
+    }
+
+    if (!*buffer) {
+        *buffer = qemu_net_buffer_new(iov, iovcnt);
+    }
+    qemu_net_queue_append_buffer(queue, sender, flags, *buffer, sent_cb);
+    return 0;
+}
+
+/* Send count packets, each held in one element of pkts, in order.  Once a
+ * packet cannot be delivered it and all packets after it are queued; only
+ * the last of them carries sent_cb.  Returns the number of packets that did
+ * not have to be queued.
+ */
+int qemu_net_queue_send_batch(NetQueue *queue,
+                              NetClientState *sender,
+                              unsigned flags,
+                              const struct iovec *pkts,
+                              int count,
+                              NetPacketSent *sent_cb)
+{
+    int i, j;
+
+    for (i = 0; i < count; i++) {
+        if (queue->delivering || !qemu_can_send_packet(sender)) {
+            break;
+        }
+
+        if (qemu_net_queue_deliver(queue, sender, flags,
+                                   pkts[i].iov_base, pkts[i].iov_len) == 0) {
+            break;
+        }
+    }
+
+    if (i < count) {
+        for (j = i; j < count; j++) {
+            qemu_net_queue_append(queue, sender, flags,
+                                  pkts[j].iov_base, pkts[j].iov_len,
+                                  j == count - 1 ? sent_cb : NULL);
+        }
+        return i;
+    }
+
+    qemu_net_queue_flush(queue);
+
+    return count;
+}
+
 void qemu_net_queue_purge(NetQueue *queue, NetClientState *from)
 {
     NetPacket *packet, *next;
@@ -220,7 +361,7 @@ void qemu_net_queue_purge(NetQueue *queue, NetClientState *from)
     QTAILQ_FOREACH_SAFE(packet, &queue->packets, entry, next) {
         if (packet->sender == from) {
             QTAILQ_REMOVE(&queue->packets, packet, entry);
-            g_free(packet);
+            qemu_net_packet_free(packet);
         }
     }
 }
@@ -248,7 +389,7 @@ bool qemu_net_queue_flush(NetQueue *queue)
             packet->sent_cb(packet->sender, ret);
         }
 
-        g_free(packet);
+        qemu_net_packet_free(packet);
     }
     return true;
 }
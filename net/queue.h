@@ -28,6 +28,7 @@
 
 typedef struct NetPacket NetPacket;
 typedef struct NetQueue NetQueue;
+typedef struct NetBuffer NetBuffer;
 
 typedef void (NetPacketSent) (NetClientState *sender, ssize_t ret);
 
@@ -36,6 +37,10 @@ typedef void (NetPacketSent) (NetClientState *sender, ssize_t ret);
 
 NetQueue *qemu_new_net_queue(void *opaque);
 
+NetBuffer *qemu_net_buffer_new(const struct iovec *iov, int iovcnt);
+NetBuffer *qemu_net_buffer_ref(NetBuffer *buffer);
+void qemu_net_buffer_unref(NetBuffer *buffer);
+
 void qemu_del_net_queue(NetQueue *queue);
 
 ssize_t qemu_net_queue_send(NetQueue *queue,
@@ -52,6 +57,21 @@ ssize_t qemu_net_queue_send_iov(NetQueue *queue,
                                 int iovcnt,
                                 NetPacketSent *sent_cb);
 
+ssize_t qemu_net_queue_send_shared(NetQueue *queue,
+                                   NetClientState *sender,
+                                   unsigned flags,
+                                   const struct iovec *iov,
+                                   int iovcnt,
+                                   NetBuffer **buffer,
+                                   NetPacketSent *sent_cb);
+
+int qemu_net_queue_send_batch(NetQueue *queue,
+                              NetClientState *sender,
+                              unsigned flags,
+                              const struct iovec *pkts,
+                              int count,
+                              NetPacketSent *sent_cb);
+
 void qemu_net_queue_purge(NetQueue *queue, NetClientState *from);
 bool qemu_net_queue_flush(NetQueue *queue);
 
@@ -33,6 +33,18 @@
 #include "qemu_socket.h"
 #include "iov.h"
 
+/* Received packets are handed to the peer in batches of up to this many */
+#define NET_SOCKET_BATCH 16
+
+/* Largest packet accepted in stream mode, big enough for GSO frames */
+#define NET_SOCKET_MAX_PACKET (64 * 1024)
+
+/* Datagrams are received into NET_SOCKET_BATCH buffers of this size.  In
+ * stream mode the whole pool is used as a single receive buffer.
+ */
+#define NET_SOCKET_BUFSIZE (64 * 1024)
+#define NET_SOCKET_POOL_SIZE (NET_SOCKET_BATCH * NET_SOCKET_BUFSIZE)
+
 typedef struct NetSocketState {
     NetClientState nc;
     int listen_fd;
@@ -41,11 +53,19 @@ typedef struct NetSocketState {
     unsigned int index;
     unsigned int packet_len;
     unsigned int send_index;      /* number of bytes sent (only SOCK_STREAM) */
-    uint8_t buf[4096];
+    uint8_t buf[NET_SOCKET_MAX_PACKET];
+    uint8_t *pool;                /* receive buffers */
     struct sockaddr_in dgram_dst; /* contains inet host and port destination iff connectionless (SOCK_DGRAM) */
     IOHandler *send_fn;           /* differs between SOCK_STREAM/SOCK_DGRAM */
     bool read_poll;               /* waiting to receive data? */
     bool write_poll;              /* waiting to transmit data? */
+#ifdef CONFIG_SENDMMSG
+    /* datagrams collected during a batch, sent with one sendmmsg() */
+    uint8_t *tx_buf;
+    size_t tx_used;
+    int tx_count;
+    struct iovec tx_iov[NET_SOCKET_BATCH];
+#endif
 } NetSocketState;
 
 static void net_socket_accept(void *opaque);
@@ -80,15 +100,50 @@ static void net_socket_write_poll(NetSocketState *s, bool enable)
     net_socket_update_fd_handler(s);
 }
 
+#ifdef CONFIG_SENDMMSG
+static void net_socket_flush_dgram(NetSocketState *s);
+#endif
+
 static void net_socket_writable(void *opaque)
 {
     NetSocketState *s = opaque;
 
     net_socket_write_poll(s, false);
 
+#ifdef CONFIG_SENDMMSG
+    net_socket_flush_dgram(s);
+    if (s->tx_count) {
+        return;
+    }
+#endif
+
     qemu_flush_queued_packets(&s->nc);
 }
 
+static void net_socket_send_completed(NetClientState *nc, ssize_t len)
+{
+    NetSocketState *s = DO_UPCAST(NetSocketState, nc, nc);
+
+    if (s->fd != -1) {
+        net_socket_read_poll(s, true);
+    }
+}
+
+/* Pass received packets on to the peer, and stop reading from the socket
+ * until it has caught up if it could not take all of them.
+ */
+static void net_socket_send_batch(NetSocketState *s,
+                                  const struct iovec *pkts, int count)
+{
+    if (count == 0) {
+        return;
+    }
+    if (qemu_send_packets_async(&s->nc, pkts, count,
+                                net_socket_send_completed) < count) {
+        net_socket_read_poll(s, false);
+    }
+}
+
 static ssize_t net_socket_receive(NetClientState *nc, const uint8_t *buf, size_t size)
 {
     NetSocketState *s = DO_UPCAST(NetSocketState, nc, nc);
@@ -124,11 +179,88 @@ static ssize_t net_socket_receive(NetClientState *nc, const uint8_t *buf, size_t
     return size;
 }
 
+#ifdef CONFIG_SENDMMSG
+/* Send the datagrams collected so far.  Whatever cannot be sent yet stays
+ * queued until the socket becomes writable again.
+ */
+static void net_socket_flush_dgram(NetSocketState *s)
+{
+    struct mmsghdr msgs[NET_SOCKET_BATCH];
+    int i, ret, sent = 0;
+
+    for (i = 0; i < s->tx_count; i++) {
+        msgs[i].msg_hdr = (struct msghdr) {
+            .msg_name    = &s->dgram_dst,
+            .msg_namelen = sizeof(s->dgram_dst),
+            .msg_iov     = &s->tx_iov[i],
+            .msg_iovlen  = 1,
+        };
+    }
+
+    while (sent < s->tx_count) {
+        ret = sendmmsg(s->fd, msgs + sent, s->tx_count - sent, 0);
+        if (ret == -1 && errno == EINTR) {
+            continue;
+        }
+        if (ret == -1 && errno == EAGAIN) {
+            net_socket_write_poll(s, true);
+            break;
+        }
+        if (ret == -1) {
+            /* drop the datagram that failed, like sendto() would */
+            ret = 1;
+        }
+        sent += ret;
+    }
+
+    if (sent == s->tx_count) {
+        s->tx_count = 0;
+        s->tx_used = 0;
+    } else if (sent) {
+        memmove(s->tx_iov, s->tx_iov + sent,
+                (s->tx_count - sent) * sizeof(s->tx_iov[0]));
+        s->tx_count -= sent;
+    }
+}
+
+static void net_socket_receive_batch_end(NetClientState *nc)
+{
+    NetSocketState *s = DO_UPCAST(NetSocketState, nc, nc);
+
+    if (s->tx_count && !s->write_poll) {
+        net_socket_flush_dgram(s);
+    }
+}
+#endif
+
 static ssize_t net_socket_receive_dgram(NetClientState *nc, const uint8_t *buf, size_t size)
 {
     NetSocketState *s = DO_UPCAST(NetSocketState, nc, nc);
     ssize_t ret;
 
+#ifdef CONFIG_SENDMMSG
+    if (s->tx_count &&
+        (!nc->receiving_batch || s->tx_count == NET_SOCKET_BATCH ||
+         s->tx_used + size > NET_SOCKET_BUFSIZE)) {
+        if (s->write_poll) {
+            return 0;
+        }
+        net_socket_flush_dgram(s);
+        if (s->tx_count) {
+            return 0;
+        }
+    }
+
+    if (nc->receiving_batch && size <= NET_SOCKET_BUFSIZE) {
+        memcpy(s->tx_buf + s->tx_used, buf, size);
+        s->tx_iov[s->tx_count].iov_base = s->tx_buf + s->tx_used;
+        s->tx_iov[s->tx_count].iov_len = size;
+        s->tx_used += size;
+        s->tx_count++;
+        return size;
+    }
+#endif
+
     do {
         ret = qemu_sendto(s->fd, buf, size, 0,
                           (struct sockaddr *)&s->dgram_dst,
@@ -145,12 +277,13 @@ static ssize_t net_socket_receive_dgram(NetClientState *nc, const uint8_t *buf,
 static void net_socket_send(void *opaque)
 {
     NetSocketState *s = opaque;
-    int size, err;
+    struct iovec pkts[NET_SOCKET_BATCH];
+    int size, err, count = 0;
     unsigned l;
-    uint8_t buf1[4096];
+    uint32_t len;
     const uint8_t *buf;
 
-    size = qemu_recv(s->fd, buf1, sizeof(buf1), 0);
+    size = qemu_recv(s->fd, s->pool, NET_SOCKET_POOL_SIZE, 0);
     if (size < 0) {
         err = socket_error();
         if (err != EWOULDBLOCK)
@@ -175,8 +308,25 @@ static void net_socket_send(void *opaque)
 
         return;
     }
-    buf = buf1;
+    buf = s->pool;
     while (size > 0) {
+        /* packets that arrived in one piece are passed on without copying */
+        if (s->state == 0 && s->index == 0 && size >= 4) {
+            memcpy(&len, buf, 4);
+            len = ntohl(len);
+            if (len <= size - 4 && len <= NET_SOCKET_MAX_PACKET) {
+                pkts[count].iov_base = (void *)(buf + 4);
+                pkts[count].iov_len = len;
+                buf += 4 + len;
+                size -= 4 + len;
+                if (++count == NET_SOCKET_BATCH) {
+                    net_socket_send_batch(s, pkts, count);
+                    count = 0;
+                }
+                continue;
+            }
+        }
+
         /* reassemble a packet from the network */
         switch(s->state) {
         case 0:
@@ -211,6 +361,8 @@ static void net_socket_send(void *opaque)
             buf += l;
             size -= l;
             if (s->index >= s->packet_len) {
+                net_socket_send_batch(s, pkts, count);
+                count = 0;
                 qemu_send_packet(&s->nc, s->buf, s->packet_len);
                 s->index = 0;
                 s->state = 0;
@@ -218,23 +370,61 @@ static void net_socket_send(void *opaque)
             break;
         }
     }
+    net_socket_send_batch(s, pkts, count);
 }
 
 static void net_socket_send_dgram(void *opaque)
 {
     NetSocketState *s = opaque;
-    int size;
-
-    size = qemu_recv(s->fd, s->buf, sizeof(s->buf), 0);
-    if (size < 0)
+    struct iovec pkts[NET_SOCKET_BATCH];
+    bool eoc = false;
+    int count;
+#ifdef CONFIG_SENDMMSG
+    struct mmsghdr msgs[NET_SOCKET_BATCH];
+    int i, ret;
+
+    for (i = 0; i < NET_SOCKET_BATCH; i++) {
+        pkts[i].iov_base = s->pool + i * NET_SOCKET_BUFSIZE;
+        pkts[i].iov_len = NET_SOCKET_BUFSIZE;
+        msgs[i].msg_hdr = (struct msghdr) {
+            .msg_iov    = &pkts[i],
+            .msg_iovlen = 1,
+        };
+    }
+
+    ret = recvmmsg(s->fd, msgs, NET_SOCKET_BATCH, 0, NULL);
+    if (ret < 0) {
         return;
-    if (size == 0) {
+    }
+    for (count = 0; count < ret; count++) {
+        if (msgs[count].msg_len == 0) {
+            eoc = true;
+            break;
+        }
+        pkts[count].iov_len = msgs[count].msg_len;
+    }
+#else
+    for (count = 0; count < NET_SOCKET_BATCH; count++) {
+        int size;
+
+        size = qemu_recv(s->fd, s->pool + count * NET_SOCKET_BUFSIZE,
+                         NET_SOCKET_BUFSIZE, 0);
+        if (size <= 0) {
+            eoc = size == 0;
+            break;
+        }
+        pkts[count].iov_base = s->pool + count * NET_SOCKET_BUFSIZE;
+        pkts[count].iov_len = size;
+    }
+#endif
+
+    net_socket_send_batch(s, pkts, count);
+
+    if (eoc) {
         /* end of connection */
         net_socket_read_poll(s, false);
         net_socket_write_poll(s, false);
-        return;
     }
-    qemu_send_packet(&s->nc, s->buf, size);
 }
 
 static int net_socket_mcast_create(struct sockaddr_in *mcastaddr, struct in_addr *localaddr)
@@ -321,6 +511,11 @@ fail:
 static void net_socket_cleanup(NetClientState *nc)
 {
     NetSocketState *s = DO_UPCAST(NetSocketState, nc, nc);
+
+    g_free(s->pool);
+#ifdef CONFIG_SENDMMSG
+    g_free(s->tx_buf);
+#endif
     if (s->fd != -1) {
         net_socket_read_poll(s, false);
         net_socket_write_poll(s, false);
@@ -338,6 +533,9 @@ static NetClientInfo net_dgram_socket_info = {
     .type = NET_CLIENT_OPTIONS_KIND_SOCKET,
     .size = sizeof(NetSocketState),
     .receive = net_socket_receive_dgram,
+#ifdef CONFIG_SENDMMSG
+    .receive_batch_end = net_socket_receive_batch_end,
+#endif
     .cleanup = net_socket_cleanup,
 };
 
@@ -383,6 +581,9 @@ static NetSocketState *net_socket_fd_init_dgram(NetClientState *peer,
         }
     }
 
+    /* net_socket_send_dgram() reads until the socket is drained */
+    socket_set_nonblock(fd);
+
     nc = qemu_new_net_client(&net_dgram_socket_info, peer, model, name);
 
     snprintf(nc->info_str, sizeof(nc->info_str),
@@ -395,6 +596,10 @@ static NetSocketState *net_socket_fd_init_dgram(NetClientState *peer,
     s->fd = fd;
     s->listen_fd = -1;
     s->send_fn = net_socket_send_dgram;
+    s->pool = g_malloc(NET_SOCKET_POOL_SIZE);
+#ifdef CONFIG_SENDMMSG
+    s->tx_buf = g_malloc(NET_SOCKET_BUFSIZE);
+#endif
     net_socket_read_poll(s, true);
 
     /* mcast: save bound address as dst */
@@ -412,6 +617,10 @@ err:
 static void net_socket_connect(void *opaque)
 {
     NetSocketState *s = opaque;
+
+    if (!s->pool) {
+        s->pool = g_malloc(NET_SOCKET_POOL_SIZE);
+    }
     s->send_fn = net_socket_send;
     net_socket_read_poll(s, true);
 }
@@ -33,8 +33,14 @@
 #include <net/if_tap.h>
 #endif
 
-int tap_open(char *ifname, int ifname_size, int *vnet_hdr, int vnet_hdr_required)
+int tap_open(char *ifname, int ifname_size, int *vnet_hdr,
+             int vnet_hdr_required, int mq_required)
 {
+    if (mq_required) {
+        error_report("multiqueue tap is not supported on BSD");
+        return -1;
+    }
+
     int fd;
 #ifdef TAPGIFNAME
     struct ifreq ifr;
@@ -145,3 +151,13 @@ void tap_fd_set_offload(int fd, int csum, int tso4,
                         int tso6, int ecn, int ufo)
 {
 }
+
+int tap_fd_enable(int fd)
+{
+    return -1;
+}
+
+int tap_fd_disable(int fd)
+{
+    return -1;
+}
@@ -0,0 +1,112 @@
+/*
+ * vhost-user network backend
+ *
+ * Copyright (c) 2013 QEMU contributors
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "clients.h"
+#include "net/vhost-user.h"
+#include "hw/vhost_net.h"
+#include "qemu-common.h"
+#include "qemu-error.h"
+#include "qerror.h"
+#include "qemu_socket.h"
+
+/* The guest's rings are processed by another process, which is handed
+ * guest memory and the virtqueue eventfds over a unix socket.  QEMU only
+ * sets the rings up and tears them down; no packet ever goes through this
+ * client.
+ */
+typedef struct VhostUserState {
+    NetClientState nc;
+    int fd;
+    VHostNetState *vhost_net;
+} VhostUserState;
+
+VHostNetState *vhost_user_get_vhost_net(NetClientState *nc)
+{
+    VhostUserState *s = DO_UPCAST(VhostUserState, nc, nc);
+    assert(nc->info->type == NET_CLIENT_OPTIONS_KIND_VHOST_USER);
+    return s->vhost_net;
+}
+
+static ssize_t vhost_user_receive(NetClientState *nc, const uint8_t *buf,
+                                  size_t size)
+{
+    /* Packets sent by QEMU itself, e.g. before the guest driver is up,
+     * have nowhere to go.  */
+    return size;
+}
+
+static void vhost_user_cleanup(NetClientState *nc)
+{
+    VhostUserState *s = DO_UPCAST(VhostUserState, nc, nc);
+
+    if (s->vhost_net) {
+        vhost_net_cleanup(s->vhost_net);
+        s->vhost_net = NULL;
+    }
+    if (s->fd >= 0) {
+        closesocket(s->fd);
+        s->fd = -1;
+    }
+}
+
+static NetClientInfo net_vhost_user_info = {
+    .type = NET_CLIENT_OPTIONS_KIND_VHOST_USER,
+    .size = sizeof(VhostUserState),
+    .receive = vhost_user_receive,
+    .cleanup = vhost_user_cleanup,
+};
+
+int net_init_vhost_user(const NetClientOptions *opts, const char *name,
+                        NetClientState *peer)
+{
+    const NetdevVhostUserOptions *vhost_user;
+    VhostNetOptions options;
+    NetClientState *nc;
+    VhostUserState *s;
+    Error *err = NULL;
+    int fd;
+
+    assert(opts->kind == NET_CLIENT_OPTIONS_KIND_VHOST_USER);
+    vhost_user = opts->vhost_user;
+
+    if (peer) {
+        error_report("vhost-user can only be used with -netdev");
+        return -1;
+    }
+
+    fd = unix_connect(vhost_user->path, &err);
+    if (fd < 0) {
+        qerror_report_err(err);
+        error_free(err);
+        return -1;
+    }
+
+    nc = qemu_new_net_client(&net_vhost_user_info, peer, "vhost-user", name);
+    snprintf(nc->info_str, sizeof(nc->info_str), "vhost-user to %s",
+             vhost_user->path);
+    s = DO_UPCAST(VhostUserState, nc, nc);
+    s->fd = fd;
+
+    options.backend_type = VHOST_BACKEND_TYPE_USER;
+    options.net_backend = nc;
+    options.devfd = fd;
+    /* There is no datapath in QEMU to fall back to */
+    options.force = true;
+
+    s->vhost_net = vhost_net_init(&options);
+    if (!s->vhost_net) {
+        error_report("vhost-user backend %s could not be initialized",
+                     vhost_user->path);
+        qemu_del_net_client(nc);
+        return -1;
+    }
+
+    return 0;
+}
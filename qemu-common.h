@@ -127,6 +127,12 @@ static inline char *realpath(const char *path, char *resolved_path)
 void configure_icount(const char *option);
 extern int use_icount;
 
+/* multi-threaded TCG */
+struct QemuOpts;
+void configure_tcg(struct QemuOpts *opts);
+extern bool mttcg_enabled;
+extern bool parallel_cpus;
+
 /* FIXME: Remove NEED_CPU_H.  */
 #ifndef NEED_CPU_H
 
@@ -335,6 +341,7 @@ struct qemu_work_item {
     void (*func)(void *data);
     void *data;
     int done;
+    bool free;
 };
 
 #ifdef CONFIG_USER_ONLY
@@ -379,6 +379,32 @@ QemuOptsList qemu_sandbox_opts = {
     },
 };
 
+static QemuOptsList qemu_tcg_opts = {
+    .name = "tcg",
+    .implied_opt_name = "thread",
+    .head = QTAILQ_HEAD_INITIALIZER(qemu_tcg_opts.head),
+    .desc = {
+        {
+            .name = "thread",
+            .type = QEMU_OPT_STRING,
+            .help = "single or multi",
+        },{
+            .name = "cache",
+            .type = QEMU_OPT_STRING,
+            .help = "file that keeps translated code across runs",
+        },{
+            .name = "perfmap",
+            .type = QEMU_OPT_BOOL,
+            .help = "write /tmp/perf-PID.map for the perf profiler",
+        },{
+            .name = "profile",
+            .type = QEMU_OPT_BOOL,
+            .help = "count translated block executions (see hotblocks)",
+        },
+        { /* end of list */ }
+    },
+};
+
 static QemuOptsList qemu_mon_opts = {
     .name = "mon",
     .implied_opt_name = "chardev",
@@ -709,6 +735,7 @@ static QemuOptsList *vm_config_groups[32] = {
     &qemu_sandbox_opts,
     &qemu_add_fd_opts,
     &qemu_object_opts,
+    &qemu_tcg_opts,
     NULL,
 };
 
@@ -52,7 +52,7 @@ static void format_print(void *opaque, const char *name)
 }
 
 /* Please keep in synch with qemu-img.texi */
-static void help(void)
+static void QEMU_NORETURN help_exit(int status)
 {
     const char *help_msg =
            "qemu-img version " QEMU_VERSION ", Copyright (c) 2004-2008 Fabrice Bellard\n"
@@ -90,6 +90,27 @@ static void help(void)
            "       for qemu-img to create a sparse image during conversion\n"
            "  '--output' takes the format in which the output must be done (human or json)\n"
            "\n"
+           "Parameters to convert subcommand:\n"
+           "  '-m' specifies how many coroutines work in parallel during the convert\n"
+           "       process (defaults to 8)\n"
+           "  '-W' allow to write to the target out of order rather than sequential\n"
+           "\n"
+           "Parameters to bench subcommand:\n"
+           "  '-c' number of read/write requests to issue (default 75000)\n"
+           "  '-d' number of requests in flight at the same time (default 64)\n"
+           "  '-F' issue a flush after every 'flush_interval' write requests\n"
+           "  '-o' start of the region that is accessed (default 0)\n"
+           "  '-P' byte used as the data pattern for write requests\n"
+           "  '-r' use random offsets instead of a sequential pattern\n"
+           "  '-s' size of each request in bytes (default 4k)\n"
+           "  '-S' distance between two sequential requests (default buffer_size)\n"
+           "  '-w' percentage of requests that are writes (default 0)\n"
+           "\n"
+           "Parameters to compare subcommand:\n"
+           "  '-f' first image format\n"
+           "  '-F' second image format\n"
+           "  '-s' run in Strict mode - fail on different image size or sector allocation\n"
+           "\n"
            "Parameters to check subcommand:\n"
            "  '-r' tries to repair any inconsistencies that are found during the check.\n"
            "       '-r leaks' repairs only cluster leaks, whereas '-r all' fixes all\n"
@@ -106,7 +127,12 @@ static void help(void)
     printf("%s\nSupported formats:", help_msg);
     bdrv_iterate_format(format_print, NULL);
     printf("\n");
-    exit(1);
+    exit(status);
+}
+
+static void QEMU_NORETURN help(void)
+{
+    help_exit(1);
 }
 
 #if defined(WIN32)
@@ -658,17 +684,297 @@ static int compare_sectors(const uint8_t *buf1, const uint8_t *buf2, int n,
 
 #define IO_BUF_SIZE (2 * 1024 * 1024)
 
+#define MAX_COROUTINES 16
+
+typedef struct ImgConvertState {
+    BlockDriverState **src;
+    int64_t *src_sectors;
+    int src_cur, src_num;
+    int64_t src_cur_offset;
+    int64_t total_sectors;
+    BlockDriverState *target;
+    bool has_zero_init;
+    bool target_has_backing;
+    int min_sparse;
+    int buf_sectors;
+
+    /* Next sector to be handed out to a coroutine */
+    int64_t sector_num;
+    CoMutex lock;
+
+    /* Out-of-order writes are only allowed if wr_in_order is false */
+    bool wr_in_order;
+    int64_t wr_offs;
+
+    int num_coroutines;
+    int running_coroutines;
+    Coroutine *co[MAX_COROUTINES];
+    int64_t wait_sector_num[MAX_COROUTINES];
+    int ret;
+} ImgConvertState;
+
+static void convert_select_part(ImgConvertState *s, int64_t sector_num)
+{
+    assert(sector_num >= s->src_cur_offset);
+    while (sector_num - s->src_cur_offset >= s->src_sectors[s->src_cur]) {
+        s->src_cur_offset += s->src_sectors[s->src_cur];
+        s->src_cur++;
+        assert(s->src_cur < s->src_num);
+    }
+}
+
+/*
+ * Determines the length of the next chunk to copy, which starts at sector_num
+ * and never crosses the boundary between two source images. *copy is set to
+ * false if the chunk doesn't need to be copied because it is unallocated in the
+ * source and the target has the same backing file.
+ *
+ * Returns the number of sectors in the chunk or -errno.
+ */
+static int coroutine_fn convert_iteration_sectors(ImgConvertState *s,
+                                                  int64_t sector_num,
+                                                  bool *copy)
+{
+    int64_t src_remaining;
+    int n, n1, ret;
+
+    convert_select_part(s, sector_num);
+
+    src_remaining = s->src_cur_offset + s->src_sectors[s->src_cur] - sector_num;
+    n = MIN(s->buf_sectors, src_remaining);
+    *copy = true;
+
+    /* If the output image is being created as a copy on write image, assume
+     * that sectors which are unallocated in the input image are present in
+     * both the output's and input's base images (no need to copy them). */
+    if (s->has_zero_init && s->target_has_backing) {
+        ret = bdrv_co_is_allocated(s->src[s->src_cur],
+                                   sector_num - s->src_cur_offset, n, &n1);
+        if (ret < 0) {
+            return ret;
+        }
+        *copy = ret;
+        n = n1;
+    }
+
+    return n;
+}
+
+static int coroutine_fn convert_co_read(ImgConvertState *s, int src_cur,
+                                        int64_t src_sector_num,
+                                        int nb_sectors, uint8_t *buf)
+{
+    QEMUIOVector qiov;
+    struct iovec iov;
+    int ret;
+
+    iov.iov_base = buf;
+    iov.iov_len = nb_sectors * BDRV_SECTOR_SIZE;
+    qemu_iovec_init_external(&qiov, &iov, 1);
+
+    ret = bdrv_co_readv(s->src[src_cur], src_sector_num, nb_sectors, &qiov);
+    if (ret < 0 && s->ret == -EINPROGRESS) {
+        error_report("error while reading sector %" PRId64 ": %s",
+                     src_sector_num, strerror(-ret));
+    }
+    return ret;
+}
+
+static int coroutine_fn convert_co_write(ImgConvertState *s, int64_t sector_num,
+                                         int nb_sectors, uint8_t *buf)
+{
+    QEMUIOVector qiov;
+    struct iovec iov;
+    int n, ret;
+
+    while (nb_sectors > 0) {
+        /* If the output image is being created as a copy on write image,
+           copy all sectors even the ones containing only NUL bytes,
+           because they may differ from the sectors in the base image.
+
+           If the output is to a host device, we also write out
+           sectors that are entirely 0, since whatever data was
+           already there is garbage, not 0s. */
+        if (!s->has_zero_init || s->target_has_backing) {
+            n = nb_sectors;
+        } else if (!is_allocated_sectors_min(buf, nb_sectors, &n,
+                                             s->min_sparse)) {
+            goto next;
+        }
+
+        iov.iov_base = buf;
+        iov.iov_len = n * BDRV_SECTOR_SIZE;
+        qemu_iovec_init_external(&qiov, &iov, 1);
+
+        ret = bdrv_co_writev(s->target, sector_num, n, &qiov);
+        if (ret < 0) {
+            if (s->ret == -EINPROGRESS) {
+                error_report("error while writing sector %" PRId64 ": %s",
+                             sector_num, strerror(-ret));
+            }
+            return ret;
+        }
+
+next:
+        sector_num += n;
+        nb_sectors -= n;
+        buf += n * BDRV_SECTOR_SIZE;
+    }
+
+    return 0;
+}
+
+/* Reenters all coroutines waiting for their turn to write, so that they can
+ * notice that the conversion has failed */
+static void convert_wake_waiters(ImgConvertState *s)
+{
+    int i;
+
+    for (i = 0; i < s->num_coroutines; i++) {
+        if (s->co[i] && s->wait_sector_num[i] != -1) {
+            s->wait_sector_num[i] = -1;
+            qemu_coroutine_enter(s->co[i], NULL);
+        }
+    }
+}
+
+static void coroutine_fn convert_co_do_copy(void *opaque)
+{
+    ImgConvertState *s = opaque;
+    uint8_t *buf;
+    int index = -1;
+    int ret, i;
+
+    for (i = 0; i < s->num_coroutines; i++) {
+        if (s->co[i] == qemu_coroutine_self()) {
+            index = i;
+            break;
+        }
+    }
+    assert(index >= 0);
+
+    buf = qemu_blockalign(s->target, s->buf_sectors * BDRV_SECTOR_SIZE);
+
+    while (s->ret == -EINPROGRESS) {
+        int64_t sector_num, src_sector_num;
+        int src_cur;
+        bool copy;
+        int n;
+
+        qemu_co_mutex_lock(&s->lock);
+        if (s->ret != -EINPROGRESS || s->sector_num >= s->total_sectors) {
+            qemu_co_mutex_unlock(&s->lock);
+            break;
+        }
+        n = convert_iteration_sectors(s, s->sector_num, &copy);
+        if (n < 0) {
+            qemu_co_mutex_unlock(&s->lock);
+            ret = n;
+            goto fail;
+        }
+        sector_num = s->sector_num;
+        src_cur = s->src_cur;
+        src_sector_num = sector_num - s->src_cur_offset;
+        s->sector_num += n;
+        qemu_co_mutex_unlock(&s->lock);
+
+        if (copy) {
+            ret = convert_co_read(s, src_cur, src_sector_num, n, buf);
+            if (ret < 0) {
+                goto fail;
+            }
+        }
+
+        if (s->wr_in_order) {
+            /* Keep writes in order */
+            while (s->wr_offs != sector_num) {
+                if (s->ret != -EINPROGRESS) {
+                    goto out;
+                }
+                s->wait_sector_num[index] = sector_num;
+                qemu_coroutine_yield();
+            }
+            s->wait_sector_num[index] = -1;
+        }
+
+        if (copy) {
+            ret = convert_co_write(s, sector_num, n, buf);
+            if (ret < 0) {
+                goto fail;
+            }
+        }
+
+        if (s->wr_in_order) {
+            /* Reenter the coroutine that might have waited for this write */
+            s->wr_offs = sector_num + n;
+            for (i = 0; i < s->num_coroutines; i++) {
+                if (s->co[i] && s->wait_sector_num[i] == s->wr_offs) {
+                    s->wait_sector_num[i] = -1;
+                    qemu_coroutine_enter(s->co[i], NULL);
+                    break;
+                }
+            }
+        }
+
+        qemu_progress_print((float) n * 100 / s->total_sectors, 100);
+    }
+    goto out;
+
+fail:
+    if (s->ret == -EINPROGRESS) {
+        s->ret = ret;
+    }
+    convert_wake_waiters(s);
+out:
+    qemu_vfree(buf);
+    s->co[index] = NULL;
+    s->running_coroutines--;
+}
+
+static int convert_do_copy(ImgConvertState *s)
+{
+    int i;
+
+    s->sector_num = 0;
+    s->wr_offs = 0;
+    s->src_cur = 0;
+    s->src_cur_offset = 0;
+    s->ret = -EINPROGRESS;
+    qemu_co_mutex_init(&s->lock);
+
+    for (i = 0; i < s->num_coroutines; i++) {
+        s->co[i] = qemu_coroutine_create(convert_co_do_copy);
+        s->wait_sector_num[i] = -1;
+        s->running_coroutines++;
+    }
+
+    for (i = 0; i < s->num_coroutines; i++) {
+        if (s->co[i]) {
+            qemu_coroutine_enter(s->co[i], s);
+        }
+    }
+
+    while (s->running_coroutines) {
+        qemu_aio_wait();
+    }
+
+    if (s->ret == -EINPROGRESS) {
+        s->ret = 0;
+    }
+    return s->ret;
+}
+
 static int img_convert(int argc, char **argv)
 {
-    int c, ret = 0, n, n1, bs_n, bs_i, compress, cluster_size, cluster_sectors;
+    int c, ret = 0, n, bs_n, bs_i, compress, cluster_size, cluster_sectors;
     int progress = 0, flags;
     const char *fmt, *out_fmt, *cache, *out_baseimg, *out_filename;
     BlockDriver *drv, *proto_drv;
     BlockDriverState **bs = NULL, *out_bs = NULL;
     int64_t total_sectors, nb_sectors, sector_num, bs_offset;
+    int64_t *src_sectors = NULL;
     uint64_t bs_sectors;
     uint8_t * buf = NULL;
-    const uint8_t *buf1;
     BlockDriverInfo bdi;
     QEMUOptionParameter *param = NULL, *create_options = NULL;
     QEMUOptionParameter *out_baseimg_param;
@@ -676,6 +982,8 @@ static int img_convert(int argc, char **argv)
     const char *snapshot_name = NULL;
     float local_progress = 0;
     int min_sparse = 8; /* Need at least 4k of zeros for sparse detection */
+    int num_coroutines = 8;
+    bool wr_in_order = true;
 
     fmt = NULL;
     out_fmt = "raw";
@@ -683,7 +991,7 @@ static int img_convert(int argc, char **argv)
     out_baseimg = NULL;
     compress = 0;
     for(;;) {
-        c = getopt(argc, argv, "f:O:B:s:hce6o:pS:t:");
+        c = getopt(argc, argv, "f:O:B:s:hce6o:pS:t:m:W");
         if (c == -1) {
             break;
         }
@@ -737,6 +1045,21 @@ static int img_convert(int argc, char **argv)
         case 't':
             cache = optarg;
             break;
+        case 'm':
+        {
+            char *end;
+            num_coroutines = strtol(optarg, &end, 10);
+            if (*end || num_coroutines < 1 ||
+                num_coroutines > MAX_COROUTINES) {
+                error_report("Invalid number of coroutines. Allowed number of"
+                             " coroutines is between 1 and %d", MAX_COROUTINES);
+                return 1;
+            }
+            break;
+        }
+        case 'W':
+            wr_in_order = false;
+            break;
         }
     }
 
@@ -765,6 +1088,7 @@ static int img_convert(int argc, char **argv)
     qemu_progress_print(0, 100);
 
     bs = g_malloc0(bs_n * sizeof(BlockDriverState *));
+    src_sectors = g_malloc0(bs_n * sizeof(int64_t));
 
     total_sectors = 0;
     for (bs_i = 0; bs_i < bs_n; bs_i++) {
@@ -775,6 +1099,7 @@ static int img_convert(int argc, char **argv)
             goto out;
         }
         bdrv_get_geometry(bs[bs_i], &bs_sectors);
+        src_sectors[bs_i] = bs_sectors;
         total_sectors += bs_sectors;
     }
 
@@ -896,9 +1221,9 @@ static int img_convert(int argc, char **argv)
     bs_i = 0;
     bs_offset = 0;
     bdrv_get_geometry(bs[0], &bs_sectors);
-    buf = qemu_blockalign(out_bs, IO_BUF_SIZE);
 
     if (compress) {
+        buf = qemu_blockalign(out_bs, IO_BUF_SIZE);
         ret = bdrv_get_info(out_bs, &bdi);
         if (ret < 0) {
             error_report("could not get block driver info");
@@ -984,92 +1309,21 @@ static int img_convert(int argc, char **argv)
         /* signal EOF to align */
         bdrv_write_compressed(out_bs, 0, NULL, 0);
     } else {
-        int has_zero_init = bdrv_has_zero_init(out_bs);
-
-        sector_num = 0; // total number of sectors converted so far
-        nb_sectors = total_sectors - sector_num;
-        if (nb_sectors != 0) {
-            local_progress = (float)100 /
-                (nb_sectors / MIN(nb_sectors, IO_BUF_SIZE / 512));
-        }
-
-        for(;;) {
-            nb_sectors = total_sectors - sector_num;
-            if (nb_sectors <= 0) {
-                break;
-            }
-            if (nb_sectors >= (IO_BUF_SIZE / 512)) {
-                n = (IO_BUF_SIZE / 512);
-            } else {
-                n = nb_sectors;
-            }
-
-            while (sector_num - bs_offset >= bs_sectors) {
-                bs_i ++;
-                assert (bs_i < bs_n);
-                bs_offset += bs_sectors;
-                bdrv_get_geometry(bs[bs_i], &bs_sectors);
-                /* printf("changing part: sector_num=%" PRId64 ", bs_i=%d, "
-                  "bs_offset=%" PRId64 ", bs_sectors=%" PRId64 "\n",
-                   sector_num, bs_i, bs_offset, bs_sectors); */
-            }
-
-            if (n > bs_offset + bs_sectors - sector_num) {
-                n = bs_offset + bs_sectors - sector_num;
-            }
-
-            if (has_zero_init) {
-                /* If the output image is being created as a copy on write image,
-                   assume that sectors which are unallocated in the input image
-                   are present in both the output's and input's base images (no
-                   need to copy them). */
-                if (out_baseimg) {
-                    if (!bdrv_is_allocated(bs[bs_i], sector_num - bs_offset,
-                                           n, &n1)) {
-                        sector_num += n1;
-                        continue;
-                    }
-                    /* The next 'n1' sectors are allocated in the input image. Copy
-                       only those as they may be followed by unallocated sectors. */
-                    n = n1;
-                }
-            } else {
-                n1 = n;
-            }
+        ImgConvertState state = {
+            .src                = bs,
+            .src_sectors        = src_sectors,
+            .src_num            = bs_n,
+            .total_sectors      = total_sectors,
+            .target             = out_bs,
+            .has_zero_init      = bdrv_has_zero_init(out_bs),
+            .target_has_backing = (out_baseimg != NULL),
+            .min_sparse         = min_sparse,
+            .buf_sectors        = IO_BUF_SIZE / BDRV_SECTOR_SIZE,
+            .wr_in_order        = wr_in_order,
+            .num_coroutines     = num_coroutines,
+        };
 
-            ret = bdrv_read(bs[bs_i], sector_num - bs_offset, buf, n);
-            if (ret < 0) {
-                error_report("error while reading sector %" PRId64 ": %s",
-                             sector_num - bs_offset, strerror(-ret));
-                goto out;
-            }
-            /* NOTE: at the same time we convert, we do not write zero
-               sectors to have a chance to compress the image. Ideally, we
-               should add a specific call to have the info to go faster */
-            buf1 = buf;
-            while (n > 0) {
-                /* If the output image is being created as a copy on write image,
-                   copy all sectors even the ones containing only NUL bytes,
-                   because they may differ from the sectors in the base image.
-
-                   If the output is to a host device, we also write out
-                   sectors that are entirely 0, since whatever data was
-                   already there is garbage, not 0s. */
-                if (!has_zero_init || out_baseimg ||
-                    is_allocated_sectors_min(buf1, n, &n1, min_sparse)) {
-                    ret = bdrv_write(out_bs, sector_num, buf1, n1);
-                    if (ret < 0) {
-                        error_report("error while writing sector %" PRId64
-                                     ": %s", sector_num, strerror(-ret));
-                        goto out;
-                    }
-                }
-                sector_num += n1;
-                n -= n1;
-                buf1 += n1 * 512;
-            }
-            qemu_progress_print(local_progress, 100);
-        }
+        ret = convert_do_copy(&state);
     }
 out:
     qemu_progress_end();
@@ -1087,126 +1341,855 @@ out:
         }
         g_free(bs);
     }
+    g_free(src_sectors);
     if (ret) {
         return 1;
     }
     return 0;
 }
 
+enum {
+    BENCH_OP_READ,
+    BENCH_OP_WRITE,
+    BENCH_OP_FLUSH,
+    BENCH_OP_MAX,
+};
 
-static void dump_snapshots(BlockDriverState *bs)
-{
-    QEMUSnapshotInfo *sn_tab, *sn;
-    int nb_sns, i;
-    char buf[256];
+static const char *bench_op_name[BENCH_OP_MAX] = {
+    [BENCH_OP_READ]  = "read",
+    [BENCH_OP_WRITE] = "write",
+    [BENCH_OP_FLUSH] = "flush",
+};
 
-    nb_sns = bdrv_snapshot_list(bs, &sn_tab);
-    if (nb_sns <= 0)
-        return;
-    printf("Snapshot list:\n");
-    printf("%s\n", bdrv_snapshot_dump(buf, sizeof(buf), NULL));
-    for(i = 0; i < nb_sns; i++) {
-        sn = &sn_tab[i];
-        printf("%s\n", bdrv_snapshot_dump(buf, sizeof(buf), sn));
-    }
-    g_free(sn_tab);
-}
+typedef struct BenchData {
+    BlockDriverState *bs;
+    uint64_t image_size;
+    int bufsize;
+    int step;
+    int write_pct;
+    int flush_interval;
+    int pattern;
+    bool random;
+    uint64_t start_offset;
+
+    /* Requests still to be issued, and writes since the last flush */
+    int n;
+    int writes_since_flush;
+    uint64_t offset;
+    uint64_t rand_state;
+
+    int in_flight;
+    int ret;
 
-static void dump_json_image_info_list(ImageInfoList *list)
+    /* Per-operation latencies in nanoseconds, in order of completion */
+    int64_t *latency[BENCH_OP_MAX];
+    int nr_done[BENCH_OP_MAX];
+} BenchData;
+
+/* Deterministic so that runs can be compared with each other */
+static uint64_t bench_rand(BenchData *b)
 {
-    Error *errp = NULL;
-    QString *str;
-    QmpOutputVisitor *ov = qmp_output_visitor_new();
-    QObject *obj;
-    visit_type_ImageInfoList(qmp_output_get_visitor(ov),
-                             &list, NULL, &errp);
-    obj = qmp_output_get_qobject(ov);
-    str = qobject_to_json_pretty(obj);
-    assert(str != NULL);
-    printf("%s\n", qstring_get_str(str));
-    qobject_decref(obj);
-    qmp_output_visitor_cleanup(ov);
-    QDECREF(str);
+    b->rand_state = b->rand_state * 6364136223846793005ULL +
+                    1442695040888963407ULL;
+    return b->rand_state >> 16;
 }
 
-static void collect_snapshots(BlockDriverState *bs , ImageInfo *info)
+static void coroutine_fn bench_co(void *opaque)
 {
-    int i, sn_count;
-    QEMUSnapshotInfo *sn_tab = NULL;
-    SnapshotInfoList *info_list, *cur_item = NULL;
-    sn_count = bdrv_snapshot_list(bs, &sn_tab);
-
-    for (i = 0; i < sn_count; i++) {
-        info->has_snapshots = true;
-        info_list = g_new0(SnapshotInfoList, 1);
-
-        info_list->value                = g_new0(SnapshotInfo, 1);
-        info_list->value->id            = g_strdup(sn_tab[i].id_str);
-        info_list->value->name          = g_strdup(sn_tab[i].name);
-        info_list->value->vm_state_size = sn_tab[i].vm_state_size;
-        info_list->value->date_sec      = sn_tab[i].date_sec;
-        info_list->value->date_nsec     = sn_tab[i].date_nsec;
-        info_list->value->vm_clock_sec  = sn_tab[i].vm_clock_nsec / 1000000000;
-        info_list->value->vm_clock_nsec = sn_tab[i].vm_clock_nsec % 1000000000;
+    BenchData *b = opaque;
+    QEMUIOVector qiov;
+    struct iovec iov;
+    uint8_t *buf;
+    int64_t start;
+    int op, ret;
+
+    buf = qemu_blockalign(b->bs, b->bufsize);
+    memset(buf, b->pattern, b->bufsize);
+    iov.iov_base = buf;
+    iov.iov_len = b->bufsize;
+    qemu_iovec_init_external(&qiov, &iov, 1);
+
+    while (b->n > 0 && b->ret == 0) {
+        uint64_t offset;
+
+        if (b->flush_interval &&
+            b->writes_since_flush >= b->flush_interval) {
+            b->writes_since_flush = 0;
+            op = BENCH_OP_FLUSH;
+        } else {
+            b->n--;
+            op = (int)(bench_rand(b) % 100) < b->write_pct ?
+                 BENCH_OP_WRITE : BENCH_OP_READ;
+            if (op == BENCH_OP_WRITE) {
+                b->writes_since_flush++;
+            }
+        }
 
-        /* XXX: waiting for the qapi to support qemu-queue.h types */
-        if (!cur_item) {
-            info->snapshots = cur_item = info_list;
+        if (b->random) {
+            offset = b->start_offset +
+                     (bench_rand(b) % ((b->image_size - b->start_offset) /
+                                       b->bufsize)) * b->bufsize;
         } else {
-            cur_item->next = info_list;
-            cur_item = info_list;
+            offset = b->offset;
+            b->offset += b->step;
+            if (b->offset > b->image_size - b->bufsize) {
+                b->offset = b->start_offset;
+            }
         }
 
+        start = get_clock();
+        switch (op) {
+        case BENCH_OP_READ:
+            ret = bdrv_co_readv(b->bs, offset >> BDRV_SECTOR_BITS,
+                                b->bufsize >> BDRV_SECTOR_BITS, &qiov);
+            break;
+        case BENCH_OP_WRITE:
+            ret = bdrv_co_writev(b->bs, offset >> BDRV_SECTOR_BITS,
+                                 b->bufsize >> BDRV_SECTOR_BITS, &qiov);
+            break;
+        default:
+            ret = bdrv_co_flush(b->bs);
+            break;
+        }
+        if (ret < 0) {
+            error_report("Failed %s request: %s", bench_op_name[op],
+                         strerror(-ret));
+            b->ret = ret;
+            break;
+        }
+        b->latency[op][b->nr_done[op]++] = get_clock() - start;
     }
 
-    g_free(sn_tab);
+    qemu_vfree(buf);
+    b->in_flight--;
 }
 
-static void dump_json_image_info(ImageInfo *info)
+static int compare_int64(const void *a, const void *b)
 {
-    Error *errp = NULL;
-    QString *str;
-    QmpOutputVisitor *ov = qmp_output_visitor_new();
-    QObject *obj;
-    visit_type_ImageInfo(qmp_output_get_visitor(ov),
-                         &info, NULL, &errp);
-    obj = qmp_output_get_qobject(ov);
-    str = qobject_to_json_pretty(obj);
-    assert(str != NULL);
-    printf("%s\n", qstring_get_str(str));
-    qobject_decref(obj);
-    qmp_output_visitor_cleanup(ov);
-    QDECREF(str);
+    int64_t x = *(const int64_t *) a;
+    int64_t y = *(const int64_t *) b;
+
+    return (x > y) - (x < y);
 }
 
-static void collect_image_info(BlockDriverState *bs,
-                   ImageInfo *info,
-                   const char *filename,
-                   const char *fmt)
+static void bench_print_latency(const char *name, int64_t *lat, int n)
 {
-    uint64_t total_sectors;
-    char backing_filename[1024];
-    char backing_filename2[1024];
-    BlockDriverInfo bdi;
+    int64_t sum = 0;
+    int i;
 
-    bdrv_get_geometry(bs, &total_sectors);
+    if (n == 0) {
+        return;
+    }
 
-    info->filename        = g_strdup(filename);
-    info->format          = g_strdup(bdrv_get_format_name(bs));
-    info->virtual_size    = total_sectors * 512;
-    info->actual_size     = bdrv_get_allocated_file_size(bs);
-    info->has_actual_size = info->actual_size >= 0;
-    if (bdrv_is_encrypted(bs)) {
-        info->encrypted = true;
-        info->has_encrypted = true;
+    qsort(lat, n, sizeof(lat[0]), compare_int64);
+    for (i = 0; i < n; i++) {
+        sum += lat[i];
     }
-    if (bdrv_get_info(bs, &bdi) >= 0) {
-        if (bdi.cluster_size != 0) {
-            info->cluster_size = bdi.cluster_size;
-            info->has_cluster_size = true;
-        }
-        info->dirty_flag = bdi.is_dirty;
-        info->has_dirty_flag = true;
+
+    printf("%-5s %8d requests, latency (us): min %.1f avg %.1f max %.1f "
+           "p50 %.1f p90 %.1f p99 %.1f p99.9 %.1f\n",
+           name, n, lat[0] / 1000.0, (double) sum / n / 1000.0,
+           lat[n - 1] / 1000.0, lat[n * 50 / 100] / 1000.0,
+           lat[n * 90 / 100] / 1000.0, lat[n * 99 / 100] / 1000.0,
+           lat[n * 999 / 1000] / 1000.0);
+}
+
+static int img_bench(int argc, char **argv)
+{
+    int c, ret = 0, flags, i;
+    const char *filename, *fmt = NULL, *cache = BDRV_DEFAULT_CACHE;
+    BlockDriverState *bs = NULL;
+    int count = 75000;
+    int depth = 64;
+    int64_t offset = 0;
+    int64_t bufsize = 4096;
+    int64_t step = 0;
+    int write_pct = 0;
+    int flush_interval = 0;
+    int pattern = 0;
+    bool random = false;
+    int64_t t_start, t_end;
+    double elapsed;
+    uint64_t total_sectors;
+    BenchData data;
+    char *end;
+
+    for (;;) {
+        c = getopt(argc, argv, "c:d:f:F:ho:P:rs:S:t:w:");
+        if (c == -1) {
+            break;
+        }
+
+        switch (c) {
+        case '?':
+        case 'h':
+            help();
+            break;
+        case 'c':
+            count = strtol(optarg, &end, 0);
+            if (*end || count < 1) {
+                error_report("Invalid request count specified");
+                return 1;
+            }
+            break;
+        case 'd':
+            depth = strtol(optarg, &end, 0);
+            if (*end || depth < 1 || depth > 4096) {
+                error_report("Invalid queue depth specified");
+                return 1;
+            }
+            break;
+        case 'f':
+            fmt = optarg;
+            break;
+        case 'F':
+            flush_interval = strtol(optarg, &end, 0);
+            if (*end || flush_interval < 0) {
+                error_report("Invalid flush interval specified");
+                return 1;
+            }
+            break;
+        case 'o':
+            offset = strtosz_suffix(optarg, &end, STRTOSZ_DEFSUFFIX_B);
+            if (offset < 0 || *end) {
+                error_report("Invalid offset specified");
+                return 1;
+            }
+            break;
+        case 'P':
+            pattern = strtol(optarg, &end, 0);
+            if (*end || pattern < 0 || pattern > 0xff) {
+                error_report("Invalid pattern byte specified");
+                return 1;
+            }
+            break;
+        case 'r':
+            random = true;
+            break;
+        case 's':
+            bufsize = strtosz_suffix(optarg, &end, STRTOSZ_DEFSUFFIX_B);
+            if (bufsize <= 0 || *end || bufsize > INT_MAX ||
+                (bufsize & (BDRV_SECTOR_SIZE - 1))) {
+                error_report("Invalid buffer size specified");
+                return 1;
+            }
+            break;
+        case 'S':
+            step = strtosz_suffix(optarg, &end, STRTOSZ_DEFSUFFIX_B);
+            if (step < 0 || *end || step > INT_MAX ||
+                (step & (BDRV_SECTOR_SIZE - 1))) {
+                error_report("Invalid step size specified");
+                return 1;
+            }
+            break;
+        case 't':
+            cache = optarg;
+            break;
+        case 'w':
+            write_pct = strtol(optarg, &end, 0);
+            if (*end || write_pct < 0 || write_pct > 100) {
+                error_report("Invalid write percentage specified");
+                return 1;
+            }
+            break;
+        }
+    }
+
+    if (optind != argc - 1) {
+        help();
+    }
+    filename = argv[argc - 1];
+
+    if (offset & (BDRV_SECTOR_SIZE - 1)) {
+        error_report("Offset must be a multiple of the sector size");
+        return 1;
+    }
+
+    flags = (write_pct || flush_interval) ? BDRV_O_RDWR : 0;
+    ret = bdrv_parse_cache_flags(cache, &flags);
+    if (ret < 0) {
+        error_report("Invalid cache option: %s", cache);
+        return 1;
+    }
+
+    bs = bdrv_new_open(filename, fmt, flags, true);
+    if (!bs) {
+        return 1;
+    }
+
+    bdrv_get_geometry(bs, &total_sectors);
+
+    data = (BenchData) {
+        .bs             = bs,
+        .image_size     = total_sectors * BDRV_SECTOR_SIZE,
+        .bufsize        = bufsize,
+        .step           = step ?: bufsize,
+        .write_pct      = write_pct,
+        .flush_interval = flush_interval,
+        .pattern        = pattern,
+        .random         = random,
+        .start_offset   = offset,
+        .n              = count,
+        .offset         = offset,
+        .rand_state     = 1,
+    };
+
+    if (data.image_size < data.bufsize ||
+        offset > data.image_size - data.bufsize) {
+        error_report("Image is too small for the requested offset and "
+                     "buffer size");
+        ret = -1;
+        goto out;
+    }
+
+    for (i = 0; i < BENCH_OP_MAX; i++) {
+        /* One extra flush can be issued per coroutine at the end */
+        data.latency[i] = g_malloc((count + depth) * sizeof(int64_t));
+    }
+
+    printf("Sending %d requests (%d%% writes%s), %d bytes each, "
+           "%d in parallel (%s, starting at offset %" PRId64
+           ", step size %d)\n",
+           count, write_pct, flush_interval ? ", with flushes" : "",
+           data.bufsize, depth, random ? "random" : "sequential",
+           offset, data.step);
+
+    t_start = get_clock();
+    for (i = 0; i < depth; i++) {
+        Coroutine *co = qemu_coroutine_create(bench_co);
+        data.in_flight++;
+        qemu_coroutine_enter(co, &data);
+    }
+    while (data.in_flight > 0) {
+        qemu_aio_wait();
+    }
+    t_end = get_clock();
+
+    ret = data.ret;
+    if (ret < 0) {
+        goto out;
+    }
+
+    elapsed = (t_end - t_start) / 1000000000.0;
+    printf("Run completed in %3.3f seconds.\n", elapsed);
+    printf("%.0f IOPS, %.2f MB/s\n",
+           (data.nr_done[BENCH_OP_READ] + data.nr_done[BENCH_OP_WRITE])
+               / elapsed,
+           (double) (data.nr_done[BENCH_OP_READ] +
+                     data.nr_done[BENCH_OP_WRITE]) * data.bufsize
+               / elapsed / (1024 * 1024));
+    for (i = 0; i < BENCH_OP_MAX; i++) {
+        bench_print_latency(bench_op_name[i], data.latency[i],
+                            data.nr_done[i]);
+    }
+
+out:
+    for (i = 0; i < BENCH_OP_MAX; i++) {
+        g_free(data.latency[i]);
+    }
+    bdrv_delete(bs);
+
+    if (ret) {
+        return 1;
+    }
+    return 0;
+}
+
+typedef struct ImgReadCo {
+    BlockDriverState *bs;
+    int64_t sector_num;
+    int nb_sectors;
+    uint8_t *buf;
+    Coroutine *waiter;
+    bool done;
+    int ret;
+} ImgReadCo;
+
+static int coroutine_fn img_co_read(BlockDriverState *bs, int64_t sector_num,
+                                    int nb_sectors, uint8_t *buf)
+{
+    QEMUIOVector qiov;
+    struct iovec iov;
+    int ret;
+
+    iov.iov_base = buf;
+    iov.iov_len = nb_sectors * BDRV_SECTOR_SIZE;
+    qemu_iovec_init_external(&qiov, &iov, 1);
+
+    ret = bdrv_co_readv(bs, sector_num, nb_sectors, &qiov);
+    if (ret < 0) {
+        error_report("Error while reading offset %" PRId64 " of %s: %s",
+                     sector_num * (int64_t)BDRV_SECTOR_SIZE, bs->filename,
+                     strerror(-ret));
+    }
+    return ret;
+}
+
+static void coroutine_fn img_read_co_entry(void *opaque)
+{
+    ImgReadCo *r = opaque;
+
+    r->ret = img_co_read(r->bs, r->sector_num, r->nb_sectors, r->buf);
+    r->done = true;
+    if (r->waiter) {
+        qemu_coroutine_enter(r->waiter, NULL);
+    }
+}
+
+/* Reads the same area of two images, with both requests in flight at once */
+static int coroutine_fn img_co_read_pair(BlockDriverState *bs1, uint8_t *buf1,
+                                         BlockDriverState *bs2, uint8_t *buf2,
+                                         int64_t sector_num, int nb_sectors)
+{
+    ImgReadCo r2 = {
+        .bs         = bs2,
+        .sector_num = sector_num,
+        .nb_sectors = nb_sectors,
+        .buf        = buf2,
+    };
+    Coroutine *co;
+    int ret;
+
+    co = qemu_coroutine_create(img_read_co_entry);
+    qemu_coroutine_enter(co, &r2);
+
+    ret = img_co_read(bs1, sector_num, nb_sectors, buf1);
+
+    if (!r2.done) {
+        r2.waiter = qemu_coroutine_self();
+        qemu_coroutine_yield();
+    }
+
+    return ret < 0 ? ret : r2.ret;
+}
+
+typedef struct ImgCompareState {
+    BlockDriverState *bs1, *bs2;
+    int64_t total_sectors1, total_sectors2;
+    bool strict;
+    uint8_t *buf1, *buf2;
+    /* 0 if identical, 1 if different, -errno on error, -EINPROGRESS
+     * while the comparison is still running */
+    int ret;
+} ImgCompareState;
+
+/*
+ * Looks up the first layer of the backing chain that has the sectors starting
+ * at sector_num allocated. Returns 1 and stores the layer in *layer if there
+ * is one, 0 if the sectors aren't allocated anywhere in the chain, or -errno.
+ * *pnum is set to the number of sectors for which the same layer is the first
+ * one to have them allocated; *depth to the position of that layer, or of the
+ * layer where the lookup ended, in the chain.
+ *
+ * Unlike bdrv_co_is_allocated_above(), a backing file that ends before
+ * sector_num ends the lookup: the overlay reads zeros there, so the sectors
+ * count as unallocated rather than yielding *pnum == 0.
+ */
+static int coroutine_fn img_co_find_layer(BlockDriverState *bs,
+                                          int64_t sector_num, int nb_sectors,
+                                          int *pnum, BlockDriverState **layer,
+                                          int *depth)
+{
+    int ret = 0, n;
+
+    *depth = 0;
+    while (bs) {
+        if (*depth > 0 && sector_num >= bs->total_sectors) {
+            bs = NULL;
+            break;
+        }
+        ret = bdrv_co_is_allocated(bs, sector_num, nb_sectors, &n);
+        if (ret < 0) {
+            return ret;
+        }
+        nb_sectors = n;
+        if (ret) {
+            break;
+        }
+        bs = bs->backing_hd;
+        (*depth)++;
+    }
+
+    *pnum = nb_sectors;
+    *layer = bs;
+    return ret;
+}
+
+static int coroutine_fn img_co_is_allocated(BlockDriverState *bs,
+                                            int64_t sector_num, int nb_sectors,
+                                            int *pnum)
+{
+    BlockDriverState *layer;
+    int depth;
+
+    return img_co_find_layer(bs, sector_num, nb_sectors, pnum, &layer, &depth);
+}
+
+/*
+ * Checks that the allocated parts of [sector_num, sector_num + nb_sectors)
+ * read as zeros. Returns 0 if they do, 1 if they don't (and prints the offset
+ * of the first mismatch) or -errno.
+ */
+static int coroutine_fn img_co_check_empty(BlockDriverState *bs, uint8_t *buf,
+                                           int64_t sector_num,
+                                           int64_t nb_sectors)
+{
+    int ret, n, pnum;
+
+    while (nb_sectors > 0) {
+        n = MIN(nb_sectors, IO_BUF_SIZE / BDRV_SECTOR_SIZE);
+        ret = img_co_is_allocated(bs, sector_num, n, &n);
+        if (ret < 0) {
+            error_report("Sector allocation test failed for %s",
+                         bs->filename);
+            return ret;
+        }
+        if (n == 0) {
+            error_report("No allocation status for sector %" PRId64 " of %s",
+                         sector_num, bs->filename);
+            return -EIO;
+        }
+
+        if (ret) {
+            ret = img_co_read(bs, sector_num, n, buf);
+            if (ret < 0) {
+                return ret;
+            }
+            ret = is_allocated_sectors(buf, n, &pnum);
+            if (ret || pnum < n) {
+                printf("Content mismatch at offset %" PRId64 "!\n",
+                       (sector_num + (ret ? 0 : pnum)) *
+                       (int64_t)BDRV_SECTOR_SIZE);
+                return 1;
+            }
+        }
+
+        sector_num += n;
+        nb_sectors -= n;
+    }
+
+    return 0;
+}
+
+static void coroutine_fn img_compare_co(void *opaque)
+{
+    ImgCompareState *s = opaque;
+    int64_t total_sectors, sector_num = 0;
+    int64_t progress_base;
+    int ret, pnum;
+
+    total_sectors = MIN(s->total_sectors1, s->total_sectors2);
+    progress_base = MAX(s->total_sectors1, s->total_sectors2);
+
+    while (sector_num < total_sectors) {
+        int allocated1, allocated2;
+        int nb_sectors, pnum1, pnum2;
+
+        nb_sectors = MIN(total_sectors - sector_num,
+                         IO_BUF_SIZE / BDRV_SECTOR_SIZE);
+
+        allocated1 = img_co_is_allocated(s->bs1, sector_num, nb_sectors,
+                                         &pnum1);
+        if (allocated1 < 0) {
+            error_report("Sector allocation test failed for %s",
+                         s->bs1->filename);
+            ret = allocated1;
+            goto out;
+        }
+
+        allocated2 = img_co_is_allocated(s->bs2, sector_num, nb_sectors,
+                                         &pnum2);
+        if (allocated2 < 0) {
+            error_report("Sector allocation test failed for %s",
+                         s->bs2->filename);
+            ret = allocated2;
+            goto out;
+        }
+
+        nb_sectors = MIN(pnum1, pnum2);
+        if (nb_sectors == 0) {
+            error_report("No allocation status for sector %" PRId64,
+                         sector_num);
+            ret = -EIO;
+            goto out;
+        }
+
+        if (allocated1 && allocated2) {
+            ret = img_co_read_pair(s->bs1, s->buf1, s->bs2, s->buf2,
+                                   sector_num, nb_sectors);
+            if (ret < 0) {
+                goto out;
+            }
+            ret = compare_sectors(s->buf1, s->buf2, nb_sectors, &pnum);
+            if (ret || pnum != nb_sectors) {
+                printf("Content mismatch at offset %" PRId64 "!\n",
+                       (sector_num + (ret ? 0 : pnum)) *
+                       (int64_t)BDRV_SECTOR_SIZE);
+                ret = 1;
+                goto out;
+            }
+        } else if (allocated1 != allocated2) {
+            if (s->strict) {
+                printf("Strict mode: Offset %" PRId64
+                       " allocation mismatch!\n",
+                       sector_num * (int64_t)BDRV_SECTOR_SIZE);
+                ret = 1;
+                goto out;
+            }
+
+            /* Unallocated areas read as zeros */
+            ret = img_co_check_empty(allocated1 ? s->bs1 : s->bs2, s->buf1,
+                                     sector_num, nb_sectors);
+            if (ret) {
+                goto out;
+            }
+        }
+
+        sector_num += nb_sectors;
+        qemu_progress_print((float) nb_sectors * 100 / progress_base, 100);
+    }
+
+    if (s->total_sectors1 != s->total_sectors2) {
+        BlockDriverState *bs_over;
+        int64_t total_sectors_over;
+
+        if (s->strict) {
+            printf("Strict mode: Image size mismatch!\n");
+            ret = 1;
+            goto out;
+        }
+
+        printf("Warning: Image size mismatch!\n");
+        if (s->total_sectors1 > s->total_sectors2) {
+            bs_over = s->bs1;
+            total_sectors_over = s->total_sectors1;
+        } else {
+            bs_over = s->bs2;
+            total_sectors_over = s->total_sectors2;
+        }
+
+        ret = img_co_check_empty(bs_over, s->buf1, total_sectors,
+                                 total_sectors_over - total_sectors);
+        if (ret) {
+            goto out;
+        }
+    }
+
+    printf("Images are identical.\n");
+    ret = 0;
+
+out:
+    s->ret = ret;
+}
+
+/*
+ * Compares two images. Returns 0 if they are identical, 1 if they differ and
+ * 2 if an error occurred.
+ */
+static int img_compare(int argc, char **argv)
+{
+    const char *fmt1 = NULL, *fmt2 = NULL, *filename1, *filename2;
+    BlockDriverState *bs1, *bs2;
+    uint64_t total_sectors1, total_sectors2;
+    bool progress = false, strict = false;
+    ImgCompareState s;
+    Coroutine *co;
+    int c, ret;
+
+    for (;;) {
+        c = getopt(argc, argv, "hpf:F:s");
+        if (c == -1) {
+            break;
+        }
+        switch (c) {
+        case '?':
+        case 'h':
+            help_exit(2);
+            break;
+        case 'f':
+            fmt1 = optarg;
+            break;
+        case 'F':
+            fmt2 = optarg;
+            break;
+        case 'p':
+            progress = true;
+            break;
+        case 's':
+            strict = true;
+            break;
+        }
+    }
+
+    if (optind != argc - 2) {
+        help_exit(2);
+    }
+    filename1 = argv[optind++];
+    filename2 = argv[optind++];
+
+    /* Initialize before goto out */
+    qemu_progress_init(progress, 2.0);
+
+    bs1 = bdrv_new_open(filename1, fmt1, BDRV_O_FLAGS, true);
+    if (!bs1) {
+        ret = 2;
+        goto out3;
+    }
+
+    bs2 = bdrv_new_open(filename2, fmt2, BDRV_O_FLAGS, true);
+    if (!bs2) {
+        ret = 2;
+        goto out2;
+    }
+
+    bdrv_get_geometry(bs1, &total_sectors1);
+    bdrv_get_geometry(bs2, &total_sectors2);
+
+    s = (ImgCompareState) {
+        .bs1            = bs1,
+        .bs2            = bs2,
+        .total_sectors1 = total_sectors1,
+        .total_sectors2 = total_sectors2,
+        .strict         = strict,
+        .buf1           = qemu_blockalign(bs1, IO_BUF_SIZE),
+        .buf2           = qemu_blockalign(bs2, IO_BUF_SIZE),
+        .ret            = -EINPROGRESS,
+    };
+
+    qemu_progress_print(0, 100);
+
+    co = qemu_coroutine_create(img_compare_co);
+    qemu_coroutine_enter(co, &s);
+    while (s.ret == -EINPROGRESS) {
+        qemu_aio_wait();
+    }
+
+    ret = s.ret < 0 ? 2 : s.ret;
+
+    qemu_vfree(s.buf1);
+    qemu_vfree(s.buf2);
+    bdrv_delete(bs2);
+out2:
+    bdrv_delete(bs1);
+out3:
+    qemu_progress_end();
+    return ret;
+}
+
+
+static void dump_snapshots(BlockDriverState *bs)
+{
+    QEMUSnapshotInfo *sn_tab, *sn;
+    int nb_sns, i;
+    char buf[256];
+
+    nb_sns = bdrv_snapshot_list(bs, &sn_tab);
+    if (nb_sns <= 0)
+        return;
+    printf("Snapshot list:\n");
+    printf("%s\n", bdrv_snapshot_dump(buf, sizeof(buf), NULL));
+    for(i = 0; i < nb_sns; i++) {
+        sn = &sn_tab[i];
+        printf("%s\n", bdrv_snapshot_dump(buf, sizeof(buf), sn));
+    }
+    g_free(sn_tab);
+}
+
+static void dump_json_image_info_list(ImageInfoList *list)
+{
+    Error *errp = NULL;
+    QString *str;
+    QmpOutputVisitor *ov = qmp_output_visitor_new();
+    QObject *obj;
+    visit_type_ImageInfoList(qmp_output_get_visitor(ov),
+                             &list, NULL, &errp);
+    obj = qmp_output_get_qobject(ov);
+    str = qobject_to_json_pretty(obj);
+    assert(str != NULL);
+    printf("%s\n", qstring_get_str(str));
+    qobject_decref(obj);
+    qmp_output_visitor_cleanup(ov);
+    QDECREF(str);
+}
+
+static void collect_snapshots(BlockDriverState *bs , ImageInfo *info)
+{
+    int i, sn_count;
+    QEMUSnapshotInfo *sn_tab = NULL;
+    SnapshotInfoList *info_list, *cur_item = NULL;
+    sn_count = bdrv_snapshot_list(bs, &sn_tab);
+
+    for (i = 0; i < sn_count; i++) {
+        info->has_snapshots = true;
+        info_list = g_new0(SnapshotInfoList, 1);
+
+        info_list->value                = g_new0(SnapshotInfo, 1);
+        info_list->value->id            = g_strdup(sn_tab[i].id_str);
+        info_list->value->name          = g_strdup(sn_tab[i].name);
+        info_list->value->vm_state_size = sn_tab[i].vm_state_size;
+        info_list->value->date_sec      = sn_tab[i].date_sec;
+        info_list->value->date_nsec     = sn_tab[i].date_nsec;
+        info_list->value->vm_clock_sec  = sn_tab[i].vm_clock_nsec / 1000000000;
+        info_list->value->vm_clock_nsec = sn_tab[i].vm_clock_nsec % 1000000000;
+
+        /* XXX: waiting for the qapi to support qemu-queue.h types */
+        if (!cur_item) {
+            info->snapshots = cur_item = info_list;
+        } else {
+            cur_item->next = info_list;
+            cur_item = info_list;
+        }
+
+    }
+
+    g_free(sn_tab);
+}
+
+static void dump_json_image_info(ImageInfo *info)
+{
+    Error *errp = NULL;
+    QString *str;
+    QmpOutputVisitor *ov = qmp_output_visitor_new();
+    QObject *obj;
+    visit_type_ImageInfo(qmp_output_get_visitor(ov),
+                         &info, NULL, &errp);
+    obj = qmp_output_get_qobject(ov);
+    str = qobject_to_json_pretty(obj);
+    assert(str != NULL);
+    printf("%s\n", qstring_get_str(str));
+    qobject_decref(obj);
+    qmp_output_visitor_cleanup(ov);
+    QDECREF(str);
+}
+
+static void collect_image_info(BlockDriverState *bs,
+                   ImageInfo *info,
+                   const char *filename,
+                   const char *fmt)
+{
+    uint64_t total_sectors;
+    char backing_filename[1024];
+    char backing_filename2[1024];
+    BlockDriverInfo bdi;
+
+    bdrv_get_geometry(bs, &total_sectors);
+
+    info->filename        = g_strdup(filename);
+    info->format          = g_strdup(bdrv_get_format_name(bs));
+    info->virtual_size    = total_sectors * 512;
+    info->actual_size     = bdrv_get_allocated_file_size(bs);
+    info->has_actual_size = info->actual_size >= 0;
+    if (bdrv_is_encrypted(bs)) {
+        info->encrypted = true;
+        info->has_encrypted = true;
+    }
+    if (bdrv_get_info(bs, &bdi) >= 0) {
+        if (bdi.cluster_size != 0) {
+            info->cluster_size = bdi.cluster_size;
+            info->has_cluster_size = true;
+        }
+        info->dirty_flag = bdi.is_dirty;
+        info->has_dirty_flag = true;
     }
     bdrv_get_backing_filename(bs, backing_filename, sizeof(backing_filename));
     if (backing_filename[0] != '\0') {
@@ -1473,6 +2456,209 @@ static int img_info(int argc, char **argv)
     return 0;
 }
 
+typedef struct MapEntry {
+    int64_t start;
+    int64_t length;
+    int depth;
+    bool data;
+    bool zero;
+    BlockDriverState *bs;
+} MapEntry;
+
+typedef struct ImgMapState {
+    BlockDriverState *bs;
+    OutputFormat output_format;
+    MapEntry curr;
+    bool first;
+    int ret;
+} ImgMapState;
+
+static void dump_map_entry(ImgMapState *s, MapEntry *e)
+{
+    switch (s->output_format) {
+    case OFORMAT_HUMAN:
+        if (e->data) {
+            printf("%#-16" PRIx64 "%#-16" PRIx64 "%s\n",
+                   e->start, e->length, e->bs->filename);
+        }
+        break;
+    case OFORMAT_JSON:
+        printf("%s{ \"start\": %" PRId64 ", \"length\": %" PRId64 ", "
+               "\"depth\": %d, \"zero\": %s, \"data\": %s }",
+               s->first ? "" : ",\n", e->start, e->length, e->depth,
+               e->zero ? "true" : "false", e->data ? "true" : "false");
+        break;
+    }
+    s->first = false;
+}
+
+/*
+ * Fills in the entry for the sectors starting at sector_num, which are
+ * allocated in the same layer of the backing chain (see img_co_find_layer).
+ */
+static int coroutine_fn get_map_entry(BlockDriverState *bs, int64_t sector_num,
+                                      int nb_sectors, MapEntry *e)
+{
+    int depth, ret;
+
+    ret = img_co_find_layer(bs, sector_num, nb_sectors, &nb_sectors, &bs,
+                            &depth);
+    if (ret < 0) {
+        return ret;
+    }
+
+    *e = (MapEntry) {
+        .start  = sector_num * BDRV_SECTOR_SIZE,
+        .length = (int64_t) nb_sectors * BDRV_SECTOR_SIZE,
+        .depth  = depth,
+        .data   = bs != NULL,
+        /* Sectors that aren't allocated anywhere in the chain read as zero */
+        .zero   = bs == NULL,
+        .bs     = bs,
+    };
+    return 0;
+}
+
+static void coroutine_fn img_map_co(void *opaque)
+{
+    ImgMapState *s = opaque;
+    int64_t length, sector_num = 0;
+    MapEntry next;
+    int ret;
+
+    length = bdrv_getlength(s->bs);
+    if (length < 0) {
+        error_report("Failed to get size of %s: %s", s->bs->filename,
+                     strerror(-length));
+        s->ret = length;
+        return;
+    }
+
+    /* Entries are printed as soon as they can't be merged with the next one,
+     * so that nothing is buffered for the whole image */
+    s->curr.length = 0;
+    while (sector_num < length / BDRV_SECTOR_SIZE) {
+        int nb_sectors = MIN(length / BDRV_SECTOR_SIZE - sector_num,
+                             INT_MAX / BDRV_SECTOR_SIZE);
+
+        ret = get_map_entry(s->bs, sector_num, nb_sectors, &next);
+        if (ret < 0) {
+            error_report("Could not read file metadata: %s", strerror(-ret));
+            s->ret = ret;
+            return;
+        }
+        if (next.length == 0) {
+            error_report("No allocation status for offset %" PRId64 " of %s",
+                         sector_num * (int64_t)BDRV_SECTOR_SIZE,
+                         s->bs->filename);
+            s->ret = -EIO;
+            return;
+        }
+
+        if (s->curr.length != 0 &&
+            s->curr.start + s->curr.length == next.start &&
+            s->curr.depth == next.depth && s->curr.data == next.data &&
+            s->curr.zero == next.zero && s->curr.bs == next.bs) {
+            s->curr.length += next.length;
+        } else {
+            if (s->curr.length != 0) {
+                dump_map_entry(s, &s->curr);
+            }
+            s->curr = next;
+        }
+
+        sector_num += next.length / BDRV_SECTOR_SIZE;
+    }
+
+    if (s->curr.length != 0) {
+        dump_map_entry(s, &s->curr);
+    }
+    s->ret = 0;
+}
+
+static int img_map(int argc, char **argv)
+{
+    int c;
+    OutputFormat output_format = OFORMAT_HUMAN;
+    BlockDriverState *bs;
+    const char *filename, *fmt, *output;
+    ImgMapState s;
+    Coroutine *co;
+
+    fmt = NULL;
+    output = NULL;
+    for (;;) {
+        int option_index = 0;
+        static const struct option long_options[] = {
+            {"help", no_argument, 0, 'h'},
+            {"format", required_argument, 0, 'f'},
+            {"output", required_argument, 0, OPTION_OUTPUT},
+            {0, 0, 0, 0}
+        };
+        c = getopt_long(argc, argv, "f:h",
+                        long_options, &option_index);
+        if (c == -1) {
+            break;
+        }
+        switch (c) {
+        case '?':
+        case 'h':
+            help();
+            break;
+        case 'f':
+            fmt = optarg;
+            break;
+        case OPTION_OUTPUT:
+            output = optarg;
+            break;
+        }
+    }
+    if (optind >= argc) {
+        help();
+    }
+    filename = argv[optind++];
+
+    if (output && !strcmp(output, "json")) {
+        output_format = OFORMAT_JSON;
+    } else if (output && !strcmp(output, "human")) {
+        output_format = OFORMAT_HUMAN;
+    } else if (output) {
+        error_report("--output must be used with human or json as argument.");
+        return 1;
+    }
+
+    bs = bdrv_new_open(filename, fmt, BDRV_O_FLAGS, true);
+    if (!bs) {
+        return 1;
+    }
+
+    if (output_format == OFORMAT_HUMAN) {
+        printf("%-16s%-16s%s\n", "Offset", "Length", "File");
+    } else {
+        printf("[");
+    }
+
+    s = (ImgMapState) {
+        .bs             = bs,
+        .output_format  = output_format,
+        .first          = true,
+        .ret            = -EINPROGRESS,
+    };
+
+    co = qemu_coroutine_create(img_map_co);
+    qemu_coroutine_enter(co, &s);
+    while (s.ret == -EINPROGRESS) {
+        qemu_aio_wait();
+    }
+
+    if (output_format == OFORMAT_JSON) {
+        printf("]\n");
+    }
+
+    bdrv_delete(bs);
+    return s.ret < 0 ? 1 : 0;
+}
+
 #define SNAPSHOT_LIST   1
 #define SNAPSHOT_CREATE 2
 #define SNAPSHOT_APPLY  3
@@ -36,6 +36,7 @@
 #define SOCKET_PATH         "/var/lock/qemu-nbd-%s"
 #define QEMU_NBD_OPT_CACHE  1
 #define QEMU_NBD_OPT_AIO    2
+#define QEMU_NBD_OPT_QUEUE_DEPTH 3
 
 static NBDExport *exp;
 static int verbose;
@@ -62,7 +63,9 @@ static void usage(const char *name)
 "                       (default '"SOCKET_PATH"')\n"
 "  -e, --shared=NUM     device can be shared by NUM clients (default '1')\n"
 "  -t, --persistent     don't exit on the last connection\n"
-"  -v, --verbose        display extra debugging information\n"
+"      --queue-depth=NUM  serve up to NUM requests per client in parallel\n"
+"                       (default '%d')\n"
+"  -v, --verbose        display extra debugging information and statistics\n"
 "\n"
 "Exposing part of the image:\n"
 "  -o, --offset=OFFSET  offset into the image\n"
@@ -85,7 +88,7 @@ static void usage(const char *name)
 #endif
 "\n"
 "Report bugs to <qemu-devel@nongnu.org>\n"
-    , name, NBD_DEFAULT_PORT, "DEVICE");
+    , name, NBD_DEFAULT_PORT, "DEVICE", NBD_DEFAULT_QUEUE_DEPTH);
 }
 
 static void version(const char *name)
@@ -264,6 +267,31 @@ out:
     return (void *) EXIT_FAILURE;
 }
 
+static void print_export_stats(NBDExport *exp)
+{
+    static const char *names[NBD_CMD_MAX] = {
+        [NBD_CMD_READ] = "read",
+        [NBD_CMD_WRITE] = "write",
+        [NBD_CMD_FLUSH] = "flush",
+        [NBD_CMD_TRIM] = "trim",
+    };
+    NBDExportStats stats;
+    int i;
+
+    nbd_export_get_stats(exp, &stats);
+    for (i = 0; i < NBD_CMD_MAX; i++) {
+        if (!names[i] || !stats.nr_ops[i]) {
+            continue;
+        }
+        fprintf(stderr, "%s: %" PRIu64 " requests, %" PRIu64 " bytes, "
+                "%" PRIu64 " us average latency\n", names[i],
+                stats.nr_ops[i], stats.nr_bytes[i],
+                stats.total_time_ns[i] / stats.nr_ops[i] / 1000);
+    }
+    fprintf(stderr, "%" PRIu64 " errors, at most %d requests in flight\n",
+            stats.nr_errors, stats.max_in_flight);
+}
+
 static int nbd_can_accept(void *opaque)
 {
     return nb_fds < shared;
@@ -332,6 +360,7 @@ int main(int argc, char **argv)
 #endif
         { "shared", 1, NULL, 'e' },
         { "persistent", 0, NULL, 't' },
+        { "queue-depth", 1, NULL, QEMU_NBD_OPT_QUEUE_DEPTH },
         { "verbose", 0, NULL, 'v' },
         { NULL, 0, NULL, 0 }
     };
@@ -341,6 +370,7 @@ int main(int argc, char **argv)
     char *end;
     int flags = BDRV_O_RDWR;
     int partition = -1;
+    int queue_depth = NBD_DEFAULT_QUEUE_DEPTH;
     int ret;
     int fd;
     bool seen_cache = false;
@@ -445,6 +475,16 @@ int main(int argc, char **argv)
 	case 't':
 	    persistent = 1;
 	    break;
+        case QEMU_NBD_OPT_QUEUE_DEPTH:
+            queue_depth = strtol(optarg, &end, 0);
+            if (*end) {
+                errx(EXIT_FAILURE, "Invalid queue depth `%s'", optarg);
+            }
+            if (queue_depth < 1 || queue_depth > NBD_MAX_QUEUE_DEPTH) {
+                errx(EXIT_FAILURE, "Queue depth must be between 1 and %d",
+                     NBD_MAX_QUEUE_DEPTH);
+            }
+            break;
         case 'v':
             verbose = 1;
             break;
@@ -561,6 +601,7 @@ int main(int argc, char **argv)
     }
 
     exp = nbd_export_new(bs, dev_offset, fd_size, nbdflags, nbd_export_closed);
+    nbd_export_set_queue_depth(exp, queue_depth);
 
     if (sockpath) {
         fd = unix_socket_incoming(sockpath);
@@ -599,6 +640,9 @@ int main(int argc, char **argv)
         main_loop_wait(false);
         if (state == TERMINATE) {
             state = TERMINATING;
+            if (verbose) {
+                print_export_stats(exp);
+            }
             nbd_export_close(exp);
             nbd_export_put(exp);
             exp = NULL;
@@ -1330,7 +1330,7 @@ DEF("net", HAS_ARG, QEMU_OPTION_net,
     "-net tap[,vlan=n][,name=str],ifname=name\n"
     "                connect the host TAP network interface to VLAN 'n'\n"
 #else
-    "-net tap[,vlan=n][,name=str][,fd=h][,ifname=name][,script=file][,downscript=dfile][,helper=helper][,sndbuf=nbytes][,vnet_hdr=on|off][,vhost=on|off][,vhostfd=h][,vhostforce=on|off]\n"
+    "-net tap[,vlan=n][,name=str][,fd=h][,ifname=name][,script=file][,downscript=dfile][,helper=helper][,sndbuf=nbytes][,vnet_hdr=on|off][,vhost=on|off][,vhostfd=h][,vhostforce=on|off][,queues=n]\n"
     "                connect the host TAP network interface to VLAN 'n' \n"
     "                use network scripts 'file' (default=" DEFAULT_NETWORK_SCRIPT ")\n"
     "                to configure it and 'dfile' (default=" DEFAULT_NETWORK_DOWN_SCRIPT ")\n"
@@ -1347,6 +1347,7 @@ DEF("net", HAS_ARG, QEMU_OPTION_net,
     "                    (only has effect for virtio guests which use MSIX)\n"
     "                use vhostforce=on to force vhost on for non-MSIX virtio guests\n"
     "                use 'vhostfd=h' to connect to an already opened vhost net device\n"
+    "                use 'queues=n' to open n queues of a multiqueue tap device (-netdev only)\n"
     "-net bridge[,vlan=n][,name=str][,br=bridge][,helper=helper]\n"
     "                connects a host TAP network interface to a host bridge device 'br'\n"
     "                (default=" DEFAULT_BRIDGE_INTERFACE ") using the program 'helper'\n"
@@ -1366,8 +1367,11 @@ DEF("net", HAS_ARG, QEMU_OPTION_net,
     "                Use group 'groupname' and mode 'octalmode' to change default\n"
     "                ownership and permissions for communication port.\n"
 #endif
-    "-net dump[,vlan=n][,file=f][,len=n]\n"
+    "-net dump[,vlan=n][,file=f][,len=n][,rotate=n]\n"
     "                dump traffic on vlan 'n' to file 'f' (max n bytes per packet)\n"
+    "                and move 'f' to 'f.1' once it reaches 'rotate' bytes\n"
+    "                use 'learning=on' with any of the above to make vlan 'n' forward\n"
+    "                unicast frames only to the client their destination was seen on\n"
     "-net none       use it alone to have zero network devices. If no -net option\n"
     "                is provided, the default is '-net nic -net user'\n", QEMU_ARCH_ALL)
 DEF("netdev", HAS_ARG, QEMU_OPTION_netdev,
@@ -1379,6 +1383,9 @@ DEF("netdev", HAS_ARG, QEMU_OPTION_netdev,
     "bridge|"
 #ifdef CONFIG_VDE
     "vde|"
+#endif
+#ifdef CONFIG_LINUX
+    "vhost-user|"
 #endif
     "socket],id=str[,option][,option][,...]\n", QEMU_ARCH_ALL)
 STEXI
@@ -1565,6 +1572,12 @@ helper executable is @file{/usr/local/libexec/qemu-bridge-helper}.
 @option{fd}=@var{h} can be used to specify the handle of an already
 opened host TAP interface.
 
+With @option{-netdev}, @option{queues}=@var{n} opens @var{n} queues of a
+multiqueue TAP interface (Linux only).  Each queue gets its own vhost-net
+instance when @option{vhost=on} is given.  A virtio-net device using this
+netdev only offers the @var{n} queue pairs to the guest when it is created
+with @option{mq=on}; otherwise the guest sees a single queue pair.
+
 Examples:
 
 @example
@@ -1580,6 +1593,13 @@ qemu-system-i386 linux.img \
                  -net nic,vlan=1 -net tap,vlan=1,ifname=tap1
 @end example
 
+@example
+#launch a QEMU instance with a four queue virtio-net NIC
+qemu-system-i386 linux.img \
+                 -netdev tap,id=hn0,queues=4,vhost=on \
+                 -device virtio-net-pci,netdev=hn0,mq=on,vectors=10
+@end example
+
 @example
 #launch a QEMU instance with the default network helper to
 #connect a TAP device to bridge br0
@@ -1701,11 +1721,41 @@ vde_switch -F -sock /tmp/myswitch
 qemu-system-i386 linux.img -net nic -net vde,sock=/tmp/myswitch
 @end example
 
-@item -net dump[,vlan=@var{n}][,file=@var{file}][,len=@var{len}]
+@item -netdev vhost-user,id=@var{id},path=@var{path}
+Connect to an external process listening on the unix socket @var{path}
+that processes the NIC's virtqueues itself, for instance a userspace
+switch.  QEMU passes it the guest memory, the ring addresses and the
+notification eventfds using the vhost-user protocol described in
+@file{docs/specs/vhost-user.txt}.  Guest RAM must be shareable with the
+other process, so @option{-mem-path} and @option{-mem-prealloc} are
+required.  This option is only available on Linux hosts with vhost-net
+support.
+
+Example:
+@example
+qemu-system-x86_64 -enable-kvm -m 512 \
+                   -mem-path /dev/hugepages -mem-prealloc \
+                   -netdev vhost-user,id=net0,path=/var/run/switch.sock \
+                   -device virtio-net-pci,netdev=net0
+@end example
+
+@item -net dump[,vlan=@var{n}][,file=@var{file}][,len=@var{len}][,rotate=@var{size}]
 Dump network traffic on VLAN @var{n} to file @var{file} (@file{qemu-vlan0.pcap} by default).
 At most @var{len} bytes (64k by default) per packet are stored. The file format is
 libpcap, so it can be analyzed with tools such as tcpdump or Wireshark.
 
+Packets are written to disk by a separate thread.  If it cannot keep up,
+packets are dropped rather than slowing down the guest; the number of dropped
+packets is shown by @code{info network}.  With @option{rotate}, @var{file} is
+renamed to @file{@var{file}.1} once it would grow past @var{size} bytes and a
+new capture file is started, so at most two files are kept.
+
+All of the above also accept @option{learning=on|off}.  With learning on,
+VLAN @var{n} remembers which client each source MAC address was last seen on
+and forwards unicast frames for a known address to that client only, like a
+switch; @option{-net dump} clients still see every frame.  Learning applies to
+the whole VLAN, so all clients that give @option{learning} must agree.
+
 @item -net none
 Indicate that no network devices should be configured. It is used to
 override the default configuration (@option{-net nic -net user}) which
@@ -2652,6 +2702,41 @@ order cores with complex cache hierarchies.  The number of instructions
 executed often has little or no correlation with actual performance.
 ETEXI
 
+DEF("tcg", HAS_ARG, QEMU_OPTION_tcg, \
+    "-tcg [thread=]single|multi[,cache=file][,perfmap=on|off][,profile=on|off]\n" \
+    "                run all TCG vCPUs in one host thread (default) or each\n" \
+    "                in its own host thread\n" \
+    "                cache=file reuses translated code across runs\n" \
+    "                perfmap=on describes translated code to perf\n" \
+    "                profile=on counts translated block executions\n",
+    QEMU_ARCH_ALL)
+STEXI
+@item -tcg [thread=]@var{mode}[,cache=@var{file}][,perfmap=on|off][,profile=on|off]
+@findex -tcg
+Select how the TCG accelerator maps guest vCPUs to host threads.  With
+@code{single}, the default, one host thread runs all vCPUs in turn.  With
+@code{multi}, each vCPU gets its own host thread and guest code runs in
+parallel.  Device emulation and TLB refills still run under the global
+I/O lock, and guest atomic instructions are executed one at a time with
+all other vCPUs stopped.
+
+Multi-threaded TCG is experimental.  It is only available for x86 and
+ARM guests on x86 hosts, and cannot be combined with @option{-icount}.
+
+With @option{cache=@var{file}}, the host code of translated blocks is
+saved in @var{file} and reused by later runs of the same QEMU binary
+with the same CPU model, provided the guest code is unchanged.  The file
+is created if needed and may be shared by several QEMU processes.
+Statistics are shown by @code{info jit}.  The cache is only available for
+x86 and ARM guests on 64-bit x86 Linux hosts.
+
+With @option{perfmap=on}, the host address of each translated block is
+written to @file{/tmp/perf-@var{pid}.map}, so that @command{perf report}
+attributes samples in translated code to guest PCs.  With
+@option{profile=on}, each block counts its executions from the start;
+see the @code{tb_profile} and @code{hotblocks} monitor commands.
+ETEXI
+
 DEF("watchdog", HAS_ARG, QEMU_OPTION_watchdog, \
     "-watchdog i6300esb|ib700\n" \
     "                enable virtual hardware watchdog [default=none]\n",
@@ -94,7 +94,7 @@ static int icmp_send(struct socket *so, struct mbuf *m, int hlen)
     addr.sin_family = AF_INET;
     addr.sin_addr = so->so_faddr;
 
-    insque(so, &so->slirp->icmp);
+    soinsque(so, &so->slirp->icmp);
 
     if (sendto(so->s, m->m_data + hlen, m->m_len - hlen, 0,
                (struct sockaddr *)&addr, sizeof(addr)) == -1) {
@@ -174,6 +174,7 @@ icmp_input(struct mbuf *m, int hlen)
       so->so_fport = htons(7);
       so->so_laddr = ip->ip_src;
       so->so_lport = htons(9);
+      sohash_insert(&slirp->udp_hash, so);
       so->so_iptos = ip->ip_tos;
       so->so_type = IPPROTO_ICMP;
       so->so_state = SS_ISFCONNECTED;
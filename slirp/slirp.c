@@ -39,13 +39,13 @@ static const uint8_t special_ethaddr[ETH_ALEN] = {
 
 static const uint8_t zero_ethaddr[ETH_ALEN] = { 0, 0, 0, 0, 0, 0 };
 
-/* XXX: suppress those select globals */
-fd_set *global_readfds, *global_writefds, *global_xfds;
-
 u_int curtime;
 static u_int time_fasttimo, last_slowtimo;
 static int do_slowtimo;
 
+/* Number of ready sockets fetched per epoll_wait() */
+#define SLIRP_EPOLL_EVENTS 64
+
 static QTAILQ_HEAD(slirp_instances, Slirp) slirp_instances =
     QTAILQ_HEAD_INITIALIZER(slirp_instances);
 
@@ -212,6 +212,14 @@ Slirp *slirp_init(int restricted, struct in_addr vnetwork,
 
     slirp->restricted = restricted;
 
+    QTAILQ_INIT(&slirp->so_changed);
+#ifdef CONFIG_EPOLL
+    slirp->epoll_fd = epoll_create(SLIRP_EPOLL_EVENTS);
+    if (slirp->epoll_fd >= 0) {
+        qemu_set_cloexec(slirp->epoll_fd);
+    }
+#endif
+
     if_init(slirp);
     ip_init(slirp);
 
@@ -257,6 +265,12 @@ void slirp_cleanup(Slirp *slirp)
     ip_cleanup(slirp);
     m_cleanup(slirp);
 
+#ifdef CONFIG_EPOLL
+    if (slirp->epoll_fd >= 0) {
+        close(slirp->epoll_fd);
+    }
+#endif
+
     g_free(slirp->vdnssearch);
     g_free(slirp->tftp_prefix);
     g_free(slirp->bootp_filename);
@@ -265,7 +279,6 @@ void slirp_cleanup(Slirp *slirp)
 
 #define CONN_CANFSEND(so) (((so)->so_state & (SS_FCANTSENDMORE|SS_ISFCONNECTED)) == SS_ISFCONNECTED)
 #define CONN_CANFRCV(so) (((so)->so_state & (SS_FCANTRCVMORE|SS_ISFCONNECTED)) == SS_ISFCONNECTED)
-#define UPD_NFDS(x) if (nfds < (x)) nfds = (x)
 
 void slirp_update_timeout(uint32_t *timeout)
 {
@@ -274,343 +287,506 @@ void slirp_update_timeout(uint32_t *timeout)
     }
 }
 
+/*
+ * Return the G_IO_* events a socket wants to be polled for.
+ */
+static int slirp_socket_events(struct socket *so)
+{
+    Slirp *slirp = so->slirp;
+    int events = 0;
+
+    if (so->so_head == &slirp->tcb) {
+        /*
+         * See if we need a tcp_fasttimo
+         */
+        if (time_fasttimo == 0 && so->so_tcpcb->t_flags & TF_DELACK) {
+            time_fasttimo = curtime; /* Flag when we want a fasttimo */
+        }
+
+        /*
+         * NOFDREF can include still connecting to local-host,
+         * newly socreated() sockets etc. Don't want to select these.
+         */
+        if (so->so_state & SS_NOFDREF || so->s == -1) {
+            return 0;
+        }
+
+        /*
+         * Set for reading sockets which are accepting
+         */
+        if (so->so_state & SS_FACCEPTCONN) {
+            return G_IO_IN;
+        }
+
+        /*
+         * Set for writing sockets which are connecting
+         */
+        if (so->so_state & SS_ISFCONNECTING) {
+            return G_IO_OUT;
+        }
+
+        /*
+         * Set for writing if we are connected, can send more, and
+         * we have something to send
+         */
+        if (CONN_CANFSEND(so) && so->so_rcv.sb_cc) {
+            events |= G_IO_OUT;
+        }
+
+        /*
+         * Set for reading (and urgent data) if we are connected, can
+         * receive more, and we have room for it XXX /2 ?
+         */
+        if (CONN_CANFRCV(so) &&
+            (so->so_snd.sb_cc < (so->so_snd.sb_datalen/2))) {
+            events |= G_IO_IN | G_IO_PRI;
+        }
+    } else if (so->s != -1 && (so->so_state & SS_ISFCONNECTED)) {
+        /*
+         * When UDP packets are received from over the
+         * link, they're sendto()'d straight away, so
+         * no need for setting for writing
+         * Limit the number of packets queued by this session
+         * to 4.  Note that even though we try and limit this
+         * to 4 packets, the session could have more queued
+         * if the packets needed to be fragmented
+         * (XXX <= 4 ?)
+         */
+        if (so->so_head == &slirp->icmp || so->so_queued <= 4) {
+            events |= G_IO_IN;
+        }
+    }
+
+    return events;
+}
+
+/*
+ * Handle the events in so->so_revents.  Socket state changes made while
+ * handling them clear the events that no longer apply.
+ */
+static void slirp_socket_poll(struct socket *so)
+{
+    Slirp *slirp = so->slirp;
+    int ret;
+
+    if (so->so_head == &slirp->udb) {
+        if (so->so_revents & G_IO_IN) {
+            sorecvfrom(so);
+        }
+        return;
+    }
+    if (so->so_head == &slirp->icmp) {
+        if (so->so_revents & G_IO_IN) {
+            icmp_receive(so);
+        }
+        return;
+    }
+
+    /*
+     * Events are meaningless on these sockets
+     * (and they can crash the program)
+     */
+    if (so->so_state & SS_NOFDREF || so->s == -1) {
+        return;
+    }
+
+    /*
+     * Check for URG data
+     * This will soread as well, so no need to
+     * test for readfds below if this succeeds
+     */
+    if (so->so_revents & G_IO_PRI) {
+        sorecvoob(so);
+    }
+    /*
+     * Check sockets for reading
+     */
+    else if (so->so_revents & G_IO_IN) {
+        /*
+         * Check for incoming connections
+         */
+        if (so->so_state & SS_FACCEPTCONN) {
+            tcp_connect(so);
+            return;
+        } /* else */
+        ret = soread(so);
+
+        /* Output it if we read something */
+        if (ret > 0) {
+            tcp_output(sototcpcb(so));
+        }
+    }
+
+    /*
+     * Check sockets for writing
+     */
+    if (so->so_revents & G_IO_OUT) {
+        /*
+         * Check for non-blocking, still-connecting sockets
+         */
+        if (so->so_state & SS_ISFCONNECTING) {
+            /* Connected */
+            so->so_state &= ~SS_ISFCONNECTING;
+
+            ret = send(so->s, (const void *) &ret, 0, 0);
+            if (ret < 0) {
+                /* XXXXX Must fix, zero bytes is a NOP */
+                if (errno == EAGAIN || errno == EWOULDBLOCK ||
+                    errno == EINPROGRESS || errno == ENOTCONN) {
+                    return;
+                }
+
+                /* else failed */
+                so->so_state &= SS_PERSISTENT_MASK;
+                so->so_state |= SS_NOFDREF;
+            }
+            /* else so->so_state &= ~SS_ISFCONNECTING; */
+
+            /*
+             * Continue tcp_input
+             */
+            tcp_input((struct mbuf *)NULL, sizeof(struct ip), so);
+            /* continue; */
+        } else {
+            ret = sowrite(so);
+        }
+        /*
+         * XXXXX If we wrote something (a lot), there
+         * could be a need for a window update.
+         * In the worst case, the remote will send
+         * a window probe to get things going again
+         */
+    }
+
+    /*
+     * Probe a still-connecting, non-blocking socket
+     * to check if it's still alive
+     */
+#ifdef PROBE_CONN
+    if (so->so_state & SS_ISFCONNECTING) {
+        ret = qemu_recv(so->s, &ret, 0, 0);
+
+        if (ret < 0) {
+            /* XXX */
+            if (errno == EAGAIN || errno == EWOULDBLOCK ||
+                errno == EINPROGRESS || errno == ENOTCONN) {
+                return; /* Still connecting, continue */
+            }
+
+            /* else failed */
+            so->so_state &= SS_PERSISTENT_MASK;
+            so->so_state |= SS_NOFDREF;
+
+            /* tcp_input will take care of it */
+        } else {
+            ret = send(so->s, &ret, 0, 0);
+            if (ret < 0) {
+                /* XXX */
+                if (errno == EAGAIN || errno == EWOULDBLOCK ||
+                    errno == EINPROGRESS || errno == ENOTCONN) {
+                    return;
+                }
+                /* else failed */
+                so->so_state &= SS_PERSISTENT_MASK;
+                so->so_state |= SS_NOFDREF;
+            } else {
+                so->so_state &= ~SS_ISFCONNECTING;
+            }
+
+        }
+        tcp_input((struct mbuf *)NULL, sizeof(struct ip), so);
+    } /* SS_ISFCONNECTING */
+#endif
+}
+
+/*
+ * Drop UDP and ICMP sockets that have timed out.
+ */
+static void slirp_expire_sockets(Slirp *slirp)
+{
+    struct socket *so, *so_next;
+
+    for (so = slirp->udb.so_next; so != &slirp->udb; so = so_next) {
+        so_next = so->so_next;
+        if (so->so_expire && so->so_expire <= curtime) {
+            udp_detach(so);
+        }
+    }
+    for (so = slirp->icmp.so_next; so != &slirp->icmp; so = so_next) {
+        so_next = so->so_next;
+        if (so->so_expire && so->so_expire <= curtime) {
+            icmp_detach(so);
+        }
+    }
+}
+
+static void slirp_select_fill_list(struct socket *head, int *pnfds,
+                                   fd_set *readfds, fd_set *writefds,
+                                   fd_set *xfds)
+{
+    struct socket *so;
+    int events;
+
+    for (so = head->so_next; so != head; so = so->so_next) {
+        events = slirp_socket_events(so);
+        if (events & G_IO_IN) {
+            FD_SET(so->s, readfds);
+        }
+        if (events & G_IO_OUT) {
+            FD_SET(so->s, writefds);
+        }
+        if (events & G_IO_PRI) {
+            FD_SET(so->s, xfds);
+        }
+        if (events && *pnfds < so->s) {
+            *pnfds = so->s;
+        }
+    }
+}
+
+static void slirp_select_poll_list(struct socket *head, fd_set *readfds,
+                                   fd_set *writefds, fd_set *xfds)
+{
+    struct socket *so, *so_next;
+
+    for (so = head->so_next; so != head; so = so_next) {
+        so_next = so->so_next;
+
+        if (so->s == -1) {
+            continue;
+        }
+        so->so_revents = 0;
+        if (FD_ISSET(so->s, readfds)) {
+            so->so_revents |= G_IO_IN;
+        }
+        if (FD_ISSET(so->s, writefds)) {
+            so->so_revents |= G_IO_OUT;
+        }
+        if (FD_ISSET(so->s, xfds)) {
+            so->so_revents |= G_IO_PRI;
+        }
+        if (so->so_revents) {
+            slirp_socket_poll(so);
+        }
+    }
+}
+
+#ifdef CONFIG_EPOLL
+/*
+ * Bring the epoll registration of a socket in line with the events it
+ * wants.  Only sockets on the so_changed list are looked at, so the cost
+ * of a main loop iteration does not grow with the number of idle
+ * connections.
+ */
+static void slirp_epoll_update(Slirp *slirp, struct socket *so)
+{
+    struct epoll_event ev;
+    int events = slirp_socket_events(so);
+    int op;
+
+    /* Closing the descriptor dropped the old registration */
+    if (so->so_events && so->so_events_fd != so->s) {
+        so->so_events = 0;
+    }
+    if (events == so->so_events) {
+        return;
+    }
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = (events & G_IO_IN ? EPOLLIN : 0) |
+                (events & G_IO_OUT ? EPOLLOUT : 0) |
+                (events & G_IO_PRI ? EPOLLPRI : 0);
+    ev.data.ptr = so;
+
+    if (!events) {
+        op = EPOLL_CTL_DEL;
+    } else if (!so->so_events) {
+        op = EPOLL_CTL_ADD;
+    } else {
+        op = EPOLL_CTL_MOD;
+    }
+    if (epoll_ctl(slirp->epoll_fd, op, so->s, &ev) < 0) {
+        if (op == EPOLL_CTL_ADD && errno == EEXIST) {
+            epoll_ctl(slirp->epoll_fd, EPOLL_CTL_MOD, so->s, &ev);
+        } else if (op == EPOLL_CTL_MOD && errno == ENOENT) {
+            epoll_ctl(slirp->epoll_fd, EPOLL_CTL_ADD, so->s, &ev);
+        }
+    }
+    so->so_events = events;
+    so->so_events_fd = so->s;
+}
+
+static void slirp_epoll_poll(Slirp *slirp)
+{
+    struct epoll_event events[SLIRP_EPOLL_EVENTS];
+    struct socket *so;
+    int i, n;
+
+    n = epoll_wait(slirp->epoll_fd, events, ARRAY_SIZE(events), 0);
+    if (n <= 0) {
+        return;
+    }
+
+    /* Let sofree() clear the events of sockets freed along the way */
+    slirp->epoll_events = events;
+    slirp->epoll_nevents = n;
+
+    for (i = 0; i < n; i++) {
+        so = events[i].data.ptr;
+        if (!so) {
+            continue;
+        }
+        so->so_revents = 0;
+        if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+            so->so_revents |= G_IO_IN;
+        }
+        if (events[i].events & (EPOLLOUT | EPOLLERR)) {
+            so->so_revents |= G_IO_OUT;
+        }
+        if (events[i].events & EPOLLPRI) {
+            so->so_revents |= G_IO_PRI;
+        }
+        so->so_revents &= so->so_events;
+
+        sochanged(so);
+        slirp_socket_poll(so);
+    }
+
+    slirp->epoll_events = NULL;
+    slirp->epoll_nevents = 0;
+}
+#endif
+
+/*
+ * Called by sofree() to drop any reference the poll loop holds on so.
+ */
+void slirp_socket_forget(struct socket *so)
+{
+#ifdef CONFIG_EPOLL
+    Slirp *slirp = so->slirp;
+    int i;
+
+    if (slirp->epoll_fd < 0) {
+        return;
+    }
+    for (i = 0; i < slirp->epoll_nevents; i++) {
+        if (slirp->epoll_events[i].data.ptr == so) {
+            slirp->epoll_events[i].data.ptr = NULL;
+        }
+    }
+    /* Usually already gone with the descriptor, but not always */
+    if (so->so_events && so->so_events_fd == so->s) {
+        epoll_ctl(slirp->epoll_fd, EPOLL_CTL_DEL, so->s, NULL);
+    }
+#endif
+}
+
 void slirp_select_fill(int *pnfds,
                        fd_set *readfds, fd_set *writefds, fd_set *xfds)
 {
     Slirp *slirp;
-    struct socket *so, *so_next;
-    int nfds;
+    struct socket *so;
 
     if (QTAILQ_EMPTY(&slirp_instances)) {
         return;
     }
 
-    /* fail safe */
-    global_readfds = NULL;
-    global_writefds = NULL;
-    global_xfds = NULL;
-
-    nfds = *pnfds;
-	/*
-	 * First, TCP sockets
-	 */
-	do_slowtimo = 0;
-
-	QTAILQ_FOREACH(slirp, &slirp_instances, entry) {
-		/*
-		 * *_slowtimo needs calling if there are IP fragments
-		 * in the fragment queue, or there are TCP connections active
-		 */
-		do_slowtimo |= ((slirp->tcb.so_next != &slirp->tcb) ||
-		    (&slirp->ipq.ip_link != slirp->ipq.ip_link.next));
-
-		for (so = slirp->tcb.so_next; so != &slirp->tcb;
-		     so = so_next) {
-			so_next = so->so_next;
-
-			/*
-			 * See if we need a tcp_fasttimo
-			 */
-			if (time_fasttimo == 0 && so->so_tcpcb->t_flags & TF_DELACK)
-			   time_fasttimo = curtime; /* Flag when we want a fasttimo */
-
-			/*
-			 * NOFDREF can include still connecting to local-host,
-			 * newly socreated() sockets etc. Don't want to select these.
-	 		 */
-			if (so->so_state & SS_NOFDREF || so->s == -1)
-			   continue;
-
-			/*
-			 * Set for reading sockets which are accepting
-			 */
-			if (so->so_state & SS_FACCEPTCONN) {
-                                FD_SET(so->s, readfds);
-				UPD_NFDS(so->s);
-				continue;
-			}
-
-			/*
-			 * Set for writing sockets which are connecting
-			 */
-			if (so->so_state & SS_ISFCONNECTING) {
-				FD_SET(so->s, writefds);
-				UPD_NFDS(so->s);
-				continue;
-			}
-
-			/*
-			 * Set for writing if we are connected, can send more, and
-			 * we have something to send
-			 */
-			if (CONN_CANFSEND(so) && so->so_rcv.sb_cc) {
-				FD_SET(so->s, writefds);
-				UPD_NFDS(so->s);
-			}
-
-			/*
-			 * Set for reading (and urgent data) if we are connected, can
-			 * receive more, and we have room for it XXX /2 ?
-			 */
-			if (CONN_CANFRCV(so) && (so->so_snd.sb_cc < (so->so_snd.sb_datalen/2))) {
-				FD_SET(so->s, readfds);
-				FD_SET(so->s, xfds);
-				UPD_NFDS(so->s);
-			}
-		}
-
-		/*
-		 * UDP sockets
-		 */
-		for (so = slirp->udb.so_next; so != &slirp->udb;
-		     so = so_next) {
-			so_next = so->so_next;
-
-			/*
-			 * See if it's timed out
-			 */
-			if (so->so_expire) {
-				if (so->so_expire <= curtime) {
-					udp_detach(so);
-					continue;
-				} else
-					do_slowtimo = 1; /* Let socket expire */
-			}
-
-			/*
-			 * When UDP packets are received from over the
-			 * link, they're sendto()'d straight away, so
-			 * no need for setting for writing
-			 * Limit the number of packets queued by this session
-			 * to 4.  Note that even though we try and limit this
-			 * to 4 packets, the session could have more queued
-			 * if the packets needed to be fragmented
-			 * (XXX <= 4 ?)
-			 */
-			if ((so->so_state & SS_ISFCONNECTED) && so->so_queued <= 4) {
-				FD_SET(so->s, readfds);
-				UPD_NFDS(so->s);
-			}
-		}
+    do_slowtimo = 0;
 
-                /*
-                 * ICMP sockets
-                 */
-                for (so = slirp->icmp.so_next; so != &slirp->icmp;
-                     so = so_next) {
-                    so_next = so->so_next;
-
-                    /*
-                     * See if it's timed out
-                     */
-                    if (so->so_expire) {
-                        if (so->so_expire <= curtime) {
-                            icmp_detach(so);
-                            continue;
-                        } else {
-                            do_slowtimo = 1; /* Let socket expire */
-                        }
-                    }
-
-                    if (so->so_state & SS_ISFCONNECTED) {
-                        FD_SET(so->s, readfds);
-                        UPD_NFDS(so->s);
-                    }
-                }
-	}
+    QTAILQ_FOREACH(slirp, &slirp_instances, entry) {
+        /*
+         * *_slowtimo needs calling if there are IP fragments
+         * in the fragment queue, TCP connections active, or
+         * UDP and ICMP sockets to expire
+         */
+        do_slowtimo |= ((slirp->tcb.so_next != &slirp->tcb) ||
+            (slirp->udb.so_next != &slirp->udb) ||
+            (slirp->icmp.so_next != &slirp->icmp) ||
+            (&slirp->ipq.ip_link != slirp->ipq.ip_link.next));
+
+        while ((so = QTAILQ_FIRST(&slirp->so_changed)) != NULL) {
+            QTAILQ_REMOVE(&slirp->so_changed, so, so_changed_entry);
+            so->so_changed = 0;
+#ifdef CONFIG_EPOLL
+            if (slirp->epoll_fd >= 0) {
+                slirp_epoll_update(slirp, so);
+            }
+#endif
+        }
 
-        *pnfds = nfds;
+#ifdef CONFIG_EPOLL
+        if (slirp->epoll_fd >= 0) {
+            FD_SET(slirp->epoll_fd, readfds);
+            if (*pnfds < slirp->epoll_fd) {
+                *pnfds = slirp->epoll_fd;
+            }
+            continue;
+        }
+#endif
+
+        slirp_select_fill_list(&slirp->tcb, pnfds, readfds, writefds, xfds);
+        slirp_select_fill_list(&slirp->udb, pnfds, readfds, writefds, xfds);
+        slirp_select_fill_list(&slirp->icmp, pnfds, readfds, writefds, xfds);
+    }
 }
 
 void slirp_select_poll(fd_set *readfds, fd_set *writefds, fd_set *xfds,
                        int select_error)
 {
     Slirp *slirp;
-    struct socket *so, *so_next;
-    int ret;
+    struct socket *so;
 
     if (QTAILQ_EMPTY(&slirp_instances)) {
         return;
     }
 
-    global_readfds = readfds;
-    global_writefds = writefds;
-    global_xfds = xfds;
-
     curtime = qemu_get_clock_ms(rt_clock);
 
     QTAILQ_FOREACH(slirp, &slirp_instances, entry) {
-	/*
-	 * See if anything has timed out
-	 */
-		if (time_fasttimo && ((curtime - time_fasttimo) >= 2)) {
-			tcp_fasttimo(slirp);
-			time_fasttimo = 0;
-		}
-		if (do_slowtimo && ((curtime - last_slowtimo) >= 499)) {
-			ip_slowtimo(slirp);
-			tcp_slowtimo(slirp);
-			last_slowtimo = curtime;
-		}
-
-	/*
-	 * Check sockets
-	 */
-	if (!select_error) {
-		/*
-		 * Check TCP sockets
-		 */
-		for (so = slirp->tcb.so_next; so != &slirp->tcb;
-		     so = so_next) {
-			so_next = so->so_next;
-
-			/*
-			 * FD_ISSET is meaningless on these sockets
-			 * (and they can crash the program)
-			 */
-			if (so->so_state & SS_NOFDREF || so->s == -1)
-			   continue;
-
-			/*
-			 * Check for URG data
-			 * This will soread as well, so no need to
-			 * test for readfds below if this succeeds
-			 */
-			if (FD_ISSET(so->s, xfds))
-			   sorecvoob(so);
-			/*
-			 * Check sockets for reading
-			 */
-			else if (FD_ISSET(so->s, readfds)) {
-				/*
-				 * Check for incoming connections
-				 */
-				if (so->so_state & SS_FACCEPTCONN) {
-					tcp_connect(so);
-					continue;
-				} /* else */
-				ret = soread(so);
-
-				/* Output it if we read something */
-				if (ret > 0)
-				   tcp_output(sototcpcb(so));
-			}
-
-			/*
-			 * Check sockets for writing
-			 */
-			if (FD_ISSET(so->s, writefds)) {
-			  /*
-			   * Check for non-blocking, still-connecting sockets
-			   */
-			  if (so->so_state & SS_ISFCONNECTING) {
-			    /* Connected */
-			    so->so_state &= ~SS_ISFCONNECTING;
-
-			    ret = send(so->s, (const void *) &ret, 0, 0);
-			    if (ret < 0) {
-			      /* XXXXX Must fix, zero bytes is a NOP */
-			      if (errno == EAGAIN || errno == EWOULDBLOCK ||
-				  errno == EINPROGRESS || errno == ENOTCONN)
-				continue;
-
-			      /* else failed */
-			      so->so_state &= SS_PERSISTENT_MASK;
-			      so->so_state |= SS_NOFDREF;
-			    }
-			    /* else so->so_state &= ~SS_ISFCONNECTING; */
-
-			    /*
-			     * Continue tcp_input
-			     */
-			    tcp_input((struct mbuf *)NULL, sizeof(struct ip), so);
-			    /* continue; */
-			  } else
-			    ret = sowrite(so);
-			  /*
-			   * XXXXX If we wrote something (a lot), there
-			   * could be a need for a window update.
-			   * In the worst case, the remote will send
-			   * a window probe to get things going again
-			   */
-			}
-
-			/*
-			 * Probe a still-connecting, non-blocking socket
-			 * to check if it's still alive
-	 	 	 */
-#ifdef PROBE_CONN
-			if (so->so_state & SS_ISFCONNECTING) {
-                          ret = qemu_recv(so->s, &ret, 0,0);
-
-			  if (ret < 0) {
-			    /* XXX */
-			    if (errno == EAGAIN || errno == EWOULDBLOCK ||
-				errno == EINPROGRESS || errno == ENOTCONN)
-			      continue; /* Still connecting, continue */
-
-			    /* else failed */
-			    so->so_state &= SS_PERSISTENT_MASK;
-			    so->so_state |= SS_NOFDREF;
-
-			    /* tcp_input will take care of it */
-			  } else {
-			    ret = send(so->s, &ret, 0,0);
-			    if (ret < 0) {
-			      /* XXX */
-			      if (errno == EAGAIN || errno == EWOULDBLOCK ||
-				  errno == EINPROGRESS || errno == ENOTCONN)
-				continue;
-			      /* else failed */
-			      so->so_state &= SS_PERSISTENT_MASK;
-			      so->so_state |= SS_NOFDREF;
-			    } else
-			      so->so_state &= ~SS_ISFCONNECTING;
-
-			  }
-			  tcp_input((struct mbuf *)NULL, sizeof(struct ip),so);
-			} /* SS_ISFCONNECTING */
-#endif
-		}
-
-		/*
-		 * Now UDP sockets.
-		 * Incoming packets are sent straight away, they're not buffered.
-		 * Incoming UDP data isn't buffered either.
-		 */
-		for (so = slirp->udb.so_next; so != &slirp->udb;
-		     so = so_next) {
-			so_next = so->so_next;
-
-			if (so->s != -1 && FD_ISSET(so->s, readfds)) {
-                            sorecvfrom(so);
-                        }
-		}
+        /*
+         * See if anything has timed out
+         */
+        if (time_fasttimo && ((curtime - time_fasttimo) >= 2)) {
+            tcp_fasttimo(slirp);
+            time_fasttimo = 0;
+        }
+        if (do_slowtimo && ((curtime - last_slowtimo) >= 499)) {
+            ip_slowtimo(slirp);
+            tcp_slowtimo(slirp);
+            slirp_expire_sockets(slirp);
+            last_slowtimo = curtime;
+
+            /* The TCP timers may have changed any connection's state */
+            for (so = slirp->tcb.so_next; so != &slirp->tcb;
+                 so = so->so_next) {
+                sochanged(so);
+            }
+        }
 
+        /*
+         * Check sockets
+         */
+        if (!select_error) {
+#ifdef CONFIG_EPOLL
+            if (slirp->epoll_fd >= 0) {
+                if (FD_ISSET(slirp->epoll_fd, readfds)) {
+                    slirp_epoll_poll(slirp);
+                }
+            } else
+#endif
+            {
                 /*
-                 * Check incoming ICMP relies.
+                 * UDP and ICMP: incoming packets are sent straight
+                 * away, they're not buffered.
                  */
-                for (so = slirp->icmp.so_next; so != &slirp->icmp;
-                     so = so_next) {
-                     so_next = so->so_next;
-
-                    if (so->s != -1 && FD_ISSET(so->s, readfds)) {
-                        icmp_receive(so);
-                    }
-                }
-	}
+                slirp_select_poll_list(&slirp->tcb, readfds, writefds, xfds);
+                slirp_select_poll_list(&slirp->udb, readfds, writefds, xfds);
+                slirp_select_poll_list(&slirp->icmp, readfds, writefds, xfds);
+            }
+        }
 
         if_start(slirp);
     }
-
-	/* clear global file descriptor sets.
-	 * these reside on the stack in vl.c
-	 * so they're unusable if we're not in
-	 * slirp_select_fill or slirp_select_poll.
-	 */
-	 global_readfds = NULL;
-	 global_writefds = NULL;
-	 global_xfds = NULL;
 }
 
 static void arp_input(Slirp *slirp, const uint8_t *pkt, int pkt_len)
@@ -1075,6 +1251,7 @@ static int slirp_socket_load(QEMUFile *f, struct socket *so)
     so->so_laddr.s_addr = qemu_get_be32(f);
     so->so_fport = qemu_get_be16(f);
     so->so_lport = qemu_get_be16(f);
+    sohash_insert(&so->slirp->tcp_hash, so);
     so->so_iptos = qemu_get_byte(f);
     so->so_emu = qemu_get_byte(f);
     so->so_type = qemu_get_byte(f);
@@ -122,6 +122,10 @@ void free(void *ptr);
 
 #include <sys/stat.h>
 
+#ifdef CONFIG_EPOLL
+#include <sys/epoll.h>
+#endif
+
 /* Avoid conflicting with the libc insque() and remque(), which
    have different prototypes. */
 #define insque slirp_insque
@@ -238,15 +242,25 @@ struct Slirp {
     size_t vdnssearch_len;
     uint8_t *vdnssearch;
 
+    /* sockets whose poll events must be recomputed */
+    QTAILQ_HEAD(, socket) so_changed;
+#ifdef CONFIG_EPOLL
+    int epoll_fd;           /* -1 if the sockets are select()ed */
+    struct epoll_event *epoll_events; /* events being dispatched */
+    int epoll_nevents;
+#endif
+
     /* tcp states */
     struct socket tcb;
     struct socket *tcp_last_so;
+    struct sohash tcp_hash;
     tcp_seq tcp_iss;        /* tcp initial send seq # */
     uint32_t tcp_now;       /* for RFC 1323 timestamps */
 
     /* udp states */
     struct socket udb;
     struct socket *udp_last_so;
+    struct sohash udp_hash;
 
     /* icmp states */
     struct socket icmp;
@@ -285,6 +299,8 @@ void if_start(struct ttys *);
  long gethostid(void);
 #endif
 
+void slirp_socket_forget(struct socket *so);
+
 void lprint(const char *, ...) GCC_FMT_ATTR(1, 2);
 
 #ifndef _WIN32
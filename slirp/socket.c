@@ -15,24 +15,76 @@
 static void sofcantrcvmore(struct socket *so);
 static void sofcantsendmore(struct socket *so);
 
+void
+sohash_init(struct sohash *h, int local)
+{
+	memset(h, 0, sizeof(*h));
+	h->sh_local = local;
+}
+
+static struct socket **
+sohash_bucket(struct sohash *h, struct in_addr laddr, u_int lport,
+              struct in_addr faddr, u_int fport)
+{
+	uint32_t key = laddr.s_addr ^ (lport << 16);
+
+	if (!h->sh_local)
+		key ^= faddr.s_addr * 0x9e3779b1 ^ fport;
+	key ^= key >> 16;
+	key *= 0x85ebca6b;
+	key ^= key >> 13;
+	return &h->sh_table[key & (SO_HASH_SIZE - 1)];
+}
+
+static void
+sohash_remove(struct socket *so)
+{
+	struct socket **p;
+
+	for (p = so->so_hash; *p; p = &(*p)->so_hash_next) {
+		if (*p == so) {
+			*p = so->so_hash_next;
+			break;
+		}
+	}
+	so->so_hash = NULL;
+	so->so_hash_next = NULL;
+}
+
+/*
+ * (Re)hash a socket under its current addresses and ports.  Must be
+ * called whenever those change on a socket that solookup() should find.
+ */
+void
+sohash_insert(struct sohash *h, struct socket *so)
+{
+	struct socket **bucket;
+
+	if (so->so_hash)
+		sohash_remove(so);
+	bucket = sohash_bucket(h, so->so_laddr, so->so_lport,
+	                       so->so_faddr, so->so_fport);
+	so->so_hash_next = *bucket;
+	*bucket = so;
+	so->so_hash = bucket;
+}
+
 struct socket *
-solookup(struct socket *head, struct in_addr laddr, u_int lport,
+solookup(struct sohash *h, struct in_addr laddr, u_int lport,
          struct in_addr faddr, u_int fport)
 {
 	struct socket *so;
 
-	for (so = head->so_next; so != head; so = so->so_next) {
+	so = *sohash_bucket(h, laddr, lport, faddr, fport);
+	for (; so; so = so->so_hash_next) {
 		if (so->so_lport == lport &&
 		    so->so_laddr.s_addr == laddr.s_addr &&
-		    so->so_faddr.s_addr == faddr.s_addr &&
-		    so->so_fport == fport)
+		    (h->sh_local ||
+		     (so->so_faddr.s_addr == faddr.s_addr &&
+		      so->so_fport == fport)))
 		   break;
 	}
-
-	if (so == head)
-	   return (struct socket *)NULL;
 	return so;
-
 }
 
 /*
@@ -76,12 +128,43 @@ sofree(struct socket *so)
   }
   m_free(so->so_m);
 
+  if (so->so_hash)
+    sohash_remove(so);
+  if (so->so_changed)
+    QTAILQ_REMOVE(&slirp->so_changed, so, so_changed_entry);
+  slirp_socket_forget(so);
+
   if(so->so_next && so->so_prev)
     remque(so);  /* crashes if so is not in a queue */
 
   free(so);
 }
 
+/*
+ * insque() a socket on the tcb, udb or icmp list
+ */
+void
+soinsque(struct socket *so, struct socket *head)
+{
+  insque(so, head);
+  so->so_head = head;
+  sochanged(so);
+}
+
+/*
+ * Note that the events so is interested in may have changed, so that
+ * the poll loop recomputes them.  Called for every socket that input
+ * processing, the poll loop or the timers touched.
+ */
+void
+sochanged(struct socket *so)
+{
+  if (!so->so_changed) {
+    so->so_changed = 1;
+    QTAILQ_INSERT_TAIL(&so->slirp->so_changed, so, so_changed_entry);
+  }
+}
+
 size_t sopreprbuf(struct socket *so, struct iovec *iov, int *np)
 {
 	int n, lss, total;
@@ -608,7 +691,7 @@ tcp_listen(Slirp *slirp, uint32_t haddr, u_int hport, uint32_t laddr,
 		free(so);
 		return NULL;
 	}
-	insque(so, &slirp->tcb);
+	soinsque(so, &slirp->tcb);
 
 	/*
 	 * SS_FACCEPTONCE sockets must time out.
@@ -649,6 +732,7 @@ tcp_listen(Slirp *slirp, uint32_t haddr, u_int hport, uint32_t laddr,
 	   so->so_faddr = slirp->vhost_addr;
 	else
 	   so->so_faddr = addr.sin_addr;
+	sohash_insert(&slirp->tcp_hash, so);
 
 	so->s = s;
 	return so;
@@ -680,9 +764,7 @@ sofcantrcvmore(struct socket *so)
 {
 	if ((so->so_state & SS_NOFDREF) == 0) {
 		shutdown(so->s,0);
-		if(global_writefds) {
-		  FD_CLR(so->s,global_writefds);
-		}
+		so->so_revents &= ~G_IO_OUT;
 	}
 	so->so_state &= ~(SS_ISFCONNECTING);
 	if (so->so_state & SS_FCANTSENDMORE) {
@@ -698,12 +780,7 @@ sofcantsendmore(struct socket *so)
 {
 	if ((so->so_state & SS_NOFDREF) == 0) {
             shutdown(so->s,1);           /* send FIN to fhost */
-            if (global_readfds) {
-                FD_CLR(so->s,global_readfds);
-            }
-            if (global_xfds) {
-                FD_CLR(so->s,global_xfds);
-            }
+            so->so_revents &= ~(G_IO_IN | G_IO_PRI);
 	}
 	so->so_state &= ~(SS_ISFCONNECTING);
 	if (so->so_state & SS_FCANTRCVMORE) {
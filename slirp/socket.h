@@ -11,6 +11,18 @@
 #define SO_EXPIRE 240000
 #define SO_EXPIREFAST 10000
 
+#define SO_HASH_SIZE 1024	/* Buckets per socket lookup hash, power of 2 */
+
+/*
+ * Socket lookup hash.  TCP sockets are hashed on the full
+ * (laddr, lport, faddr, fport) tuple, UDP sockets only on the local
+ * half since their foreign address changes with every datagram.
+ */
+struct sohash {
+  struct socket *sh_table[SO_HASH_SIZE];
+  int sh_local;			/* Key on laddr/lport only */
+};
+
 /*
  * Our socket structure
  */
@@ -51,6 +63,16 @@ struct socket {
   struct sbuf so_rcv;		/* Receive buffer */
   struct sbuf so_snd;		/* Send buffer */
   void * extra;			/* Extra pointer */
+
+  struct socket *so_head;	/* tcb, udb or icmp list we are on */
+  struct socket **so_hash;	/* Lookup hash bucket we are in, if any */
+  struct socket *so_hash_next;	/* Next socket in our hash bucket */
+
+  int so_events;		/* G_IO_* events registered for so_events_fd */
+  int so_events_fd;		/* Descriptor so_events were registered for */
+  int so_revents;		/* G_IO_* events being handled by the poll loop */
+  int so_changed;		/* Queued on slirp->so_changed */
+  QTAILQ_ENTRY(socket) so_changed_entry;
 };
 
 
@@ -74,9 +96,13 @@ struct socket {
 #define SS_HOSTFWD		0x1000	/* Socket describes host->guest forwarding */
 #define SS_INCOMING		0x2000	/* Connection was initiated by a host on the internet */
 
-struct socket * solookup(struct socket *, struct in_addr, u_int, struct in_addr, u_int);
+void sohash_init(struct sohash *, int);
+void sohash_insert(struct sohash *, struct socket *);
+struct socket * solookup(struct sohash *, struct in_addr, u_int, struct in_addr, u_int);
 struct socket * socreate(Slirp *);
 void sofree(struct socket *);
+void soinsque(struct socket *, struct socket *);
+void sochanged(struct socket *);
 int soread(struct socket *);
 void sorecvoob(struct socket *);
 int sosendoob(struct socket *);
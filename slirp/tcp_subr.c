@@ -53,6 +53,7 @@ tcp_init(Slirp *slirp)
     slirp->tcp_iss = 1;		/* wrong */
     slirp->tcb.so_next = slirp->tcb.so_prev = &slirp->tcb;
     slirp->tcp_last_so = &slirp->tcb;
+    sohash_init(&slirp->tcp_hash, 0);
 }
 
 void tcp_cleanup(Slirp *slirp)
@@ -440,6 +441,7 @@ tcp_connect(struct socket *inso)
             (loopback_addr.s_addr & loopback_mask)) {
             so->so_faddr = slirp->vhost_addr;
         }
+	sohash_insert(&slirp->tcp_hash, so);
 
 	/* Close the accept() socket, set right state */
 	if (inso->so_state & SS_FACCEPTONCE) {
@@ -472,7 +474,7 @@ tcp_attach(struct socket *so)
 	if ((so->so_tcpcb = tcp_newtcpcb(so)) == NULL)
 	   return -1;
 
-	insque(so, &so->slirp->tcb);
+	soinsque(so, &so->slirp->tcb);
 
 	return 0;
 }
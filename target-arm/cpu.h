@@ -625,6 +625,9 @@ static inline bool cp_access_ok(CPUARMState *env,
 #define TARGET_PHYS_ADDR_SPACE_BITS 40
 #define TARGET_VIRT_ADDR_SPACE_BITS 32
 
+/* STREX and SWP exit with EXCP_ATOMIC under -tcg thread=multi */
+#define TARGET_SUPPORTS_MTTCG 1
+
 static inline CPUARMState *cpu_init(const char *cpu_model)
 {
     ARMCPU *cpu = cpu_arm_init(cpu_model);
@@ -66,6 +66,7 @@ typedef struct DisasContext {
     int vfp_enabled;
     int vec_len;
     int vec_stride;
+    int parallel; /* other vCPUs may run concurrently */
 } DisasContext;
 
 static uint32_t gen_opc_condexec_bits[OPC_BUF_SIZE];
@@ -6285,7 +6286,7 @@ static int disas_coproc_insn(CPUARMState * env, DisasContext *s, uint32_t insn)
                     TCGv_ptr tmpptr;
                     gen_set_pc_im(s->pc);
                     tmp64 = tcg_temp_new_i64();
-                    tmpptr = tcg_const_ptr(ri);
+                    tmpptr = tcg_const_host_ptr(ri);
                     gen_helper_get_cp_reg64(tmp64, cpu_env, tmpptr);
                     tcg_temp_free_ptr(tmpptr);
                 } else {
@@ -6308,7 +6309,7 @@ static int disas_coproc_insn(CPUARMState * env, DisasContext *s, uint32_t insn)
                     TCGv_ptr tmpptr;
                     gen_set_pc_im(s->pc);
                     tmp = tcg_temp_new_i32();
-                    tmpptr = tcg_const_ptr(ri);
+                    tmpptr = tcg_const_host_ptr(ri);
                     gen_helper_get_cp_reg(tmp, cpu_env, tmpptr);
                     tcg_temp_free_ptr(tmpptr);
                 } else {
@@ -6340,7 +6341,7 @@ static int disas_coproc_insn(CPUARMState * env, DisasContext *s, uint32_t insn)
                 tcg_temp_free_i32(tmplo);
                 tcg_temp_free_i32(tmphi);
                 if (ri->writefn) {
-                    TCGv_ptr tmpptr = tcg_const_ptr(ri);
+                    TCGv_ptr tmpptr = tcg_const_host_ptr(ri);
                     gen_set_pc_im(s->pc);
                     gen_helper_set_cp_reg64(cpu_env, tmpptr, tmp64);
                     tcg_temp_free_ptr(tmpptr);
@@ -6354,7 +6355,7 @@ static int disas_coproc_insn(CPUARMState * env, DisasContext *s, uint32_t insn)
                     TCGv_ptr tmpptr;
                     gen_set_pc_im(s->pc);
                     tmp = load_reg(s, rt);
-                    tmpptr = tcg_const_ptr(ri);
+                    tmpptr = tcg_const_host_ptr(ri);
                     gen_helper_set_cp_reg(cpu_env, tmpptr, tmp);
                     tcg_temp_free_ptr(tmpptr);
                     tcg_temp_free_i32(tmp);
@@ -6496,6 +6497,13 @@ static void gen_store_exclusive(DisasContext *s, int rd, int rt, int rt2,
     int done_label;
     int fail_label;
 
+    if (s->parallel) {
+        /* Another vCPU could store to [addr] between the compare and the
+           store below; redo the instruction with all others stopped.  */
+        gen_exception_insn(s, 4, EXCP_ATOMIC);
+        return;
+    }
+
     /* if (env->exclusive_addr == addr && env->exclusive_val == [addr]) {
          [addr] = {Rt};
          {Rd} = 0;
@@ -7279,20 +7287,25 @@ static void disas_arm_insn(CPUARMState * env, DisasContext *s)
                         /* SWP instruction */
                         rm = (insn) & 0xf;
 
-                        /* ??? This is not really atomic.  However we know
-                           we never have multiple CPUs running in parallel,
-                           so it is good enough.  */
-                        addr = load_reg(s, rn);
-                        tmp = load_reg(s, rm);
-                        if (insn & (1 << 22)) {
-                            tmp2 = gen_ld8u(addr, IS_USER(s));
-                            gen_st8(tmp, addr, IS_USER(s));
+                        /* ??? This is not really atomic.  It is good enough
+                           as long as no other vCPU runs in parallel, and
+                           otherwise it is executed with all of them
+                           stopped.  */
+                        if (s->parallel) {
+                            gen_exception_insn(s, 4, EXCP_ATOMIC);
                         } else {
-                            tmp2 = gen_ld32(addr, IS_USER(s));
-                            gen_st32(tmp, addr, IS_USER(s));
+                            addr = load_reg(s, rn);
+                            tmp = load_reg(s, rm);
+                            if (insn & (1 << 22)) {
+                                tmp2 = gen_ld8u(addr, IS_USER(s));
+                                gen_st8(tmp, addr, IS_USER(s));
+                            } else {
+                                tmp2 = gen_ld32(addr, IS_USER(s));
+                                gen_st32(tmp, addr, IS_USER(s));
+                            }
+                            tcg_temp_free_i32(addr);
+                            store_reg(s, rd, tmp2);
                         }
-                        tcg_temp_free_i32(addr);
-                        store_reg(s, rd, tmp2);
                     }
                 }
             } else {
@@ -9743,6 +9756,7 @@ static inline void gen_intermediate_code_internal(CPUARMState *env,
     dc->vfp_enabled = ARM_TBFLAG_VFPEN(tb->flags);
     dc->vec_len = ARM_TBFLAG_VECLEN(tb->flags);
     dc->vec_stride = ARM_TBFLAG_VECSTRIDE(tb->flags);
+    dc->parallel = parallel_cpus && !(tb->cflags & CF_EXCLUSIVE);
     cpu_F0s = tcg_temp_new_i32();
     cpu_F1s = tcg_temp_new_i32();
     cpu_F0d = tcg_temp_new_i64();
@@ -9936,8 +9950,18 @@ static inline void gen_intermediate_code_internal(CPUARMState *env,
         case DISAS_NEXT:
             gen_goto_tb(dc, 1, dc->pc);
             break;
-        default:
         case DISAS_JUMP:
+            if (TCG_TARGET_HAS_goto_ptr) {
+                /* indirect branch: look the next TB up from here */
+                TCGv_ptr ptr = tcg_temp_new_ptr();
+
+                gen_helper_lookup_tb_ptr(ptr, cpu_env);
+                tcg_gen_goto_ptr(ptr);
+                tcg_temp_free_ptr(ptr);
+                break;
+            }
+            /* fall through */
+        default:
         case DISAS_UPDATE:
             /* indicate that the hash table must be used to find the next TB */
             tcg_gen_exit_tb(0);
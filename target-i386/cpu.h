@@ -1032,6 +1032,9 @@ uint64_t cpu_get_tsc(CPUX86State *env);
 #define TARGET_VIRT_ADDR_SPACE_BITS 32
 #endif
 
+/* LOCK-prefixed instructions exit with EXCP_ATOMIC under -tcg thread=multi */
+#define TARGET_SUPPORTS_MTTCG 1
+
 static inline CPUX86State *cpu_init(const char *cpu_model)
 {
     X86CPU *cpu = cpu_x86_init(cpu_model);
@@ -69,32 +69,56 @@ void helper_check_iol(CPUX86State *env, uint32_t t0)
 
 void helper_outb(uint32_t port, uint32_t data)
 {
+    bool locked = tcg_iothread_lock();
+
     cpu_outb(port, data & 0xff);
+    tcg_iothread_unlock(locked);
 }
 
 target_ulong helper_inb(uint32_t port)
 {
-    return cpu_inb(port);
+    bool locked = tcg_iothread_lock();
+    target_ulong val;
+
+    val = cpu_inb(port);
+    tcg_iothread_unlock(locked);
+    return val;
 }
 
 void helper_outw(uint32_t port, uint32_t data)
 {
+    bool locked = tcg_iothread_lock();
+
     cpu_outw(port, data & 0xffff);
+    tcg_iothread_unlock(locked);
 }
 
 target_ulong helper_inw(uint32_t port)
 {
-    return cpu_inw(port);
+    bool locked = tcg_iothread_lock();
+    target_ulong val;
+
+    val = cpu_inw(port);
+    tcg_iothread_unlock(locked);
+    return val;
 }
 
 void helper_outl(uint32_t port, uint32_t data)
 {
+    bool locked = tcg_iothread_lock();
+
     cpu_outl(port, data);
+    tcg_iothread_unlock(locked);
 }
 
 target_ulong helper_inl(uint32_t port)
 {
-    return cpu_inl(port);
+    bool locked = tcg_iothread_lock();
+    target_ulong val;
+
+    val = cpu_inl(port);
+    tcg_iothread_unlock(locked);
+    return val;
 }
 
 void helper_into(CPUX86State *env, int next_eip_addend)
@@ -154,7 +178,10 @@ target_ulong helper_read_crN(CPUX86State *env, int reg)
         break;
     case 8:
         if (!(env->hflags2 & HF2_VINTR_MASK)) {
+            bool locked = tcg_iothread_lock();
+
             val = cpu_get_apic_tpr(env->apic_state);
+            tcg_iothread_unlock(locked);
         } else {
             val = env->v_tpr;
         }
@@ -178,7 +205,10 @@ void helper_write_crN(CPUX86State *env, int reg, target_ulong t0)
         break;
     case 8:
         if (!(env->hflags2 & HF2_VINTR_MASK)) {
+            bool locked = tcg_iothread_lock();
+
             cpu_set_apic_tpr(env->apic_state, t0);
+            tcg_iothread_unlock(locked);
         }
         env->v_tpr = t0 & 0x0f;
         break;
@@ -268,11 +298,14 @@ void helper_rdmsr(CPUX86State *env)
 void helper_wrmsr(CPUX86State *env)
 {
     uint64_t val;
+    bool locked;
 
     cpu_svm_check_intercept_param(env, SVM_EXIT_MSR, 1);
 
     val = ((uint32_t)EAX) | ((uint64_t)((uint32_t)EDX) << 32);
 
+    /* several MSRs are backed by the APIC */
+    locked = tcg_iothread_lock();
     switch ((uint32_t)ECX) {
     case MSR_IA32_SYSENTER_CS:
         env->sysenter_cs = val & 0xffff;
@@ -410,14 +443,17 @@ void helper_wrmsr(CPUX86State *env)
         /* XXX: exception? */
         break;
     }
+    tcg_iothread_unlock(locked);
 }
 
 void helper_rdmsr(CPUX86State *env)
 {
     uint64_t val;
+    bool locked;
 
     cpu_svm_check_intercept_param(env, SVM_EXIT_MSR, 0);
 
+    locked = tcg_iothread_lock();
     switch ((uint32_t)ECX) {
     case MSR_IA32_SYSENTER_CS:
         val = env->sysenter_cs;
@@ -548,6 +584,7 @@ void helper_rdmsr(CPUX86State *env)
         val = 0;
         break;
     }
+    tcg_iothread_unlock(locked);
     EAX = (uint32_t)(val);
     EDX = (uint32_t)(val >> 32);
 }
@@ -600,3 +637,14 @@ void helper_debug(CPUX86State *env)
     env->exception_index = EXCP_DEBUG;
     cpu_loop_exit(env);
 }
+
+void helper_exit_atomic(CPUX86State *env)
+{
+    env->exception_index = EXCP_ATOMIC;
+    cpu_loop_exit(env);
+}
+
+void *helper_lookup_tb_ptr(CPUX86State *env)
+{
+    return tb_lookup_ptr(env);
+}
@@ -123,6 +123,53 @@ static void patch_reloc(uint8_t *code_ptr, int type,
     }
 }
 
+#ifdef TCG_TARGET_EXT_RELOCS
+static bool patch_ext_reloc(uint8_t *code_ptr, uint8_t *site, int type,
+                            tcg_target_long value)
+{
+    tcg_target_long disp;
+
+    if (type & TCG_EXT_BRANCH) {
+        /* tcg_out_branch() only loads the targets it cannot reach */
+        disp = value - (tcg_target_long)site - 5;
+        if (disp == (int32_t)disp) {
+            return false;
+        }
+        type &= ~TCG_EXT_BRANCH;
+    }
+    /* tcg_out_movi() picks the encoding from the value */
+    switch (type) {
+    case TCG_EXT_REL32:
+        disp = value - (tcg_target_long)code_ptr - 4;
+        if (disp != (int32_t)disp) {
+            return false;
+        }
+        *(uint32_t *)code_ptr = disp;
+        return true;
+    case TCG_EXT_ABS32:
+        if (value == 0 || value != (uint32_t)value) {
+            return false;
+        }
+        *(uint32_t *)code_ptr = value;
+        return true;
+    case TCG_EXT_ABS32S:
+        if (value == (uint32_t)value || value != (int32_t)value) {
+            return false;
+        }
+        *(uint32_t *)code_ptr = value;
+        return true;
+    case TCG_EXT_ABS64:
+        if (value == (uint32_t)value || value == (int32_t)value) {
+            return false;
+        }
+        *(uint64_t *)code_ptr = value;
+        return true;
+    default:
+        return false;
+    }
+}
+#endif
+
 /* parse target specific constraints */
 static int target_parse_constraint(TCGArgConstraint *ct, const char **pct_str)
 {
@@ -545,6 +592,31 @@ static void tcg_out_movi(TCGContext *s, TCGType type,
     }
 }
 
+/* Load a host address, recording it so that the code can be moved.  'site'
+   is the start of the branch sequence if the address is a branch target.  */
+static void tcg_out_movi_ext(TCGContext *s, TCGReg ret, tcg_target_long arg,
+                             uint8_t *site)
+{
+    int type, size = 4;
+
+    tcg_out_movi(s, TCG_TYPE_PTR, ret, arg);
+    if (arg == 0) {
+        return;
+    }
+    if (arg == (uint32_t)arg || TCG_TARGET_REG_BITS == 32) {
+        type = TCG_EXT_ABS32;
+    } else if (arg == (int32_t)arg) {
+        type = TCG_EXT_ABS32S;
+    } else {
+        type = TCG_EXT_ABS64;
+        size = 8;
+    }
+    if (site) {
+        type |= TCG_EXT_BRANCH;
+    }
+    tcg_out_ext_reloc(s, s->code_ptr - size, site, type, arg);
+}
+
 static inline void tcg_out_pushi(TCGContext *s, tcg_target_long val)
 {
     if (val == (int8_t)val) {
@@ -958,13 +1030,19 @@ static void tcg_out_movcond64(TCGContext *s, TCGCond cond, TCGArg dest,
 
 static void tcg_out_branch(TCGContext *s, int call, tcg_target_long dest)
 {
-    tcg_target_long disp = dest - (tcg_target_long)s->code_ptr - 5;
+    uint8_t *site = s->code_ptr;
+    tcg_target_long disp = dest - (tcg_target_long)site - 5;
 
     if (disp == (int32_t)disp) {
         tcg_out_opc(s, call ? OPC_CALL_Jz : OPC_JMP_long, 0, 0, 0);
         tcg_out32(s, disp);
+        /* only targets outside of this TB move with respect to it */
+        if (dest < (tcg_target_long)s->code_buf
+            || dest >= (tcg_target_long)site) {
+            tcg_out_ext_reloc(s, s->code_ptr - 4, site, TCG_EXT_REL32, dest);
+        }
     } else {
-        tcg_out_movi(s, TCG_TYPE_PTR, TCG_REG_R10, dest);
+        tcg_out_movi_ext(s, TCG_REG_R10, dest, site);
         tcg_out_modrm(s, OPC_GRP5,
                       call ? EXT5_CALLN_Ev : EXT5_JMPN_Ev, TCG_REG_R10);
     }
@@ -1059,8 +1137,10 @@ static inline void tcg_out_tlb_load(TCGContext *s, int addrlo_idx,
 
     tgen_arithi(s, ARITH_AND + rexw, r1,
                 TARGET_PAGE_MASK | ((1 << s_bits) - 1), 0);
-    tgen_arithi(s, ARITH_AND + rexw, r0,
-                (CPU_TLB_SIZE - 1) << CPU_TLB_ENTRY_BITS, 0);
+    /* and tlb_mask[mem_index](env), r0 -- the TLB size is dynamic */
+    tcg_out_modrm_offset(s, OPC_ARITH_GvEv + (ARITH_AND << 3) + rexw, r0,
+                         TCG_AREG0,
+                         offsetof(CPUArchState, tlb_mask[mem_index]));
 
     tcg_out_modrm_sib_offset(s, OPC_LEA + P_REXW, r0, TCG_AREG0, r0, 0,
                              offsetof(CPUArchState, tlb_table[mem_index][0])
@@ -1246,6 +1326,10 @@ static void tcg_out_qemu_ld(TCGContext *s, const TCGArg *args,
            want to enforce this, we can either do an explicit zero-extension
            here, or (if GUEST_BASE == 0, or a segment register is in use)
            use the ADDR32 prefix.  For now, do nothing.  */
+        if (GUEST_BASE && !guest_base_flags) {
+            /* the code embeds the base, see translate-cache.c */
+            s->code_fixed = true;
+        }
         if (GUEST_BASE && guest_base_flags) {
             seg = guest_base_flags;
             offset = 0;
@@ -1373,6 +1457,10 @@ static void tcg_out_qemu_st(TCGContext *s, const TCGArg *args,
            want to enforce this, we can either do an explicit zero-extension
            here, or (if GUEST_BASE == 0, or a segment register is in use)
            use the ADDR32 prefix.  For now, do nothing.  */
+        if (GUEST_BASE && !guest_base_flags) {
+            /* the code embeds the base, see translate-cache.c */
+            s->code_fixed = true;
+        }
         if (GUEST_BASE && guest_base_flags) {
             seg = guest_base_flags;
             offset = 0;
@@ -1660,22 +1748,33 @@ static inline void tcg_out_op(TCGContext *s, TCGOpcode opc,
 
     switch(opc) {
     case INDEX_op_exit_tb:
-        tcg_out_movi(s, TCG_TYPE_PTR, TCG_REG_EAX, args[0]);
+        tcg_out_movi_ext(s, TCG_REG_EAX, args[0], NULL);
         tcg_out_jmp(s, (tcg_target_long) tb_ret_addr);
         break;
     case INDEX_op_goto_tb:
         if (s->tb_jmp_offset) {
             /* direct jump method */
+            /* Align the displacement so that tb_set_jmp_target() patches
+               it with a single atomic store while another vCPU thread
+               may be executing this code.  */
+            while (((uintptr_t)s->code_ptr + 1) & 3) {
+                tcg_out8(s, OPC_XCHG_ax_r32); /* nop */
+            }
             tcg_out8(s, OPC_JMP_long); /* jmp im */
             s->tb_jmp_offset[args[0]] = s->code_ptr - s->code_buf;
             tcg_out32(s, 0);
         } else {
             /* indirect jump method */
+            s->code_fixed = true;
             tcg_out_modrm_offset(s, OPC_GRP5, EXT5_JMPN_Ev, -1,
                                  (tcg_target_long)(s->tb_next + args[0]));
         }
         s->tb_next_offset[args[0]] = s->code_ptr - s->code_buf;
         break;
+    case INDEX_op_goto_ptr:
+        /* jmp *reg */
+        tcg_out_modrm(s, OPC_GRP5, EXT5_JMPN_Ev, args[0]);
+        break;
     case INDEX_op_call:
         if (const_args[0]) {
             tcg_out_calli(s, args[0]);
@@ -2010,6 +2109,7 @@ static inline void tcg_out_op(TCGContext *s, TCGOpcode opc,
 static const TCGTargetOpDef x86_op_defs[] = {
     { INDEX_op_exit_tb, { } },
     { INDEX_op_goto_tb, { } },
+    { INDEX_op_goto_ptr, { "r" } },
     { INDEX_op_call, { "ri" } },
     { INDEX_op_br, { } },
     { INDEX_op_mov_i32, { "r", "r" } },
@@ -2223,6 +2323,10 @@ static void tcg_target_qemu_prologue(TCGContext *s)
     tcg_out_modrm(s, OPC_GRP5, EXT5_JMPN_Ev, tcg_target_call_iarg_regs[1]);
 #endif
 
+    /* Return path for goto_ptr.  Set return value to 0.  */
+    s->code_gen_epilogue = s->code_ptr;
+    tcg_out_movi(s, TCG_TYPE_PTR, TCG_REG_EAX, 0);
+
     /* TB epilogue */
     tb_ret_addr = s->code_ptr;
 
@@ -67,6 +67,15 @@ typedef enum {
 /* used for function call generation */
 #define TCG_REG_CALL_STACK TCG_REG_ESP 
 #define TCG_TARGET_STACK_ALIGN 16
+
+/* Direct jumps are patched with a single aligned 32-bit store and the
+   host memory model is strong enough to run guest vCPUs in parallel.  */
+#define TCG_TARGET_SUPPORTS_MTTCG 1
+
+#if TCG_TARGET_REG_BITS == 64
+/* All host addresses in the generated code are recorded in ext_relocs.  */
+#define TCG_TARGET_EXT_RELOCS 1
+#endif
 #if defined(_WIN64)
 #define TCG_TARGET_CALL_STACK_OFFSET 32
 #else
@@ -96,6 +105,7 @@ typedef enum {
 #else
 #define TCG_TARGET_HAS_movcond_i32      0
 #endif
+#define TCG_TARGET_HAS_goto_ptr         1
 
 #if TCG_TARGET_REG_BITS == 64
 #define TCG_TARGET_HAS_div2_i64         1
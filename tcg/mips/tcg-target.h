@@ -95,6 +95,7 @@ typedef enum {
 #else
 #define TCG_TARGET_HAS_movcond_i32      0
 #endif
+#define TCG_TARGET_HAS_goto_ptr         0
 
 /* optional instructions only implemented on MIPS32R2 */
 #if defined(__mips_isa_rev) && (__mips_isa_rev >= 2)
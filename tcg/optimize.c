@@ -50,10 +50,54 @@ struct tcg_temp_info {
 
 static struct tcg_temp_info temps[TCG_MAX_TEMPS];
 
+/* Constant globals and local temps at the start of a label's basic block:
+   the intersection of the state at each forward branch to the label and
+   of the fall-through state.  Labels targeted by a backward branch start
+   with nothing known.  */
+struct tcg_label_info {
+    bool backward;
+    int nb_consts;              /* -1 until a branch to the label is seen */
+    uint16_t *temp;
+    tcg_target_ulong *val;
+};
+
+/* Full-width values known to be held in CPUArchState fields, either
+   because they were just loaded from there or just stored there.  */
+struct tcg_env_info {
+    TCGType type;
+    tcg_target_long offset;
+    TCGArg temp;
+};
+
+#define TCG_OPT_ENV_SLOTS 8
+
+static struct tcg_env_info env_info[TCG_OPT_ENV_SLOTS];
+static int nb_env_info;
+
+static void reset_env_info(void)
+{
+    nb_env_info = 0;
+}
+
+/* Forget the CPUArchState values held in TEMP, which is being redefined. */
+static void reset_env_info_temp(TCGArg temp)
+{
+    int i;
+
+    for (i = 0; i < nb_env_info; ) {
+        if (env_info[i].temp == temp) {
+            env_info[i] = env_info[--nb_env_info];
+        } else {
+            i++;
+        }
+    }
+}
+
 /* Reset TEMP's state to TCG_TEMP_UNDEF.  If TEMP only had one copy, remove
    the copy flag from the left temp.  */
 static void reset_temp(TCGArg temp)
 {
+    reset_env_info_temp(temp);
     if (temps[temp].state == TCG_TEMP_COPY) {
         if (temps[temp].prev_copy == temps[temp].next_copy) {
             temps[temps[temp].next_copy].state = TCG_TEMP_UNDEF;
@@ -465,24 +509,213 @@ static bool swap_commutative2(TCGArg *p1, TCGArg *p2)
     return false;
 }
 
+static void reset_all_temps(TCGContext *s)
+{
+    memset(temps, 0, s->nb_temps * sizeof(struct tcg_temp_info));
+    reset_env_info();
+}
+
+/* End of a basic block that may fall through: plain temps are dead, but
+   globals and local temps keep their constant values.  Copies are
+   dropped since they may involve plain temps.  */
+static void reset_temps_bb_end(TCGContext *s)
+{
+    int i;
+
+    for (i = 0; i < s->nb_temps; i++) {
+        if (temps[i].state == TCG_TEMP_COPY
+            || (i >= s->nb_globals && !s->temps[i].temp_local)) {
+            temps[i].state = TCG_TEMP_UNDEF;
+        }
+    }
+    reset_env_info();
+}
+
+static struct tcg_env_info *find_env_info(TCGType type, tcg_target_long offset)
+{
+    int i;
+
+    for (i = 0; i < nb_env_info; i++) {
+        if (env_info[i].type == type && env_info[i].offset == offset) {
+            return &env_info[i];
+        }
+    }
+    return NULL;
+}
+
+/* The SIZE bytes at OFFSET in CPUArchState are being written.  */
+static void clobber_env_info(tcg_target_long offset, int size)
+{
+    struct tcg_env_info *e;
+    int i, e_size;
+
+    for (i = 0; i < nb_env_info; ) {
+        e = &env_info[i];
+        e_size = e->type == TCG_TYPE_I32 ? 4 : 8;
+        if (offset < e->offset + e_size && e->offset < offset + size) {
+            *e = env_info[--nb_env_info];
+        } else {
+            i++;
+        }
+    }
+}
+
+static void add_env_info(TCGType type, tcg_target_long offset, TCGArg temp)
+{
+    if (nb_env_info < TCG_OPT_ENV_SLOTS) {
+        env_info[nb_env_info].type = type;
+        env_info[nb_env_info].offset = offset;
+        env_info[nb_env_info].temp = temp;
+        nb_env_info++;
+    }
+}
+
+static bool is_local_state(TCGContext *s, TCGArg temp)
+{
+    return temp < s->nb_globals || s->temps[temp].temp_local;
+}
+
+/* Intersect the constants known at label L with the current state.  */
+static void label_meet(struct tcg_label_info *l)
+{
+    int i, j;
+
+    for (i = j = 0; i < l->nb_consts; i++) {
+        TCGArg t = l->temp[i];
+        if (temps[t].state == TCG_TEMP_CONST && temps[t].val == l->val[i]) {
+            l->temp[j] = t;
+            l->val[j] = l->val[i];
+            j++;
+        }
+    }
+    l->nb_consts = j;
+}
+
+/* Record the state at a branch to label L.  */
+static void tcg_opt_branch(TCGContext *s, struct tcg_label_info *l)
+{
+    int i, n;
+
+    if (l->backward) {
+        return;
+    }
+    if (l->nb_consts >= 0) {
+        label_meet(l);
+        return;
+    }
+    for (i = n = 0; i < s->nb_temps; i++) {
+        if (temps[i].state == TCG_TEMP_CONST && is_local_state(s, i)) {
+            n++;
+        }
+    }
+    l->temp = tcg_malloc(n * sizeof(uint16_t) + 1);
+    l->val = tcg_malloc(n * sizeof(tcg_target_ulong) + 1);
+    l->nb_consts = 0;
+    for (i = 0; i < s->nb_temps; i++) {
+        if (temps[i].state == TCG_TEMP_CONST && is_local_state(s, i)) {
+            l->temp[l->nb_consts] = i;
+            l->val[l->nb_consts] = temps[i].val;
+            l->nb_consts++;
+        }
+    }
+}
+
+/* Compute the state at the start of label L.  REACHABLE is false if the
+   previous op does not fall through.  */
+static void tcg_opt_label(TCGContext *s, struct tcg_label_info *l,
+                          bool reachable)
+{
+    int i;
+
+    if (l->backward || (l->nb_consts < 0 && !reachable)) {
+        reset_all_temps(s);
+    } else if (l->nb_consts < 0) {
+        reset_temps_bb_end(s);
+    } else {
+        if (reachable) {
+            label_meet(l);
+        }
+        reset_all_temps(s);
+        for (i = 0; i < l->nb_consts; i++) {
+            temps[l->temp[i]].state = TCG_TEMP_CONST;
+            temps[l->temp[i]].val = l->val[i];
+        }
+#ifdef CONFIG_PROFILER
+        s->opt_label_const_count += l->nb_consts;
+#endif
+    }
+}
+
+/* Allocate the label states, and find the labels that are the target of
+   a backward branch.  */
+static struct tcg_label_info *tcg_opt_scan_labels(TCGContext *s,
+                                                  uint16_t *tcg_opc_ptr,
+                                                  TCGArg *args)
+{
+    struct tcg_label_info *labels;
+    uint16_t *opc;
+    uint8_t *label_set;
+    int i, label;
+
+    labels = tcg_malloc(s->nb_labels * sizeof(*labels) + 1);
+    label_set = tcg_malloc(s->nb_labels + 1);
+    for (i = 0; i < s->nb_labels; i++) {
+        labels[i].backward = false;
+        labels[i].nb_consts = -1;
+        label_set[i] = 0;
+    }
+
+    for (opc = s->gen_opc_buf; opc < tcg_opc_ptr; opc++) {
+        label = -1;
+        switch (*opc) {
+        case INDEX_op_call:
+            args += (args[0] >> 16) + (args[0] & 0xffff) + 3;
+            continue;
+        case INDEX_op_set_label:
+            label_set[args[0]] = 1;
+            break;
+        case INDEX_op_br:
+            label = args[0];
+            break;
+        CASE_OP_32_64(brcond):
+            label = args[3];
+            break;
+        case INDEX_op_brcond2_i32:
+            label = args[5];
+            break;
+        default:
+            break;
+        }
+        if (label >= 0 && label_set[label]) {
+            labels[label].backward = true;
+        }
+        args += tcg_op_defs[*opc].nb_args;
+    }
+    return labels;
+}
+
 /* Propagate constants and copies, fold constant expressions. */
 static TCGArg *tcg_constant_folding(TCGContext *s, uint16_t *tcg_opc_ptr,
                                     TCGArg *args, TCGOpDef *tcg_op_defs)
 {
-    int i, nb_ops, op_index, nb_temps, nb_globals, nb_call_args;
+    int i, nb_ops, op_index, nb_globals, nb_call_args;
     TCGOpcode op;
     const TCGOpDef *def;
     TCGArg *gen_args;
-    TCGArg tmp;
+    TCGArg tmp, mask;
+    struct tcg_label_info *labels;
+    struct tcg_env_info *e;
+    TCGType type;
+    bool reachable = true;
 
     /* Array VALS has an element for each temp.
        If this temp holds a constant then its value is kept in VALS' element.
        If this temp is a copy of other ones then the other copies are
        available through the doubly linked circular list. */
 
-    nb_temps = s->nb_temps;
     nb_globals = s->nb_globals;
-    memset(temps, 0, nb_temps * sizeof(struct tcg_temp_info));
+    reset_all_temps(s);
+    labels = tcg_opt_scan_labels(s, tcg_opc_ptr, args);
 
     nb_ops = tcg_opc_ptr - s->gen_opc_buf;
     gen_args = args;
@@ -629,6 +862,88 @@ static TCGArg *tcg_constant_folding(TCGContext *s, uint16_t *tcg_opc_ptr,
             break;
         }
 
+        /* Strength reduce multiplications by 1, 2 and -1, and logical
+           operations with an all-ones constant.  */
+        switch (op) {
+        CASE_OP_32_64(mul):
+        CASE_OP_32_64(and):
+        CASE_OP_32_64(or):
+        CASE_OP_32_64(xor):
+            if (temps[args[1]].state == TCG_TEMP_CONST
+                || temps[args[2]].state != TCG_TEMP_CONST) {
+                break;
+            }
+            mask = -1;
+            if (op_bits(op) == 32) {
+                mask = 0xffffffff;
+            }
+            tmp = temps[args[2]].val & mask;
+            if ((tmp == 1 && (op == INDEX_op_mul_i32
+                              || op == INDEX_op_mul_i64))
+                || (tmp == mask && (op == INDEX_op_and_i32
+                                    || op == INDEX_op_and_i64))) {
+                if (temps_are_copies(args[0], args[1])) {
+                    s->gen_opc_buf[op_index] = INDEX_op_nop;
+                } else {
+                    s->gen_opc_buf[op_index] = op_to_mov(op);
+                    tcg_opt_gen_mov(s, gen_args, args[0], args[1]);
+                    gen_args += 2;
+                }
+                args += 3;
+#ifdef CONFIG_PROFILER
+                s->opt_strength_count++;
+#endif
+                continue;
+            }
+            if (tmp == mask && (op == INDEX_op_or_i32
+                                || op == INDEX_op_or_i64)) {
+                s->gen_opc_buf[op_index] = op_to_movi(op);
+                tcg_opt_gen_movi(gen_args, args[0], temps[args[2]].val);
+                gen_args += 2;
+                args += 3;
+#ifdef CONFIG_PROFILER
+                s->opt_strength_count++;
+#endif
+                continue;
+            }
+            if (tmp == 2 && (op == INDEX_op_mul_i32
+                             || op == INDEX_op_mul_i64)) {
+                op = op_bits(op) == 32 ? INDEX_op_add_i32 : INDEX_op_add_i64;
+                s->gen_opc_buf[op_index] = op;
+                args[2] = args[1];
+#ifdef CONFIG_PROFILER
+                s->opt_strength_count++;
+#endif
+                break;
+            }
+            if (tmp != mask) {
+                break;
+            }
+            if (op == INDEX_op_mul_i32 || op == INDEX_op_mul_i64) {
+                op = op_bits(op) == 32 ? INDEX_op_neg_i32 : INDEX_op_neg_i64;
+            } else if (op == INDEX_op_xor_i32 || op == INDEX_op_xor_i64) {
+                op = op_bits(op) == 32 ? INDEX_op_not_i32 : INDEX_op_not_i64;
+            } else {
+                break;
+            }
+            if (tcg_op_defs[op].flags & TCG_OPF_NOT_PRESENT) {
+                op = s->gen_opc_buf[op_index];
+                break;
+            }
+            s->gen_opc_buf[op_index] = op;
+            reset_temp(args[0]);
+            gen_args[0] = args[0];
+            gen_args[1] = args[1];
+            gen_args += 2;
+            args += 3;
+#ifdef CONFIG_PROFILER
+            s->opt_strength_count++;
+#endif
+            continue;
+        default:
+            break;
+        }
+
         /* Simplify expression for "op r, a, a => mov r, a" cases */
         switch (op) {
         CASE_OP_32_64(or):
@@ -688,6 +1003,16 @@ static TCGArg *tcg_constant_folding(TCGContext *s, uint16_t *tcg_opc_ptr,
             args[1] = temps[args[1]].val;
             /* fallthrough */
         CASE_OP_32_64(movi):
+            if (temps[args[0]].state == TCG_TEMP_CONST
+                && temps[args[0]].val == args[1]) {
+                /* the temp already holds this constant */
+                s->gen_opc_buf[op_index] = INDEX_op_nop;
+                args += 2;
+#ifdef CONFIG_PROFILER
+                s->opt_movi_count++;
+#endif
+                break;
+            }
             tcg_opt_gen_movi(gen_args, args[0], args[1]);
             gen_args += 2;
             args += 2;
@@ -768,7 +1093,9 @@ static TCGArg *tcg_constant_folding(TCGContext *s, uint16_t *tcg_opc_ptr,
             tmp = do_constant_folding_cond(op, args[0], args[1], args[2]);
             if (tmp != 2) {
                 if (tmp) {
-                    memset(temps, 0, nb_temps * sizeof(struct tcg_temp_info));
+                    tcg_opt_branch(s, &labels[args[3]]);
+                    reset_all_temps(s);
+                    reachable = false;
                     s->gen_opc_buf[op_index] = INDEX_op_br;
                     gen_args[0] = args[3];
                     gen_args += 1;
@@ -861,7 +1188,9 @@ static TCGArg *tcg_constant_folding(TCGContext *s, uint16_t *tcg_opc_ptr,
             tmp = do_constant_folding_cond2(&args[0], &args[2], args[4]);
             if (tmp != 2) {
                 if (tmp) {
-                    memset(temps, 0, nb_temps * sizeof(struct tcg_temp_info));
+                    tcg_opt_branch(s, &labels[args[5]]);
+                    reset_all_temps(s);
+                    reachable = false;
                     s->gen_opc_buf[op_index] = INDEX_op_br;
                     gen_args[0] = args[5];
                     gen_args += 1;
@@ -875,7 +1204,8 @@ static TCGArg *tcg_constant_folding(TCGContext *s, uint16_t *tcg_opc_ptr,
                        && temps[args[3]].val == 0) {
                 /* Simplify LT/GE comparisons vs zero to a single compare
                    vs the high word of the input.  */
-                memset(temps, 0, nb_temps * sizeof(struct tcg_temp_info));
+                tcg_opt_branch(s, &labels[args[5]]);
+                reset_temps_bb_end(s);
                 s->gen_opc_buf[op_index] = INDEX_op_brcond_i32;
                 gen_args[0] = args[1];
                 gen_args[1] = args[3];
@@ -914,6 +1244,8 @@ static TCGArg *tcg_constant_folding(TCGContext *s, uint16_t *tcg_opc_ptr,
             break;
 
         case INDEX_op_call:
+            /* helpers may write any CPUArchState field */
+            reset_env_info();
             nb_call_args = (args[0] >> 16) + (args[0] & 0xffff);
             if (!(args[nb_call_args + 1] & (TCG_CALL_NO_READ_GLOBALS |
                                             TCG_CALL_NO_WRITE_GLOBALS))) {
@@ -933,15 +1265,127 @@ static TCGArg *tcg_constant_folding(TCGContext *s, uint16_t *tcg_opc_ptr,
             }
             break;
 
+        case INDEX_op_ld_i32:
+        case INDEX_op_ld_i64:
+            /* Reuse a value already loaded from or stored to the same
+               CPUArchState field.  */
+            if (!tcg_temp_is_env(s, args[1])) {
+                goto do_default;
+            }
+            type = op == INDEX_op_ld_i32 ? TCG_TYPE_I32 : TCG_TYPE_I64;
+            if (tcg_env_field_is_global(s, args[2],
+                                        type == TCG_TYPE_I32 ? 4 : 8)) {
+                goto do_default;
+            }
+            e = find_env_info(type, args[2]);
+            if (e) {
+                tmp = e->temp;
+                if (temps_are_copies(args[0], tmp)) {
+                    s->gen_opc_buf[op_index] = INDEX_op_nop;
+                } else if (temps[tmp].state == TCG_TEMP_CONST) {
+                    s->gen_opc_buf[op_index] = op_to_movi(op);
+                    tcg_opt_gen_movi(gen_args, args[0], temps[tmp].val);
+                    gen_args += 2;
+                } else {
+                    s->gen_opc_buf[op_index] = op_to_mov(op);
+                    tcg_opt_gen_mov(s, gen_args, args[0], tmp);
+                    gen_args += 2;
+                }
+                args += 3;
+#ifdef CONFIG_PROFILER
+                s->opt_ld_count++;
+#endif
+                break;
+            }
+            reset_temp(args[0]);
+            add_env_info(type, args[2], args[0]);
+            gen_args[0] = args[0];
+            gen_args[1] = args[1];
+            gen_args[2] = args[2];
+            gen_args += 3;
+            args += 3;
+            break;
+
+        CASE_OP_32_64(st8):
+        CASE_OP_32_64(st16):
+        case INDEX_op_st_i32:
+        case INDEX_op_st32_i64:
+        case INDEX_op_st_i64:
+            if (!tcg_temp_is_env(s, args[1])) {
+                /* may alias CPUArchState */
+                reset_env_info();
+                goto do_default;
+            }
+            switch (op) {
+            CASE_OP_32_64(st8):
+                clobber_env_info(args[2], 1);
+                break;
+            CASE_OP_32_64(st16):
+                clobber_env_info(args[2], 2);
+                break;
+            case INDEX_op_st32_i64:
+                clobber_env_info(args[2], 4);
+                break;
+            case INDEX_op_st_i32:
+                clobber_env_info(args[2], 4);
+                if (!tcg_env_field_is_global(s, args[2], 4)) {
+                    add_env_info(TCG_TYPE_I32, args[2], args[0]);
+                }
+                break;
+            default:
+                clobber_env_info(args[2], 8);
+                if (!tcg_env_field_is_global(s, args[2], 8)) {
+                    add_env_info(TCG_TYPE_I64, args[2], args[0]);
+                }
+                break;
+            }
+            goto do_default;
+
+        case INDEX_op_set_label:
+            tcg_opt_label(s, &labels[args[0]], reachable);
+            reachable = true;
+            gen_args[0] = args[0];
+            gen_args += 1;
+            args += 1;
+            break;
+
         default:
         do_default:
             /* Default case: we know nothing about operation (or were unable
                to compute the operation result) so no propagation is done.
-               We trash everything if the operation is the end of a basic
-               block, otherwise we only trash the output args.  */
+               At the end of a basic block, the branch target gets the
+               current state; globals and local temps keep their constant
+               values if the block falls through.  Otherwise we only trash
+               the output args.  */
             if (def->flags & TCG_OPF_BB_END) {
-                memset(temps, 0, nb_temps * sizeof(struct tcg_temp_info));
+                switch (op) {
+                case INDEX_op_br:
+                    tcg_opt_branch(s, &labels[args[0]]);
+                    reset_all_temps(s);
+                    reachable = false;
+                    break;
+                CASE_OP_32_64(brcond):
+                    tcg_opt_branch(s, &labels[args[3]]);
+                    reset_temps_bb_end(s);
+                    break;
+                case INDEX_op_brcond2_i32:
+                    tcg_opt_branch(s, &labels[args[5]]);
+                    reset_temps_bb_end(s);
+                    break;
+                case INDEX_op_exit_tb:
+                case INDEX_op_goto_ptr:
+                    reset_all_temps(s);
+                    reachable = false;
+                    break;
+                default:
+                    reset_temps_bb_end(s);
+                    break;
+                }
             } else {
+                if (def->flags & (TCG_OPF_CALL_CLOBBER |
+                                  TCG_OPF_SIDE_EFFECTS)) {
+                    reset_env_info();
+                }
                 for (i = 0; i < def->nb_oargs; i++) {
                     reset_temp(args[i]);
                 }
@@ -2360,6 +2360,13 @@ static inline void tcg_gen_exit_tb(tcg_target_long val)
     tcg_gen_op1i(INDEX_op_exit_tb, val);
 }
 
+/* Jump to the host code at ptr, which must be the start of a TB or
+   tcg_ctx.code_gen_epilogue.  */
+static inline void tcg_gen_goto_ptr(TCGv_ptr ptr)
+{
+    tcg_gen_op1i(INDEX_op_goto_ptr, GET_TCGV_PTR(ptr));
+}
+
 static inline void tcg_gen_goto_tb(unsigned idx)
 {
     /* We only support two chained exits.  */
@@ -96,6 +96,9 @@ const size_t tcg_op_defs_max = ARRAY_SIZE(tcg_op_defs);
 static TCGRegSet tcg_target_available_regs[2];
 static TCGRegSet tcg_target_call_clobber_regs;
 
+/* bytes of code_gen_prologue used by tcg_target_qemu_prologue() */
+size_t code_gen_prologue_size;
+
 static inline void tcg_out8(TCGContext *s, uint8_t v)
 {
     *s->code_ptr++ = v;
@@ -171,8 +174,38 @@ int gen_new_label(void)
     return idx;
 }
 
+/* host address relocation processing, see TCGExtReloc */
+
+static inline void tcg_out_ext_reloc(TCGContext *s, uint8_t *ptr,
+                                     uint8_t *site, int type,
+                                     tcg_target_long value)
+{
+    TCGExtReloc *r;
+
+    if (s->nb_ext_relocs >= TCG_MAX_EXT_RELOCS) {
+        s->code_fixed = true;
+        return;
+    }
+    r = &s->ext_relocs[s->nb_ext_relocs++];
+    r->ptr = ptr;
+    r->site = site;
+    r->type = type;
+    r->value = value;
+}
+
 #include "tcg-target.c"
 
+#ifdef TCG_TARGET_EXT_RELOCS
+/* Store 'value' in the field at 'ptr' of code that was moved from where it
+   was generated.  Return false if the backend would not have chosen the
+   same encoding at the new location.  */
+bool tcg_patch_ext_reloc(uint8_t *ptr, uint8_t *site, int type,
+                         tcg_target_long value)
+{
+    return patch_ext_reloc(ptr, site, type, value);
+}
+#endif
+
 /* pool based memory allocation */
 void *tcg_malloc_internal(TCGContext *s, int size)
 {
@@ -266,6 +299,7 @@ void tcg_prologue_init(TCGContext *s)
     s->code_buf = code_gen_prologue;
     s->code_ptr = s->code_buf;
     tcg_target_qemu_prologue(s);
+    code_gen_prologue_size = s->code_ptr - s->code_buf;
     flush_icache_range((tcg_target_ulong)s->code_buf,
                        (tcg_target_ulong)s->code_ptr);
 }
@@ -295,6 +329,8 @@ void tcg_func_start(TCGContext *s)
 
     s->gen_opc_ptr = s->gen_opc_buf;
     s->gen_opparam_ptr = s->gen_opparam_buf;
+    s->nb_ext_relocs = 0;
+    s->code_fixed = false;
 
 #if defined(CONFIG_QEMU_LDST_OPTIMIZATION) && defined(CONFIG_SOFTMMU)
     /* Initialize qemu_ld/st labels to assist code generation at the end of TB
@@ -1188,6 +1224,121 @@ static inline void tcg_set_nop(TCGContext *s, uint16_t *opc_ptr,
     }
 }
 
+/* Return true if ARG is the global holding the CPUArchState pointer. */
+bool tcg_temp_is_env(TCGContext *s, TCGArg arg)
+{
+    return arg < s->nb_globals && s->temps[arg].fixed_reg
+        && s->temps[arg].reg == TCG_AREG0;
+}
+
+/* Return true if the SIZE bytes at OFFSET in CPUArchState overlap the
+   memory slot of a global.  Explicit loads and stores to such fields
+   cannot be optimized, because the register allocator also accesses
+   them.  */
+bool tcg_env_field_is_global(TCGContext *s, tcg_target_long offset, int size)
+{
+    TCGTemp *ts;
+    int i, ts_size;
+
+    for (i = 0; i < s->nb_globals; i++) {
+        ts = &s->temps[i];
+        if (ts->fixed_reg || ts->mem_reg != TCG_AREG0) {
+            continue;
+        }
+        ts_size = ts->type == TCG_TYPE_I32 ? 4 : 8;
+        if (offset < ts->mem_offset + ts_size
+            && ts->mem_offset < offset + size) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Return the size of the host memory access done by OP, or 0 if OP is
+   not one of the ld/st ops.  */
+static int tcg_ldst_size(TCGOpcode op, bool *is_store)
+{
+    *is_store = false;
+    switch (op) {
+    case INDEX_op_st8_i32:
+    case INDEX_op_st8_i64:
+        *is_store = true;
+        /* fall through */
+    case INDEX_op_ld8u_i32:
+    case INDEX_op_ld8s_i32:
+    case INDEX_op_ld8u_i64:
+    case INDEX_op_ld8s_i64:
+        return 1;
+    case INDEX_op_st16_i32:
+    case INDEX_op_st16_i64:
+        *is_store = true;
+        /* fall through */
+    case INDEX_op_ld16u_i32:
+    case INDEX_op_ld16s_i32:
+    case INDEX_op_ld16u_i64:
+    case INDEX_op_ld16s_i64:
+        return 2;
+    case INDEX_op_st_i32:
+    case INDEX_op_st32_i64:
+        *is_store = true;
+        /* fall through */
+    case INDEX_op_ld_i32:
+    case INDEX_op_ld32u_i64:
+    case INDEX_op_ld32s_i64:
+        return 4;
+    case INDEX_op_st_i64:
+        *is_store = true;
+        /* fall through */
+    case INDEX_op_ld_i64:
+        return 8;
+    default:
+        return 0;
+    }
+}
+
+/* liveness analysis: CPUArchState fields stored to later in the basic
+   block, with nothing in between that may read them.  Earlier stores to
+   these fields are dead.  */
+typedef struct TCGEnvStore {
+    tcg_target_long offset;
+    int size;
+} TCGEnvStore;
+
+#define TCG_MAX_ENV_STORES 8
+
+/* Forget the later stores that overlap the SIZE bytes at OFFSET, which
+   are read here.  */
+static int tcg_la_env_read(TCGEnvStore *st, int nb_st,
+                           tcg_target_long offset, int size)
+{
+    int i;
+
+    for (i = 0; i < nb_st; ) {
+        if (offset < st[i].offset + st[i].size
+            && st[i].offset < offset + size) {
+            st[i] = st[--nb_st];
+        } else {
+            i++;
+        }
+    }
+    return nb_st;
+}
+
+/* Return true if a later store covers the SIZE bytes at OFFSET.  */
+static bool tcg_la_env_store_dead(TCGEnvStore *st, int nb_st,
+                                  tcg_target_long offset, int size)
+{
+    int i;
+
+    for (i = 0; i < nb_st; i++) {
+        if (st[i].offset <= offset
+            && offset + size <= st[i].offset + st[i].size) {
+            return true;
+        }
+    }
+    return false;
+}
+
 /* liveness analysis: end of function: all temps are dead, and globals
    should be in memory. */
 static inline void tcg_la_func_end(TCGContext *s, uint8_t *dead_temps,
@@ -1224,6 +1375,9 @@ static void tcg_liveness_analysis(TCGContext *s)
     uint8_t *dead_temps, *mem_temps;
     uint16_t dead_args;
     uint8_t sync_args;
+    TCGEnvStore env_st[TCG_MAX_ENV_STORES];
+    int nb_env_st = 0, size;
+    bool is_store;
     
     s->gen_opc_ptr++; /* skip end */
 
@@ -1253,6 +1407,9 @@ static void tcg_liveness_analysis(TCGContext *s)
                 args++;
                 call_flags = args[nb_oargs + nb_iargs];
 
+                /* helpers may read any CPUArchState field */
+                nb_env_st = 0;
+
                 /* pure functions can be removed if their result is not
                    used */
                 if (call_flags & TCG_CALL_NO_SIDE_EFFECTS) {
@@ -1379,6 +1536,36 @@ static void tcg_liveness_analysis(TCGContext *s)
             nb_iargs = def->nb_iargs;
             nb_oargs = def->nb_oargs;
 
+            /* Remove stores to CPUArchState that are overwritten later
+               in the basic block.  */
+            size = tcg_ldst_size(op, &is_store);
+            if (size == 0) {
+                if (def->flags & (TCG_OPF_BB_END | TCG_OPF_CALL_CLOBBER |
+                                  TCG_OPF_SIDE_EFFECTS)) {
+                    nb_env_st = 0;
+                }
+            } else if (!tcg_temp_is_env(s, args[1])) {
+                /* may alias CPUArchState */
+                nb_env_st = 0;
+            } else if (!is_store) {
+                nb_env_st = tcg_la_env_read(env_st, nb_env_st,
+                                            args[2], size);
+            } else if (tcg_env_field_is_global(s, args[2], size)) {
+                nb_env_st = tcg_la_env_read(env_st, nb_env_st,
+                                            args[2], size);
+            } else if (tcg_la_env_store_dead(env_st, nb_env_st,
+                                             args[2], size)) {
+                tcg_set_nop(s, s->gen_opc_buf + op_index, args, def->nb_args);
+#ifdef CONFIG_PROFILER
+                s->del_st_count++;
+#endif
+                break;
+            } else if (nb_env_st < TCG_MAX_ENV_STORES) {
+                env_st[nb_env_st].offset = args[2];
+                env_st[nb_env_st].size = size;
+                nb_env_st++;
+            }
+
             /* Test if the operation can be removed because all
                its outputs are dead. We assume that nb_oargs == 0
                implies side effects */
@@ -2101,6 +2288,7 @@ static int tcg_reg_alloc_call(TCGContext *s, const TCGOpDef *def,
         tcg_out_ld(s, ts->type, reg, ts->mem_reg, ts->mem_offset);
         func_arg = reg;
         tcg_regset_set_reg(allocated_regs, reg);
+        s->code_fixed = true;
     } else if (ts->val_type == TEMP_VAL_REG) {
         reg = ts->reg;
         if (!tcg_regset_test_reg(arg_ct->u.regs, reg)) {
@@ -2109,6 +2297,7 @@ static int tcg_reg_alloc_call(TCGContext *s, const TCGOpDef *def,
         }
         func_arg = reg;
         tcg_regset_set_reg(allocated_regs, reg);
+        s->code_fixed = true;
     } else if (ts->val_type == TEMP_VAL_CONST) {
         if (tcg_target_const_match(func_addr, arg_ct)) {
             const_func_arg = 1;
@@ -2118,6 +2307,7 @@ static int tcg_reg_alloc_call(TCGContext *s, const TCGOpDef *def,
             tcg_out_movi(s, ts->type, reg, func_addr);
             func_arg = reg;
             tcg_regset_set_reg(allocated_regs, reg);
+            s->code_fixed = true;
         }
     } else {
         tcg_abort();
@@ -2378,6 +2568,17 @@ void tcg_dump_info(FILE *f, fprintf_function cpu_fprintf)
     cpu_fprintf(f, "deleted ops/TB      %0.2f\n",
                 s->tb_count ? 
                 (double)s->del_op_count / s->tb_count : 0);
+    cpu_fprintf(f, "dead env stores/TB  %0.2f\n",
+                s->tb_count ? (double)s->del_st_count / s->tb_count : 0);
+    cpu_fprintf(f, "env loads reused/TB %0.2f\n",
+                s->tb_count ? (double)s->opt_ld_count / s->tb_count : 0);
+    cpu_fprintf(f, "redundant movi/TB   %0.2f\n",
+                s->tb_count ? (double)s->opt_movi_count / s->tb_count : 0);
+    cpu_fprintf(f, "strength red./TB    %0.2f\n",
+                s->tb_count ? (double)s->opt_strength_count / s->tb_count : 0);
+    cpu_fprintf(f, "label consts/TB     %0.2f\n",
+                s->tb_count ?
+                (double)s->opt_label_const_count / s->tb_count : 0);
     cpu_fprintf(f, "avg temps/TB        %0.2f max=%d\n",
                 s->tb_count ? 
                 (double)s->temp_count / s->tb_count : 0,
@@ -386,6 +386,26 @@ typedef struct TCGHelperInfo {
 
 typedef struct TCGContext TCGContext;
 
+/* Host addresses embedded in the generated code of the current TB.  They
+   let translate-cache.c move the code to another location.  */
+enum {
+    TCG_EXT_REL32,      /* 32-bit pc-relative displacement */
+    TCG_EXT_ABS32,      /* 32-bit zero-extended immediate */
+    TCG_EXT_ABS32S,     /* 32-bit sign-extended immediate */
+    TCG_EXT_ABS64,      /* 64-bit immediate */
+};
+/* the immediate is a branch target that did not fit in a displacement */
+#define TCG_EXT_BRANCH 0x10
+
+typedef struct TCGExtReloc {
+    uint8_t *ptr;       /* patched field */
+    uint8_t *site;      /* start of the branch sequence for TCG_EXT_BRANCH */
+    int type;
+    tcg_target_long value;
+} TCGExtReloc;
+
+#define TCG_MAX_EXT_RELOCS 64
+
 struct TCGContext {
     uint8_t *pool_cur, *pool_end;
     TCGPool *pool_first, *pool_current, *pool_first_large;
@@ -402,6 +422,15 @@ struct TCGContext {
     uint16_t *tb_next_offset;
     uint16_t *tb_jmp_offset; /* != NULL if USE_DIRECT_JUMP */
 
+    /* goto_ptr support: returns to cpu_exec() with 0, i.e. no chaining */
+    uint8_t *code_gen_epilogue;
+
+    /* relocatable code support */
+    TCGExtReloc ext_relocs[TCG_MAX_EXT_RELOCS];
+    int nb_ext_relocs;
+    bool code_fixed; /* the code embeds host addresses that are not listed
+                        in ext_relocs */
+
     /* liveness analysis */
     uint16_t *op_dead_args; /* for each operation, each bit tells if the
                                corresponding argument is dead */
@@ -435,6 +464,11 @@ struct TCGContext {
     int64_t temp_count;
     int temp_count_max;
     int64_t del_op_count;
+    int64_t del_st_count; /* dead stores to CPUArchState */
+    int64_t opt_ld_count; /* loads from CPUArchState reused */
+    int64_t opt_strength_count;
+    int64_t opt_movi_count; /* constants already held by the temp */
+    int64_t opt_label_const_count; /* constants kept across labels */
     int64_t code_in_len;
     int64_t code_out_len;
     int64_t interm_time;
@@ -640,6 +674,10 @@ void tcg_gen_shifti_i64(TCGv_i64 ret, TCGv_i64 arg1,
 
 TCGArg *tcg_optimize(TCGContext *s, uint16_t *tcg_opc_ptr, TCGArg *args,
                      TCGOpDef *tcg_op_def);
+bool tcg_temp_is_env(TCGContext *s, TCGArg arg);
+bool tcg_env_field_is_global(TCGContext *s, tcg_target_long offset, int size);
+bool tcg_patch_ext_reloc(uint8_t *ptr, uint8_t *site, int type,
+                         tcg_target_long value);
 
 /* only used for debugging purposes */
 void tcg_register_helper(void *func, const char *name);
@@ -652,7 +690,16 @@ TCGv_i64 tcg_const_i64(int64_t val);
 TCGv_i32 tcg_const_local_i32(int32_t val);
 TCGv_i64 tcg_const_local_i64(int64_t val);
 
+/* A host pointer that is only meaningful in this process: the code that
+   uses it can never be relocated.  */
+static inline TCGv_ptr tcg_const_host_ptr(const void *ptr)
+{
+    tcg_ctx.code_fixed = true;
+    return tcg_const_ptr(ptr);
+}
+
 extern uint8_t *code_gen_prologue;
+extern size_t code_gen_prologue_size;
 
 /* TCG targets may use a different definition of tcg_qemu_tb_exec. */
 #if !defined(tcg_qemu_tb_exec)
@@ -0,0 +1,181 @@
+/*
+ * QTest testcase and benchmark for MMIO dispatch
+ *
+ * Accesses the HPET registers of the PC machine, which go through the
+ * physical page lookup and MemoryRegion dispatch on every access.  The
+ * benchmark is only run in perf mode (gtester -m=perf).
+ *
+ * The remap test moves the register BAR of the default e1000 NIC around
+ * and checks that accesses follow it, i.e. that no stale cached page
+ * lookup survives a change of the memory map.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+#include "libqtest.h"
+#include "qemu-common.h"
+
+#include <glib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#define HPET_BASE   0xfed00000
+#define HPET_ID     0x000
+#define HPET_CFG    0x010
+
+#define PCI_CONFIG_ADDR 0xcf8
+#define PCI_CONFIG_DATA 0xcfc
+#define PCI_COMMAND     0x04
+#define PCI_BAR0        0x10
+
+#define E1000_ID        0x100e8086
+#define E1000_RDBAL     0x2800
+#define BAR_A           0xe0000000
+#define BAR_B           0xe0040000  /* e1000 BAR0 is 128 KB */
+
+#define BENCH_ACCESSES 100000
+
+static uint32_t mmio_readl(uint64_t addr)
+{
+    uint32_t val;
+
+    memread(addr, &val, sizeof(val));
+    return le32_to_cpu(val);
+}
+
+static void mmio_writel(uint64_t addr, uint32_t val)
+{
+    val = cpu_to_le32(val);
+    memwrite(addr, &val, sizeof(val));
+}
+
+static uint32_t pci_config_readl(int devfn, int offset)
+{
+    outl(PCI_CONFIG_ADDR, 0x80000000 | devfn << 8 | offset);
+    return inl(PCI_CONFIG_DATA);
+}
+
+static void pci_config_writel(int devfn, int offset, uint32_t val)
+{
+    outl(PCI_CONFIG_ADDR, 0x80000000 | devfn << 8 | offset);
+    outl(PCI_CONFIG_DATA, val);
+}
+
+static void pci_config_writew(int devfn, int offset, uint16_t val)
+{
+    outl(PCI_CONFIG_ADDR, 0x80000000 | devfn << 8 | offset);
+    outw(PCI_CONFIG_DATA, val);
+}
+
+static int e1000_find(void)
+{
+    int slot;
+
+    for (slot = 0; slot < 32; slot++) {
+        if (pci_config_readl(slot << 3, 0) == E1000_ID) {
+            return slot << 3;
+        }
+    }
+    g_assert_not_reached();
+}
+
+static void hpet_id(void)
+{
+    uint32_t id = mmio_readl(HPET_BASE + HPET_ID);
+
+    /* vendor id in bits 31:16, revision in bits 7:0 */
+    g_assert_cmphex(id >> 16, ==, 0x8086);
+    g_assert_cmphex(id & 0xff, ==, 0x01);
+}
+
+static void hpet_cfg(void)
+{
+    mmio_writel(HPET_BASE + HPET_CFG, 0);
+    g_assert_cmphex(mmio_readl(HPET_BASE + HPET_CFG) & 1, ==, 0);
+}
+
+/* Every step reads the address that was just remapped, which is still in
+ * the page lookup cache from the previous step.
+ */
+static void remap(void)
+{
+    const uint32_t pattern = 0x12345670;
+    int devfn = e1000_find();
+
+    pci_config_writel(devfn, PCI_BAR0, BAR_A);
+    pci_config_writew(devfn, PCI_COMMAND, 0x2);     /* memory space */
+
+    g_assert_cmphex(mmio_readl(BAR_B + E1000_RDBAL), !=, pattern);
+    mmio_writel(BAR_A + E1000_RDBAL, pattern);
+    g_assert_cmphex(mmio_readl(BAR_A + E1000_RDBAL), ==, pattern);
+
+    pci_config_writel(devfn, PCI_BAR0, BAR_B);
+    g_assert_cmphex(mmio_readl(BAR_A + E1000_RDBAL), !=, pattern);
+    g_assert_cmphex(mmio_readl(BAR_B + E1000_RDBAL), ==, pattern);
+
+    pci_config_writew(devfn, PCI_COMMAND, 0);
+    g_assert_cmphex(mmio_readl(BAR_B + E1000_RDBAL), !=, pattern);
+    pci_config_writew(devfn, PCI_COMMAND, 0x2);
+    g_assert_cmphex(mmio_readl(BAR_B + E1000_RDBAL), ==, pattern);
+
+    pci_config_writel(devfn, PCI_BAR0, BAR_A);
+    g_assert_cmphex(mmio_readl(BAR_B + E1000_RDBAL), !=, pattern);
+    g_assert_cmphex(mmio_readl(BAR_A + E1000_RDBAL), ==, pattern);
+
+    pci_config_writew(devfn, PCI_COMMAND, 0);
+}
+
+static void bench_readl(void)
+{
+    double secs;
+    int i;
+
+    g_test_timer_start();
+    for (i = 0; i < BENCH_ACCESSES; i++) {
+        mmio_readl(HPET_BASE + HPET_ID);
+    }
+    secs = g_test_timer_elapsed();
+    g_test_maximized_result(BENCH_ACCESSES / secs,
+                            "%.0f MMIO reads/s", BENCH_ACCESSES / secs);
+}
+
+static void bench_writel(void)
+{
+    double secs;
+    int i;
+
+    g_test_timer_start();
+    for (i = 0; i < BENCH_ACCESSES; i++) {
+        mmio_writel(HPET_BASE + HPET_CFG, 0);
+    }
+    secs = g_test_timer_elapsed();
+    g_test_maximized_result(BENCH_ACCESSES / secs,
+                            "%.0f MMIO writes/s", BENCH_ACCESSES / secs);
+}
+
+int main(int argc, char **argv)
+{
+    QTestState *s = NULL;
+    int ret;
+
+    g_test_init(&argc, &argv, NULL);
+
+    s = qtest_start("-display none");
+
+    qtest_add_func("/mmio/hpet/id", hpet_id);
+    qtest_add_func("/mmio/hpet/cfg", hpet_cfg);
+    qtest_add_func("/mmio/remap", remap);
+    if (g_test_perf()) {
+        qtest_add_func("/mmio/bench/readl", bench_readl);
+        qtest_add_func("/mmio/bench/writel", bench_writel);
+    }
+    ret = g_test_run();
+
+    if (s) {
+        qtest_quit(s);
+    }
+
+    return ret;
+}
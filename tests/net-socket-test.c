@@ -0,0 +1,336 @@
+/*
+ * QTest testcase and packet rate benchmark for the socket network backend
+ *
+ * QEMU runs without a guest and forwards frames between "-net socket"
+ * backends on a vlan; the test is the far end of all of them:
+ *
+ *   vlan 0: udp backend A  <->  udp backend B
+ *   vlan 1: stream backend (one end of a socketpair)  <->  udp backend C
+ *
+ * The tests check that bursts of frames of all sizes up to 64 KB are
+ * forwarded intact and in order, including stream frames that arrive
+ * split across reads.  In perf mode (gtester -m=perf) the benchmarks
+ * report forwarded packets/s from a datagram and from a stream backend.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+#include "libqtest.h"
+#include "qemu-common.h"
+
+#include <glib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define MAX_FRAME       65536
+#define BATCH           64
+#define BENCH_PACKETS   (BATCH * 2048)
+
+typedef struct UDPEnd {
+    int fd;                     /* our socket */
+    struct sockaddr_in qemu;    /* the backend's address */
+} UDPEnd;
+
+static const int frame_sizes[] = { 60, 512, 1514, 9000, 65000 };
+static const int bench_sizes[] = { 64, 1514 };
+
+static UDPEnd udp_a, udp_b, udp_c;
+static int stream;              /* our end of the socketpair */
+static uint8_t frame[MAX_FRAME];
+static uint8_t buf[BATCH * (4 + 1514)];
+
+static void build_frame(uint8_t *f, int size, int seq)
+{
+    int i;
+
+    memset(f, 0xff, 6);
+    memcpy(f + 6, "\x52\x54\x00\x00\x00\x01", 6);
+    f[12] = 0x88;               /* local experimental ethertype */
+    f[13] = 0xb5;
+    for (i = 14; i < size; i++) {
+        f[i] = i + seq;
+    }
+}
+
+static void check_frame(const uint8_t *f, int len, int size, int seq)
+{
+    g_assert_cmpint(len, ==, size);
+    build_frame(frame, size, seq);
+    g_assert(!memcmp(f, frame, size));
+}
+
+/* Fail instead of hanging if nothing arrives on @fd */
+static void wait_readable(int fd)
+{
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+
+    g_assert_cmpint(poll(&pfd, 1, 10000), ==, 1);
+}
+
+static int bound_socket(int type, struct sockaddr_in *addr)
+{
+    socklen_t addrlen = sizeof(*addr);
+    int bufsize = 4 * 1024 * 1024;
+    int fd;
+
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    fd = socket(AF_INET, type, 0);
+    g_assert_cmpint(fd, >=, 0);
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &bufsize, sizeof(bufsize));
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize));
+    g_assert_cmpint(bind(fd, (struct sockaddr *)addr, sizeof(*addr)), ==, 0);
+    g_assert_cmpint(getsockname(fd, (struct sockaddr *)addr, &addrlen), ==, 0);
+    qemu_set_cloexec(fd);
+    return fd;
+}
+
+/* Set up our end of a udp backend and return its -net option */
+static char *udp_end_init(UDPEnd *e, int vlan)
+{
+    struct sockaddr_in ours;
+    int fd;
+
+    e->fd = bound_socket(SOCK_DGRAM, &ours);
+
+    /* find a free port for QEMU */
+    fd = bound_socket(SOCK_DGRAM, &e->qemu);
+    close(fd);
+
+    return g_strdup_printf("-net socket,vlan=%d,udp=127.0.0.1:%d,"
+                           "localaddr=127.0.0.1:%d ", vlan,
+                           ntohs(ours.sin_port), ntohs(e->qemu.sin_port));
+}
+
+/* Nothing stops us from overrunning the socket buffers, which are only
+ * about 200 KB by default; send at most this many frames before reading.
+ */
+static int burst_len(int size)
+{
+    return MAX(1, MIN(BATCH, 64 * 1024 / size));
+}
+
+static void udp_send(UDPEnd *e, const uint8_t *f, int size)
+{
+    g_assert_cmpint(sendto(e->fd, f, size, 0, (struct sockaddr *)&e->qemu,
+                           sizeof(e->qemu)), ==, size);
+}
+
+static int udp_recv(UDPEnd *e, uint8_t *f, int size)
+{
+    wait_readable(e->fd);
+    return recv(e->fd, f, size, 0);
+}
+
+/* -net socket streams carry each frame behind a 32-bit big-endian length */
+static void stream_io(bool out, uint8_t *p, size_t len)
+{
+    size_t done = 0;
+    ssize_t ret;
+
+    while (done < len) {
+        if (out) {
+            ret = write(stream, p + done, len - done);
+        } else {
+            ret = read(stream, p + done, len - done);
+        }
+        g_assert(ret > 0 || errno == EINTR);
+        done += MAX(ret, 0);
+    }
+}
+
+static void stream_put_len(uint8_t *p, uint32_t len)
+{
+    len = cpu_to_be32(len);
+    memcpy(p, &len, 4);
+}
+
+static int stream_recv(uint8_t *f)
+{
+    uint32_t len;
+
+    stream_io(false, (uint8_t *)&len, 4);
+    len = be32_to_cpu(len);
+    g_assert_cmpint(len, <=, MAX_FRAME);
+    stream_io(false, f, len);
+    return len;
+}
+
+/* Tests */
+
+static void test_udp(void)
+{
+    static uint8_t got[MAX_FRAME];
+    int s, i;
+
+    for (s = 0; s < ARRAY_SIZE(frame_sizes); s++) {
+        int size = frame_sizes[s];
+        int n = burst_len(size);
+
+        for (i = 0; i < n; i++) {
+            build_frame(frame, size, i);
+            udp_send(&udp_a, frame, size);
+        }
+        for (i = 0; i < n; i++) {
+            check_frame(got, udp_recv(&udp_b, got, size + 1), size, i);
+        }
+
+        build_frame(frame, size, 0);
+        udp_send(&udp_b, frame, size);
+        check_frame(got, udp_recv(&udp_a, got, size + 1), size, 0);
+    }
+}
+
+/* Stream to datagram: several frames per write, and frames split across
+ * writes at every point of the length header and the payload.
+ */
+static void test_stream(void)
+{
+    static uint8_t out[2 * (4 + MAX_FRAME)];
+    static uint8_t got[MAX_FRAME];
+    int s, i, len;
+
+    for (s = 0; s < ARRAY_SIZE(frame_sizes); s++) {
+        int size = frame_sizes[s];
+        int splits[] = { 1, 3, 4, 5, 4 + size / 2, 4 + size - 1 };
+
+        /* two frames in one write */
+        for (i = 0; i < 2; i++) {
+            stream_put_len(out + i * (4 + size), size);
+            build_frame(out + i * (4 + size) + 4, size, i);
+        }
+        stream_io(true, out, 2 * (4 + size));
+        for (i = 0; i < 2; i++) {
+            check_frame(got, udp_recv(&udp_c, got, size + 1), size, i);
+        }
+
+        /* one frame in two writes; QEMU gets to read in between */
+        for (i = 0; i < ARRAY_SIZE(splits); i++) {
+            stream_put_len(out, size);
+            build_frame(out + 4, size, i);
+            stream_io(true, out, splits[i]);
+            g_usleep(1000);
+            stream_io(true, out + splits[i], 4 + size - splits[i]);
+            check_frame(got, udp_recv(&udp_c, got, size + 1), size, i);
+        }
+
+        /* and back */
+        build_frame(frame, size, 0);
+        udp_send(&udp_c, frame, size);
+        len = stream_recv(got);
+        check_frame(got, len, size, 0);
+    }
+}
+
+/* Benchmarks */
+
+static void bench_report(const char *from, int size, int packets,
+                         double secs)
+{
+    double pps = packets / secs;
+
+    g_test_maximized_result(pps, "%s to udp %4d bytes: %.0f packets/s, "
+                            "%.1f MB/s", from, size, pps, pps * size / 1e6);
+}
+
+static void bench_udp(void)
+{
+    double secs;
+    int s, i, j;
+
+    for (s = 0; s < ARRAY_SIZE(bench_sizes); s++) {
+        int size = bench_sizes[s];
+        int n = burst_len(size);
+
+        build_frame(frame, size, 0);
+        g_test_timer_start();
+        for (i = 0; i < BENCH_PACKETS; i += n) {
+            for (j = 0; j < n; j++) {
+                udp_send(&udp_a, frame, size);
+            }
+            for (j = 0; j < n; j++) {
+                g_assert_cmpint(udp_recv(&udp_b, buf, sizeof(buf)), ==, size);
+            }
+        }
+        secs = g_test_timer_elapsed();
+        bench_report("udp", size, i, secs);
+    }
+}
+
+static void bench_stream(void)
+{
+    double secs;
+    int s, i, j;
+
+    for (s = 0; s < ARRAY_SIZE(bench_sizes); s++) {
+        int size = bench_sizes[s];
+        int n = burst_len(size);
+
+        for (j = 0; j < n; j++) {
+            stream_put_len(buf + j * (4 + size), size);
+            build_frame(buf + j * (4 + size) + 4, size, 0);
+        }
+        g_test_timer_start();
+        for (i = 0; i < BENCH_PACKETS; i += n) {
+            stream_io(true, buf, n * (4 + size));
+            for (j = 0; j < n; j++) {
+                g_assert_cmpint(udp_recv(&udp_c, frame, sizeof(frame)),
+                                ==, size);
+            }
+        }
+        secs = g_test_timer_elapsed();
+        bench_report("stream", size, i, secs);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    struct timeval tv = { .tv_sec = 10 };
+    QTestState *s = NULL;
+    char *a, *b, *c, *args;
+    int sv[2];
+    int ret;
+
+    g_test_init(&argc, &argv, NULL);
+
+    g_assert_cmpint(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), ==, 0);
+    setsockopt(sv[0], SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    setsockopt(sv[0], SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    qemu_set_cloexec(sv[0]);
+    stream = sv[0];
+
+    a = udp_end_init(&udp_a, 0);
+    b = udp_end_init(&udp_b, 0);
+    c = udp_end_init(&udp_c, 1);
+    args = g_strdup_printf("-display none -nodefaults %s%s%s"
+                           "-net socket,vlan=1,fd=%d", a, b, c, sv[1]);
+    s = qtest_start(args);
+    g_free(args);
+    g_free(a);
+    g_free(b);
+    g_free(c);
+    close(sv[1]);
+
+    qtest_add_func("/net-socket/udp", test_udp);
+    qtest_add_func("/net-socket/stream", test_stream);
+    if (g_test_perf()) {
+        qtest_add_func("/net-socket/bench/udp", bench_udp);
+        qtest_add_func("/net-socket/bench/stream", bench_stream);
+    }
+    ret = g_test_run();
+
+    if (s) {
+        qtest_quit(s);
+    }
+
+    return ret;
+}
@@ -0,0 +1,787 @@
+/*
+ * QTest testcase and packet rate benchmark for emulated NICs
+ *
+ * The test acts as the guest driver for an e1000 and a virtio-net-pci
+ * device: it programs them through PCI config space and their BARs, posts
+ * descriptors directly in guest memory and polls for completion.  Each
+ * NIC's peer is a -netdev socket on one end of a socketpair; the test
+ * sends and receives frames on the other end.  The benchmarks are only
+ * run in perf mode (gtester -m=perf) and report packets/s and bytes/s in
+ * each direction for several frame sizes.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+#include "libqtest.h"
+#include "qemu-common.h"
+
+#include <glib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+
+#define PCI_CONFIG_ADDR     0xcf8
+#define PCI_CONFIG_DATA     0xcfc
+#define PCI_COMMAND         0x04
+#define PCI_BAR0            0x10
+
+#define RING_SIZE       256
+#define BATCH           128         /* frames per doorbell, < RING_SIZE */
+#define BUF_SIZE        2048
+#define MAX_FRAME       1514
+#define POLL_LIMIT      1000000
+
+#define BENCH_PACKETS   (BATCH * 256)
+
+/* e1000: slot 4, BAR0 mapped at E1000_BAR */
+#define E1000_SLOT          4
+#define E1000_BAR           0xe0000000
+#define E1000_MAC           "52:54:00:12:34:56"
+#define E1000_RCTL          0x0100
+#define E1000_TCTL          0x0400
+#define E1000_RDBAL         0x2800
+#define E1000_RDBAH         0x2804
+#define E1000_RDLEN         0x2808
+#define E1000_RDH           0x2810
+#define E1000_RDT           0x2818
+#define E1000_TDBAL         0x3800
+#define E1000_TDBAH         0x3804
+#define E1000_TDLEN         0x3808
+#define E1000_TDH           0x3810
+#define E1000_TDT           0x3818
+#define E1000_RCTL_EN       (1 << 1)
+#define E1000_RCTL_BAM      (1 << 15)
+#define E1000_RCTL_SECRC    (1 << 26)
+#define E1000_TCTL_EN       (1 << 1)
+#define E1000_TCTL_PSP      (1 << 3)
+#define E1000_TXD_CMD_EOP   0x01
+#define E1000_TXD_CMD_IFCS  0x02
+#define E1000_TXD_CMD_RS    0x08
+#define E1000_RXD_STAT_DD   0x01
+#define E1000_RXD_STAT_EOP  0x02
+
+#define E1000_RX_RING       0x100000
+#define E1000_TX_RING       0x110000
+#define E1000_RX_BUF        0x200000
+#define E1000_TX_BUF        0x300000
+
+/* virtio-net-pci: slot 5, legacy I/O BAR at VIRTIO_BAR, no features */
+#define VIRTIO_SLOT         5
+#define VIRTIO_BAR          0xc000
+#define VIRTIO_MAC          "52:54:00:12:34:57"
+#define VIRTIO_PCI_GUEST_FEATURES   4
+#define VIRTIO_PCI_QUEUE_PFN        8
+#define VIRTIO_PCI_QUEUE_NUM        12
+#define VIRTIO_PCI_QUEUE_SEL        14
+#define VIRTIO_PCI_QUEUE_NOTIFY     16
+#define VIRTIO_PCI_STATUS           18
+#define VIRTIO_CONFIG_S_ACKNOWLEDGE 1
+#define VIRTIO_CONFIG_S_DRIVER      2
+#define VIRTIO_CONFIG_S_DRIVER_OK   4
+#define VRING_DESC_F_WRITE          2
+#define VIRTIO_NET_HDR_LEN          10
+#define VIRTIO_RXQ                  0
+#define VIRTIO_TXQ                  1
+#define VIRTIO_CTRLQ                2
+#define VRING_DESC_F_NEXT           1
+#define VIRTIO_NET_OK               0
+#define VIRTIO_NET_ERR              1
+#define VIRTIO_NET_CTRL_RX_MODE     0
+#define VIRTIO_NET_CTRL_RX_MODE_PROMISC 0
+#define VIRTIO_NET_CTRL_MAC         1
+#define VIRTIO_NET_CTRL_MAC_TABLE_SET   0
+
+/* Legacy vring layout for RING_SIZE entries and 4096 byte alignment */
+#define VRING_AVAIL(vq)     ((vq) + 16 * RING_SIZE)
+#define VRING_USED(vq)      ((vq) + 8192)
+
+#define VIRTIO_RX_VQ        0x400000
+#define VIRTIO_TX_VQ        0x410000
+#define VIRTIO_RX_BUF       0x500000
+#define VIRTIO_TX_BUF       0x600000
+
+/* The control queue has CTRL_RING_SIZE entries; a command uses the first
+ * four descriptors, pointing into VIRTIO_CTRL_BUF.
+ */
+#define CTRL_RING_SIZE      64
+#define VIRTIO_CTRL_VQ      0x420000
+#define VIRTIO_CTRL_AVAIL   (VIRTIO_CTRL_VQ + 16 * CTRL_RING_SIZE)
+#define VIRTIO_CTRL_USED    (VIRTIO_CTRL_VQ + 4096)
+#define VIRTIO_CTRL_BUF     0x430000
+
+typedef struct NICDriver {
+    const char *name;
+    uint8_t mac[6];
+    int peer;                   /* our end of the socketpair */
+    uint16_t rx_tail, tx_tail;  /* next descriptor to post */
+    uint16_t ctrl_tail;
+
+    /* Fill every TX buffer with @frame */
+    void (*tx_prepare)(struct NICDriver *nic, const uint8_t *frame, int size);
+    /* Hand @n TX buffers to the device */
+    void (*tx_post)(struct NICDriver *nic, int n);
+    /* Wait until all posted TX buffers are completed */
+    void (*tx_wait)(struct NICDriver *nic);
+    /* Hand @n empty RX buffers to the device */
+    void (*rx_post)(struct NICDriver *nic, int n);
+    /* Wait until all posted RX buffers are filled */
+    void (*rx_wait)(struct NICDriver *nic);
+    /* Copy out the last received frame and return its length */
+    int (*rx_last)(struct NICDriver *nic, uint8_t *frame);
+} NICDriver;
+
+static const int frame_sizes[] = { 60, 512, 1514 };
+
+static uint8_t peer_buf[BATCH * (4 + MAX_FRAME)];
+
+static void pci_config_writel(int slot, int offset, uint32_t val)
+{
+    outl(PCI_CONFIG_ADDR, 0x80000000 | (slot << 11) | offset);
+    outl(PCI_CONFIG_DATA, val);
+}
+
+static uint32_t mmio_readl(uint64_t addr)
+{
+    uint32_t val;
+
+    memread(addr, &val, sizeof(val));
+    return le32_to_cpu(val);
+}
+
+static void mmio_writel(uint64_t addr, uint32_t val)
+{
+    val = cpu_to_le32(val);
+    memwrite(addr, &val, sizeof(val));
+}
+
+static uint16_t mem_readw(uint64_t addr)
+{
+    uint16_t val;
+
+    memread(addr, &val, sizeof(val));
+    return le16_to_cpu(val);
+}
+
+static void mem_writew(uint64_t addr, uint16_t val)
+{
+    val = cpu_to_le16(val);
+    memwrite(addr, &val, sizeof(val));
+}
+
+static void build_frame(uint8_t *frame, const uint8_t *dst, int size)
+{
+    static const uint8_t src[6] = { 0x52, 0x54, 0x00, 0x00, 0x00, 0x01 };
+    int i;
+
+    memcpy(frame, dst, 6);
+    memcpy(frame + 6, src, 6);
+    frame[12] = 0x88;           /* local experimental ethertype */
+    frame[13] = 0xb5;
+    for (i = 14; i < size; i++) {
+        frame[i] = i;
+    }
+}
+
+/* Peer side.  -netdev socket streams carry each frame behind a 32-bit
+ * big-endian length.
+ */
+
+static int peer_socket(int *qemu_fd)
+{
+    struct timeval tv = { .tv_sec = 10 };
+    int bufsize = 4 * 1024 * 1024;
+    int sv[2], i;
+
+    g_assert_cmpint(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), ==, 0);
+    for (i = 0; i < 2; i++) {
+        setsockopt(sv[i], SOL_SOCKET, SO_SNDBUF, &bufsize, sizeof(bufsize));
+        setsockopt(sv[i], SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize));
+    }
+    setsockopt(sv[0], SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    setsockopt(sv[0], SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    qemu_set_cloexec(sv[0]);
+
+    *qemu_fd = sv[1];
+    return sv[0];
+}
+
+static void peer_send(NICDriver *nic, const uint8_t *frame, int size, int n)
+{
+    size_t len = n * (4 + size), done = 0;
+    uint32_t be = cpu_to_be32(size);
+    ssize_t ret;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        memcpy(peer_buf + i * (4 + size), &be, 4);
+        memcpy(peer_buf + i * (4 + size) + 4, frame, size);
+    }
+    while (done < len) {
+        ret = write(nic->peer, peer_buf + done, len - done);
+        g_assert(ret > 0 || errno == EINTR);
+        done += MAX(ret, 0);
+    }
+}
+
+/* Receive @n frames of @size bytes; they are left in peer_buf */
+static void peer_recv(NICDriver *nic, int size, int n)
+{
+    size_t len = n * (4 + size), done = 0;
+    ssize_t ret;
+    int i;
+
+    while (done < len) {
+        ret = read(nic->peer, peer_buf + done, len - done);
+        g_assert(ret > 0 || errno == EINTR);
+        done += MAX(ret, 0);
+    }
+    for (i = 0; i < n; i++) {
+        uint32_t be;
+
+        memcpy(&be, peer_buf + i * (4 + size), 4);
+        g_assert_cmpint(be32_to_cpu(be), ==, size);
+    }
+}
+
+/* e1000 */
+
+static void e1000_tx_prepare(NICDriver *nic, const uint8_t *frame, int size)
+{
+    static uint8_t ring[RING_SIZE * 16];
+    int i;
+
+    memset(ring, 0, sizeof(ring));
+    for (i = 0; i < RING_SIZE; i++) {
+        uint64_t addr = cpu_to_le64(E1000_TX_BUF + i * BUF_SIZE);
+        uint16_t len = cpu_to_le16(size);
+
+        memcpy(ring + i * 16, &addr, 8);
+        memcpy(ring + i * 16 + 8, &len, 2);
+        ring[i * 16 + 11] = E1000_TXD_CMD_EOP | E1000_TXD_CMD_IFCS |
+                            E1000_TXD_CMD_RS;
+        memwrite(E1000_TX_BUF + i * BUF_SIZE, frame, size);
+    }
+    memwrite(E1000_TX_RING, ring, sizeof(ring));
+}
+
+static void e1000_tx_post(NICDriver *nic, int n)
+{
+    nic->tx_tail = (nic->tx_tail + n) % RING_SIZE;
+    mmio_writel(E1000_BAR + E1000_TDT, nic->tx_tail);
+}
+
+static void e1000_tx_wait(NICDriver *nic)
+{
+    int i;
+
+    for (i = 0; mmio_readl(E1000_BAR + E1000_TDH) != nic->tx_tail; i++) {
+        g_assert_cmpint(i, <, POLL_LIMIT);
+    }
+}
+
+static void e1000_rx_post(NICDriver *nic, int n)
+{
+    nic->rx_tail = (nic->rx_tail + n) % RING_SIZE;
+    mmio_writel(E1000_BAR + E1000_RDT, nic->rx_tail);
+}
+
+static void e1000_rx_wait(NICDriver *nic)
+{
+    int i;
+
+    for (i = 0; mmio_readl(E1000_BAR + E1000_RDH) != nic->rx_tail; i++) {
+        g_assert_cmpint(i, <, POLL_LIMIT);
+    }
+}
+
+static int e1000_rx_last(NICDriver *nic, uint8_t *frame)
+{
+    int last = (nic->rx_tail + RING_SIZE - 1) % RING_SIZE;
+    uint8_t desc[16];
+    uint16_t len;
+
+    memread(E1000_RX_RING + last * 16, desc, sizeof(desc));
+    g_assert_cmphex(desc[12] & (E1000_RXD_STAT_DD | E1000_RXD_STAT_EOP), ==,
+                    E1000_RXD_STAT_DD | E1000_RXD_STAT_EOP);
+    memcpy(&len, desc + 8, 2);
+    len = le16_to_cpu(len);
+    g_assert_cmpint(len, <=, BUF_SIZE);
+    memread(E1000_RX_BUF + last * BUF_SIZE, frame, len);
+    return len;
+}
+
+static void e1000_init(void)
+{
+    static uint8_t ring[RING_SIZE * 16];
+    int i;
+
+    pci_config_writel(E1000_SLOT, PCI_BAR0, E1000_BAR);
+    pci_config_writel(E1000_SLOT, PCI_COMMAND, 0x6);   /* memory, master */
+
+    memset(ring, 0, sizeof(ring));
+    for (i = 0; i < RING_SIZE; i++) {
+        uint64_t addr = cpu_to_le64(E1000_RX_BUF + i * BUF_SIZE);
+
+        memcpy(ring + i * 16, &addr, 8);
+    }
+    memwrite(E1000_RX_RING, ring, sizeof(ring));
+
+    mmio_writel(E1000_BAR + E1000_RDBAL, E1000_RX_RING);
+    mmio_writel(E1000_BAR + E1000_RDBAH, 0);
+    mmio_writel(E1000_BAR + E1000_RDLEN, sizeof(ring));
+    mmio_writel(E1000_BAR + E1000_RDH, 0);
+    mmio_writel(E1000_BAR + E1000_RDT, 0);
+    mmio_writel(E1000_BAR + E1000_RCTL,
+                E1000_RCTL_EN | E1000_RCTL_BAM | E1000_RCTL_SECRC);
+
+    mmio_writel(E1000_BAR + E1000_TDBAL, E1000_TX_RING);
+    mmio_writel(E1000_BAR + E1000_TDBAH, 0);
+    mmio_writel(E1000_BAR + E1000_TDLEN, sizeof(ring));
+    mmio_writel(E1000_BAR + E1000_TDH, 0);
+    mmio_writel(E1000_BAR + E1000_TDT, 0);
+    mmio_writel(E1000_BAR + E1000_TCTL, E1000_TCTL_EN | E1000_TCTL_PSP);
+}
+
+static NICDriver e1000 = {
+    .name = "e1000",
+    .mac = { 0x52, 0x54, 0x00, 0x12, 0x34, 0x56 },
+    .tx_prepare = e1000_tx_prepare,
+    .tx_post = e1000_tx_post,
+    .tx_wait = e1000_tx_wait,
+    .rx_post = e1000_rx_post,
+    .rx_wait = e1000_rx_wait,
+    .rx_last = e1000_rx_last,
+};
+
+/* virtio-net.  The descriptor table and available ring are written once:
+ * descriptor i always points at buffer i and avail->ring[i] is i, so
+ * posting buffers only means bumping avail->idx.
+ */
+
+static void virtio_vring_init(int queue, uint64_t vq, uint64_t bufs,
+                              int len, uint16_t flags)
+{
+    static uint8_t desc[RING_SIZE * 16];
+    uint16_t avail[2 + RING_SIZE];
+    int i;
+
+    outw(VIRTIO_BAR + VIRTIO_PCI_QUEUE_SEL, queue);
+    g_assert_cmpint(inw(VIRTIO_BAR + VIRTIO_PCI_QUEUE_NUM), ==, RING_SIZE);
+
+    memset(desc, 0, sizeof(desc));
+    avail[0] = avail[1] = 0;
+    for (i = 0; i < RING_SIZE; i++) {
+        uint64_t addr = cpu_to_le64(bufs + i * BUF_SIZE);
+        uint32_t le_len = cpu_to_le32(len);
+        uint16_t le_flags = cpu_to_le16(flags);
+
+        memcpy(desc + i * 16, &addr, 8);
+        memcpy(desc + i * 16 + 8, &le_len, 4);
+        memcpy(desc + i * 16 + 12, &le_flags, 2);
+        avail[2 + i] = cpu_to_le16(i);
+    }
+    memwrite(vq, desc, sizeof(desc));
+    memwrite(VRING_AVAIL(vq), avail, sizeof(avail));
+    mem_writew(VRING_USED(vq) + 2, 0);
+
+    outl(VIRTIO_BAR + VIRTIO_PCI_QUEUE_PFN, vq >> 12);
+}
+
+static void virtio_tx_prepare(NICDriver *nic, const uint8_t *frame, int size)
+{
+    static uint8_t buf[VIRTIO_NET_HDR_LEN + MAX_FRAME];
+    uint32_t len = cpu_to_le32(VIRTIO_NET_HDR_LEN + size);
+    int i;
+
+    memset(buf, 0, VIRTIO_NET_HDR_LEN);
+    memcpy(buf + VIRTIO_NET_HDR_LEN, frame, size);
+    for (i = 0; i < RING_SIZE; i++) {
+        memwrite(VIRTIO_TX_BUF + i * BUF_SIZE, buf, VIRTIO_NET_HDR_LEN + size);
+        memwrite(VIRTIO_TX_VQ + i * 16 + 8, &len, sizeof(len));
+    }
+}
+
+static void virtio_tx_post(NICDriver *nic, int n)
+{
+    nic->tx_tail += n;
+    mem_writew(VRING_AVAIL(VIRTIO_TX_VQ) + 2, nic->tx_tail);
+    outw(VIRTIO_BAR + VIRTIO_PCI_QUEUE_NOTIFY, VIRTIO_TXQ);
+}
+
+static void virtio_tx_wait(NICDriver *nic)
+{
+    int i;
+
+    for (i = 0; mem_readw(VRING_USED(VIRTIO_TX_VQ) + 2) != nic->tx_tail;
+         i++) {
+        g_assert_cmpint(i, <, POLL_LIMIT);
+    }
+}
+
+static void virtio_rx_post(NICDriver *nic, int n)
+{
+    nic->rx_tail += n;
+    mem_writew(VRING_AVAIL(VIRTIO_RX_VQ) + 2, nic->rx_tail);
+    outw(VIRTIO_BAR + VIRTIO_PCI_QUEUE_NOTIFY, VIRTIO_RXQ);
+}
+
+static void virtio_rx_wait(NICDriver *nic)
+{
+    int i;
+
+    for (i = 0; mem_readw(VRING_USED(VIRTIO_RX_VQ) + 2) != nic->rx_tail;
+         i++) {
+        g_assert_cmpint(i, <, POLL_LIMIT);
+    }
+}
+
+static int virtio_rx_last(NICDriver *nic, uint8_t *frame)
+{
+    int last = (uint16_t)(nic->rx_tail - 1) % RING_SIZE;
+    uint32_t elem[2];
+    int id, len;
+
+    memread(VRING_USED(VIRTIO_RX_VQ) + 4 + last * 8, elem, sizeof(elem));
+    id = le32_to_cpu(elem[0]);
+    len = le32_to_cpu(elem[1]);
+    g_assert_cmpint(id, ==, last);
+    g_assert_cmpint(len, >=, VIRTIO_NET_HDR_LEN);
+    g_assert_cmpint(len, <=, BUF_SIZE);
+    memread(VIRTIO_RX_BUF + id * BUF_SIZE + VIRTIO_NET_HDR_LEN, frame,
+            len - VIRTIO_NET_HDR_LEN);
+    return len - VIRTIO_NET_HDR_LEN;
+}
+
+/* Run a control queue command whose data is split into @n out buffers
+ * and return the status the device wrote back.
+ */
+static int virtio_ctrl(NICDriver *nic, uint8_t class, uint8_t cmd,
+                       const struct iovec *data, int n)
+{
+    uint8_t desc[16 * 4], hdr[2] = { class, cmd };
+    uint64_t buf = VIRTIO_CTRL_BUF;
+    uint8_t status = 0xff;
+    int i;
+
+    g_assert_cmpint(n, <=, 2);
+    memset(desc, 0, sizeof(desc));
+    for (i = 0; i < n + 2; i++) {
+        const void *p = i == 0 ? hdr : i <= n ? data[i - 1].iov_base : &status;
+        uint32_t len = i == 0 ? 2 : i <= n ? data[i - 1].iov_len : 1;
+        uint64_t le_addr = cpu_to_le64(buf);
+        uint32_t le_len = cpu_to_le32(len);
+        uint16_t le_flags = cpu_to_le16(i <= n ? VRING_DESC_F_NEXT
+                                               : VRING_DESC_F_WRITE);
+        uint16_t le_next = cpu_to_le16(i + 1);
+
+        memcpy(desc + i * 16, &le_addr, 8);
+        memcpy(desc + i * 16 + 8, &le_len, 4);
+        memcpy(desc + i * 16 + 12, &le_flags, 2);
+        memcpy(desc + i * 16 + 14, &le_next, 2);
+        memwrite(buf, p, len);
+        buf += BUF_SIZE;
+    }
+    memwrite(VIRTIO_CTRL_VQ, desc, sizeof(desc));
+
+    /* avail->ring[] entry for this command: the chain starts at 0 */
+    mem_writew(VIRTIO_CTRL_AVAIL + 4 + (nic->ctrl_tail % CTRL_RING_SIZE) * 2,
+               0);
+    nic->ctrl_tail++;
+    mem_writew(VIRTIO_CTRL_AVAIL + 2, nic->ctrl_tail);
+    outw(VIRTIO_BAR + VIRTIO_PCI_QUEUE_NOTIFY, VIRTIO_CTRLQ);
+    for (i = 0; mem_readw(VIRTIO_CTRL_USED + 2) != nic->ctrl_tail; i++) {
+        g_assert_cmpint(i, <, POLL_LIMIT);
+    }
+
+    memread(buf - BUF_SIZE, &status, 1);
+    return status;
+}
+
+static void virtio_init(void)
+{
+    pci_config_writel(VIRTIO_SLOT, PCI_BAR0, VIRTIO_BAR);
+    pci_config_writel(VIRTIO_SLOT, PCI_COMMAND, 0x5);  /* I/O, master */
+
+    outb(VIRTIO_BAR + VIRTIO_PCI_STATUS, 0);
+    outb(VIRTIO_BAR + VIRTIO_PCI_STATUS,
+         VIRTIO_CONFIG_S_ACKNOWLEDGE | VIRTIO_CONFIG_S_DRIVER);
+    outl(VIRTIO_BAR + VIRTIO_PCI_GUEST_FEATURES, 0);
+
+    virtio_vring_init(VIRTIO_RXQ, VIRTIO_RX_VQ, VIRTIO_RX_BUF, BUF_SIZE,
+                      VRING_DESC_F_WRITE);
+    virtio_vring_init(VIRTIO_TXQ, VIRTIO_TX_VQ, VIRTIO_TX_BUF, 0, 0);
+
+    outw(VIRTIO_BAR + VIRTIO_PCI_QUEUE_SEL, VIRTIO_CTRLQ);
+    g_assert_cmpint(inw(VIRTIO_BAR + VIRTIO_PCI_QUEUE_NUM), ==, CTRL_RING_SIZE);
+    outl(VIRTIO_BAR + VIRTIO_PCI_QUEUE_PFN, VIRTIO_CTRL_VQ >> 12);
+
+    outb(VIRTIO_BAR + VIRTIO_PCI_STATUS,
+         VIRTIO_CONFIG_S_ACKNOWLEDGE | VIRTIO_CONFIG_S_DRIVER |
+         VIRTIO_CONFIG_S_DRIVER_OK);
+}
+
+static NICDriver virtio = {
+    .name = "virtio-net",
+    .mac = { 0x52, 0x54, 0x00, 0x12, 0x34, 0x57 },
+    .tx_prepare = virtio_tx_prepare,
+    .tx_post = virtio_tx_post,
+    .tx_wait = virtio_tx_wait,
+    .rx_post = virtio_rx_post,
+    .rx_wait = virtio_rx_wait,
+    .rx_last = virtio_rx_last,
+};
+
+/* Generic tests and benchmarks */
+
+static void nic_tx(NICDriver *nic)
+{
+    uint8_t frame[MAX_FRAME];
+    int s, i;
+
+    for (s = 0; s < ARRAY_SIZE(frame_sizes); s++) {
+        build_frame(frame, nic->mac, frame_sizes[s]);
+        nic->tx_prepare(nic, frame, frame_sizes[s]);
+        nic->tx_post(nic, 2);
+        peer_recv(nic, frame_sizes[s], 2);
+        nic->tx_wait(nic);
+        for (i = 0; i < 2; i++) {
+            g_assert(!memcmp(peer_buf + i * (4 + frame_sizes[s]) + 4, frame,
+                             frame_sizes[s]));
+        }
+    }
+}
+
+static void nic_rx(NICDriver *nic)
+{
+    uint8_t frame[MAX_FRAME], got[BUF_SIZE];
+    int s;
+
+    for (s = 0; s < ARRAY_SIZE(frame_sizes); s++) {
+        build_frame(frame, nic->mac, frame_sizes[s]);
+        nic->rx_post(nic, 2);
+        peer_send(nic, frame, frame_sizes[s], 2);
+        nic->rx_wait(nic);
+        g_assert_cmpint(nic->rx_last(nic, got), ==, frame_sizes[s]);
+        g_assert(!memcmp(got, frame, frame_sizes[s]));
+    }
+}
+
+/* Check whether the receive filter passes a frame for @dst.  A frame for
+ * the NIC's own address follows it, so that a dropped frame is noticed
+ * without waiting for a timeout.
+ */
+static void nic_rx_filter(NICDriver *nic, const uint8_t *dst, bool accepted)
+{
+    uint8_t frame[60], got[BUF_SIZE];
+
+    nic->rx_post(nic, 1);
+    build_frame(frame, dst, sizeof(frame));
+    peer_send(nic, frame, sizeof(frame), 1);
+    build_frame(frame, nic->mac, sizeof(frame));
+    peer_send(nic, frame, sizeof(frame), 1);
+    nic->rx_wait(nic);
+    g_assert_cmpint(nic->rx_last(nic, got), ==, sizeof(frame));
+    if (accepted) {
+        g_assert(!memcmp(got, dst, 6));
+        nic->rx_post(nic, 1);
+        nic->rx_wait(nic);
+        g_assert_cmpint(nic->rx_last(nic, got), ==, sizeof(frame));
+    }
+    g_assert(!memcmp(got, nic->mac, 6));
+}
+
+static void bench_report(NICDriver *nic, const char *dir, int size,
+                         double secs)
+{
+    double pps = BENCH_PACKETS / secs;
+
+    g_test_maximized_result(pps, "%s %s %4d bytes: %.0f packets/s, %.1f MB/s",
+                            nic->name, dir, size, pps, pps * size / 1e6);
+}
+
+static void bench_tx(NICDriver *nic)
+{
+    uint8_t frame[MAX_FRAME];
+    double secs;
+    int s, i;
+
+    for (s = 0; s < ARRAY_SIZE(frame_sizes); s++) {
+        build_frame(frame, nic->mac, frame_sizes[s]);
+        nic->tx_prepare(nic, frame, frame_sizes[s]);
+
+        g_test_timer_start();
+        for (i = 0; i < BENCH_PACKETS; i += BATCH) {
+            nic->tx_post(nic, BATCH);
+            peer_recv(nic, frame_sizes[s], BATCH);
+            nic->tx_wait(nic);
+        }
+        secs = g_test_timer_elapsed();
+        bench_report(nic, "tx", frame_sizes[s], secs);
+    }
+}
+
+static void bench_rx(NICDriver *nic)
+{
+    uint8_t frame[MAX_FRAME];
+    double secs;
+    int s, i;
+
+    for (s = 0; s < ARRAY_SIZE(frame_sizes); s++) {
+        build_frame(frame, nic->mac, frame_sizes[s]);
+
+        g_test_timer_start();
+        for (i = 0; i < BENCH_PACKETS; i += BATCH) {
+            nic->rx_post(nic, BATCH);
+            peer_send(nic, frame, frame_sizes[s], BATCH);
+            nic->rx_wait(nic);
+        }
+        secs = g_test_timer_elapsed();
+        bench_report(nic, "rx", frame_sizes[s], secs);
+    }
+}
+
+static void e1000_tx(void)
+{
+    nic_tx(&e1000);
+}
+
+static void e1000_rx(void)
+{
+    nic_rx(&e1000);
+}
+
+static void virtio_tx(void)
+{
+    nic_tx(&virtio);
+}
+
+static void virtio_rx(void)
+{
+    nic_rx(&virtio);
+}
+
+/* A MAC_TABLE_SET that fails half-way must leave the filter matching what
+ * the device kept of the table, not the previous table.
+ */
+static void virtio_mac_filter(void)
+{
+    static const uint8_t uni[6] = { 0x52, 0x54, 0x00, 0xab, 0xcd, 0x01 };
+    static const uint8_t multi[6] = { 0x01, 0x00, 0x5e, 0x00, 0x00, 0x01 };
+    uint8_t uni_table[4 + 6], multi_table[4 + 6], on = 0;
+    uint32_t one = cpu_to_le32(1), two = cpu_to_le32(2);
+    struct iovec iov[2] = {
+        { .iov_base = uni_table, .iov_len = sizeof(uni_table) },
+        { .iov_base = multi_table, .iov_len = sizeof(multi_table) },
+    };
+
+    iov[0].iov_base = &on;
+    iov[0].iov_len = 1;
+    g_assert_cmpint(virtio_ctrl(&virtio, VIRTIO_NET_CTRL_RX_MODE,
+                                VIRTIO_NET_CTRL_RX_MODE_PROMISC, iov, 1),
+                    ==, VIRTIO_NET_OK);
+    iov[0].iov_base = uni_table;
+    iov[0].iov_len = sizeof(uni_table);
+
+    memcpy(uni_table, &one, 4);
+    memcpy(uni_table + 4, uni, 6);
+    memcpy(multi_table, &one, 4);
+    memcpy(multi_table + 4, multi, 6);
+    g_assert_cmpint(virtio_ctrl(&virtio, VIRTIO_NET_CTRL_MAC,
+                                VIRTIO_NET_CTRL_MAC_TABLE_SET, iov, 2),
+                    ==, VIRTIO_NET_OK);
+    nic_rx_filter(&virtio, uni, true);
+    nic_rx_filter(&virtio, multi, true);
+
+    /* The multicast list is truncated: only the unicast part is kept */
+    memcpy(multi_table, &two, 4);
+    g_assert_cmpint(virtio_ctrl(&virtio, VIRTIO_NET_CTRL_MAC,
+                                VIRTIO_NET_CTRL_MAC_TABLE_SET, iov, 2),
+                    ==, VIRTIO_NET_ERR);
+    nic_rx_filter(&virtio, uni, true);
+    nic_rx_filter(&virtio, multi, false);
+
+    /* The unicast list is truncated: the table is left empty */
+    memcpy(uni_table, &two, 4);
+    g_assert_cmpint(virtio_ctrl(&virtio, VIRTIO_NET_CTRL_MAC,
+                                VIRTIO_NET_CTRL_MAC_TABLE_SET, iov, 2),
+                    ==, VIRTIO_NET_ERR);
+    nic_rx_filter(&virtio, uni, false);
+
+    on = 1;
+    iov[0].iov_base = &on;
+    iov[0].iov_len = 1;
+    g_assert_cmpint(virtio_ctrl(&virtio, VIRTIO_NET_CTRL_RX_MODE,
+                                VIRTIO_NET_CTRL_RX_MODE_PROMISC, iov, 1),
+                    ==, VIRTIO_NET_OK);
+}
+
+static void bench_e1000_tx(void)
+{
+    bench_tx(&e1000);
+}
+
+static void bench_e1000_rx(void)
+{
+    bench_rx(&e1000);
+}
+
+static void bench_virtio_tx(void)
+{
+    bench_tx(&virtio);
+}
+
+static void bench_virtio_rx(void)
+{
+    bench_rx(&virtio);
+}
+
+int main(int argc, char **argv)
+{
+    QTestState *s = NULL;
+    int e1000_fd, virtio_fd;
+    char *args;
+    int ret;
+
+    g_test_init(&argc, &argv, NULL);
+
+    e1000.peer = peer_socket(&e1000_fd);
+    virtio.peer = peer_socket(&virtio_fd);
+    args = g_strdup_printf("-display none -nodefaults "
+                           "-netdev socket,id=n0,fd=%d "
+                           "-device e1000,netdev=n0,mac=" E1000_MAC
+                           ",romfile=,addr=%d "
+                           "-netdev socket,id=n1,fd=%d "
+                           "-device virtio-net-pci,netdev=n1,mac=" VIRTIO_MAC
+                           ",romfile=,addr=%d",
+                           e1000_fd, E1000_SLOT, virtio_fd, VIRTIO_SLOT);
+    s = qtest_start(args);
+    g_free(args);
+    close(e1000_fd);
+    close(virtio_fd);
+
+    e1000_init();
+    virtio_init();
+
+    qtest_add_func("/nic/e1000/tx", e1000_tx);
+    qtest_add_func("/nic/e1000/rx", e1000_rx);
+    qtest_add_func("/nic/virtio-net/tx", virtio_tx);
+    qtest_add_func("/nic/virtio-net/rx", virtio_rx);
+    qtest_add_func("/nic/virtio-net/mac-filter", virtio_mac_filter);
+    if (g_test_perf()) {
+        qtest_add_func("/nic/bench/e1000/tx", bench_e1000_tx);
+        qtest_add_func("/nic/bench/e1000/rx", bench_e1000_rx);
+        qtest_add_func("/nic/bench/virtio-net/tx", bench_virtio_tx);
+        qtest_add_func("/nic/bench/virtio-net/rx", bench_virtio_rx);
+    }
+    ret = g_test_run();
+
+    if (s) {
+        qtest_quit(s);
+    }
+
+    return ret;
+}
@@ -0,0 +1,568 @@
+/*
+ * QTest testcase and connection rate benchmark for user mode networking
+ *
+ * The test plays the guest of a "-net user" stack: a "-net socket" on the
+ * same VLAN is one end of a socketpair, and the test exchanges raw
+ * Ethernet frames on the other end.  The host side of each connection is
+ * an ordinary loopback socket, which the guest reaches through the
+ * gateway address.  Neither a guest OS nor a tap device or root is needed.
+ *
+ * The tests keep many sockets open at once and check that every reply
+ * reaches the right guest port, which depends on slirp's socket lookup
+ * and on it polling each socket whose state changed.  In perf mode
+ * (gtester -m=perf) the benchmarks report TCP connections/s and UDP
+ * datagrams/s, both alone and with many idle connections open.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+#include "libqtest.h"
+#include "qemu-common.h"
+
+#include <glib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define ETH_HLEN        14
+#define IP_HLEN         20
+#define TCP_HLEN        20
+#define UDP_HLEN        8
+#define L4_OFF          (ETH_HLEN + IP_HLEN)
+#define MAX_FRAME       1514
+
+#define ETH_P_IP        0x0800
+#define ETH_P_ARP       0x0806
+
+#define TH_FIN          0x01
+#define TH_SYN          0x02
+#define TH_RST          0x04
+#define TH_PSH          0x08
+#define TH_ACK          0x10
+
+/* default -net user addresses */
+#define GUEST_IP        0x0a00020f      /* 10.0.2.15 */
+#define HOST_IP         0x0a000202      /* 10.0.2.2 */
+
+#define CONNS           256             /* sockets open in each test */
+#define IDLE_CONNS      500
+#define BENCH_CONNS     2000
+#define BENCH_DATAGRAMS (64 * 512)
+#define UDP_BATCH       64
+
+typedef struct Conn {
+    uint16_t port;              /* guest port */
+    uint32_t snd_nxt, rcv_nxt;
+    int fd;                     /* accepted host socket */
+} Conn;
+
+static const uint8_t guest_mac[6] = { 0x52, 0x54, 0x00, 0x12, 0x34, 0x56 };
+static const uint8_t host_mac[6] = { 0x52, 0x55, 0x0a, 0x00, 0x02, 0x02 };
+
+static int peer;                /* our end of the socketpair */
+static int listener;            /* host TCP socket the guest connects to */
+static uint16_t listen_port;
+static uint8_t out_frame[4 + MAX_FRAME];
+static uint8_t in_frame[4 + MAX_FRAME];
+
+/* stl_be_p() hides the store from the compiler on x86 hosts, which breaks
+ * checksumming the header right after building it.
+ */
+static void put_be32(uint8_t *p, uint32_t val)
+{
+    val = cpu_to_be32(val);
+    memcpy(p, &val, 4);
+}
+
+/* Peer side.  -net socket streams carry each frame behind a 32-bit
+ * big-endian length.
+ */
+
+static int peer_socket(int *qemu_fd)
+{
+    struct timeval tv = { .tv_sec = 10 };
+    int sv[2];
+
+    g_assert_cmpint(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), ==, 0);
+    setsockopt(sv[0], SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    setsockopt(sv[0], SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    qemu_set_cloexec(sv[0]);
+
+    *qemu_fd = sv[1];
+    return sv[0];
+}
+
+static void peer_io(bool out, uint8_t *buf, size_t len)
+{
+    size_t done = 0;
+    ssize_t ret;
+
+    while (done < len) {
+        if (out) {
+            ret = write(peer, buf + done, len - done);
+        } else {
+            ret = read(peer, buf + done, len - done);
+        }
+        g_assert(ret > 0 || errno == EINTR);
+        done += MAX(ret, 0);
+    }
+}
+
+/* Send the frame of @size bytes in out_frame + 4 */
+static void peer_send(int size)
+{
+    put_be32(out_frame, size);
+    peer_io(true, out_frame, 4 + size);
+}
+
+/* Receive a frame into in_frame + 4 and return its size */
+static int peer_recv(void)
+{
+    int size;
+
+    peer_io(false, in_frame, 4);
+    size = ldl_be_p(in_frame);
+    g_assert_cmpint(size, >=, ETH_HLEN);
+    g_assert_cmpint(size, <=, MAX_FRAME);
+    peer_io(false, in_frame + 4, size);
+    return size;
+}
+
+static uint32_t cksum_add(uint32_t sum, const uint8_t *p, int len)
+{
+    int i;
+
+    for (i = 0; i + 1 < len; i += 2) {
+        sum += lduw_be_p(p + i);
+    }
+    if (len & 1) {
+        sum += p[len - 1] << 8;
+    }
+    return sum;
+}
+
+static uint16_t cksum_fold(uint32_t sum)
+{
+    while (sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    return ~sum;
+}
+
+/* Host side */
+
+static int host_socket(int type, uint16_t *port)
+{
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    socklen_t addrlen = sizeof(addr);
+    int fd;
+
+    fd = socket(AF_INET, type, 0);
+    g_assert_cmpint(fd, >=, 0);
+    g_assert_cmpint(bind(fd, (struct sockaddr *)&addr, sizeof(addr)), ==, 0);
+    g_assert_cmpint(getsockname(fd, (struct sockaddr *)&addr, &addrlen),
+                    ==, 0);
+    qemu_set_cloexec(fd);
+    *port = ntohs(addr.sin_port);
+    return fd;
+}
+
+/* Fail instead of hanging if nothing arrives on @fd */
+static void host_wait(int fd)
+{
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+
+    g_assert_cmpint(poll(&pfd, 1, 10000), ==, 1);
+}
+
+static ssize_t host_recvfrom(int fd, void *buf, size_t len,
+                             struct sockaddr_in *from)
+{
+    socklen_t fromlen = sizeof(*from);
+
+    host_wait(fd);
+    return recvfrom(fd, buf, len, 0, (struct sockaddr *)from, &fromlen);
+}
+
+/* Guest side */
+
+static void send_arp(uint16_t op, const uint8_t *tha, uint32_t tip)
+{
+    uint8_t *f = out_frame + 4, *arp = f + ETH_HLEN;
+
+    memset(f, 0, 60);
+    memset(f, 0xff, 6);
+    memcpy(f + 6, guest_mac, 6);
+    stw_be_p(f + 12, ETH_P_ARP);
+    stw_be_p(arp, 1);                   /* Ethernet */
+    stw_be_p(arp + 2, ETH_P_IP);
+    arp[4] = 6;
+    arp[5] = 4;
+    stw_be_p(arp + 6, op);
+    memcpy(arp + 8, guest_mac, 6);
+    put_be32(arp + 14, GUEST_IP);
+    memcpy(arp + 18, tha, 6);
+    put_be32(arp + 24, tip);
+    peer_send(60);
+}
+
+/* Send the layer 4 packet of @len bytes at out_frame + 4 + L4_OFF to the
+ * host, filling in the Ethernet and IP headers and the TCP checksum.
+ */
+static void send_ip(uint8_t proto, int len)
+{
+    uint8_t *f = out_frame + 4, *ip = f + ETH_HLEN, *l4 = f + L4_OFF;
+    uint32_t sum;
+
+    memcpy(f, host_mac, 6);
+    memcpy(f + 6, guest_mac, 6);
+    stw_be_p(f + 12, ETH_P_IP);
+
+    memset(ip, 0, IP_HLEN);
+    ip[0] = 0x45;
+    stw_be_p(ip + 2, IP_HLEN + len);
+    stw_be_p(ip + 6, 0x4000);           /* DF */
+    ip[8] = 64;
+    ip[9] = proto;
+    put_be32(ip + 12, GUEST_IP);
+    put_be32(ip + 16, HOST_IP);
+    stw_be_p(ip + 10, cksum_fold(cksum_add(0, ip, IP_HLEN)));
+
+    if (proto == IPPROTO_TCP) {
+        /* pseudo header */
+        sum = cksum_add(proto + len, ip + 12, 8);
+        stw_be_p(l4 + 16, 0);
+        stw_be_p(l4 + 16, cksum_fold(cksum_add(sum, l4, len)));
+    }
+    peer_send(L4_OFF + len);
+}
+
+/* Wait for a @proto packet from the host to guest @port, or to any port
+ * if @port is 0.  ARP requests for the guest are answered and other
+ * frames dropped.  Returns the layer 4 length; the packet starts at
+ * in_frame + 4 + L4_OFF.
+ */
+static int recv_ip(uint8_t proto, uint16_t port)
+{
+    for (;;) {
+        int size = peer_recv();
+        uint8_t *f = in_frame + 4, *ip = f + ETH_HLEN, *l4 = f + L4_OFF;
+
+        if (lduw_be_p(f + 12) == ETH_P_ARP) {
+            if (lduw_be_p(ip + 6) == 1 && ldl_be_p(ip + 24) == GUEST_IP) {
+                send_arp(2, ip + 8, ldl_be_p(ip + 14));
+            }
+            continue;
+        }
+        if (lduw_be_p(f + 12) != ETH_P_IP || size < L4_OFF + UDP_HLEN ||
+            ip[0] != 0x45 || ip[9] != proto ||
+            ldl_be_p(ip + 12) != HOST_IP || ldl_be_p(ip + 16) != GUEST_IP) {
+            continue;
+        }
+        if (port && lduw_be_p(l4 + 2) != port) {
+            continue;
+        }
+        return lduw_be_p(ip + 2) - IP_HLEN;
+    }
+}
+
+static void udp_send(uint16_t sport, uint16_t dport, const void *data,
+                     int len)
+{
+    uint8_t *udp = out_frame + 4 + L4_OFF;
+
+    stw_be_p(udp, sport);
+    stw_be_p(udp + 2, dport);
+    stw_be_p(udp + 4, UDP_HLEN + len);
+    stw_be_p(udp + 6, 0);               /* no checksum */
+    memcpy(udp + UDP_HLEN, data, len);
+    send_ip(IPPROTO_UDP, UDP_HLEN + len);
+}
+
+static void tcp_send(Conn *c, uint8_t flags, const void *data, int len)
+{
+    uint8_t *tcp = out_frame + 4 + L4_OFF;
+
+    memset(tcp, 0, TCP_HLEN);
+    stw_be_p(tcp, c->port);
+    stw_be_p(tcp + 2, listen_port);
+    put_be32(tcp + 4, c->snd_nxt);
+    put_be32(tcp + 8, (flags & TH_ACK) ? c->rcv_nxt : 0);
+    tcp[12] = (TCP_HLEN / 4) << 4;
+    tcp[13] = flags;
+    stw_be_p(tcp + 14, 65535);
+    memcpy(tcp + TCP_HLEN, data, len);
+    send_ip(IPPROTO_TCP, TCP_HLEN + len);
+    c->snd_nxt += len + !!(flags & (TH_SYN | TH_FIN));
+}
+
+/* Wait for a TCP segment to guest @port (or any port if 0) that is not a
+ * pure ACK.  Returns its payload length; the segment starts at
+ * in_frame + 4 + L4_OFF.
+ */
+static int tcp_recv(uint16_t port)
+{
+    uint8_t *tcp = in_frame + 4 + L4_OFF;
+    int len;
+
+    do {
+        len = recv_ip(IPPROTO_TCP, port) - (tcp[12] >> 4) * 4;
+    } while (len == 0 && !(tcp[13] & (TH_SYN | TH_FIN | TH_RST)));
+    return len;
+}
+
+static void tcp_connect(Conn *c, uint16_t port)
+{
+    uint8_t *tcp = in_frame + 4 + L4_OFF;
+
+    c->port = port;
+    c->snd_nxt = port * 65536;
+    c->rcv_nxt = 0;
+    tcp_send(c, TH_SYN, NULL, 0);
+
+    g_assert_cmpint(tcp_recv(port), ==, 0);
+    g_assert_cmphex(tcp[13] & (TH_SYN | TH_ACK | TH_RST), ==,
+                    TH_SYN | TH_ACK);
+    g_assert_cmphex((uint32_t)ldl_be_p(tcp + 8), ==, c->snd_nxt);
+    c->rcv_nxt = ldl_be_p(tcp + 4) + 1;
+    tcp_send(c, TH_ACK, NULL, 0);
+
+    host_wait(listener);
+    c->fd = accept(listener, NULL, NULL);
+    g_assert_cmpint(c->fd, >=, 0);
+}
+
+static void tcp_reset(Conn *c)
+{
+    tcp_send(c, TH_RST | TH_ACK, NULL, 0);
+    close(c->fd);
+}
+
+/* Tests */
+
+/* Datagrams from many guest ports to one host socket; each reply must come
+ * back to the guest port that sent the datagram it answers.
+ */
+static void test_udp(void)
+{
+    struct sockaddr_in from[CONNS];
+    uint16_t host_port;
+    char buf[32];
+    int fd, i;
+
+    fd = host_socket(SOCK_DGRAM, &host_port);
+    for (i = 0; i < CONNS; i++) {
+        snprintf(buf, sizeof(buf), "ping %d", i);
+        udp_send(10000 + i, host_port, buf, strlen(buf) + 1);
+    }
+    for (i = 0; i < CONNS; i++) {
+        int n;
+
+        g_assert_cmpint(host_recvfrom(fd, buf, sizeof(buf), &from[i]), >, 0);
+        g_assert_cmpint(sscanf(buf, "ping %d", &n), ==, 1);
+        g_assert_cmpint(n, ==, i);
+    }
+
+    for (i = CONNS - 1; i >= 0; i--) {
+        uint8_t *udp = in_frame + 4 + L4_OFF;
+
+        snprintf(buf, sizeof(buf), "pong %d", i);
+        g_assert_cmpint(sendto(fd, buf, strlen(buf) + 1, 0,
+                               (struct sockaddr *)&from[i], sizeof(from[i])),
+                        ==, strlen(buf) + 1);
+        g_assert_cmpint(recv_ip(IPPROTO_UDP, 0), ==,
+                        UDP_HLEN + strlen(buf) + 1);
+        g_assert_cmpint(lduw_be_p(udp), ==, host_port);
+        g_assert_cmpint(lduw_be_p(udp + 2), ==, 10000 + i);
+        g_assert_cmpstr((char *)udp + UDP_HLEN, ==, buf);
+    }
+    close(fd);
+}
+
+/* Open many connections, then write to their host ends in reverse order:
+ * each write must be noticed although the socket was idle, and arrive on
+ * the right connection.
+ */
+static void test_tcp(void)
+{
+    struct sockaddr_in from;
+    Conn conns[CONNS];
+    char buf[32];
+    int i, len;
+
+    for (i = 0; i < CONNS; i++) {
+        tcp_connect(&conns[i], 20000 + i);
+    }
+    for (i = CONNS - 1; i >= 0; i--) {
+        uint8_t *tcp = in_frame + 4 + L4_OFF;
+
+        snprintf(buf, sizeof(buf), "data %d", i);
+        len = strlen(buf) + 1;
+        g_assert_cmpint(write(conns[i].fd, buf, len), ==, len);
+        g_assert_cmpint(tcp_recv(0), ==, len);
+        g_assert_cmpint(lduw_be_p(tcp + 2), ==, conns[i].port);
+        g_assert_cmphex((uint32_t)ldl_be_p(tcp + 4), ==, conns[i].rcv_nxt);
+        g_assert_cmpstr((char *)tcp + (tcp[12] >> 4) * 4, ==, buf);
+        conns[i].rcv_nxt += len;
+        tcp_send(&conns[i], TH_ACK, NULL, 0);
+    }
+
+    /* and the other way round */
+    for (i = 0; i < CONNS; i++) {
+        snprintf(buf, sizeof(buf), "data %d", i);
+        len = strlen(buf) + 1;
+        tcp_send(&conns[i], TH_ACK | TH_PSH, buf, len);
+        memset(buf, 0, sizeof(buf));
+        g_assert_cmpint(host_recvfrom(conns[i].fd, buf, len, &from), ==, len);
+        g_assert_cmpint(atoi(buf + 5), ==, i);
+    }
+
+    for (i = 0; i < CONNS; i++) {
+        tcp_reset(&conns[i]);
+    }
+}
+
+/* Benchmarks */
+
+static Conn idle[IDLE_CONNS];
+
+static void idle_open(int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        tcp_connect(&idle[i], 30000 + i);
+    }
+}
+
+static void idle_close(int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        tcp_reset(&idle[i]);
+    }
+}
+
+static void bench_tcp_connect(int n_idle)
+{
+    Conn c;
+    double secs;
+    int i;
+
+    idle_open(n_idle);
+    g_test_timer_start();
+    for (i = 0; i < BENCH_CONNS; i++) {
+        tcp_connect(&c, 40000 + i);
+        tcp_reset(&c);
+    }
+    secs = g_test_timer_elapsed();
+    idle_close(n_idle);
+
+    g_test_maximized_result(BENCH_CONNS / secs,
+                            "TCP connect, %d idle: %.0f connections/s",
+                            n_idle, BENCH_CONNS / secs);
+}
+
+static void bench_udp(int n_idle)
+{
+    struct sockaddr_in from;
+    uint16_t host_port;
+    uint8_t buf[64];
+    double secs;
+    int fd, i, j;
+
+    fd = host_socket(SOCK_DGRAM, &host_port);
+    memset(buf, 0, sizeof(buf));
+    idle_open(n_idle);
+    g_test_timer_start();
+    for (i = 0; i < BENCH_DATAGRAMS; i += UDP_BATCH) {
+        for (j = 0; j < UDP_BATCH; j++) {
+            udp_send(10000, host_port, buf, sizeof(buf));
+        }
+        for (j = 0; j < UDP_BATCH; j++) {
+            g_assert_cmpint(host_recvfrom(fd, buf, sizeof(buf), &from),
+                            ==, sizeof(buf));
+        }
+    }
+    secs = g_test_timer_elapsed();
+    idle_close(n_idle);
+    close(fd);
+
+    g_test_maximized_result(BENCH_DATAGRAMS / secs,
+                            "UDP %zd bytes, %d idle: %.0f datagrams/s",
+                            sizeof(buf), n_idle, BENCH_DATAGRAMS / secs);
+}
+
+static void bench_tcp_connect_0(void)
+{
+    bench_tcp_connect(0);
+}
+
+static void bench_tcp_connect_idle(void)
+{
+    bench_tcp_connect(IDLE_CONNS);
+}
+
+static void bench_udp_0(void)
+{
+    bench_udp(0);
+}
+
+static void bench_udp_idle(void)
+{
+    bench_udp(IDLE_CONNS);
+}
+
+int main(int argc, char **argv)
+{
+    static const uint8_t zero_mac[6];
+    QTestState *s = NULL;
+    int qemu_fd;
+    char *args;
+    int ret;
+
+    g_test_init(&argc, &argv, NULL);
+
+    peer = peer_socket(&qemu_fd);
+    listener = host_socket(SOCK_STREAM, &listen_port);
+    g_assert_cmpint(listen(listener, SOMAXCONN), ==, 0);
+
+    args = g_strdup_printf("-display none -nodefaults "
+                           "-net socket,vlan=0,fd=%d -net user,vlan=0",
+                           qemu_fd);
+    s = qtest_start(args);
+    g_free(args);
+    close(qemu_fd);
+
+    /* let slirp learn our MAC address */
+    send_arp(1, zero_mac, GUEST_IP);
+
+    qtest_add_func("/slirp/udp", test_udp);
+    qtest_add_func("/slirp/tcp", test_tcp);
+    if (g_test_perf()) {
+        qtest_add_func("/slirp/bench/tcp-connect", bench_tcp_connect_0);
+        qtest_add_func("/slirp/bench/tcp-connect-idle",
+                       bench_tcp_connect_idle);
+        qtest_add_func("/slirp/bench/udp", bench_udp_0);
+        qtest_add_func("/slirp/bench/udp-idle", bench_udp_idle);
+    }
+    ret = g_test_run();
+
+    if (s) {
+        qtest_quit(s);
+    }
+    close(listener);
+
+    return ret;
+}
@@ -0,0 +1,171 @@
+/*
+ * MACSet unit tests
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include <glib.h>
+#include "qemu-common.h"
+#include "net/macset.h"
+
+static void mac_random(uint8_t *mac)
+{
+    int i;
+
+    for (i = 0; i < 6; i++) {
+        mac[i] = g_test_rand_int_range(0, 256);
+    }
+}
+
+/* The linear scan the NIC models used to do */
+static bool mac_table_contains(const uint8_t *table, int n, const uint8_t *mac)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        if (!memcmp(mac, &table[i * 6], 6)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void test_empty(void)
+{
+    static const uint8_t zero[6];
+    static const uint8_t bcast[6] = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
+    MACSet set;
+
+    mac_set_clear(&set);
+    g_assert(!mac_set_contains(&set, zero));
+    g_assert(!mac_set_contains(&set, bcast));
+
+    /* The all-zeroes address must not be confused with an empty slot */
+    g_assert_cmpint(mac_set_add(&set, zero), ==, 0);
+    g_assert(mac_set_contains(&set, zero));
+    g_assert(!mac_set_contains(&set, bcast));
+}
+
+static void test_add(void)
+{
+    uint8_t table[MAC_SET_MAX * 6], mac[6];
+    MACSet set;
+    int i;
+
+    mac_set_clear(&set);
+    for (i = 0; i < MAC_SET_MAX; i++) {
+        mac_random(&table[i * 6]);
+        g_assert_cmpint(mac_set_add(&set, &table[i * 6]), ==, 0);
+    }
+    for (i = 0; i < MAC_SET_MAX; i++) {
+        g_assert(mac_set_contains(&set, &table[i * 6]));
+    }
+
+    /* Re-adding an address is not an error even when the set is full */
+    g_assert_cmpint(mac_set_add(&set, &table[0]), ==, 0);
+    do {
+        mac_random(mac);
+    } while (mac_table_contains(table, MAC_SET_MAX, mac));
+    g_assert_cmpint(mac_set_add(&set, mac), ==, -ENOSPC);
+    g_assert(!mac_set_contains(&set, mac));
+
+    mac_set_clear(&set);
+    for (i = 0; i < MAC_SET_MAX; i++) {
+        g_assert(!mac_set_contains(&set, &table[i * 6]));
+    }
+}
+
+static void test_random(void)
+{
+    uint8_t table[MAC_SET_MAX * 6], mac[6];
+    MACSet set;
+    int i, j, n;
+
+    for (i = 0; i < 1000; i++) {
+        n = g_test_rand_int_range(0, MAC_SET_MAX + 1);
+        mac_set_clear(&set);
+        for (j = 0; j < n; j++) {
+            mac_random(&table[j * 6]);
+            /* Addresses differing in one byte only probe nearby slots */
+            if (j && g_test_rand_int_range(0, 2)) {
+                memcpy(&table[j * 6], &table[(j - 1) * 6], 5);
+            }
+            mac_set_add(&set, &table[j * 6]);
+        }
+        for (j = 0; j < 100; j++) {
+            if (n && g_test_rand_int_range(0, 2)) {
+                memcpy(mac, &table[g_test_rand_int_range(0, n) * 6], 6);
+            } else {
+                mac_random(mac);
+            }
+            g_assert(mac_set_contains(&set, mac) ==
+                     mac_table_contains(table, n, mac));
+        }
+    }
+}
+
+/* Look up a stream of frames that mostly miss, as a guest with a few
+ * multicast groups joined sees on a busy segment, against tables of the
+ * sizes virtio-net (64 entries) and e1000 (16 RA pairs) can hold.
+ */
+static void perf_lookup(void)
+{
+    static const int sizes[] = { 1, 4, 16, 32, 64 };
+    uint8_t table[MAC_SET_MAX * 6], frames[256 * 6];
+    unsigned int i, max, hits;
+    double linear, hashed;
+    MACSet set;
+    int s, j, n;
+
+    max = 10000000;
+
+    for (s = 0; s < ARRAY_SIZE(sizes); s++) {
+        n = sizes[s];
+        mac_set_clear(&set);
+        for (j = 0; j < n; j++) {
+            mac_random(&table[j * 6]);
+            table[j * 6] |= 1;
+            mac_set_add(&set, &table[j * 6]);
+        }
+        for (j = 0; j < 256; j++) {
+            if (j % 8 == 0) {
+                memcpy(&frames[j * 6], &table[(j / 8 % n) * 6], 6);
+            } else {
+                mac_random(&frames[j * 6]);
+            }
+        }
+
+        hits = 0;
+        g_test_timer_start();
+        for (i = 0; i < max; i++) {
+            hits += mac_table_contains(table, n, &frames[(i & 255) * 6]);
+        }
+        linear = g_test_timer_elapsed();
+        g_assert_cmpint(hits, >=, max / 8);
+
+        hits = 0;
+        g_test_timer_start();
+        for (i = 0; i < max; i++) {
+            hits += mac_set_contains(&set, &frames[(i & 255) * 6]);
+        }
+        hashed = g_test_timer_elapsed();
+        g_assert_cmpint(hits, >=, max / 8);
+
+        g_test_message("%2d entries, %u lookups: linear %f s, hashed %f s\n",
+                       n, max, linear, hashed);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/basic/macset/empty", test_empty);
+    g_test_add_func("/basic/macset/add", test_add);
+    g_test_add_func("/basic/macset/random", test_random);
+    if (g_test_perf()) {
+        g_test_add_func("/perf/macset/lookup", perf_lookup);
+    }
+    return g_test_run();
+}
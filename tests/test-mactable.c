@@ -0,0 +1,132 @@
+/*
+ * MACTable unit tests
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include <glib.h>
+#include "qemu-common.h"
+#include "net/mactable.h"
+
+static const uint8_t mac_a[6] = {0x52, 0x54, 0x00, 0x12, 0x34, 0x56};
+static const uint8_t mac_b[6] = {0x52, 0x54, 0x00, 0x12, 0x34, 0x57};
+/* same slot as mac_a */
+static const uint8_t mac_a2[6] = {0x52, 0x54, 0x00, 0x12, 0x56, 0x34};
+static const uint8_t bcast[6] = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
+static const uint8_t mcast[6] = {0x01, 0x00, 0x5e, 0x00, 0x00, 0x01};
+
+static int port1, port2;
+
+static void test_learn(void)
+{
+    static const uint8_t zero[6];
+    MACTable table;
+
+    memset(&table, 0, sizeof(table));
+    g_assert(!mac_table_lookup(&table, mac_a, 0));
+    g_assert(!mac_table_lookup(&table, zero, 0));
+
+    mac_table_learn(&table, mac_a, &port1, 0);
+    g_assert(mac_table_lookup(&table, mac_a, 0) == &port1);
+    g_assert(!mac_table_lookup(&table, mac_b, 0));
+
+    mac_table_learn(&table, mac_b, &port2, 0);
+    g_assert(mac_table_lookup(&table, mac_a, 0) == &port1);
+    g_assert(mac_table_lookup(&table, mac_b, 0) == &port2);
+
+    /* an address that moves is followed */
+    mac_table_learn(&table, mac_a, &port2, 1);
+    g_assert(mac_table_lookup(&table, mac_a, 1) == &port2);
+}
+
+static void test_group(void)
+{
+    MACTable table;
+
+    memset(&table, 0, sizeof(table));
+
+    /* group addresses are neither learned nor looked up */
+    mac_table_learn(&table, mcast, &port1, 0);
+    mac_table_learn(&table, bcast, &port1, 0);
+    g_assert(!mac_table_lookup(&table, mcast, 0));
+    g_assert(!mac_table_lookup(&table, bcast, 0));
+}
+
+static void test_ageing(void)
+{
+    MACTable table;
+    int64_t t = 1000;
+
+    memset(&table, 0, sizeof(table));
+
+    mac_table_learn(&table, mac_a, &port1, t);
+    g_assert(mac_table_lookup(&table, mac_a, t + MAC_TABLE_AGEING_MS) ==
+             &port1);
+    g_assert(!mac_table_lookup(&table, mac_a, t + MAC_TABLE_AGEING_MS + 1));
+
+    /* seeing the address again refreshes it */
+    t += MAC_TABLE_AGEING_MS;
+    mac_table_learn(&table, mac_a, &port1, t);
+    g_assert(mac_table_lookup(&table, mac_a, t + MAC_TABLE_AGEING_MS) ==
+             &port1);
+    g_assert(!mac_table_lookup(&table, mac_a, t + MAC_TABLE_AGEING_MS + 1));
+}
+
+static void test_collision(void)
+{
+    MACTable table;
+
+    memset(&table, 0, sizeof(table));
+
+    mac_table_learn(&table, mac_a, &port1, 0);
+    mac_table_learn(&table, mac_a2, &port2, 0);
+
+    /* the displaced address must be flooded, not sent to the new owner */
+    g_assert(!mac_table_lookup(&table, mac_a, 0));
+    g_assert(mac_table_lookup(&table, mac_a2, 0) == &port2);
+
+    mac_table_learn(&table, mac_a, &port1, 0);
+    g_assert(mac_table_lookup(&table, mac_a, 0) == &port1);
+    g_assert(!mac_table_lookup(&table, mac_a2, 0));
+}
+
+static void test_forget(void)
+{
+    uint8_t mac[6];
+    MACTable table;
+    int i;
+
+    memset(&table, 0, sizeof(table));
+    memcpy(mac, mac_a, 6);
+
+    for (i = 0; i < MAC_TABLE_SIZE; i++) {
+        mac[5] = i;
+        mac_table_learn(&table, mac, i & 1 ? &port2 : &port1, 0);
+    }
+
+    mac_table_forget(&table, &port1);
+    for (i = 0; i < MAC_TABLE_SIZE; i++) {
+        mac[5] = i;
+        g_assert(mac_table_lookup(&table, mac, 0) ==
+                 (i & 1 ? &port2 : NULL));
+    }
+
+    mac_table_forget(&table, &port2);
+    for (i = 0; i < MAC_TABLE_SIZE; i++) {
+        mac[5] = i;
+        g_assert(!mac_table_lookup(&table, mac, 0));
+    }
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/basic/mactable/learn", test_learn);
+    g_test_add_func("/basic/mactable/group", test_group);
+    g_test_add_func("/basic/mactable/ageing", test_ageing);
+    g_test_add_func("/basic/mactable/collision", test_collision);
+    g_test_add_func("/basic/mactable/forget", test_forget);
+    return g_test_run();
+}
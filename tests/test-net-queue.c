@@ -0,0 +1,303 @@
+/*
+ * NetQueue unit tests: sharing of queued packet bodies between queues
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include <glib.h>
+#include "qemu-common.h"
+#include "net.h"
+#include "iov.h"
+
+/*
+ * The test stands in for net.c: each queue's opaque is a Receiver, which
+ * either takes a packet or reports that it is busy, and records what it was
+ * handed.
+ */
+
+#define PKT_SIZE 1514
+#define NQUEUES  3
+
+typedef struct Receiver {
+    bool busy;
+    int count;
+    const uint8_t *data;        /* as passed to the last delivery */
+    uint8_t copy[PKT_SIZE];     /* and a copy of the packet */
+    size_t size;
+    uint8_t seq[8];             /* first byte of each packet delivered */
+} Receiver;
+
+static NetClientState sender, other_sender;
+static int sent_count;
+
+int qemu_can_send_packet(NetClientState *nc)
+{
+    return 1;
+}
+
+ssize_t qemu_deliver_packet(NetClientState *sender,
+                            unsigned flags,
+                            const uint8_t *data,
+                            size_t size,
+                            void *opaque)
+{
+    Receiver *r = opaque;
+
+    if (r->busy) {
+        return 0;
+    }
+    g_assert_cmpint(size, <=, PKT_SIZE);
+    r->data = data;
+    r->size = size;
+    memcpy(r->copy, data, size);
+    r->seq[r->count++ % ARRAY_SIZE(r->seq)] = data[0];
+    return size;
+}
+
+ssize_t qemu_deliver_packet_iov(NetClientState *sender,
+                            unsigned flags,
+                            const struct iovec *iov,
+                            int iovcnt,
+                            void *opaque)
+{
+    Receiver *r = opaque;
+
+    if (r->busy) {
+        return 0;
+    }
+    r->data = NULL;
+    r->size = iov_to_buf(iov, iovcnt, 0, r->copy, PKT_SIZE);
+    r->seq[r->count++ % ARRAY_SIZE(r->seq)] = r->copy[0];
+    return r->size;
+}
+
+static void sent_cb(NetClientState *nc, ssize_t ret)
+{
+    g_assert(nc == &sender);
+    g_assert_cmpint(ret, ==, PKT_SIZE);
+    sent_count++;
+}
+
+/* A packet in three pieces with a pattern that depends on @seq */
+static void packet_init(struct iovec *iov, uint8_t *buf, int seq)
+{
+    int i;
+
+    for (i = 0; i < PKT_SIZE; i++) {
+        buf[i] = i * 7 + seq;
+    }
+    iov[0].iov_base = buf;
+    iov[0].iov_len = 14;
+    iov[1].iov_base = buf + 14;
+    iov[1].iov_len = 20;
+    iov[2].iov_base = buf + 34;
+    iov[2].iov_len = PKT_SIZE - 34;
+}
+
+static void check_received(Receiver *r, int count, int seq)
+{
+    uint8_t expected[PKT_SIZE];
+    struct iovec iov[3];
+
+    packet_init(iov, expected, seq);
+    g_assert_cmpint(r->count, ==, count);
+    g_assert_cmpint(r->size, ==, PKT_SIZE);
+    g_assert(!memcmp(r->copy, expected, PKT_SIZE));
+}
+
+static void setup(NetQueue **queues, Receiver *receivers)
+{
+    int i;
+
+    memset(receivers, 0, NQUEUES * sizeof(*receivers));
+    for (i = 0; i < NQUEUES; i++) {
+        receivers[i].busy = true;
+        queues[i] = qemu_new_net_queue(&receivers[i]);
+    }
+    sent_count = 0;
+}
+
+/* Send one packet to every queue the way a hub does */
+static NetBuffer *send_shared_all(NetQueue **queues, struct iovec *iov)
+{
+    NetBuffer *buffer = NULL, *first = NULL;
+    int i;
+
+    for (i = 0; i < NQUEUES; i++) {
+        g_assert_cmpint(qemu_net_queue_send_shared(queues[i], &sender, 0,
+                                                   iov, 3, &buffer, sent_cb),
+                        ==, 0);
+        g_assert(buffer);
+        if (!first) {
+            first = buffer;
+        }
+        g_assert(buffer == first);
+    }
+    return buffer;
+}
+
+static void test_direct(void)
+{
+    NetQueue *queues[NQUEUES];
+    Receiver receivers[NQUEUES];
+    NetBuffer *buffer = NULL;
+    uint8_t buf[PKT_SIZE];
+    struct iovec iov[3];
+
+    setup(queues, receivers);
+    receivers[0].busy = false;
+    packet_init(iov, buf, 0);
+
+    /* a packet that can be delivered right away is never copied */
+    g_assert_cmpint(qemu_net_queue_send_shared(queues[0], &sender, 0,
+                                               iov, 3, &buffer, sent_cb),
+                    ==, PKT_SIZE);
+    g_assert(!buffer);
+    check_received(&receivers[0], 1, 0);
+
+    iov[0].iov_len = PKT_SIZE;
+    g_assert_cmpint(qemu_net_queue_send_shared(queues[0], &sender, 0,
+                                               iov, 1, &buffer, sent_cb),
+                    ==, PKT_SIZE);
+    g_assert(!buffer);
+    g_assert(receivers[0].data == buf);
+    check_received(&receivers[0], 2, 0);
+    g_assert_cmpint(sent_count, ==, 0);
+
+    qemu_del_net_queue(queues[0]);
+    qemu_del_net_queue(queues[1]);
+    qemu_del_net_queue(queues[2]);
+}
+
+static void test_shared(void)
+{
+    NetQueue *queues[NQUEUES];
+    Receiver receivers[NQUEUES];
+    uint8_t buf[PKT_SIZE];
+    struct iovec iov[3];
+    const uint8_t *data;
+    int i;
+
+    setup(queues, receivers);
+    packet_init(iov, buf, 1);
+
+    qemu_net_buffer_unref(send_shared_all(queues, iov));
+
+    /* the body must no longer depend on the caller's iovec */
+    memset(buf, 0, sizeof(buf));
+
+    for (i = 0; i < NQUEUES; i++) {
+        g_assert_cmpint(receivers[i].count, ==, 0);
+    }
+
+    receivers[0].busy = false;
+    g_assert(qemu_net_queue_flush(queues[0]));
+    check_received(&receivers[0], 1, 1);
+    data = receivers[0].data;
+    qemu_del_net_queue(queues[0]);
+
+    /* every queue delivers the same copy */
+    for (i = 1; i < NQUEUES; i++) {
+        receivers[i].busy = false;
+        g_assert(qemu_net_queue_flush(queues[i]));
+        check_received(&receivers[i], 1, 1);
+        g_assert(receivers[i].data == data);
+    }
+    g_assert_cmpint(sent_count, ==, NQUEUES);
+
+    for (i = 1; i < NQUEUES; i++) {
+        qemu_del_net_queue(queues[i]);
+    }
+}
+
+/* Queues let go of a shared packet in every possible way and order */
+static void test_release(void)
+{
+    NetQueue *queues[NQUEUES];
+    Receiver receivers[NQUEUES];
+    NetBuffer *buffer;
+    uint8_t buf[PKT_SIZE];
+    struct iovec iov[3];
+
+    setup(queues, receivers);
+    packet_init(iov, buf, 2);
+
+    buffer = send_shared_all(queues, iov);
+
+    /* purged, then deleted without having delivered it */
+    qemu_net_queue_purge(queues[0], &other_sender);
+    qemu_net_queue_purge(queues[0], &sender);
+    receivers[0].busy = false;
+    g_assert(qemu_net_queue_flush(queues[0]));
+    g_assert_cmpint(receivers[0].count, ==, 0);
+    qemu_del_net_queue(queues[0]);
+
+    qemu_del_net_queue(queues[1]);
+
+    /* the caller's reference is not the last one */
+    qemu_net_buffer_unref(buffer);
+
+    receivers[2].busy = false;
+    g_assert(qemu_net_queue_flush(queues[2]));
+    check_received(&receivers[2], 1, 2);
+    g_assert_cmpint(sent_count, ==, 1);
+    qemu_del_net_queue(queues[2]);
+}
+
+/* A buffer passed in by the caller is used as is, and shared and private
+ * packets keep their order within a queue.
+ */
+static void test_order(void)
+{
+    NetQueue *queues[NQUEUES];
+    Receiver receivers[NQUEUES];
+    NetBuffer *buffer, *reused;
+    uint8_t buf[PKT_SIZE];
+    struct iovec iov[3];
+
+    setup(queues, receivers);
+
+    packet_init(iov, buf, 3);
+    g_assert_cmpint(qemu_net_queue_send_iov(queues[0], &sender, 0, iov, 3,
+                                            sent_cb), ==, 0);
+
+    packet_init(iov, buf, 4);
+    buffer = qemu_net_buffer_new(iov, 3);
+    reused = qemu_net_buffer_ref(buffer);
+    g_assert(reused == buffer);
+    g_assert_cmpint(qemu_net_queue_send_shared(queues[0], &sender, 0,
+                                               iov, 3, &reused, sent_cb),
+                    ==, 0);
+    g_assert(reused == buffer);
+    qemu_net_buffer_unref(reused);
+    qemu_net_buffer_unref(buffer);
+    qemu_net_buffer_unref(NULL);
+
+    packet_init(iov, buf, 5);
+    g_assert_cmpint(qemu_net_queue_send_iov(queues[0], &sender, 0, iov, 3,
+                                            sent_cb), ==, 0);
+
+    receivers[0].busy = false;
+    g_assert(qemu_net_queue_flush(queues[0]));
+    check_received(&receivers[0], 3, 5);
+    g_assert_cmpint(receivers[0].seq[0], ==, 3);
+    g_assert_cmpint(receivers[0].seq[1], ==, 4);
+    g_assert_cmpint(receivers[0].seq[2], ==, 5);
+    g_assert_cmpint(sent_count, ==, 3);
+
+    qemu_del_net_queue(queues[0]);
+    qemu_del_net_queue(queues[1]);
+    qemu_del_net_queue(queues[2]);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/basic/net-queue/direct", test_direct);
+    g_test_add_func("/basic/net-queue/shared", test_shared);
+    g_test_add_func("/basic/net-queue/release", test_release);
+    g_test_add_func("/basic/net-queue/order", test_order);
+    return g_test_run();
+}
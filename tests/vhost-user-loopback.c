@@ -0,0 +1,651 @@
+/*
+ * Reference vhost-user slave: sends every packet the guest transmits back
+ * to the guest.
+ *
+ * Copyright (c) 2013 QEMU contributors
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * Usage:
+ *   vhost-user-loopback /tmp/vhost.sock &
+ *   qemu-system-x86_64 -enable-kvm -m 512 -mem-path /dev/shm -mem-prealloc \
+ *       -netdev vhost-user,id=net0,path=/tmp/vhost.sock \
+ *       -device virtio-net-pci,netdev=net0
+ *
+ * It is single threaded and polls the transmit kick eventfd, so it doubles
+ * as a baseline for measuring the cost of the vhost-user datapath.  Packet
+ * counts are printed when QEMU disconnects and on SIGINT/SIGTERM.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define VHOST_MEMORY_MAX_NREGIONS   8
+#define VHOST_USER_VERSION          0x1
+#define VHOST_USER_REPLY_MASK       (0x1 << 2)
+#define VHOST_USER_VRING_IDX_MASK   0xff
+#define VHOST_USER_VRING_NOFD_MASK  (0x1 << 8)
+
+enum {
+    VHOST_USER_NONE = 0,
+    VHOST_USER_GET_FEATURES = 1,
+    VHOST_USER_SET_FEATURES = 2,
+    VHOST_USER_SET_OWNER = 3,
+    VHOST_USER_RESET_OWNER = 4,
+    VHOST_USER_SET_MEM_TABLE = 5,
+    VHOST_USER_SET_LOG_BASE = 6,
+    VHOST_USER_SET_LOG_FD = 7,
+    VHOST_USER_SET_VRING_NUM = 8,
+    VHOST_USER_SET_VRING_ADDR = 9,
+    VHOST_USER_SET_VRING_BASE = 10,
+    VHOST_USER_GET_VRING_BASE = 11,
+    VHOST_USER_SET_VRING_KICK = 12,
+    VHOST_USER_SET_VRING_CALL = 13,
+    VHOST_USER_SET_VRING_ERR = 14,
+    VHOST_USER_MAX
+};
+
+typedef struct VringState {
+    uint32_t index;
+    uint32_t num;
+} VringState;
+
+typedef struct VringAddr {
+    uint32_t index;
+    uint32_t flags;
+    uint64_t desc_user_addr;
+    uint64_t used_user_addr;
+    uint64_t avail_user_addr;
+    uint64_t log_guest_addr;
+} VringAddr;
+
+typedef struct MemoryRegion {
+    uint64_t guest_phys_addr;
+    uint64_t memory_size;
+    uint64_t userspace_addr;
+    uint64_t mmap_offset;
+} MemoryRegion;
+
+typedef struct Memory {
+    uint32_t nregions;
+    uint32_t padding;
+    MemoryRegion regions[VHOST_MEMORY_MAX_NREGIONS];
+} Memory;
+
+typedef struct Msg {
+    uint32_t request;
+    uint32_t flags;
+    uint32_t size;
+    union {
+        uint64_t u64;
+        VringState state;
+        VringAddr addr;
+        Memory memory;
+    } payload;
+} __attribute__((packed)) Msg;
+
+#define HDR_SIZE offsetof(Msg, payload)
+
+/* Split virtqueue layout, see the virtio specification */
+#define VRING_DESC_F_NEXT           1
+#define VRING_DESC_F_WRITE          2
+#define VRING_AVAIL_F_NO_INTERRUPT  1
+
+#define VIRTIO_NET_F_MRG_RXBUF      15
+
+struct vring_desc {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t flags;
+    uint16_t next;
+};
+
+struct vring_avail {
+    uint16_t flags;
+    uint16_t idx;
+    uint16_t ring[];
+};
+
+struct vring_used_elem {
+    uint32_t id;
+    uint32_t len;
+};
+
+struct vring_used {
+    uint16_t flags;
+    uint16_t idx;
+    struct vring_used_elem ring[];
+};
+
+typedef struct Region {
+    uint64_t gpa;
+    uint64_t size;
+    uint64_t qva;
+    uint8_t *mmap_addr;
+    uint64_t mmap_size;
+} Region;
+
+typedef struct Vring {
+    unsigned int num;
+    struct vring_desc *desc;
+    struct vring_avail *avail;
+    struct vring_used *used;
+    uint16_t last_avail_idx;
+    int kick_fd;
+    int call_fd;
+} Vring;
+
+enum { RX_VQ = 0, TX_VQ = 1, NUM_VQ = 2 };
+
+typedef struct Dev {
+    int sock;
+    int nregions;
+    Region regions[VHOST_MEMORY_MAX_NREGIONS];
+    Vring vq[NUM_VQ];
+    uint64_t features;
+    size_t hdr_len;
+    uint64_t packets;
+    uint64_t bytes;
+    uint64_t dropped;
+} Dev;
+
+static volatile sig_atomic_t quit;
+
+static void die(const char *msg)
+{
+    perror(msg);
+    exit(1);
+}
+
+static void *gpa_to_va(Dev *dev, uint64_t gpa, uint32_t len)
+{
+    int i;
+
+    for (i = 0; i < dev->nregions; i++) {
+        Region *r = &dev->regions[i];
+
+        if (gpa >= r->gpa && gpa - r->gpa + len <= r->size) {
+            return r->mmap_addr + (gpa - r->gpa);
+        }
+    }
+    return NULL;
+}
+
+static void *qva_to_va(Dev *dev, uint64_t qva)
+{
+    int i;
+
+    for (i = 0; i < dev->nregions; i++) {
+        Region *r = &dev->regions[i];
+
+        if (qva >= r->qva && qva - r->qva < r->size) {
+            return r->mmap_addr + (qva - r->qva);
+        }
+    }
+    return NULL;
+}
+
+static void unmap_regions(Dev *dev)
+{
+    int i;
+
+    for (i = 0; i < dev->nregions; i++) {
+        Region *r = &dev->regions[i];
+
+        munmap(r->mmap_addr - (r->mmap_size - r->size), r->mmap_size);
+    }
+    dev->nregions = 0;
+}
+
+static void reset_vrings(Dev *dev)
+{
+    int i;
+
+    for (i = 0; i < NUM_VQ; i++) {
+        Vring *vq = &dev->vq[i];
+
+        if (vq->kick_fd >= 0) {
+            close(vq->kick_fd);
+        }
+        if (vq->call_fd >= 0) {
+            close(vq->call_fd);
+        }
+        memset(vq, 0, sizeof(*vq));
+        vq->kick_fd = vq->call_fd = -1;
+    }
+}
+
+static void vring_notify(Vring *vq)
+{
+    uint64_t one = 1;
+
+    __sync_synchronize();
+    if (vq->call_fd >= 0 && !(vq->avail->flags & VRING_AVAIL_F_NO_INTERRUPT)) {
+        if (write(vq->call_fd, &one, sizeof(one)) < 0) {
+            perror("write call fd");
+        }
+    }
+}
+
+static void vring_push(Vring *vq, uint16_t head, uint32_t len)
+{
+    uint16_t idx = vq->used->idx;
+
+    vq->used->ring[idx % vq->num].id = head;
+    vq->used->ring[idx % vq->num].len = len;
+    __sync_synchronize();
+    vq->used->idx = idx + 1;
+}
+
+/* Copy @len bytes of @buf into the receive buffers the guest posted.  */
+static bool rx_packet(Dev *dev, const uint8_t *buf, uint32_t len)
+{
+    Vring *vq = &dev->vq[RX_VQ];
+    uint32_t copied = 0;
+    uint16_t head, i;
+
+    if (!vq->avail || vq->last_avail_idx == vq->avail->idx) {
+        return false;
+    }
+    __sync_synchronize();
+    head = vq->avail->ring[vq->last_avail_idx % vq->num];
+    vq->last_avail_idx++;
+
+    i = head;
+    for (;;) {
+        struct vring_desc *d = &vq->desc[i];
+        uint32_t chunk = len - copied < d->len ? len - copied : d->len;
+        uint8_t *p = gpa_to_va(dev, d->addr, chunk);
+
+        if (!p || !(d->flags & VRING_DESC_F_WRITE)) {
+            fprintf(stderr, "bad rx descriptor\n");
+            break;
+        }
+        memcpy(p, buf + copied, chunk);
+        copied += chunk;
+        if (copied == len || !(d->flags & VRING_DESC_F_NEXT)) {
+            break;
+        }
+        i = d->next;
+    }
+
+    vring_push(vq, head, copied);
+    return copied == len;
+}
+
+/* Loop every pending transmit buffer back into the receive queue.  */
+static void process_tx(Dev *dev)
+{
+    Vring *vq = &dev->vq[TX_VQ];
+    static uint8_t buf[65536 + 64];
+    bool rx_used = false, tx_used = false;
+
+    if (!vq->avail) {
+        return;
+    }
+
+    while (vq->last_avail_idx != vq->avail->idx) {
+        uint32_t len = 0;
+        uint16_t head, i;
+
+        __sync_synchronize();
+        head = vq->avail->ring[vq->last_avail_idx % vq->num];
+        vq->last_avail_idx++;
+
+        i = head;
+        for (;;) {
+            struct vring_desc *d = &vq->desc[i];
+            uint8_t *p = gpa_to_va(dev, d->addr, d->len);
+
+            if (!p || len + d->len > sizeof(buf)) {
+                fprintf(stderr, "bad tx descriptor\n");
+                break;
+            }
+            memcpy(buf + len, p, d->len);
+            len += d->len;
+            if (!(d->flags & VRING_DESC_F_NEXT)) {
+                break;
+            }
+            i = d->next;
+        }
+        vring_push(vq, head, 0);
+        tx_used = true;
+
+        if (len < dev->hdr_len) {
+            continue;
+        }
+        /* The packet goes back as a single buffer */
+        if (dev->hdr_len == 12) {
+            buf[10] = 1;
+            buf[11] = 0;
+        }
+        if (rx_packet(dev, buf, len)) {
+            dev->packets++;
+            dev->bytes += len - dev->hdr_len;
+            rx_used = true;
+        } else {
+            dev->dropped++;
+        }
+    }
+
+    if (tx_used) {
+        vring_notify(vq);
+    }
+    if (rx_used) {
+        vring_notify(&dev->vq[RX_VQ]);
+    }
+}
+
+static void print_stats(Dev *dev)
+{
+    fprintf(stderr, "vhost-user-loopback: %" PRIu64 " packets, %" PRIu64
+            " bytes looped back, %" PRIu64 " dropped\n",
+            dev->packets, dev->bytes, dev->dropped);
+}
+
+/* Returns the number of bytes read, 0 on disconnect.  */
+static ssize_t read_msg(int sock, Msg *msg, int *fds, int *fd_num)
+{
+    char control[CMSG_SPACE(VHOST_MEMORY_MAX_NREGIONS * sizeof(int))];
+    struct msghdr msgh;
+    struct cmsghdr *cmsg;
+    struct iovec iov;
+    ssize_t r;
+
+    memset(&msgh, 0, sizeof(msgh));
+    iov.iov_base = msg;
+    iov.iov_len = HDR_SIZE;
+    msgh.msg_iov = &iov;
+    msgh.msg_iovlen = 1;
+    msgh.msg_control = control;
+    msgh.msg_controllen = sizeof(control);
+
+    *fd_num = 0;
+    r = recvmsg(sock, &msgh, MSG_WAITALL);
+    if (r <= 0) {
+        return r;
+    }
+    for (cmsg = CMSG_FIRSTHDR(&msgh); cmsg; cmsg = CMSG_NXTHDR(&msgh, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            *fd_num = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(fds, CMSG_DATA(cmsg), *fd_num * sizeof(int));
+        }
+    }
+    if (r != HDR_SIZE || msg->size > sizeof(msg->payload)) {
+        fprintf(stderr, "bad message header\n");
+        return -1;
+    }
+    if (msg->size) {
+        r = recv(sock, &msg->payload, msg->size, MSG_WAITALL);
+        if (r != msg->size) {
+            return -1;
+        }
+    }
+    return HDR_SIZE + msg->size;
+}
+
+static void reply(Dev *dev, Msg *msg)
+{
+    msg->flags = VHOST_USER_VERSION | VHOST_USER_REPLY_MASK;
+    if (write(dev->sock, msg, HDR_SIZE + msg->size) < 0) {
+        perror("write reply");
+    }
+}
+
+static void set_mem_table(Dev *dev, Msg *msg, int *fds, int fd_num)
+{
+    Memory mem = msg->payload.memory;
+    int i;
+
+    unmap_regions(dev);
+    if (mem.nregions != fd_num) {
+        fprintf(stderr, "bad memory table\n");
+        for (i = 0; i < fd_num; i++) {
+            close(fds[i]);
+        }
+        return;
+    }
+    for (i = 0; i < mem.nregions; i++) {
+        MemoryRegion *mr = &mem.regions[i];
+        Region *r = &dev->regions[i];
+        uint8_t *p;
+
+        r->gpa = mr->guest_phys_addr;
+        r->size = mr->memory_size;
+        r->qva = mr->userspace_addr;
+        r->mmap_size = mr->memory_size + mr->mmap_offset;
+        p = mmap(NULL, r->mmap_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                 fds[i], 0);
+        close(fds[i]);
+        if (p == MAP_FAILED) {
+            die("mmap guest memory");
+        }
+        r->mmap_addr = p + mr->mmap_offset;
+        dev->nregions = i + 1;
+    }
+}
+
+/* Returns false when the connection must be dropped.  */
+static bool handle_msg(Dev *dev)
+{
+    int fds[VHOST_MEMORY_MAX_NREGIONS];
+    int fd_num, i;
+    Msg msg;
+    Vring *vq;
+    unsigned idx;
+
+    if (read_msg(dev->sock, &msg, fds, &fd_num) <= 0) {
+        return false;
+    }
+
+    switch (msg.request) {
+    case VHOST_USER_GET_FEATURES:
+        msg.payload.u64 = 1ULL << VIRTIO_NET_F_MRG_RXBUF;
+        msg.size = sizeof(msg.payload.u64);
+        reply(dev, &msg);
+        break;
+    case VHOST_USER_SET_FEATURES:
+        dev->features = msg.payload.u64;
+        dev->hdr_len = dev->features & (1ULL << VIRTIO_NET_F_MRG_RXBUF) ?
+            12 : 10;
+        break;
+    case VHOST_USER_SET_OWNER:
+        break;
+    case VHOST_USER_RESET_OWNER:
+        reset_vrings(dev);
+        break;
+    case VHOST_USER_SET_MEM_TABLE:
+        set_mem_table(dev, &msg, fds, fd_num);
+        fd_num = 0;
+        break;
+    case VHOST_USER_SET_LOG_BASE:
+    case VHOST_USER_SET_LOG_FD:
+        break;
+    case VHOST_USER_SET_VRING_NUM:
+        if (msg.payload.state.index < NUM_VQ) {
+            dev->vq[msg.payload.state.index].num = msg.payload.state.num;
+        }
+        break;
+    case VHOST_USER_SET_VRING_ADDR:
+        if (msg.payload.addr.index < NUM_VQ) {
+            vq = &dev->vq[msg.payload.addr.index];
+            vq->desc = qva_to_va(dev, msg.payload.addr.desc_user_addr);
+            vq->avail = qva_to_va(dev, msg.payload.addr.avail_user_addr);
+            vq->used = qva_to_va(dev, msg.payload.addr.used_user_addr);
+            if (!vq->desc || !vq->avail || !vq->used) {
+                fprintf(stderr, "ring %u is outside guest memory\n",
+                        msg.payload.addr.index);
+                vq->desc = NULL;
+                vq->avail = NULL;
+                vq->used = NULL;
+            }
+        }
+        break;
+    case VHOST_USER_SET_VRING_BASE:
+        if (msg.payload.state.index < NUM_VQ) {
+            dev->vq[msg.payload.state.index].last_avail_idx =
+                msg.payload.state.num;
+        }
+        break;
+    case VHOST_USER_GET_VRING_BASE:
+        idx = msg.payload.state.index;
+        if (idx < NUM_VQ) {
+            vq = &dev->vq[idx];
+            msg.payload.state.num = vq->last_avail_idx;
+            /* The ring stops until it is kicked off again */
+            if (vq->kick_fd >= 0) {
+                close(vq->kick_fd);
+                vq->kick_fd = -1;
+            }
+            vq->avail = NULL;
+        }
+        reply(dev, &msg);
+        break;
+    case VHOST_USER_SET_VRING_KICK:
+    case VHOST_USER_SET_VRING_CALL:
+    case VHOST_USER_SET_VRING_ERR:
+        idx = msg.payload.u64 & VHOST_USER_VRING_IDX_MASK;
+        if (idx < NUM_VQ && msg.request != VHOST_USER_SET_VRING_ERR &&
+            !(msg.payload.u64 & VHOST_USER_VRING_NOFD_MASK) && fd_num == 1) {
+            int *slot = msg.request == VHOST_USER_SET_VRING_KICK ?
+                &dev->vq[idx].kick_fd : &dev->vq[idx].call_fd;
+
+            if (*slot >= 0) {
+                close(*slot);
+            }
+            *slot = fds[0];
+            fd_num = 0;
+        }
+        break;
+    default:
+        fprintf(stderr, "unknown request %u\n", msg.request);
+        break;
+    }
+
+    for (i = 0; i < fd_num; i++) {
+        close(fds[i]);
+    }
+    return true;
+}
+
+static void serve(Dev *dev)
+{
+    struct pollfd pfd[1 + NUM_VQ];
+    uint64_t count;
+    int i, n, r;
+
+    while (!quit) {
+        n = 0;
+        pfd[n].fd = dev->sock;
+        pfd[n++].events = POLLIN;
+        for (i = 0; i < NUM_VQ; i++) {
+            if (dev->vq[i].kick_fd >= 0) {
+                pfd[n].fd = dev->vq[i].kick_fd;
+                pfd[n++].events = POLLIN;
+            }
+        }
+
+        r = poll(pfd, n, -1);
+        if (r < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            die("poll");
+        }
+
+        for (i = 1; i < n; i++) {
+            if (pfd[i].revents & POLLIN) {
+                if (read(pfd[i].fd, &count, sizeof(count)) < 0) {
+                    perror("read kick fd");
+                }
+            }
+        }
+        /* Transmit buffers are never held back for lack of receive
+         * buffers, so whichever ring was kicked, only TX has work.  */
+        if (n > 1) {
+            process_tx(dev);
+        }
+
+        if ((pfd[0].revents & (POLLIN | POLLHUP)) && !handle_msg(dev)) {
+            break;
+        }
+    }
+}
+
+static void handle_signal(int sig)
+{
+    quit = 1;
+}
+
+int main(int argc, char **argv)
+{
+    struct sockaddr_un un;
+    struct sigaction sa;
+    Dev dev;
+    int lsock, i;
+
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s SOCKET-PATH\n", argv[0]);
+        return 1;
+    }
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    lsock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (lsock < 0) {
+        die("socket");
+    }
+    memset(&un, 0, sizeof(un));
+    un.sun_family = AF_UNIX;
+    snprintf(un.sun_path, sizeof(un.sun_path), "%s", argv[1]);
+    unlink(un.sun_path);
+    if (bind(lsock, (struct sockaddr *)&un, sizeof(un)) < 0) {
+        die("bind");
+    }
+    if (listen(lsock, 1) < 0) {
+        die("listen");
+    }
+
+    while (!quit) {
+        memset(&dev, 0, sizeof(dev));
+        dev.hdr_len = 10;
+        for (i = 0; i < NUM_VQ; i++) {
+            dev.vq[i].kick_fd = dev.vq[i].call_fd = -1;
+        }
+
+        dev.sock = accept(lsock, NULL, NULL);
+        if (dev.sock < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            die("accept");
+        }
+
+        serve(&dev);
+        print_stats(&dev);
+
+        reset_vrings(&dev);
+        unmap_regions(&dev);
+        close(dev.sock);
+    }
+
+    close(lsock);
+    unlink(argv[1]);
+    return 0;
+}
@@ -27,7 +27,7 @@
 #define NO_CPU_IO_DEFS
 #include "cpu.h"
 #include "disas.h"
-#include "tcg.h"
+#include "tcg-op.h"
 #include "qemu-timer.h"
 
 /* code generation context */
@@ -42,6 +42,19 @@ void cpu_gen_init(void)
     tcg_context_init(&tcg_ctx); 
 }
 
+/* Count the executions of 'tb', see tb_profile_dump().  */
+static void gen_tb_profile(TranslationBlock *tb)
+{
+    TCGv_ptr ptr = tcg_const_host_ptr(&tb->exec_count);
+    TCGv_i64 count = tcg_temp_new_i64();
+
+    tcg_gen_ld_i64(count, ptr, 0);
+    tcg_gen_addi_i64(count, count, 1);
+    tcg_gen_st_i64(count, ptr, 0);
+    tcg_temp_free_i64(count);
+    tcg_temp_free_ptr(ptr);
+}
+
 /* return non zero if the very first instruction is invalid so that
    the virtual CPU can trigger an exception.
 
@@ -64,6 +77,9 @@ int cpu_gen_code(CPUArchState *env, TranslationBlock *tb, int *gen_code_size_ptr
 #endif
     tcg_func_start(s);
 
+    if (tb->cflags & CF_PROFILE) {
+        gen_tb_profile(tb);
+    }
     gen_intermediate_code(env, tb);
 
     /* generate machine code */
@@ -103,10 +119,8 @@ int cpu_gen_code(CPUArchState *env, TranslationBlock *tb, int *gen_code_size_ptr
     return 0;
 }
 
-/* The cpu state corresponding to 'searched_pc' is restored.
- */
-int cpu_restore_state(TranslationBlock *tb,
-                      CPUArchState *env, uintptr_t searched_pc)
+static int cpu_restore_state_locked(TranslationBlock *tb,
+                                    CPUArchState *env, uintptr_t searched_pc)
 {
     TCGContext *s = &tcg_ctx;
     int j;
@@ -120,6 +134,9 @@ int cpu_restore_state(TranslationBlock *tb,
 #endif
     tcg_func_start(s);
 
+    if (tb->cflags & CF_PROFILE) {
+        gen_tb_profile(tb);
+    }
     gen_intermediate_code_pc(env, tb);
 
     if (use_icount) {
@@ -158,3 +175,21 @@ int cpu_restore_state(TranslationBlock *tb,
 #endif
     return 0;
 }
+
+/* The cpu state corresponding to 'searched_pc' is restored.
+ */
+int cpu_restore_state(TranslationBlock *tb,
+                      CPUArchState *env, uintptr_t searched_pc)
+{
+    bool locked;
+    int ret;
+
+    /* Retranslation shares tcg_ctx with the translator and may fault in
+       code pages, so it needs both locks, in the usual order.  */
+    locked = tcg_iothread_lock();
+    tb_lock_acquire();
+    ret = cpu_restore_state_locked(tb, env, searched_pc);
+    tb_lock_release();
+    tcg_iothread_unlock(locked);
+    return ret;
+}
@@ -0,0 +1,627 @@
+/*
+ *  Persistent translation cache
+ *
+ *  Copyright (c) 2013 QEMU contributors
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Host code of translated blocks is appended to a file and reused by later
+ * runs of the same QEMU binary instead of translating the guest code again.
+ *
+ * A record is looked up by (pc, cs_base, flags, cflags) and only used if the
+ * guest code it was translated from is still byte for byte identical.  The
+ * host addresses the code refers to (helpers, the epilogue, the TB itself)
+ * are stored relative to a base and patched when the code is copied into the
+ * translation buffer.  A record is rejected if the backend would not have
+ * chosen the same instruction encoding at the new location, so that
+ * cpu_restore_state() regenerates exactly the same code.
+ *
+ * The file starts with a header carrying a hash of the QEMU binary and of
+ * the CPU configuration; on mismatch the file is started afresh.  Each record
+ * is appended with a single write() and carries a checksum, so that files
+ * shared by several QEMU processes or cut short by a crash stay usable.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <limits.h>
+
+#include "config.h"
+
+#define NO_CPU_IO_DEFS
+#include "cpu.h"
+#include "tcg.h"
+#include "qemu-log.h"
+
+#if defined(TCG_TARGET_EXT_RELOCS) && defined(__linux__) && \
+    (defined(TARGET_I386) || defined(TARGET_ARM))
+#define TB_CACHE_SUPPORTED
+#endif
+
+#ifdef TB_CACHE_SUPPORTED
+
+#define TB_CACHE_MAGIC          "QEMUTBC1"
+#define TB_CACHE_RECORD_MAGIC   0x54424331
+#define TB_CACHE_MAX_SIZE       (128 * 1024 * 1024)
+
+typedef struct TBCacheHeader {
+    char magic[8];
+    uint64_t config;            /* see tb_cache_config() */
+} TBCacheHeader;
+
+/* followed by the relocations, the guest code and the host code */
+typedef struct TBCacheRecord {
+    uint32_t magic;
+    uint32_t len;               /* of the whole record, multiple of 8 */
+    uint64_t checksum;          /* of what follows this field */
+    uint64_t pc;
+    uint64_t cs_base;
+    uint32_t flags;
+    uint32_t cflags;
+    uint32_t code_size;
+    uint16_t size;
+    uint16_t icount;
+    uint16_t nb_relocs;
+    uint16_t tb_next_offset[2];
+    uint16_t tb_jmp_offset[2];
+    uint16_t pad;
+} TBCacheRecord;
+
+enum {
+    TB_CACHE_BASE_TB,           /* the TranslationBlock */
+    TB_CACHE_BASE_PROLOGUE,     /* code_gen_prologue */
+    TB_CACHE_BASE_TEXT,         /* the text segment of the QEMU binary */
+};
+
+typedef struct TBCacheReloc {
+    uint32_t offset;            /* of the field in the host code */
+    uint32_t site;              /* of the branch, for TCG_EXT_BRANCH */
+    uint32_t type;              /* TCG_EXT_* */
+    uint32_t base;              /* TB_CACHE_BASE_* */
+    int64_t addend;
+} TBCacheReloc;
+
+static struct {
+    const char *path;
+    bool print_stats;
+    bool opened;
+    bool store_ok;
+    int fd;
+    size_t size;
+    /* executable mapping of the QEMU binary */
+    tcg_target_long text_start;
+    tcg_target_long text_end;
+    /* open addressing hash table of records */
+    const TBCacheRecord **index;
+    unsigned int index_mask;
+    unsigned int nb_records;
+    /* statistics */
+    unsigned int lookups;
+    unsigned int hits;
+    unsigned int mismatches;
+    unsigned int rejects;
+    unsigned int stores;
+    unsigned int uncacheable;
+} tb_cache = { .fd = -1 };
+
+#define FNV_OFFSET 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+
+static uint64_t tb_cache_hash(uint64_t h, const void *data, size_t len)
+{
+    const uint8_t *p = data;
+
+    while (len--) {
+        h = (h ^ *p++) * FNV_PRIME;
+    }
+    return h;
+}
+
+/* Everything that code generation depends on besides the guest code and
+   the TB key.  */
+static uint64_t tb_cache_config(CPUArchState *env)
+{
+    uint64_t h = FNV_OFFSET;
+    uint64_t val[10];
+    struct stat st;
+
+    h = tb_cache_hash(h, QEMU_VERSION TARGET_ARCH,
+                      strlen(QEMU_VERSION TARGET_ARCH));
+    memset(val, 0, sizeof(val));
+    if (stat("/proc/self/exe", &st) == 0) {
+        val[0] = st.st_dev;
+        val[1] = st.st_ino;
+        val[2] = st.st_size;
+        val[3] = st.st_mtime;
+    }
+    val[4] = sizeof(CPUArchState);
+    /* runtime switches that change the generated code */
+    val[5] = use_icount;
+    val[6] = singlestep;
+    val[7] = mttcg_enabled;
+    val[8] = parallel_cpus;
+#if defined(CONFIG_USER_ONLY)
+    val[9] = GUEST_BASE;
+#endif
+    h = tb_cache_hash(h, val, sizeof(val));
+#if defined(TARGET_I386)
+    h = tb_cache_hash(h, &env->cpuid_level,
+                      (uint8_t *)&env->cpuid_ext3_features -
+                      (uint8_t *)&env->cpuid_level);
+    h = tb_cache_hash(h, &env->cpuid_ext4_features,
+                      sizeof(env->cpuid_ext4_features));
+    h = tb_cache_hash(h, &env->cpuid_7_0_ebx_features,
+                      sizeof(env->cpuid_7_0_ebx_features));
+    h = tb_cache_hash(h, &env->cpuid_svm_features,
+                      sizeof(env->cpuid_svm_features));
+#elif defined(TARGET_ARM)
+    h = tb_cache_hash(h, &env->features, sizeof(env->features));
+    h = tb_cache_hash(h, &env->cp15.c0_cpuid, sizeof(env->cp15.c0_cpuid));
+#endif
+    return h;
+}
+
+static unsigned int tb_cache_key(uint64_t pc, uint64_t cs_base,
+                                 uint32_t flags, uint32_t cflags)
+{
+    uint64_t h = FNV_OFFSET;
+
+    h = tb_cache_hash(h, &pc, sizeof(pc));
+    h = tb_cache_hash(h, &cs_base, sizeof(cs_base));
+    h = tb_cache_hash(h, &flags, sizeof(flags));
+    h = tb_cache_hash(h, &cflags, sizeof(cflags));
+    return h ^ (h >> 32);
+}
+
+static uint64_t tb_cache_checksum(const TBCacheRecord *rec)
+{
+    size_t start = offsetof(TBCacheRecord, pc);
+
+    return tb_cache_hash(FNV_OFFSET, (const uint8_t *)rec + start,
+                         rec->len - start);
+}
+
+static void tb_cache_insert(const TBCacheRecord *rec)
+{
+    unsigned int i, size;
+    const TBCacheRecord **old;
+
+    if (tb_cache.nb_records * 2 >= tb_cache.index_mask) {
+        old = tb_cache.index;
+        size = tb_cache.index ? tb_cache.index_mask + 1 : 0;
+        tb_cache.index_mask = size ? size * 2 - 1 : 1023;
+        tb_cache.index = g_malloc0((tb_cache.index_mask + 1) *
+                                   sizeof(*tb_cache.index));
+        tb_cache.nb_records = 0;
+        for (i = 0; i < size; i++) {
+            if (old[i]) {
+                tb_cache_insert(old[i]);
+            }
+        }
+        g_free(old);
+    }
+    i = tb_cache_key(rec->pc, rec->cs_base, rec->flags, rec->cflags);
+    for (i &= tb_cache.index_mask; tb_cache.index[i];
+         i = (i + 1) & tb_cache.index_mask) {
+        /* probe */
+    }
+    tb_cache.index[i] = rec;
+    tb_cache.nb_records++;
+}
+
+/* Index the records of a mapped file and return the length of the valid
+   part.  Checksums are verified when a record is used.  */
+static size_t tb_cache_scan(const uint8_t *map, size_t size)
+{
+    const TBCacheRecord *rec;
+    size_t off = sizeof(TBCacheHeader);
+
+    while (size - off >= sizeof(TBCacheRecord)) {
+        rec = (const TBCacheRecord *)(map + off);
+        if (rec->magic != TB_CACHE_RECORD_MAGIC || rec->len % 8 != 0
+            || rec->len > size - off
+            || rec->len < sizeof(TBCacheRecord) +
+                          rec->nb_relocs * sizeof(TBCacheReloc) +
+                          rec->size + rec->code_size) {
+            break;
+        }
+        tb_cache_insert(rec);
+        off += rec->len;
+    }
+    return off;
+}
+
+/* Atomically replace the file with 'len' bytes of 'data'.  */
+static bool tb_cache_create(const void *data, size_t len)
+{
+    char *tmp = g_strdup_printf("%s.%d", tb_cache.path, (int)getpid());
+    bool ret = false;
+    int fd;
+
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd >= 0) {
+        ret = write(fd, data, len) == len;
+        close(fd);
+        if (ret && rename(tmp, tb_cache.path) != 0) {
+            ret = false;
+        }
+        if (!ret) {
+            unlink(tmp);
+        }
+    }
+    g_free(tmp);
+    return ret;
+}
+
+/* Helpers are referred to relative to the text of the QEMU binary, which
+   moves from one run to the next if it is position independent.  */
+static bool tb_cache_find_text(void)
+{
+    char exe[PATH_MAX], line[PATH_MAX + 128], perms[8];
+    unsigned long start, end;
+    ssize_t len;
+    int n;
+    FILE *f;
+
+    len = readlink("/proc/self/exe", exe, sizeof(exe) - 1);
+    if (len < 0) {
+        return false;
+    }
+    exe[len] = 0;
+    f = fopen("/proc/self/maps", "r");
+    if (!f) {
+        return false;
+    }
+    while (fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "\n")] = 0;
+        if (sscanf(line, "%lx-%lx %7s %*s %*s %*s %n",
+                   &start, &end, perms, &n) == 3 && perms[2] == 'x'
+            && strcmp(line + n, exe) == 0) {
+            tb_cache.text_start = start;
+            tb_cache.text_end = end;
+            break;
+        }
+    }
+    fclose(f);
+    return tb_cache.text_end != 0;
+}
+
+static void tb_cache_open(CPUArchState *env)
+{
+    TBCacheHeader hdr;
+    struct stat st;
+    void *map;
+    size_t len = 0;
+    int fd;
+
+    tb_cache.opened = true;
+    if (!tb_cache_find_text()) {
+        fprintf(stderr, "qemu: translation cache disabled, cannot find "
+                "the QEMU binary in /proc/self/maps\n");
+        return;
+    }
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, TB_CACHE_MAGIC, sizeof(hdr.magic));
+    hdr.config = tb_cache_config(env);
+
+    fd = open(tb_cache.path, O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        if (fstat(fd, &st) == 0 && st.st_size >= sizeof(hdr)) {
+            map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (map != MAP_FAILED) {
+                if (memcmp(map, &hdr, sizeof(hdr)) == 0) {
+                    len = tb_cache_scan(map, st.st_size);
+                    if (len < st.st_size && !tb_cache_create(map, len)) {
+                        len = 0;
+                    }
+                }
+                if (len == 0) {
+                    munmap(map, st.st_size);
+                }
+            }
+        }
+        close(fd);
+    }
+    if (len == 0) {
+        g_free(tb_cache.index);
+        tb_cache.index = NULL;
+        tb_cache.index_mask = 0;
+        tb_cache.nb_records = 0;
+        if (!tb_cache_create(&hdr, sizeof(hdr))) {
+            goto fail;
+        }
+        len = sizeof(hdr);
+    }
+    tb_cache.fd = open(tb_cache.path, O_WRONLY | O_APPEND | O_CLOEXEC);
+    if (tb_cache.fd < 0) {
+        goto fail;
+    }
+    tb_cache.size = len;
+    return;
+ fail:
+    fprintf(stderr, "qemu: could not open translation cache %s: %s\n",
+            tb_cache.path, strerror(errno));
+}
+
+/* The generated code could differ from what the cache holds.  */
+static bool tb_cache_bypass(CPUArchState *env)
+{
+    return env->singlestep_enabled || !QTAILQ_EMPTY(&env->breakpoints)
+        || qemu_loglevel_mask(CPU_LOG_TB_IN_ASM | CPU_LOG_TB_OUT_ASM |
+                              CPU_LOG_TB_OP | CPU_LOG_TB_OP_OPT);
+}
+
+static tcg_target_long tb_cache_base(int base, TranslationBlock *tb)
+{
+    switch (base) {
+    case TB_CACHE_BASE_TB:
+        return (tcg_target_long)tb;
+    case TB_CACHE_BASE_PROLOGUE:
+        return (tcg_target_long)code_gen_prologue;
+    default:
+        return tb_cache.text_start;
+    }
+}
+
+static bool tb_cache_load(CPUArchState *env, TranslationBlock *tb,
+                          const TBCacheRecord *rec)
+{
+    const TBCacheReloc *r = (const TBCacheReloc *)(rec + 1);
+    const uint8_t *code = (const uint8_t *)(r + rec->nb_relocs) + rec->size;
+    uint8_t *ptr;
+    int i, size;
+
+    if (tb_cache_checksum(rec) != rec->checksum) {
+        return false;
+    }
+    memcpy(tb->tc_ptr, code, rec->code_size);
+    for (i = 0; i < rec->nb_relocs; i++, r++) {
+        size = (r->type & ~TCG_EXT_BRANCH) == TCG_EXT_ABS64 ? 8 : 4;
+        if (r->offset + size > rec->code_size || r->site >= rec->code_size) {
+            return false;
+        }
+        ptr = tb->tc_ptr + r->offset;
+        if (!tcg_patch_ext_reloc(ptr, tb->tc_ptr + r->site, r->type,
+                                 tb_cache_base(r->base, tb) + r->addend)) {
+            return false;
+        }
+    }
+    tb->size = rec->size;
+    tb->icount = rec->icount;
+    for (i = 0; i < 2; i++) {
+        tb->tb_next_offset[i] = rec->tb_next_offset[i];
+        tb->tb_jmp_offset[i] = rec->tb_jmp_offset[i];
+    }
+    flush_icache_range((tcg_target_ulong)tb->tc_ptr,
+                       (tcg_target_ulong)tb->tc_ptr + rec->code_size);
+    return true;
+}
+
+static bool tb_cache_guest_code_equal(CPUArchState *env, target_ulong pc,
+                                      const uint8_t *code, int size)
+{
+    int i;
+
+    for (i = 0; i < size; i++) {
+        if (cpu_ldub_code(env, pc + i) != code[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Fill 'tb' with cached code at tb->tc_ptr.  Return false if it must be
+   translated.  */
+bool tb_cache_lookup(CPUArchState *env, TranslationBlock *tb, int *code_size)
+{
+    const TBCacheRecord *rec;
+    unsigned int i;
+
+    tb_cache.store_ok = false;
+    if (!tb_cache.path || tb_cache_bypass(env)) {
+        return false;
+    }
+    if (!tb_cache.opened) {
+        tb_cache_open(env);
+    }
+    if (tb_cache.fd < 0) {
+        return false;
+    }
+    tb_cache.lookups++;
+    tb_cache.store_ok = true;
+    if (!tb_cache.index) {
+        return false;
+    }
+    i = tb_cache_key(tb->pc, tb->cs_base, tb->flags, tb->cflags);
+    for (i &= tb_cache.index_mask; (rec = tb_cache.index[i]);
+         i = (i + 1) & tb_cache.index_mask) {
+        if (rec->pc != tb->pc || rec->cs_base != tb->cs_base
+            || rec->flags != tb->flags || rec->cflags != tb->cflags) {
+            continue;
+        }
+        if (!tb_cache_guest_code_equal(env, tb->pc,
+                                       (const uint8_t *)(rec + 1) +
+                                       rec->nb_relocs * sizeof(TBCacheReloc),
+                                       rec->size)) {
+            tb_cache.mismatches++;
+            continue;
+        }
+        if (tb_cache_load(env, tb, rec)) {
+            *code_size = rec->code_size;
+            tb_cache.hits++;
+            return true;
+        }
+        /* retranslating here gives the same record again */
+        tb_cache.rejects++;
+        tb_cache.store_ok = false;
+    }
+    return false;
+}
+
+static bool tb_cache_reloc(TBCacheReloc *r, const TCGExtReloc *ext,
+                           TranslationBlock *tb)
+{
+    tcg_target_long value = ext->value;
+
+    r->offset = ext->ptr - tb->tc_ptr;
+    r->site = ext->site ? ext->site - tb->tc_ptr : 0;
+    r->type = ext->type;
+    if (value - (tcg_target_long)tb >= 0 && value - (tcg_target_long)tb < 4) {
+        r->base = TB_CACHE_BASE_TB;
+    } else if (value >= (tcg_target_long)code_gen_prologue
+               && value < (tcg_target_long)code_gen_prologue
+                          + code_gen_prologue_size) {
+        r->base = TB_CACHE_BASE_PROLOGUE;
+    } else if (value >= tb_cache.text_start && value < tb_cache.text_end) {
+        r->base = TB_CACHE_BASE_TEXT;
+    } else {
+        return false;
+    }
+    r->addend = value - tb_cache_base(r->base, tb);
+    return true;
+}
+
+/* Append the code just generated for 'tb' to the cache.  */
+void tb_cache_store(CPUArchState *env, TranslationBlock *tb, int code_size)
+{
+    TCGContext *s = &tcg_ctx;
+    TBCacheRecord *rec;
+    TBCacheReloc *r;
+    uint8_t *p;
+    size_t len;
+    int i;
+
+    if (!tb_cache.store_ok) {
+        return;
+    }
+    tb_cache.store_ok = false;
+    len = sizeof(TBCacheRecord) + s->nb_ext_relocs * sizeof(TBCacheReloc) +
+          tb->size + code_size;
+    len = (len + 7) & ~7;
+    if (s->code_fixed || tb->size == 0 ||
+        ((tb->pc ^ (tb->pc + tb->size - 1)) & TARGET_PAGE_MASK) ||
+        tb_cache.size + len > TB_CACHE_MAX_SIZE) {
+        tb_cache.uncacheable++;
+        return;
+    }
+
+    rec = g_malloc0(len);
+    rec->magic = TB_CACHE_RECORD_MAGIC;
+    rec->len = len;
+    rec->pc = tb->pc;
+    rec->cs_base = tb->cs_base;
+    rec->flags = tb->flags;
+    rec->cflags = tb->cflags;
+    rec->code_size = code_size;
+    rec->size = tb->size;
+    rec->icount = tb->icount;
+    rec->nb_relocs = s->nb_ext_relocs;
+    for (i = 0; i < 2; i++) {
+        rec->tb_next_offset[i] = tb->tb_next_offset[i];
+        rec->tb_jmp_offset[i] = tb->tb_jmp_offset[i];
+    }
+    r = (TBCacheReloc *)(rec + 1);
+    for (i = 0; i < s->nb_ext_relocs; i++) {
+        if (!tb_cache_reloc(&r[i], &s->ext_relocs[i], tb)) {
+            g_free(rec);
+            tb_cache.uncacheable++;
+            return;
+        }
+    }
+    p = (uint8_t *)(r + s->nb_ext_relocs);
+    for (i = 0; i < tb->size; i++) {
+        *p++ = cpu_ldub_code(env, tb->pc + i);
+    }
+    memcpy(p, tb->tc_ptr, code_size);
+    rec->checksum = tb_cache_checksum(rec);
+
+    if (write(tb_cache.fd, rec, len) != len) {
+        /* the partial record, if any, ends the file for later runs */
+        close(tb_cache.fd);
+        tb_cache.fd = -1;
+        g_free(rec);
+        return;
+    }
+    tb_cache.size += len;
+    tb_cache.stores++;
+    /* also used after the TB is flushed */
+    tb_cache_insert(rec);
+}
+
+void tb_cache_init(const char *path, bool print_stats)
+{
+    tb_cache.path = path;
+    tb_cache.print_stats = print_stats;
+}
+
+void tb_cache_dump_info(FILE *f, fprintf_function cpu_fprintf)
+{
+    if (!tb_cache.path) {
+        return;
+    }
+    cpu_fprintf(f, "TB cache            %s: %u records, %zd KB\n",
+                tb_cache.path, tb_cache.nb_records, tb_cache.size >> 10);
+    cpu_fprintf(f, "TB cache lookups    %u, hits %u (%u%%), "
+                "code changed %u, rejected %u\n",
+                tb_cache.lookups, tb_cache.hits,
+                tb_cache.lookups ? tb_cache.hits * 100 / tb_cache.lookups : 0,
+                tb_cache.mismatches, tb_cache.rejects);
+    cpu_fprintf(f, "TB cache stores     %u, uncacheable %u\n",
+                tb_cache.stores, tb_cache.uncacheable);
+}
+
+void tb_cache_exit(void)
+{
+    if (tb_cache.print_stats) {
+        tb_cache_dump_info(stderr, fprintf);
+    }
+}
+
+#else
+
+bool tb_cache_lookup(CPUArchState *env, TranslationBlock *tb, int *code_size)
+{
+    return false;
+}
+
+void tb_cache_store(CPUArchState *env, TranslationBlock *tb, int code_size)
+{
+}
+
+void tb_cache_init(const char *path, bool print_stats)
+{
+    fprintf(stderr, "qemu: the translation cache is not supported for "
+            "this target or host\n");
+    exit(1);
+}
+
+void tb_cache_dump_info(FILE *f, fprintf_function cpu_fprintf)
+{
+}
+
+void tb_cache_exit(void)
+{
+}
+
+#endif
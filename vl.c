@@ -3423,6 +3423,12 @@ int main(int argc, char **argv, char **envp)
             case QEMU_OPTION_icount:
                 icount_option = optarg;
                 break;
+            case QEMU_OPTION_tcg:
+                opts = qemu_opts_parse(qemu_find_opts("tcg"), optarg, 1);
+                if (!opts) {
+                    exit(1);
+                }
+                break;
             case QEMU_OPTION_incoming:
                 incoming = optarg;
                 runstate_set(RUN_STATE_INMIGRATE);
@@ -3759,6 +3765,11 @@ int main(int argc, char **argv, char **envp)
     }
     configure_icount(icount_option);
 
+    opts = qemu_opts_find(qemu_find_opts("tcg"), NULL);
+    if (opts) {
+        configure_tcg(opts);
+    }
+
     if (net_init_clients() < 0) {
         exit(1);
     }